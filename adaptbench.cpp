@@ -0,0 +1,178 @@
+// Adaptive scans against uniform ones over a synthetic feature: a simulated stage on a virtual clock
+// scans a narrow Gaussian peak on a flat baseline, uniformly at the adaptive scan's finest step, as
+// the feature needs, and at its coarsest, and adaptively between the two. Prints the points each
+// took, how many of them fell on the feature, the time, and how far the signal interpolated between
+// the measured points strays from the true one. Exits 1 if a check fails.
+//
+// usage: mcpher_adaptbench [--width MM] [--step MM] [--min-step MM] [--tol F] [--noise F] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "measurement.h"
+#include "scanengine.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+#define PEAK_CENTER 12.3f
+#define PEAK_AMPLITUDE 1.0
+
+typedef struct
+{
+    float width;   // standard deviation of the peak, mm
+    float step;    // coarsest step
+    float minStep; // finest step
+    double tol;    // adaptive scans: change of the signal between points, of the amplitude
+    double noise;  // of the amplitude
+    unsigned latencyUs;
+    int pollMs;
+} adaptConfig;
+
+typedef struct
+{
+    long ret;
+    long points;
+    long onFeature; // points within 3 widths of the peak
+    double seconds; // virtual
+    double maxErr;  // largest |interpolated - true signal| over the scan, of the amplitude
+} adaptRun;
+
+// linear interpolation of the measured points, sorted by position, against the noiseless signal
+static double InterpolationError(std::vector<std::pair<float, double>> pts, const SimDetector &det, float from, float to)
+{
+    std::sort(pts.begin(), pts.end());
+    double err = 0;
+    size_t k = 0;
+    for (float x = from; x <= to && pts.size() > 1; x += 0.001f)
+    {
+        while (k + 2 < pts.size() && pts[k + 1].first < x)
+            k++;
+        float x0 = pts[k].first, x1 = pts[k + 1].first;
+        double v = x1 > x0 ? pts[k].second + (pts[k + 1].second - pts[k].second) * (x - x0) / (x1 - x0) : pts[k].second;
+        err = std::max(err, fabs(v - det.Signal(&x, 1)));
+    }
+    return err;
+}
+
+static bool Run(const adaptConfig &cfg, float step, bool adaptive, adaptRun *r)
+{
+    VirtualClock clock;
+    SimDriver sim(1, cfg.latencyUs);
+    sim.SetClock(&clock);
+    MotorController controller(&sim, cfg.pollMs);
+    controller.SetClock(&clock);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stage: %s\n", msg.c_str());
+        return false;
+    }
+    SimDetector det(0.1, cfg.noise * PEAK_AMPLITUDE, 0.05f);
+    det.SetClock(&clock);
+    det.AddPeak(PEAK_CENTER, cfg.width, PEAK_AMPLITUDE);
+    ScanEngine eng(&sim, controller.Telemetry(), 0, controller.SerialNums()[0]);
+    eng.SetMeasurement(&det);
+    std::vector<std::pair<float, double>> pts;
+    eng.SetPointHook([&pts](long, float, float actual, double value)
+                     { pts.push_back(std::make_pair(actual, value)); });
+    scanParams p = {};
+    p.start = 5;
+    p.stop = 20;
+    p.step = step;
+    p.minStep = cfg.minStep;
+    p.adaptTol = cfg.tol * PEAK_AMPLITUDE;
+    p.settleTol = 0.001f;
+    p.settleCount = 2;
+    p.timeout = 30;
+    r->ret = eng.MoveAndSettle(p.start, p);
+    double t0 = clock.Now();
+    if (!r->ret)
+        r->ret = adaptive ? eng.RunAdaptive(p) : eng.Run(p);
+    r->seconds = clock.Now() - t0;
+    controller.Shutdown();
+    r->points = (long)pts.size();
+    r->onFeature = 0;
+    for (auto &pt : pts)
+        r->onFeature += fabs(pt.first - PEAK_CENTER) <= 3 * cfg.width;
+    r->maxErr = InterpolationError(pts, det, p.start, p.stop) / PEAK_AMPLITUDE;
+    return true;
+}
+
+static void Report(const char *what, const adaptRun &r)
+{
+    printf("%-22s %7ld %9ld %9.1f %10.4f\n", what, r.points, r.onFeature, r.seconds, r.maxErr);
+}
+
+int main(int argc, char **argv)
+{
+    adaptConfig cfg;
+    cfg.width = 0.15f;
+    cfg.step = 0.5f;
+    cfg.minStep = 0.02f;
+    cfg.tol = 0.02;
+    cfg.noise = 0;
+    cfg.latencyUs = 2000;
+    cfg.pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--width"))
+            cfg.width = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--step"))
+            cfg.step = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--min-step"))
+            cfg.minStep = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--tol"))
+            cfg.tol = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--noise"))
+            cfg.noise = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            cfg.latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            cfg.pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_adaptbench [--width MM] [--step MM] [--min-step MM] [--tol F] [--noise F] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (!(cfg.width > 0) || !(cfg.minStep > 0) || cfg.step < cfg.minStep || !(cfg.tol > 0) || cfg.noise < 0 || cfg.pollMs < 1)
+        return 1;
+
+    printf("peak of width %.3f mm in 15 mm; steps %.3f to %.3f mm, tolerance %.3f, noise %.3f\n", cfg.width, cfg.minStep, cfg.step, cfg.tol,
+           cfg.noise);
+    printf("scan                    points  on peak   s/scan   max err\n");
+    adaptRun fine, coarse, adapt;
+    if (!Run(cfg, cfg.minStep, false, &fine) || !Run(cfg, cfg.step, false, &coarse) || !Run(cfg, cfg.step, true, &adapt))
+        return 1;
+    Report("uniform, finest step", fine);
+    Report("uniform, coarsest step", coarse);
+    Report("adaptive", adapt);
+    printf("adaptive: %.1fx fewer points, %.1fx faster than the finest uniform scan; %.0f%% of its points on the peak, against %.0f%%\n",
+           (double)fine.points / adapt.points, fine.seconds / adapt.seconds, 100.0 * adapt.onFeature / adapt.points,
+           100.0 * fine.onFeature / fine.points);
+
+    Check(!fine.ret && !coarse.ret && !adapt.ret, "every scan completes");
+    Check(adapt.onFeature * 2 >= fine.onFeature, "on the peak, adaptive has half the finest scan's points");
+    Check(adapt.maxErr < 2 * cfg.tol + 4 * cfg.noise, "and follows the signal within twice its tolerance");
+    Check(coarse.maxErr > 5 * adapt.maxErr, "where the coarsest uniform step misses it");
+    Check(adapt.points * 4 < fine.points, "in a quarter of the points of the finest uniform scan");
+    Check(adapt.seconds * 2 < fine.seconds, "and half the time");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -5,7 +5,27 @@ if %arg1%==x86 (set ext=32) else (set ext=64)
 @set OUT_DIR=output
 @set OUT_EXE=aptcontroller
 @set INCLUDES=/I .\include /I imgui\include /I "C:\Program Files\Thorlabs\APT\APT Server" /I "%DXSDK_DIR%/Include"
-@set SOURCES=main.cpp
+@set SOURCES=main.cpp motorpanel.cpp diagpanel.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\paramcache.cpp src\instrdriver.cpp src\latencyhist.cpp src\aptdriver.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\framesched.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\scanplan.cpp src\sequence.cpp src\homing.cpp src\scanorder.cpp src\measurement.cpp src\recorder.cpp src\scanlog.cpp src\statusbus.cpp
 @set LIBS=/LIBPATH:"%DXSDK_DIR%/Lib/%arg1%" /LIBPATH:"C:\Program Files\Thorlabs\APT\APT Server" d3d9.lib imgui\win32_lib\libimgui_win%ext%.lib
 mkdir %OUT_DIR%
-cl /nologo /Zi /MD /EHsc /wd4005 %INCLUDES% /D UNICODE /D _UNICODE %SOURCES% /Fe%OUT_DIR%/%OUT_EXE%.exe /Fo%OUT_DIR%/ /link %LIBS%
\ No newline at end of file
+cl /nologo /Zi /MD /EHsc /std:c++17 /wd4005 %INCLUDES% /D UNICODE /D _UNICODE %SOURCES% /Fe%OUT_DIR%/%OUT_EXE%.exe /Fo%OUT_DIR%/ /link %LIBS%
+@set SRV_SOURCES=server.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\paramcache.cpp src\instrdriver.cpp src\latencyhist.cpp src\aptdriver.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp src\ctlserver.cpp src\statusbus.cpp
+cl /nologo /Zi /MD /EHsc /std:c++17 /wd4005 /I .\include /I "C:\Program Files\Thorlabs\APT\APT Server" %SRV_SOURCES% /Fe%OUT_DIR%/mcpher_srv.exe /Fo%OUT_DIR%/ /link /LIBPATH:"C:\Program Files\Thorlabs\APT\APT Server"
+cl /nologo /Zi /MD /EHsc /std:c++17 loadtest.cpp /Fe%OUT_DIR%/mcpher_load.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include histbench.cpp src\history.cpp /Fe%OUT_DIR%/mcpher_histbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include scanstress.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_scanstress.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include motionbench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_motionbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include seqbench.cpp src\sequence.cpp src\scanlog.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_seqbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include homebench.cpp src\homing.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_homebench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include regbench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_regbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include instrbench.cpp src\instrdriver.cpp src\latencyhist.cpp src\clock.cpp src\simdriver.cpp /Fe%OUT_DIR%/mcpher_instrbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include simbench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\replaydriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_simbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include envbench.cpp src\scanplan.cpp src\sequence.cpp src\scanlog.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_envbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include precbench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_precbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include framebench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_framebench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include cmdbench.cpp src\clock.cpp src\cmdqueue.cpp src\envelope.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_cmdbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include scanbench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_scanbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include planbench.cpp src\scanplan.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_planbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include orderbench.cpp src\scanorder.cpp src\scanplan.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_orderbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include adaptbench.cpp src\clock.cpp src\controller.cpp src\envelope.cpp src\backlash.cpp src\motionmodel.cpp src\simdriver.cpp src\registry.cpp src\telemetry.cpp src\history.cpp src\cmdqueue.cpp src\scanengine.cpp src\scantask.cpp src\measurement.cpp src\recorder.cpp /Fe%OUT_DIR%/mcpher_adaptbench.exe /Fo%OUT_DIR%/
+cl /nologo /Zi /MD /EHsc /std:c++17 /I .\include logstress.cpp src\scanlog.cpp /Fe%OUT_DIR%/mcpher_logstress.exe /Fo%OUT_DIR%/
@@ -0,0 +1,396 @@
+// Status bus: what publishing the state of every motor to shared memory costs the poller that calls
+// Publish(), and how soon reader processes see a record, for 0 to 64 readers forked off, each
+// waiting on the bus and reading the slots that changed. The registry is written synthetically at a
+// fixed rate, then a live check on simulated stages, with the telemetry change hook publishing.
+// Linux only, the readers are processes and Wait() sleeps on a futex. Exits 1 if a check fails.
+//
+// usage: mcpher_busbench [--motors N] [--rate HZ] [--seconds S] [--readers N]
+
+#include "controller.h"
+#include "registry.h"
+#include "simdriver.h"
+#include "statusbus.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+static uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now().time_since_epoch()).count();
+}
+
+// what a reader process sends back through its pipe
+typedef struct
+{
+    long ret;          // of StatusReader::Open
+    long records;      // new records read
+    long wakeups;      // Wait() calls that returned with news
+    long backwards;    // records older than one read before from the same slot
+    uint64_t lastPolls; // sum over the slots, of the last record read after the bus closed
+    double p50;        // us from publish to read
+    double p99;
+    double max;
+} readerResult;
+
+typedef struct
+{
+    long readers;
+    double publishCpu;  // ns of CPU per Publish(), what it costs the poller
+    double publishMean; // ns per Publish(), including any time the readers took the CPU
+    double publishP99;
+    long published;
+    uint64_t finalPolls;
+    std::vector<readerResult> results;
+} busRound;
+
+static double ThreadCpuNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double Percentile(std::vector<double> &v, double q)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(q * v.size()))];
+}
+
+// a reader process: waits on the bus until it closes, reading the slots whose version moved on
+static void Reader(const char *name, int ready, int out)
+{
+    readerResult r = {};
+    StatusReader bus;
+    r.ret = bus.Open(name);
+    char c = 1;
+    if (write(ready, &c, 1) != 1 || r.ret)
+    {
+        if (write(out, &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+        _exit(0);
+    }
+    long cap = bus.Capacity();
+    std::vector<uint64_t> versions(cap, 0), polls(cap, 0);
+    std::vector<double> lat;
+    lat.reserve(1 << 20);
+    uint32_t seq = bus.Sequence();
+    while (bus.Alive())
+    {
+        if (!bus.Wait(&seq, 100))
+            continue;
+        r.wakeups++;
+        uint64_t now = NowNs();
+        long n = bus.NumSlots();
+        for (long i = 0; i < n; i++)
+        {
+            uint64_t v = bus.Version(i);
+            if (v == versions[i])
+                continue;
+            busMotor m;
+            bus.Read(i, &m);
+            versions[i] = v;
+            if (m.polls < polls[i])
+                r.backwards++;
+            polls[i] = m.polls;
+            r.records++;
+            if (lat.size() < lat.capacity())
+                lat.push_back((now - std::min(now, m.stampNs)) * 1e-3);
+        }
+    }
+    // the mapping outlives the segment's name
+    std::vector<busMotor> last(cap);
+    long n = bus.Snapshot(last.data(), cap);
+    for (long i = 0; i < n; i++)
+        r.lastPolls += last[i].polls;
+    r.p50 = Percentile(lat, 0.5);
+    r.p99 = Percentile(lat, 0.99);
+    r.max = lat.empty() ? 0 : lat.back();
+    if (write(out, &r, sizeof(r)) != sizeof(r))
+        _exit(1);
+    _exit(0);
+}
+
+// the registry written at rate records per second, round robin, for seconds, with readers waiting
+static bool Round(const char *name, MotorRegistry *reg, long readers, double rate, double seconds, busRound *res)
+{
+    res->readers = readers;
+    StatusBus bus;
+    if (bus.Open(name, reg))
+        return false;
+    int ready[2], out[2];
+    if (pipe(ready) || pipe(out))
+        return false;
+    std::vector<pid_t> pids;
+    fflush(stdout); // or the children may print it again
+    for (long k = 0; k < readers; k++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            Reader(name, ready[1], out[1]);
+        if (pid > 0)
+            pids.push_back(pid);
+    }
+    for (size_t k = 0; k < pids.size(); k++)
+    {
+        char c;
+        if (read(ready[0], &c, 1) != 1)
+            break;
+    }
+
+    long n = reg->NumSlots();
+    std::vector<double> cost;
+    double cpu = 0;
+    auto period = std::chrono::duration_cast<benchClock::duration>(std::chrono::duration<double>(1 / rate));
+    auto next = benchClock::now();
+    auto end = next + std::chrono::duration_cast<benchClock::duration>(std::chrono::duration<double>(seconds));
+    for (long k = 0; benchClock::now() < end; k++)
+    {
+        long i = k % n;
+        motorState st;
+        reg->Load(i, &st);
+        st.curPos += 0.001f;
+        st.moving = (k / n) % 2;
+        st.polls++;
+        reg->Store(i, st);
+        double c0 = ThreadCpuNs();
+        auto t0 = benchClock::now();
+        bus.Publish(i);
+        cost.push_back(std::chrono::duration<double, std::nano>(benchClock::now() - t0).count());
+        cpu += ThreadCpuNs() - c0;
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+    res->published = (long)cost.size();
+    double sum = 0;
+    for (double c : cost)
+        sum += c;
+    res->publishCpu = cost.empty() ? 0 : cpu / cost.size();
+    res->publishMean = cost.empty() ? 0 : sum / cost.size();
+    res->publishP99 = Percentile(cost, 0.99);
+    res->finalPolls = 0;
+    for (long i = 0; i < n; i++)
+    {
+        motorState st;
+        reg->Load(i, &st);
+        res->finalPolls += st.polls;
+    }
+    bus.Close();
+
+    res->results.clear();
+    for (size_t k = 0; k < pids.size(); k++)
+    {
+        readerResult r;
+        if (read(out[0], &r, sizeof(r)) != sizeof(r))
+            break;
+        res->results.push_back(r);
+    }
+    for (pid_t pid : pids)
+        waitpid(pid, nullptr, 0);
+    close(ready[0]);
+    close(ready[1]);
+    close(out[0]);
+    close(out[1]);
+    return true;
+}
+
+// a stage moved by its command queue, seen on the bus of its controller by a reader
+static bool Live(const char *name)
+{
+    StatusBus bus; // outlives the pollers that publish to it
+    SimDriver sim(2, 200);
+    MotorController controller(&sim, 10);
+    controller.Telemetry()->SetChangeHook([&bus](long idx)
+                                          { bus.Publish(idx); });
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return false;
+    }
+    StatusReader reader;
+    if (bus.Open(name, controller.Telemetry()->Registry()) || reader.Open(name))
+        return false;
+    busMotor m = {};
+    bool listed = reader.NumSlots() == 2 && reader.Read(1, &m) && m.serNum == controller.SerialNums()[1] && m.present;
+    controller.Commands()->Move(1, 3.5f);
+    bool sawMoving = false, arrived = false;
+    uint32_t seq = reader.Sequence();
+    auto end = benchClock::now() + std::chrono::seconds(20);
+    while (!arrived && benchClock::now() < end)
+    {
+        if (!reader.Wait(&seq, 100))
+            continue;
+        reader.Read(1, &m);
+        sawMoving |= m.moving != 0;
+        arrived = sawMoving && !m.moving && fabs(m.pos - 3.5f) < 0.01f && m.ret == 0;
+    }
+    bus.SetScanIndex(1, 7);
+    reader.Read(1, &m);
+    bool scanned = m.scanIndex == 7;
+    controller.Shutdown();
+    bus.Close();
+    bool closed = !reader.Alive();
+    Check(listed, "a reader finds every stage of the controller");
+    Check(sawMoving && arrived, "and follows a move to its end through the change hook");
+    Check(scanned, "with the scan index of the point reached");
+    Check(closed, "and learns the bus closed");
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long motors = 64;
+    double rate = 2000;
+    double seconds = 1;
+    long maxReaders = 64;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--motors"))
+            motors = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--rate"))
+            rate = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--seconds"))
+            seconds = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--readers"))
+            maxReaders = atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_busbench [--motors N] [--rate HZ] [--seconds S] [--readers N]\n");
+            return 1;
+        }
+    }
+    if (motors < 1 || rate <= 0 || seconds <= 0 || maxReaders < 0)
+        return 1;
+    std::string name = std::string("mcpher_busbench_") + std::to_string((long)getpid());
+
+    MotorRegistry reg(motors);
+    for (long i = 0; i < motors; i++)
+    {
+        long slot;
+        reg.Add(26000001 + i, &slot);
+    }
+    printf("%ld motors, %.0f records/s for %.1f s per round\n", motors, rate, seconds);
+    printf("readers  publish cpu ns  wall ns  p99 ns    records/reader wakeups  read us p50  p99      max\n");
+    std::vector<busRound> rounds;
+    const long counts[] = {0, 1, 4, 16, 64};
+    for (long readers : counts)
+    {
+        if (readers > maxReaders)
+            break;
+        busRound r;
+        if (!Round(name.c_str(), &reg, readers, rate, seconds, &r))
+        {
+            fprintf(stderr, "Could not open the status bus %s\n", name.c_str());
+            return 1;
+        }
+        std::vector<double> p50, p99, mx;
+        double records = 0, wakeups = 0;
+        for (const readerResult &x : r.results)
+        {
+            p50.push_back(x.p50);
+            p99.push_back(x.p99);
+            mx.push_back(x.max);
+            records += x.records;
+            wakeups += x.wakeups;
+        }
+        long k = std::max(1L, (long)r.results.size());
+        // the median reader, and the worst of any
+        printf("%7ld  %14.0f  %7.0f  %8.0f  %14.0f %8.0f  %11.1f  %7.1f  %7.1f\n", readers, r.publishCpu, r.publishMean, r.publishP99, records / k, wakeups / k,
+               Percentile(p50, 0.5), Percentile(p99, 0.5), mx.empty() ? 0.0 : *std::max_element(mx.begin(), mx.end()));
+        rounds.push_back(r);
+    }
+
+    bool opened = true, ordered = true, current = true, seen = true;
+    for (const busRound &r : rounds)
+    {
+        opened &= (long)r.results.size() == r.readers;
+        for (const readerResult &x : r.results)
+        {
+            opened &= x.ret == 0;
+            ordered &= x.backwards == 0;
+            current &= x.lastPolls == r.finalPolls;
+            // a reader may take several records of a slot in one read, never none of a busy slot
+            seen &= x.records >= std::min(motors, r.published) && x.wakeups > 0;
+        }
+    }
+    Check(opened, "every reader process opens the bus by name");
+    Check(ordered, "no reader sees a slot go back to an older record");
+    Check(seen, "every reader is woken and reads the slots that changed");
+    Check(current, "and ends with the last record of every motor");
+    if (rounds.size() > 1)
+    {
+        // the writer never waits for a reader and wakes one at most; the wall time also has the
+        // readers running in between when they outnumber the cores
+        const busRound &none = rounds.front(), &most = rounds.back();
+        Check(most.publishCpu < none.publishCpu + 20000, "readers add under 20 us of CPU to a publish");
+        Check(rounds.size() < 3 || rounds[2].publishCpu < 3 * rounds[1].publishCpu + 2000, "however many there are");
+    }
+
+    StatusReader reader;
+    Check(reader.Open(name.c_str()) == BUS_ERR_OPEN, "there is no bus once the publisher closed it");
+    std::string path = "/" + name;
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    bool layout = fd >= 0 && ftruncate(fd, 4096) == 0 && reader.Open(name.c_str()) == BUS_ERR_LAYOUT;
+    if (fd >= 0)
+        close(fd);
+    shm_unlink(path.c_str());
+    Check(layout, "a segment that is not a status bus is refused");
+
+    // a second publisher is refused while the first is alive, and takes over the bus of one that
+    // exited without closing it
+    MotorRegistry two(2);
+    bool kept = false, replaced = false;
+    {
+        StatusBus first, second;
+        kept = !first.Open(name.c_str(), &two) && second.Open(name.c_str(), &two) == BUS_ERR_OPEN && !reader.Open(name.c_str()) &&
+               reader.Alive();
+        reader.Close();
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        StatusBus *gone = new StatusBus(); // never closed
+        _exit(gone->Open(name.c_str(), &two) ? 1 : 0);
+    }
+    int status = 0;
+    if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        StatusBus next;
+        replaced = !next.Open(name.c_str(), &two);
+    }
+    Check(kept, "a live publisher's bus is not taken over");
+    Check(replaced, "but one left by a publisher that exited is");
+
+    if (!Live(name.c_str()))
+        failed++;
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
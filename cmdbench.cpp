@@ -0,0 +1,198 @@
+// Command queues on simulated stages: a burst of panel edits, a velocity change on every device each
+// millisecond and a new destination every fourth, submitted through CommandQueue and, as the panel
+// used to, sent to the driver on the calling thread. Reports what an edit costs the calling thread,
+// the latency of the commands that reached the devices and the share coalesced away; then a flood of
+// commands for the throughput. Exits 1 if a check fails.
+//
+// usage: mcpher_cmdbench [--units N] [--edits N] [--flood N] [--latency US]
+
+#include "cmdqueue.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+static double Percentile(std::vector<double> v, double q)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(q * v.size()))];
+}
+
+static double Us(benchClock::time_point t0)
+{
+    return std::chrono::duration<double, std::micro>(benchClock::now() - t0).count();
+}
+
+// the k-th edit of a device: a velocity within the stage's limits, and a destination
+static float EditVel(long k)
+{
+    return 1.0f + 0.001f * (k % 1000);
+}
+
+static float EditPos(long k)
+{
+    return 1.0f + (k % 20);
+}
+
+int main(int argc, char **argv)
+{
+    long units = 8, edits = 400, flood = 20000;
+    unsigned latencyUs = 2000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--units"))
+            units = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--edits"))
+            edits = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--flood"))
+            flood = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_cmdbench [--units N] [--edits N] [--flood N] [--latency US]\n");
+            return 1;
+        }
+    }
+    if (units < 1 || edits < 4 || flood < 1)
+        return 1;
+
+    SimDriver sim(units, latencyUs);
+    std::vector<long> serNums(units);
+    long ret = sim.Init();
+    for (long i = 0; i < units && !ret; i++)
+    {
+        if (!(ret = sim.GetSerialNum(i, &serNums[i])))
+            ret = sim.InitDevice(serNums[i]);
+    }
+    if (ret)
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %ld\n", ret);
+        return 1;
+    }
+    printf("%ld stages, %u us per driver call, %ld edits per stage\n", units, latencyUs, edits);
+
+    // the panel's edits, one frame a millisecond
+    CommandQueue queue(&sim);
+    queue.Start(serNums.data(), units);
+    std::vector<cmdFuture> futs, lastVel(units), lastMove(units);
+    std::vector<double> submit;
+    auto next = benchClock::now();
+    for (long k = 0; k < edits; k++)
+    {
+        for (long i = 0; i < units; i++)
+        {
+            auto t0 = benchClock::now();
+            futs.push_back(lastVel[i] = queue.SetVel(i, 0, 2.0f, EditVel(k)));
+            if (k % 4 == 0)
+                futs.push_back(lastMove[i] = queue.Move(i, EditPos(k)));
+            submit.push_back(Us(t0));
+        }
+        next += std::chrono::milliseconds(1);
+        std::this_thread::sleep_until(next);
+    }
+    std::vector<double> latency;
+    long sent = 0, superseded = 0, errors = 0;
+    for (cmdFuture &f : futs)
+    {
+        cmdResult res = f.get();
+        if (res.ret == CMD_ERR_SUPERSEDED)
+            superseded++;
+        else if (res.ret)
+            errors++;
+        else
+        {
+            sent++;
+            latency.push_back(res.latency * 1e6);
+        }
+    }
+    // nothing supersedes the last of each, so they reach the stage
+    bool last = true;
+    for (long i = 0; i < units; i++)
+    {
+        cmdResult vel = lastVel[i].get();
+        last &= !vel.ret && vel.maxVel == EditVel(edits - 1) && !lastMove[i].get().ret;
+    }
+    queue.Stop(); // the workers count a command sent once its future is ready
+    cmdQueueStats st = queue.GetStats();
+
+    // the same edits sent on the calling thread, which waits on every round trip
+    std::vector<double> direct;
+    long directEdits = std::min(edits, 20L);
+    for (long k = 0; k < directEdits; k++)
+    {
+        for (long i = 0; i < units; i++)
+        {
+            float minVel, accel, maxVel;
+            auto t0 = benchClock::now();
+            sim.SetVelParams(serNums[i], 0, 2.0f, EditVel(k));
+            sim.GetVelParams(serNums[i], &minVel, &accel, &maxVel);
+            if (k % 4 == 0)
+                sim.MoveAbsolute(serNums[i], EditPos(k), false);
+            direct.push_back(Us(t0));
+        }
+    }
+
+    double ratio = st.submitted ? (double)st.coalesced / st.submitted : 0;
+    printf("%-24s %10s %10s %10s\n", "us", "p50", "p99", "max");
+    printf("%-24s %10.1f %10.1f %10.1f\n", "edit, on the driver", Percentile(direct, 0.5), Percentile(direct, 0.99), Percentile(direct, 1));
+    printf("%-24s %10.1f %10.1f %10.1f\n", "edit, queued", Percentile(submit, 0.5), Percentile(submit, 0.99), Percentile(submit, 1));
+    printf("%-24s %10.1f %10.1f %10.1f\n", "command sent, latency", Percentile(latency, 0.5), Percentile(latency, 0.99), Percentile(latency, 1));
+    printf("%llu commands: %llu sent, %llu coalesced (%.1f%%)\n", (unsigned long long)st.submitted, (unsigned long long)st.sent,
+           (unsigned long long)st.coalesced, 100 * ratio);
+
+    // as many commands as can be submitted, alternately moves and velocity changes
+    CommandQueue fq(&sim);
+    fq.Start(serNums.data(), units);
+    futs.clear();
+    futs.reserve(flood * units);
+    auto t0 = benchClock::now();
+    for (long k = 0; k < flood; k++)
+    {
+        for (long i = 0; i < units; i++)
+            futs.push_back(k % 2 ? fq.SetVel(i, 0, 2.0f, EditVel(k)) : fq.Move(i, EditPos(k)));
+    }
+    double submitted = Us(t0) * 1e-6;
+    bool resolved = true;
+    for (cmdFuture &f : futs)
+    {
+        long r = f.get().ret;
+        resolved &= r == 0 || r == CMD_ERR_SUPERSEDED;
+    }
+    double all = Us(t0) * 1e-6;
+    fq.Stop();
+    cmdQueueStats fst = fq.GetStats();
+    printf("flood of %ld commands: submitted at %.0f/s, all resolved at %.0f/s, %llu sent\n", flood * units, flood * units / submitted,
+           flood * units / all, (unsigned long long)fst.sent);
+
+    Check(errors == 0 && sent + superseded == (long)st.submitted && st.sent + st.coalesced == st.submitted,
+          "every edit is sent or coalesced, none fails");
+    Check(last, "each stage ends with the last velocity and destination");
+    Check(Percentile(submit, 0.99) < latencyUs || latencyUs == 0, "queueing an edit costs less than one round trip");
+    Check(Percentile(direct, 0.5) > 2 * latencyUs, "sent directly, it costs two or three");
+    Check(ratio > 0.5 || latencyUs < 500, "edits faster than the stages take them mostly coalesce");
+    Check(Percentile(latency, 0.99) < 8 * latencyUs + 10000, "a command waits at most for the one in flight");
+    Check(resolved && fst.sent + fst.coalesced == fst.submitted, "a flood resolves every command");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
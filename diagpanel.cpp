@@ -0,0 +1,129 @@
+#include "diagpanel.h"
+#include "imgui/imgui.h"
+
+#include <cstdio>
+#include <ctime>
+
+DiagPanel::DiagPanel(InstrumentedDriver *instr, PhaseTimer *frame) : instr(instr), frame(frame), device(0), numDevices(0)
+{
+    snprintf(names[0], DIAG_NAME_LEN, "All devices");
+    for (int i = 0; i <= INSTR_MAX_DEVICES; i++)
+        nameList[i] = names[i];
+    text[0] = '\0';
+}
+
+void DiagPanel::Row(const char *name, const latencyStats &s, const char *third)
+{
+    ImGui::Text("%s", name);
+    ImGui::NextColumn();
+    ImGui::Text("%llu", (unsigned long long)s.count);
+    ImGui::NextColumn();
+    ImGui::Text("%s", third);
+    ImGui::NextColumn();
+    ImGui::Text("%.3f", s.p50 * 1e-3);
+    ImGui::NextColumn();
+    ImGui::Text("%.3f", s.p99 * 1e-3);
+    ImGui::NextColumn();
+    ImGui::Text("%.3f", s.max * 1e-3);
+    ImGui::NextColumn();
+}
+
+void DiagPanel::Draw()
+{
+    if (frame != nullptr)
+    {
+        ImGui::Text("Frame phases (ms)");
+        ImGui::Columns(6);
+        ImGui::Text("Phase");
+        ImGui::NextColumn();
+        ImGui::Text("Frames");
+        ImGui::NextColumn();
+        ImGui::Text("Last");
+        ImGui::NextColumn();
+        ImGui::Text("p50");
+        ImGui::NextColumn();
+        ImGui::Text("p99");
+        ImGui::NextColumn();
+        ImGui::Text("Max");
+        ImGui::NextColumn();
+        latencyStats s;
+        char last[32];
+        for (int i = 0; i < frame->NumPhases(); i++)
+        {
+            frame->Phase(i).GetStats(&s);
+            snprintf(last, sizeof(last), "%.3f", frame->Last(i) * 1e-3);
+            Row(frame->Name(i), s, last);
+        }
+        frame->Total().GetStats(&s);
+        Row("total", s, "");
+        ImGui::Columns(1);
+    }
+    // new devices show up in the list as they are first called
+    long n = instr->Devices(serNums, INSTR_MAX_DEVICES);
+    for (; numDevices < n; numDevices++)
+        snprintf(names[numDevices + 1], DIAG_NAME_LEN, "%ld", serNums[numDevices]);
+    ImGui::Combo("Device##Diag", &device, nameList, (int)numDevices + 1);
+    ImGui::Text("Driver calls (ms)");
+    ImGui::Columns(6);
+    ImGui::Text("Call");
+    ImGui::NextColumn();
+    ImGui::Text("Count");
+    ImGui::NextColumn();
+    ImGui::Text("Errors");
+    ImGui::NextColumn();
+    ImGui::Text("p50");
+    ImGui::NextColumn();
+    ImGui::Text("p99");
+    ImGui::NextColumn();
+    ImGui::Text("Max");
+    ImGui::NextColumn();
+    char errors[32];
+    for (int c = 0; c < INSTR_CALLS; c++)
+    {
+        latencyStats s;
+        uint64_t n;
+        if (!instr->GetStats(device ? serNums[device - 1] : 0, c, &s, &n) || s.count == 0)
+            continue;
+        snprintf(errors, sizeof(errors), "%llu", (unsigned long long)n);
+        Row(InstrCallName(c), s, errors);
+    }
+    ImGui::Columns(1);
+    if (ImGui::Button("Dump##Diag"))
+    {
+        if (Dump(DIAG_FILE))
+            snprintf(text, sizeof(text), "Could not write " DIAG_FILE ".");
+        else
+            snprintf(text, sizeof(text), "Wrote " DIAG_FILE ".");
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Reset##Diag"))
+    {
+        instr->Clear();
+        if (frame != nullptr)
+            frame->Clear();
+        text[0] = '\0';
+    }
+    if (text[0])
+    {
+        ImGui::SameLine();
+        ImGui::Text("%s", text);
+    }
+}
+
+long DiagPanel::Dump(const char *path) const
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == nullptr)
+        return INSTR_ERR_FILE;
+    time_t now = time(nullptr);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(fp, "%s, %s\n", INSTR_MAGIC, stamp);
+    if (frame != nullptr)
+    {
+        fprintf(fp, "%-32s %10s %10s %10s %10s %10s %10s %10s\n", "# frame phase (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+        frame->Dump(fp, "frame");
+    }
+    instr->Dump(fp);
+    return fclose(fp) ? INSTR_ERR_FILE : 0;
+}
@@ -0,0 +1,36 @@
+// Diagnostics section of the control panel: latency of the driver calls, per call type and
+// device, and time spent in each phase of the render loop.
+#ifndef _DIAGPANEL_H
+#define _DIAGPANEL_H
+
+#include "instrdriver.h"
+#include "latencyhist.h"
+
+#define DIAG_FILE "diagnostics.txt"
+#define DIAG_TEXT_LEN 128
+#define DIAG_NAME_LEN 24
+
+class DiagPanel
+{
+public:
+    // neither is owned, frame may be nullptr
+    DiagPanel(InstrumentedDriver *instr, PhaseTimer *frame);
+    // into the current window; reads the histograms only while it is drawn
+    void Draw();
+    // frame phases and driver calls, as text
+    long Dump(const char *path) const;
+
+private:
+    void Row(const char *name, const latencyStats &s, const char *third);
+
+    InstrumentedDriver *instr;
+    PhaseTimer *frame;
+    int device; // 0 for all, else 1 + index into serNums
+    long numDevices;
+    long serNums[INSTR_MAX_DEVICES];
+    char names[INSTR_MAX_DEVICES + 1][DIAG_NAME_LEN];
+    const char *nameList[INSTR_MAX_DEVICES + 1];
+    char text[DIAG_TEXT_LEN];
+};
+
+#endif // _DIAGPANEL_H
@@ -0,0 +1,314 @@
+// Safety envelope: bulk validation of a three axis grid plan of up to a million points against
+// forbidden zones, with the precomputed lookup and zone by zone; then the envelope of a controller
+// on simulated stages, on a virtual clock: commands, scans, plans and sequences that would leave it
+// are refused before anything moves. Exits 1 if a check fails.
+//
+// usage: mcpher_envbench [--side N] [--repeat N] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "envelope.h"
+#include "scanengine.h"
+#include "scanplan.h"
+#include "sequence.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+// the same check zone by zone: the first point whose move reaches into a zone, -1 if none
+static long Naive(const std::vector<std::vector<envBound>> &zones, const long *serNums, long numAxes, const ScanPlan &plan, const float *from)
+{
+    std::vector<float> lo(numAxes), hi(numAxes);
+    for (long i = 0; i < plan.NumPoints(); i++)
+    {
+        const float *pt = plan.Point(i);
+        const float *prev = i > 0 ? plan.Point(i - 1) : from;
+        for (long j = 0; j < numAxes; j++)
+        {
+            lo[j] = std::min(prev[j], pt[j]);
+            hi[j] = std::max(prev[j], pt[j]);
+        }
+        for (const std::vector<envBound> &z : zones)
+        {
+            bool hit = true;
+            for (const envBound &b : z)
+            {
+                for (long j = 0; j < numAxes; j++)
+                {
+                    if (serNums[j] == b.serNum && (hi[j] < b.min || lo[j] >= b.max))
+                        hit = false;
+                }
+            }
+            if (hit)
+                return i;
+        }
+    }
+    return -1;
+}
+
+typedef struct
+{
+    double lookup; // ns per point
+    double naive;
+    long bad;      // first point refused, -1 if none
+    long naiveBad;
+} planCost;
+
+static planCost Validate(const SafetyEnvelope &env, const std::vector<std::vector<envBound>> &zones, const long *serNums,
+                         const ScanPlan &plan, const float *from, long repeat)
+{
+    planCost c = {1e300, 1e300, -1, -1};
+    std::vector<float> lo(env.NumAxes()), hi(env.NumAxes());
+    for (long j = 0; j < 3; j++)
+    {
+        long a = env.Axis(serNums[j]);
+        if (a >= 0)
+            lo[a] = hi[a] = from[j];
+    }
+    long n = plan.NumPoints();
+    for (long r = 0; r < repeat; r++)
+    {
+        auto t0 = benchClock::now();
+        env.CheckPlan(serNums, 3, plan.Point(0), n, 0, lo.data(), hi.data(), &c.bad);
+        c.lookup = std::min(c.lookup, std::chrono::duration<double, std::nano>(benchClock::now() - t0).count() / n);
+        t0 = benchClock::now();
+        c.naiveBad = Naive(zones, serNums, 3, plan, from);
+        c.naive = std::min(c.naive, std::chrono::duration<double, std::nano>(benchClock::now() - t0).count() / n);
+    }
+    return c;
+}
+
+static bool Moved(MotorTelemetry *tel, long idx, float pos)
+{
+    motorState st;
+    tel->GetState(idx, &st);
+    return fabs(st.curPos - pos) > 0.005f;
+}
+
+int main(int argc, char **argv)
+{
+    long side = 100;
+    long repeat = 3;
+    unsigned latencyUs = 2000;
+    int pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--side"))
+            side = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--repeat"))
+            repeat = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_envbench [--side N] [--repeat N] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (side < 2 || repeat < 1)
+        return 1;
+
+    // a serpentine grid over 0..10 mm on every axis; the zones overlap it on two axes and lie beyond
+    // it on the third, so every point has the first two looked up
+    const long gridSer[3] = {101, 102, 103};
+    scanAxis axes[3];
+    for (long j = 0; j < 3; j++)
+    {
+        axes[j] = {};
+        axes[j].serNum = gridSer[j];
+        axes[j].start = 0;
+        axes[j].stop = 10;
+        axes[j].step = 10.0f / (side - 1);
+    }
+    ScanPlan plan;
+    ScanPlanGrid(axes, 3, SCAN_SERPENTINE, &plan);
+    const float from[3] = {0, 0, 0};
+    printf("%ld points; ns per point, best of %ld\n", plan.NumPoints(), repeat);
+    printf("zones    lookup     naive   speedup   plan ms\n");
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u(0, 9);
+    bool agree = true, clean = true;
+    const long counts[] = {1, 8, 32, 63};
+    for (long nz : counts)
+    {
+        SafetyEnvelope env;
+        std::vector<std::vector<envBound>> zones;
+        for (long z = 0; z < nz; z++)
+        {
+            float x = u(rng), y = u(rng);
+            envBound b[3] = {{gridSer[0], x, x + 1}, {gridSer[1], y, y + 1}, {gridSer[2], 12, 14}};
+            env.AddZone(b, 3);
+            zones.push_back(std::vector<envBound>(b, b + 3));
+        }
+        for (long j = 0; j < 3; j++)
+            env.SetTravel(gridSer[j], 0, 25);
+        planCost c = Validate(env, zones, gridSer, plan, from, repeat);
+        printf("%5ld %9.2f %9.2f %8.2fx %9.1f\n", nz, c.lookup, c.naive, c.naive / c.lookup, c.lookup * plan.NumPoints() / 1e6);
+        clean &= c.bad == -1 && c.naiveBad == -1;
+        // and one zone the plan runs into, between grid lines on every axis
+        float step = axes[0].step;
+        envBound in[3] = {{gridSer[0], 6.5f * step, 7.5f * step}, {gridSer[1], 3.5f * step, 4.5f * step}, {gridSer[2], 0.5f * step, 1.5f * step}};
+        env.AddZone(in, 3);
+        zones.push_back(std::vector<envBound>(in, in + 3));
+        c = Validate(env, zones, gridSer, plan, from, 1);
+        agree &= c.bad >= 0 && c.bad == c.naiveBad;
+    }
+    Check(clean, "a plan clear of every zone passes");
+    Check(agree, "a plan into a zone fails at the same point as zone by zone");
+    SafetyEnvelope travel;
+    travel.SetTravel(gridSer[2], 0, 9.5f);
+    long bad;
+    long ret = travel.CheckPlan(gridSer, 3, plan.Point(0), plan.NumPoints(), 0, nullptr, nullptr, &bad);
+    Check(ret == ENV_ERR_TRAVEL && bad >= 0 && plan.Point(bad)[2] > 9.5f && plan.Point(bad - 1)[2] <= 9.5f,
+          "the first point beyond the travel limits is found");
+
+    const char *envPath = "mcpher_envbench.env";
+    FILE *fp = fopen(envPath, "w");
+    fprintf(fp, "zone 26000001 0 1\nzone 26000001 4\n");
+    fclose(fp);
+    SafetyEnvelope malformed;
+    std::string msg;
+    ret = malformed.Load(envPath, &msg);
+    Check(ret == ENV_ERR_PARAM && msg.find("line 2") != std::string::npos, "a malformed envelope file is refused, with its line");
+
+    // two stages, as SimDriver numbers them; a box one of them may not enter while the other is in it too
+    fp = fopen(envPath, "w");
+    fprintf(fp, "# envbench\n"
+                "travel 26000001 0 10\n"
+                "caps 26000002 1.5 2   # mm/s, mm/s2\n"
+                "zone 26000001 4 6 26000002 4 6\n");
+    fclose(fp);
+    VirtualClock clock;
+    SimDriver sim(2, latencyUs);
+    sim.SetClock(&clock);
+    MotorController controller(&sim, pollMs);
+    controller.SetClock(&clock);
+    SafetyEnvelope *env = controller.Envelope();
+    ret = env->Load(envPath, &msg);
+    remove(envPath);
+    if (ret)
+    {
+        fprintf(stderr, "%s\n", msg.c_str());
+        return 1;
+    }
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return 1;
+    }
+    MotorTelemetry *tel = controller.Telemetry();
+    CommandQueue *cmd = controller.Commands();
+    const long *serNums = controller.SerialNums();
+    // a future's get() would block the virtual clock
+    auto result = [&clock](cmdFuture f)
+    {
+        while (!CmdReady(f))
+            clock.Sleep(0.001);
+        return f.get().ret;
+    };
+    scanParams sp = {};
+    sp.settleTol = 0.005f;
+    sp.settleCount = 3;
+    sp.timeout = 60;
+    ScanEngine place0(&sim, tel, 0, serNums[0]), place1(&sim, tel, 1, serNums[1]);
+
+    ret = result(cmd->Move(0, 12));
+    clock.Sleep(0.2);
+    Check(ret == ENV_ERR_TRAVEL && !Moved(tel, 0, 0), "a move beyond the travel limits is refused");
+    Check(result(cmd->Move(0, NAN)) == ENV_ERR_TRAVEL, "so is a move to NaN");
+    Check(result(cmd->SetVel(1, 0, 1, 2.0f)) == ENV_ERR_VEL && result(cmd->SetVel(1, 0, 1, 1.5f)) == 0, "velocity above the cap of the user is refused");
+    Check(result(cmd->SetVel(0, 0, 1, 3.0f)) == ENV_ERR_VEL && result(cmd->SetVel(0, 0, 1, 2.5f)) == 0, "and above the limit of the device");
+
+    place1.MoveAndSettle(5, sp);
+    ret = result(cmd->Move(0, 8));
+    clock.Sleep(0.2);
+    Check(ret == ENV_ERR_ZONE && !Moved(tel, 0, 0), "a move through a zone is refused");
+    place1.MoveAndSettle(8, sp);
+    ret = result(cmd->Move(0, 8));
+    bool settled = place0.WaitSettled(8, sp) == 0;
+    Check(!ret && settled, "and goes once the other axis is out of it");
+    ret = result(cmd->Move(1, 5));
+    long ret0 = result(cmd->Move(0, 3));
+    Check(!ret && ret0 == ENV_ERR_ZONE, "a move queued for the other axis counts");
+    place1.WaitSettled(5, sp);
+    Check(result(cmd->Home(0)) == ENV_ERR_ZONE, "so does the way home");
+
+    ScanEngine eng(&sim, tel, 0, serNums[0]);
+    eng.SetEnvelope(env);
+    scanParams p = sp;
+    p.start = 8;
+    p.stop = 10.5f;
+    p.step = 0.5f;
+    ret = eng.Run(p);
+    Check(ret == ENV_ERR_TRAVEL && !Moved(tel, 0, 8), "a scan beyond the travel limits does not start");
+    p.start = 8;
+    p.stop = 2;
+    ret = eng.Run(p);
+    Check(ret == ENV_ERR_ZONE && !Moved(tel, 0, 8), "nor does a scan through a zone");
+
+    scanAxis grid[2] = {};
+    for (long j = 0; j < 2; j++)
+    {
+        grid[j].idx = j;
+        grid[j].serNum = serNums[j];
+        grid[j].step = 1;
+    }
+    grid[0].start = 7;
+    grid[0].stop = 9;
+    grid[1].start = 3;
+    grid[1].stop = 5;
+    ScanPlan gplan;
+    ScanPlanGrid(grid, 2, SCAN_SERPENTINE, &gplan);
+    PlanRunner runner(&sim, tel);
+    runner.SetEnvelope(env);
+    long points = 0;
+    runner.SetPointHook([&points](long, const float *, double)
+                        { points++; });
+    ret = runner.Run(grid, 2, gplan, sp);
+    Check(!ret && points == gplan.NumPoints(), "a plan clear of the zone runs");
+    grid[0].start = 3;
+    grid[0].stop = 5;
+    ScanPlanGrid(grid, 2, SCAN_SERPENTINE, &gplan);
+    float at[2];
+    motorState st;
+    tel->GetState(0, &st);
+    at[0] = st.curPos;
+    tel->GetState(1, &st);
+    at[1] = st.curPos;
+    points = 0;
+    ret = runner.Run(grid, 2, gplan, sp);
+    Check(ret == ENV_ERR_ZONE && points == 0 && !Moved(tel, 0, at[0]) && !Moved(tel, 1, at[1]), "a plan into it does not start");
+
+    place0.MoveAndSettle(0, sp);
+    place1.MoveAndSettle(0, sp);
+    SeqProgram prog;
+    prog.Compile("loop 12\n  rmove 1 1\nend\n", 2, nullptr);
+    SeqRunner seq(&sim, tel, serNums, 2);
+    seq.SetEnvelope(env);
+    ret = seq.Run(prog);
+    Check(ret == ENV_ERR_TRAVEL && !Moved(tel, 0, 10), "a sequence stops at its first move beyond travel");
+
+    controller.Shutdown();
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+// Frame cost of reading motor state, for 1 to 32 simulated stages, half of them moving: the loop
+// the panel used to run, MOT_GetInMotion for every motor and MOT_GetPosition for the moving ones
+// through the driver each frame, against the panel's read of the published state, with the pollers
+// doing the driver calls in the background. Exits 1 if a check fails.
+//
+// usage: mcpher_framebench [--frames N] [--max-units N] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+typedef struct
+{
+    double median; // us per frame
+    double p99;
+} frameCost;
+
+static frameCost Cost(std::vector<double> &t)
+{
+    std::sort(t.begin(), t.end());
+    frameCost c = {t[t.size() / 2], t[std::min(t.size() - 1, t.size() * 99 / 100)]};
+    return c;
+}
+
+static double Us(benchClock::time_point t0)
+{
+    return std::chrono::duration<double, std::micro>(benchClock::now() - t0).count();
+}
+
+// the old frame: a round trip per motor, two for the moving ones
+static frameCost DriverFrames(MotorDriver *drv, const long *serNums, long units, long frames, double *sum)
+{
+    std::vector<float> pos(units, 0);
+    std::vector<bool> moving(units, true);
+    std::vector<double> t;
+    for (long f = 0; f < frames; f++)
+    {
+        auto t0 = benchClock::now();
+        for (long i = 0; i < units; i++)
+        {
+            if (moving[i])
+                drv->GetPosition(serNums[i], &pos[i]);
+            bool m = false;
+            drv->GetInMotion(serNums[i], &m);
+            moving[i] = m;
+        }
+        t.push_back(Us(t0));
+        for (long i = 0; i < units; i++)
+            *sum += pos[i];
+    }
+    return Cost(t);
+}
+
+// the panel's frame: one snapshot of the positions and motion, and the error of every motor
+static frameCost SnapshotFrames(MotorTelemetry *tel, long units, long frames, double *sum)
+{
+    const MotorRegistry *reg = tel->Registry();
+    std::vector<float> pos(units);
+    std::vector<uint8_t> moving(units);
+    std::vector<double> t;
+    for (long f = 0; f < frames; f++)
+    {
+        auto t0 = benchClock::now();
+        reg->Snapshot(pos.data(), moving.data(), units);
+        long errors = 0;
+        for (long i = 0; i < units; i++)
+        {
+            motorState st;
+            tel->GetState(i, &st);
+            errors += st.ret != 0;
+        }
+        t.push_back(Us(t0));
+        for (long i = 0; i < units; i++)
+            *sum += pos[i] + moving[i] + errors;
+    }
+    return Cost(t);
+}
+
+int main(int argc, char **argv)
+{
+    long frames = 30;
+    long maxUnits = 32;
+    unsigned latencyUs = 1000;
+    int pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--frames"))
+            frames = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--max-units"))
+            maxUnits = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_framebench [--frames N] [--max-units N] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (frames < 1 || maxUnits < 2 || pollMs < 1)
+        return 1;
+
+    printf("%u us per driver call, poll %d ms, %ld frames per run\n", latencyUs, pollMs, frames);
+    printf("stages   driver us/frame      snapshot us/frame\n");
+    printf("         median      p99      median      p99\n");
+    double sum = 0;
+    std::vector<long> counts;
+    std::vector<frameCost> driver, snapshot;
+    for (long units = 1; units <= maxUnits; units *= 2)
+    {
+        SimDriver sim(units, latencyUs);
+        MotorController controller(&sim, pollMs);
+        std::string msg;
+        if (controller.Init(&msg) || !controller.WaitAll(10000))
+        {
+            fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+            return 1;
+        }
+        // every other stage on its way to the end of its travel for the whole run
+        for (long i = 0; i < units; i += 2)
+            controller.Commands()->Move(i, 24).get();
+        frameCost d = DriverFrames(&sim, controller.SerialNums(), units, frames, &sum);
+        frameCost s = SnapshotFrames(controller.Telemetry(), units, frames * 100, &sum);
+        controller.Shutdown();
+        printf("%6ld %10.1f %8.1f %11.2f %8.2f\n", units, d.median, d.p99, s.median, s.p99);
+        counts.push_back(units);
+        driver.push_back(d);
+        snapshot.push_back(s);
+    }
+    printf("(checksum %.0f)\n", sum);
+
+    const frameCost &d1 = driver.front(), &dn = driver.back(), &s1 = snapshot.front(), &sn = snapshot.back();
+    long n = counts.back();
+    Check(dn.median > 0.8 * latencyUs * n, "the driver loop takes a round trip per stage each frame");
+    Check(sn.median < s1.median + 20, "reading the published state stays flat with the stages");
+    Check(sn.median * 100 < dn.median || latencyUs == 0, "and costs a hundredth of the driver loop at the most");
+    Check(d1.median > 0.8 * latencyUs || latencyUs == 0, "even one stage costs a round trip the old way");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+// Insertion and query cost of MotionHistory, fed with simulated stage moves at a high sample rate.
+//
+// usage: mcpher_histbench [--rate HZ] [--hours H] [--points N] [--capacity N]
+
+#include "history.h"
+#include "kinematics.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+int main(int argc, char **argv)
+{
+    double rate = 10000, hours = 1;
+    long points = 512, capacity = 1024;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--rate"))
+            rate = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--hours"))
+            hours = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--points"))
+            points = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--capacity"))
+            capacity = atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_histbench [--rate HZ] [--hours H] [--points N] [--capacity N]\n");
+            return 1;
+        }
+    }
+    if (rate <= 0 || hours <= 0 || points < 1)
+        return 1;
+    MotionHistory hist(capacity);
+    // back and forth between random targets, 2.6 mm/s and 4 mm/s^2 like a KST101 stage
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> where(0, 25);
+    long samples = (long)(rate * hours * 3600);
+    float from = 0, to = where(rng);
+    moveProfile prof = ProfileMake(to - from, 0, 2.6, 4);
+    double moveStart = 0;
+    auto t0 = benchClock::now();
+    for (long i = 0; i < samples; i++)
+    {
+        double t = i / rate;
+        if (t - moveStart > prof.total + 0.5) // half a second at rest between moves
+        {
+            from = to;
+            to = where(rng);
+            prof = ProfileMake(to - from, 0, 2.6, 4);
+            moveStart = t;
+        }
+        float pos = from + (float)ProfileDistance(&prof, t - moveStart);
+        hist.Add(t, pos, to);
+    }
+    double insert = std::chrono::duration<double>(benchClock::now() - t0).count();
+    printf("%ld samples (%.1f h at %.0f Hz): %.1f ns per insert, %zu kB held\n",
+           samples, hours, rate, insert / samples * 1e9, hist.Memory() / 1024);
+    double first, last;
+    hist.Range(&first, &last);
+    printf("history covers %.1f s\n", last - first);
+    std::vector<histBucket> out(points);
+    const double spans[] = {1, 10, 60, 600, 3600, 1e9};
+    const int queries = 10000;
+    for (double span : spans)
+    {
+        double from = last - span < first ? first : last - span;
+        long n = 0;
+        t0 = benchClock::now();
+        for (int q = 0; q < queries; q++)
+            n = hist.Query(from, last, out.data(), points);
+        double elapsed = std::chrono::duration<double>(benchClock::now() - t0).count();
+        printf("query %8.0f s: %4ld buckets, %7.2f us\n", last - from, n, elapsed / queries * 1e6);
+    }
+    return 0;
+}
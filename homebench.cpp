@@ -0,0 +1,217 @@
+// Home all on simulated stages: the same stages homed one group at a time and all at once, with the
+// time of every device against its velocity profile; then a stage that does not end at home, a
+// cancelled homing and malformed group lists. Exits 1 if a check fails.
+//
+// usage: mcpher_homebench [--units N] [--spread MM] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "homing.h"
+#include "kinematics.h"
+#include "scanengine.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+// a K-Cube that ends a home at the offset without zeroing the position there
+class BadHomeSim : public SimDriver
+{
+public:
+    BadHomeSim(long numUnits, unsigned latencyUs) : SimDriver(numUnits, latencyUs), bad(0) {}
+    long MoveHome(long serNum, bool wait)
+    {
+        if (serNum == bad)
+            return MoveAbsolute(serNum, 0.1f, wait);
+        return SimDriver::MoveHome(serNum, wait);
+    }
+    long bad;
+};
+
+// every stage to its own distance from home, at once
+static bool Spread(MotorDriver *drv, MotorController *controller, float spread)
+{
+    long n = controller->NumUnits();
+    std::vector<ScanEngine> engines;
+    for (long i = 0; i < n; i++)
+        engines.emplace_back(drv, controller->Telemetry(), i, controller->SerialNums()[i]);
+    scanParams p = {};
+    p.settleTol = 0.005f;
+    p.settleCount = 3;
+    p.timeout = 60;
+    for (long i = 0; i < n; i++)
+        engines[i].Command(spread * (i + 1) / n);
+    bool ok = true;
+    for (long i = 0; i < n; i++)
+        ok &= engines[i].WaitSettled(spread * (i + 1) / n, p) == 0;
+    return ok;
+}
+
+static double Home(HomeRunner *runner, const std::vector<std::vector<long>> &groups, std::vector<homeResult> *res, long *ret)
+{
+    auto t0 = benchClock::now();
+    *ret = runner->Run(groups, res);
+    return std::chrono::duration<double>(benchClock::now() - t0).count();
+}
+
+static void Report(const std::vector<homeResult> &res, double homeVel, double accel, double *worst)
+{
+    printf("  motor group   from mm  start s   time s  profile s    end mm  ret\n");
+    *worst = 0;
+    for (const homeResult &r : res)
+    {
+        double profile = MoveTime(r.from, 0, homeVel, accel);
+        printf("  %5ld %5ld %9.3f %8.3f %8.3f %10.3f %9.4f  %ld\n", r.idx + 1, r.group + 1, r.from, r.start, r.time,
+               profile, r.pos, r.ret);
+        if (!r.ret)
+            *worst = std::max(*worst, fabs(r.time - profile));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long units = 4;
+    float spread = 4;
+    unsigned latencyUs = 2000;
+    int pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--units"))
+            units = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--spread"))
+            spread = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_homebench [--units N] [--spread MM] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (units < 2 || !(spread > 0.1f))
+        return 1;
+    BadHomeSim sim(units, latencyUs);
+    MotorController controller(&sim, pollMs);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return 1;
+    }
+    const long *serNums = controller.SerialNums();
+    long homeDir, limSwitch;
+    float homeVel, ofst, minVel, accel, maxVel;
+    sim.GetHomeParams(serNums[0], &homeDir, &limSwitch, &homeVel, &ofst);
+    sim.GetVelParams(serNums[0], &minVel, &accel, &maxVel);
+    HomeRunner runner(&sim, controller.Telemetry(), serNums, units);
+    runner.SetStatusHook([](const std::string &msg)
+                         { printf("  %s\n", msg.c_str()); });
+    std::vector<homeResult> res;
+    long ret;
+    double worst;
+    const double slack = 2.0 * pollMs / 1e3 + 0.05; // completion is seen to within a poll or two
+
+    // one group per motor, as a home button per motor would
+    std::vector<std::vector<long>> groups;
+    for (long i = 0; i < units; i++)
+        groups.push_back(std::vector<long>(1, i));
+    if (!Spread(&sim, &controller, spread))
+        return 1;
+    double sequential = Home(&runner, groups, &res, &ret);
+    printf("one at a time: %.2f s\n", sequential);
+    Report(res, homeVel, accel, &worst);
+    bool home = !ret;
+    for (const homeResult &r : res)
+        home &= !r.ret && fabs(r.pos) <= 0.005f;
+    Check(home, "every stage homed, one at a time");
+    Check(worst < slack, "device times match their profiles");
+
+    HomeRunner::ParseGroups("", units, &groups, nullptr);
+    if (!Spread(&sim, &controller, spread))
+        return 1;
+    double parallel = Home(&runner, groups, &res, &ret);
+    printf("all at once: %.2f s\n", parallel);
+    Report(res, homeVel, accel, &worst);
+    home = !ret;
+    double longest = 0;
+    for (const homeResult &r : res)
+    {
+        home &= !r.ret && fabs(r.pos) <= 0.005f;
+        longest = std::max(longest, r.time);
+    }
+    printf("speedup %.2fx, the longest home %.2f s\n", sequential / parallel, longest);
+    Check(home, "every stage homed, all at once");
+    Check(worst < slack, "device times match their profiles");
+    Check(parallel < longest + slack + 0.2, "all at once takes as long as the longest home");
+
+    // groups in order: a failed group stops the ones after it
+    sim.bad = serNums[0];
+    if (!Spread(&sim, &controller, spread))
+        return 1;
+    HomeRunner::ParseGroups(("1; 2-" + std::to_string(units)).c_str(), units, &groups, &msg);
+    Check(groups.empty(), "ranges are not motor numbers");
+    std::string spec = "1;";
+    for (long i = 2; i <= units; i++)
+        spec += " " + std::to_string(i);
+    HomeRunner::ParseGroups(spec.c_str(), units, &groups, nullptr);
+    Home(&runner, groups, &res, &ret);
+    Check(ret == HOME_ERR_POSITION && res[0].ret == HOME_ERR_POSITION, "a stage at rest off home fails the check");
+    Check(res.size() == (size_t)units && res[1].ret == HOME_ERR_SKIPPED && res[1].pos > 0.1f, "later groups are not homed");
+    sim.bad = 0;
+
+    // cancel stops the stages where they are
+    {
+        CancelToken token;
+        runner.SetCancelToken(&token);
+        HomeRunner::ParseGroups("", units, &groups, nullptr);
+        std::thread canceller([&token]()
+                              {
+                                  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                                  token.Cancel(); });
+        double took = Home(&runner, groups, &res, &ret);
+        canceller.join();
+        runner.SetCancelToken(nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        bool still = true;
+        for (long i = 0; i < units; i++)
+        {
+            bool moving;
+            sim.GetInMotion(serNums[i], &moving);
+            still &= !moving;
+        }
+        printf("cancelled after %.2f s\n", took);
+        Check(ret == SCAN_ERR_STOPPED && took < 0.3 + slack && still, "cancel stops every stage");
+    }
+
+    std::string none = std::to_string(units + 1);
+    const char *bad[] = {"1;;2", "1;", "0", "1 1", "x", "1 2x", none.c_str()};
+    long rejected = 0;
+    for (const char *b : bad)
+        rejected += HomeRunner::ParseGroups(b, units, &groups, nullptr) == HOME_ERR_SYNTAX;
+    HomeRunner::ParseGroups("2, 1 ; 3", units, &groups, nullptr);
+    Check(rejected == (long)(sizeof(bad) / sizeof(bad[0])) && groups.size() == 2 && groups[0][1] == 0 && groups[1][0] == 2,
+          "group lists parse, malformed ones are rejected");
+
+    controller.Shutdown();
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
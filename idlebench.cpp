@@ -0,0 +1,176 @@
+// CPU time and wakeups of the render loop on simulated stages, drawing at every vsync as the panel
+// used to and paced by FrameScheduler, with the stages at rest and moving. A frame is emulated:
+// a spin for the update, build and render time, then a sleep to the next vsync as Present does.
+// POSIX only, the CPU time and context switches come from getrusage.
+//
+// usage: mcpher_idlebench [--units N] [--seconds S] [--frame-us US] [--refresh HZ] [--poll MS]
+
+#include "controller.h"
+#include "framesched.h"
+#include "simdriver.h"
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+typedef std::chrono::steady_clock benchClock;
+
+#ifdef RUSAGE_THREAD
+#define BENCH_RUSAGE RUSAGE_THREAD // the UI thread alone, the pollers cost the same either way
+#else
+#define BENCH_RUSAGE RUSAGE_SELF
+#endif
+
+typedef struct
+{
+    double cpu;      // s, user and system
+    long switches;   // voluntary context switches: each one a sleep and a wakeup
+    double procCpu;  // s, the whole process
+} usage;
+
+static double Cpu(const struct rusage &ru)
+{
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+static usage Usage()
+{
+    struct rusage ru, self;
+    getrusage(BENCH_RUSAGE, &ru);
+    getrusage(RUSAGE_SELF, &self);
+    usage u = {Cpu(ru), ru.ru_nvcsw, Cpu(self)};
+    return u;
+}
+
+// a render loop for seconds; returns the frames drawn
+static long Loop(MotorController *controller, FrameScheduler *sched, double seconds, long frameUs, double refresh)
+{
+    MotorTelemetry *tel = controller->Telemetry();
+    auto period = std::chrono::duration_cast<benchClock::duration>(std::chrono::duration<double>(1 / refresh));
+    auto t0 = benchClock::now();
+    auto end = t0 + std::chrono::duration_cast<benchClock::duration>(std::chrono::duration<double>(seconds));
+    long frames = 0;
+    while (benchClock::now() < end)
+    {
+        sched->Wait();
+        bool busy = false;
+        for (long i = 0; i < controller->NumUnits(); i++)
+        {
+            motorState st;
+            if (tel->GetState(i, &st))
+                busy |= st.moving;
+        }
+        auto spin = benchClock::now() + std::chrono::microseconds(frameUs);
+        while (benchClock::now() < spin)
+            ;
+        sched->Frame(busy);
+        frames++;
+        // Present blocks until the next vsync
+        auto now = benchClock::now();
+        std::this_thread::sleep_until(t0 + period * ((now - t0) / period + 1));
+    }
+    return frames;
+}
+
+int main(int argc, char **argv)
+{
+    long units = 4, frameUs = 1000;
+    double seconds = 10, refresh = 60;
+    int pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--units"))
+            units = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--seconds"))
+            seconds = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--frame-us"))
+            frameUs = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--refresh"))
+            refresh = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_idlebench [--units N] [--seconds S] [--frame-us US] [--refresh HZ] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (units < 1 || seconds <= 0 || frameUs < 0 || refresh <= 0)
+        return 1;
+    SimDriver sim(units);
+    MotorController controller(&sim, pollMs);
+    FrameScheduler sched;
+    controller.Telemetry()->SetChangeHook([&sched](long)
+                                          { sched.Changed(); });
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return 1;
+    }
+    // back and forth over 2 mm, every stage, while moving is set
+    std::atomic<bool> moving(false), stop(false);
+    std::thread mover([&]
+                      {
+                          float to = 2;
+                          while (!stop)
+                          {
+                              if (!moving)
+                              {
+                                  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                                  continue;
+                              }
+                              for (long i = 0; i < units; i++)
+                              {
+                                  sim.MoveAbsolute(controller.SerialNums()[i], to, false);
+                                  controller.Telemetry()->Kick(i);
+                              }
+                              bool any = true;
+                              while (any && !stop)
+                              {
+                                  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                                  any = false;
+                                  for (long i = 0; i < units; i++)
+                                  {
+                                      bool m = false;
+                                      sim.GetInMotion(controller.SerialNums()[i], &m);
+                                      any |= m;
+                                  }
+                              }
+                              to = 2 - to;
+                          } });
+    printf("%ld stages, %.0f s per run, %ld us per frame, %.0f Hz vsync, poll %d ms\n", units, seconds, frameUs, refresh, pollMs);
+    printf("%-8s %-9s %8s %10s %10s %10s %10s\n", "stages", "loop", "frames/s", "wakeups/s", "UI CPU %", "all CPU %", "waits/s");
+    const char *loops[] = {"vsync", "adaptive"};
+    for (int phase = 0; phase < 2; phase++)
+    {
+        moving = phase == 1;
+        if (moving) // under way before the clock starts
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        for (int l = 0; l < 2; l++)
+        {
+            sched.SetEnabled(l == 1);
+            frameSchedStats s0, s1;
+            sched.GetStats(&s0);
+            usage u0 = Usage();
+            auto t0 = benchClock::now();
+            long frames = Loop(&controller, &sched, seconds, frameUs, refresh);
+            double wall = std::chrono::duration<double>(benchClock::now() - t0).count();
+            usage u1 = Usage();
+            sched.GetStats(&s1);
+            printf("%-8s %-9s %8.1f %10.1f %10.2f %10.2f %10.1f\n", moving ? "moving" : "at rest", loops[l], frames / wall,
+                   (u1.switches - u0.switches) / wall, (u1.cpu - u0.cpu) / wall * 100, (u1.procCpu - u0.procCpu) / wall * 100,
+                   (s1.waits - s0.waits) / wall);
+        }
+    }
+    stop = true;
+    mover.join();
+    controller.Shutdown();
+    return 0;
+}
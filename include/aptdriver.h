@@ -0,0 +1,26 @@
+// MotorDriver backed by the Thorlabs APT server (KST101 K-Cubes), Windows only.
+#ifndef _APTDRIVER_H
+#define _APTDRIVER_H
+
+#include "motordriver.h"
+
+class AptDriver : public MotorDriver
+{
+public:
+    long Init();
+    long Cleanup();
+    long GetNumUnits(long *numUnits);
+    long GetSerialNum(long idx, long *serNum);
+    long InitDevice(long serNum);
+    long GetPosition(long serNum, float *pos);
+    long GetInMotion(long serNum, bool *moving);
+    long MoveAbsolute(long serNum, float pos, bool wait);
+    long MoveHome(long serNum, bool wait);
+    long Stop(long serNum);
+    long GetVelParams(long serNum, float *minVel, float *accel, float *maxVel);
+    long SetVelParams(long serNum, float minVel, float accel, float maxVel);
+    long GetVelParamLimits(long serNum, float *maxAccel, float *maxVel);
+    long GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst);
+};
+
+#endif // _APTDRIVER_H
@@ -0,0 +1,66 @@
+// Learned backlash: where each stage comes to rest, against where it was sent, per approach direction.
+#ifndef _BACKLASH_H
+#define _BACKLASH_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#define BACKLASH_ERR_FILE 21401   // could not open or write the table file
+#define BACKLASH_ERR_FORMAT 21402 // not a backlash table file
+
+#define BACKLASH_MAGIC "# mcpher backlash 1"
+#define BACKLASH_FORGET 0.8 // weight of older moves per new one, ~5 moves remembered per bin
+#define BACKLASH_MAX_BINS 10000 // per device, 10 m of travel in the default 1 mm bins; beyond, only the device mean
+
+typedef struct
+{
+    uint64_t moves;  // observed, both directions
+    float backlash;  // mm, rest position approaching from above less from below; NaN until both seen
+    float offset[2]; // mm, mean rest position less the command, approaching from below and from above
+    float spread[2]; // mm, standard deviation about it
+} backlashFit;
+
+// Keyed by serial number, so a table follows its device and can be saved across sessions. The
+// travel is cut into bins of binWidth, each with the error of where the stage stops for either
+// approach direction; a bin not observed yet takes the mean of the device. Thread safe.
+class BacklashTable
+{
+public:
+    BacklashTable(float binWidth = 1.0f);
+    // a move in dir (1 up, -1 down) commanded to cmd came to rest at actual
+    void Observe(long serNum, int dir, float cmd, float actual);
+    // expected rest position less the command, near pos; 0 until observed
+    float Offset(long serNum, int dir, float pos) const;
+    // of the whole device, NaN until both directions were observed
+    float Backlash(long serNum) const;
+    bool GetFit(long serNum, backlashFit *fit) const;
+    void Clear(long serNum);
+    // entries already observed in this session are kept
+    long Load(const char *path);
+    long Save(const char *path) const;
+
+private:
+    struct entry
+    {
+        double w;    // exponentially weighted sums
+        double x;
+        double xx;
+        uint64_t n;
+    };
+    struct device
+    {
+        entry all[2];
+        std::vector<entry> bins; // 2 per bin, below and above
+    };
+    static void Add(entry *s, double x);
+    static float Mean(const entry &s);
+    long Bin(float pos) const; // -1 past BACKLASH_MAX_BINS
+
+    float binWidth;
+    mutable std::mutex lock;
+    std::map<long, device> devices;
+};
+
+#endif // _BACKLASH_H
@@ -0,0 +1,83 @@
+// Time source of the controller threads: the steady clock, or a virtual clock for simulation.
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Every sleep and timed wait of the polling, command, init and scan threads goes through one of
+// these, as do the notifications that end a wait and the threads themselves.
+class Clock
+{
+public:
+    virtual ~Clock() {}
+    // s since an arbitrary point fixed for the clock
+    virtual double Now() const = 0;
+    virtual void Sleep(double seconds) = 0;
+    // as cv.wait_for(lk, seconds, pred), INFINITY for no timeout; whoever makes pred true wakes it with Notify(cv)
+    virtual bool Wait(std::unique_lock<std::mutex> &lk, std::condition_variable &cv, double seconds, const std::function<bool()> &pred) = 0;
+    // wakes every Wait() on cv
+    virtual void Notify(std::condition_variable &cv) = 0;
+    // a thread that keeps the time of this clock; end it with Join()
+    virtual std::thread Spawn(std::function<void()> fn) = 0;
+    virtual void Join(std::thread &thr) = 0;
+};
+
+// std::chrono::steady_clock, shared by everything not given another clock
+Clock *DefaultClock();
+
+// Discrete-event clock: the threads it spawned take turns, one running at a time, and time jumps
+// to the next wakeup whenever the running thread sleeps or waits. Turns go in order of wakeup
+// time, then of when the threads blocked, so a simulation runs the same way every time and as
+// fast as the CPU allows. The thread that made the clock takes part too; no thread may block
+// other than through the clock (a future's get(), a join without Join()), and a Sleep() or
+// Wait() from a thread it did not spawn aborts.
+class VirtualClock : public Clock
+{
+public:
+    VirtualClock();
+    double Now() const;
+    void Sleep(double seconds);
+    bool Wait(std::unique_lock<std::mutex> &lk, std::condition_variable &cv, double seconds, const std::function<bool()> &pred);
+    void Notify(std::condition_variable &cv);
+    std::thread Spawn(std::function<void()> fn);
+    void Join(std::thread &thr);
+    // times one thread handed over to another, the real cost of a simulation
+    uint64_t Switches() const;
+
+private:
+    struct member
+    {
+        std::condition_variable turn;
+        bool run;                     // its turn
+        bool done;                    // the thread function returned
+        bool queued;                  // in ready, under key
+        std::pair<double, uint64_t> key;
+        std::condition_variable *on;  // in a Wait() on it, nullptr otherwise
+        std::condition_variable exit; // Join() waits on it
+    };
+    member *Self(); // call with lock held
+    void Queue(member *m, double wake);
+    void Block(member *m, std::condition_variable *cv);
+    void Next(member *self);
+    void Switch(std::unique_lock<std::mutex> &ck, member *self);
+    void Wake(std::condition_variable *cv);
+
+    mutable std::mutex lock;
+    double now;
+    uint64_t order;
+    uint64_t switches;
+    std::map<std::pair<double, uint64_t>, member *> ready; // runnable at the time of the key
+    std::unordered_multimap<std::condition_variable *, member *> waiting;
+    std::unordered_map<std::thread::id, std::unique_ptr<member>> members;
+};
+
+#endif // _CLOCK_H
@@ -0,0 +1,131 @@
+// Per-device asynchronous motor command queues with coalescing of superseded commands.
+#ifndef _CMDQUEUE_H
+#define _CMDQUEUE_H
+
+#include "clock.h"
+#include "envelope.h"
+#include "motordriver.h"
+#include "recorder.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define CMD_ERR_SUPERSEDED 20101 // replaced by a newer command before it was sent
+#define CMD_ERR_CANCELLED 20102  // queue stopped before the command was sent
+
+enum cmdType
+{
+    CMD_MOVE,
+    CMD_HOME,
+    CMD_SETVEL,
+    CMD_STOP
+};
+
+typedef struct
+{
+    long ret;     // driver return code, or CMD_ERR_*
+    float minVel; // velocity readback, valid after a successful CMD_SETVEL
+    float Accel;
+    float maxVel;
+    double latency; // s from submission to completion
+} cmdResult;
+
+typedef std::shared_future<cmdResult> cmdFuture;
+
+typedef struct
+{
+    uint64_t submitted;
+    uint64_t coalesced; // commands dropped in favour of a newer one
+    uint64_t sent;      // commands that reached the driver
+    double totalLatency;
+    double maxLatency;
+} cmdQueueStats;
+
+class CommandQueue
+{
+public:
+    CommandQueue(MotorDriver *drv);
+    ~CommandQueue();
+    // spawns one worker per device so a slow device never holds up the others; up to capacity
+    // devices (at least numUnits), the ones beyond numUnits added with Add()
+    void Start(const long *serNums, long numUnits, long capacity = 0);
+    // a device plugged in: a worker for slot idx, as numbered by the telemetry
+    long Add(long idx, long serNum);
+    // a device unplugged: its worker ends, pending commands fail with CMD_ERR_CANCELLED and new
+    // ones with DRV_ERR_NODEVICE
+    long Remove(long idx);
+    void Stop();
+    // called from the worker after a command has been sent and its future is ready, e.g. to wake
+    // the telemetry poller
+    void SetSentHook(std::function<void(long idx)> hook);
+    // every command sent is also logged to rec, set before Start()
+    void SetRecorder(Recorder *rec);
+    // time source of the workers, the steady clock unless set; set before Start(). With a
+    // VirtualClock a result is taken once CmdReady(), a get() would block the simulation
+    void SetClock(Clock *clock);
+    // moves, homes and velocity changes that leave env fail at once with its ENV_ERR_*, the other
+    // axes of a zone taken where tel has them or where a move queued here takes them; set before Start()
+    void SetEnvelope(const SafetyEnvelope *env, const MotorTelemetry *tel);
+
+    cmdFuture Move(long idx, float pos);
+    cmdFuture Home(long idx);
+    cmdFuture SetVel(long idx, float minVel, float accel, float maxVel);
+    cmdFuture Halt(long idx);
+
+    cmdQueueStats GetStats() const;
+    size_t Pending(long idx) const;
+    // destination of the last command sent if it was a move or home, NaN otherwise
+    float Target(long idx) const;
+
+private:
+    struct command
+    {
+        cmdType type;
+        float args[3];
+        double submitted; // clock s
+        std::promise<cmdResult> done;
+    };
+    struct device
+    {
+        long serNum;
+        bool present;
+        std::thread thr;
+        mutable std::mutex lock;
+        std::condition_variable cond;
+        std::deque<std::unique_ptr<command>> pending;
+        std::atomic<float> target;
+        std::atomic<float> queued; // destination of the last move or home submitted, NaN after a stop
+    };
+    cmdFuture Submit(long idx, cmdType type, float a0, float a1, float a2);
+    void Finish(command *cmd, cmdResult &res);
+    long Check(device *dev, cmdType type, const float *args) const; // call with the lock of dev held
+    void WorkerFcn(long idx);
+
+    MotorDriver *drv;
+    Recorder *rec;
+    Clock *clock;
+    const SafetyEnvelope *env;
+    const MotorTelemetry *tel;
+    std::function<void(long idx)> sentHook;
+    std::atomic<bool> running;
+    std::vector<std::unique_ptr<device>> devices; // one per slot, made in Start()
+    std::mutex addLock;                           // Add(), Remove() and Stop()
+    mutable std::mutex statLock;
+    cmdQueueStats stats;
+};
+
+// true if the command has completed, without blocking
+inline bool CmdReady(const cmdFuture &f)
+{
+    return f.valid() && f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+#endif // _CMDQUEUE_H
@@ -0,0 +1,134 @@
+// Device bring-up and the services built on a driver, shared by the GUI and the headless server.
+#ifndef _CONTROLLER_H
+#define _CONTROLLER_H
+
+#include "backlash.h"
+#include "cmdqueue.h"
+#include "envelope.h"
+#include "motionmodel.h"
+#include "motordriver.h"
+#include "recorder.h"
+#include "telemetry.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CTL_ERR_NOUNITS 20601 // the driver found no devices
+
+#define CTL_MAX_UNITS 512 // default slots for devices, those found at Init() and any plugged in later
+
+enum deviceState
+{
+    DEV_PENDING,      // waiting for a worker
+    DEV_INITIALIZING, // InitDevice and parameter reads in progress
+    DEV_READY,        // usable; ret != 0 if a parameter read failed
+    DEV_FAILED,       // InitDevice failed, the motor is not usable
+    DEV_REMOVED,      // unplugged; the slot is kept for it in case it comes back
+};
+
+typedef struct
+{
+    deviceState state;
+    long ret;         // first driver error, 0 if none
+    const char *call; // the call that returned ret
+    double initTime;  // s spent initializing this device
+    double readyTime; // s from Init() until ready or failed
+    float pos;
+    float minVel;
+    float Accel;
+    float maxVel;
+    float limMaxAccel;
+    float limMaxVel;
+    long homeDir;
+    long limSwitch;
+    float homeVel;
+    float ofst;
+} deviceInfo;
+
+class MotorController
+{
+public:
+    // drv is not owned, and stays initialized after Shutdown() so the owner can call Cleanup()
+    MotorController(MotorDriver *drv, int pollMs = 20);
+    ~MotorController();
+    // telemetry polls and commands are logged to rec, set before Init()
+    void SetRecorder(Recorder *rec);
+    // called after every command sent, after the telemetry poller was woken; set before Init()
+    void SetSentHook(std::function<void(long idx)> hook);
+    // called from a worker when a device becomes ready or fails, and from Rescan() when one is
+    // removed; set before Init()
+    void SetDeviceHook(std::function<void(long idx, const deviceInfo &info)> hook);
+    // most devices, present or not, over the life of the controller; set before Init()
+    void SetCapacity(long maxUnits);
+    // time source of the workers, the telemetry and the command queues, e.g. a VirtualClock for
+    // simulation; set before Init()
+    void SetClock(Clock *clock);
+    // initializes the driver and enumerates the devices, then returns while up to maxWorkers
+    // threads initialize the devices; each motor is polled and usable as soon as it is ready.
+    // On failure msg (may be nullptr) describes what went wrong.
+    long Init(std::string *msg, int maxWorkers = 8);
+    // blocks until every device is ready or failed, false on timeout
+    bool WaitAll(int timeoutMs);
+    // enumerates the devices again: the ones gone are removed, new ones are added and initialized in
+    // the background, while the others carry on. added and removed may be nullptr.
+    long Rescan(long *added, long *removed, std::string *msg);
+    // a device plugged in, in the slot it had before if it had one; initialized in the background
+    long AddDevice(long serNum, long *idx);
+    // a device unplugged: its poller and command queue stop, its scans fail with DRV_ERR_NODEVICE
+    long RemoveDevice(long idx);
+    // stops device initialization, telemetry and the command queues
+    void Shutdown();
+    // slots in use, including those of devices removed since; indices below it stay valid
+    long NumUnits() const;
+    // serial number of every slot, stable for the life of the controller
+    const long *SerialNums() const;
+    bool GetDevice(long idx, deviceInfo *info) const;
+    MotorDriver *Driver() const;
+    MotorTelemetry *Telemetry() const;
+    CommandQueue *Commands() const;
+    // move time prediction, learned by the scans that are given it; nullptr before Init()
+    MotionModel *Motion() const;
+    // limits of every command, set up before Init(); each device adds its own caps as it comes up,
+    // and scans are checked against it once given it
+    SafetyEnvelope *Envelope() const;
+    // where each device stops against where it is sent, learned by the scans run in precision mode
+    BacklashTable *Backlash() const;
+
+private:
+    void InitFcn();
+    void InitDevice(long idx);
+    void Queue(long idx); // call with lock held
+
+    MotorDriver *drv;
+    Recorder *rec;
+    Clock *clock;
+    std::function<void(long idx)> sentHook;
+    std::function<void(long idx, const deviceInfo &info)> deviceHook;
+    long capacity;
+    int maxWorkers;
+    std::unique_ptr<MotorTelemetry> tel;
+    std::unique_ptr<CommandQueue> cmd;
+    std::unique_ptr<MotionModel> motion;
+    std::unique_ptr<SafetyEnvelope> env;
+    std::unique_ptr<BacklashTable> backlash;
+    std::vector<std::thread> workers; // up to maxWorkers, they wait for devices until Shutdown()
+    std::deque<long> toInit;          // slots waiting for a worker
+    std::condition_variable work;
+    std::atomic<bool> stopping;
+    mutable std::mutex lock;
+    std::mutex rescanLock; // Rescan(), AddDevice() and RemoveDevice()
+    std::condition_variable done;
+    std::vector<deviceInfo> devices; // one per slot
+    long numPending;                 // devices pending or initializing
+    double t0; // clock s at Init()
+};
+
+#endif // _CONTROLLER_H
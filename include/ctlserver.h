@@ -0,0 +1,144 @@
+// Headless control: a line protocol over local TCP or Unix sockets, served by one event loop.
+//
+// Requests are lines "<tag> <command> [args]". The tag is any token without spaces and is echoed
+// in the reply, "<tag> ok [values]" or "<tag> err <code>". Requests may be pipelined; commands that
+// go through the command queue are answered once they have been sent to the device, so their
+// replies can overtake each other. Lines starting with "*" are pushed by the server.
+//
+//   ping                                       ok
+//   units                                      ok <n> <serial>...
+//   status <idx>                               ok <pos> <moving> <ret>
+//   move <idx> <pos>                           ok
+//   home <idx>                                 ok
+//   stop <idx>                                 ok
+//   vel <idx> <min> <accel> <max>              ok <min> <accel> <max> (readback)
+//   scan <idx> <start> <stop> <step> <dwell>   ok, then pushes
+//                                                * point <idx> <i> <target> <actual> <value>
+//                                                * scan <idx> <ret>
+//   scanstop <idx>                             ok
+//   sub                                        ok, then pushes "* state <idx> <pos> <moving> <ret>"
+//                                                whenever a motor's state changes
+//   unsub                                      ok
+#ifndef _CTLSERVER_H
+#define _CTLSERVER_H
+
+#include "cmdqueue.h"
+#include "envelope.h"
+#include "measurement.h"
+#include "motordriver.h"
+#include "scanengine.h"
+#include "scantask.h"
+#include "statusbus.h"
+#include "telemetry.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define SRV_ERR_SOCKET 20501  // could not create, bind or listen on a socket
+#define SRV_ERR_COMMAND 20502 // unknown command or malformed request
+#define SRV_ERR_BUSY 20503    // motor is already scanning
+
+#ifdef _WIN32
+typedef uintptr_t srvSocket; // SOCKET
+#else
+typedef int srvSocket;
+#endif
+
+class ControlServer
+{
+public:
+    // cmd's sent hook must call Wake(), or queued command replies wait for the next event
+    ControlServer(MotorDriver *drv, MotorTelemetry *tel, CommandQueue *cmd, const long *serNums, long numUnits);
+    ~ControlServer();
+    // measurement taken at every scan point, nullptr to only dwell
+    void SetMeasurement(Measurement *meas);
+    // learns from the scans' moves, set before Run()
+    void SetMotionModel(MotionModel *model);
+    // scans outside it are refused before they start, set before Run()
+    void SetEnvelope(const SafetyEnvelope *env);
+    // the point each scan has reached is published to it, set before Run()
+    void SetStatusBus(StatusBus *bus);
+    // state pushes go out at most once per interval
+    void SetPushInterval(int ms);
+    // listens on 127.0.0.1; port 0 picks a free port, see Port()
+    long ListenTcp(int port);
+    int Port() const;
+    // listens on a Unix domain socket, replacing a stale one at path; SRV_ERR_SOCKET if anything else is
+    // there, a file or a socket a server still accepts on (not available on Windows)
+    long ListenUnix(const char *path);
+    // serves clients until Shutdown(); stops running scans before returning
+    long Run();
+    // thread safe
+    void Shutdown();
+    // thread safe: wakes the event loop to deliver replies and scan events
+    void Wake();
+    uint64_t Requests() const;
+
+private:
+    struct client
+    {
+        uint64_t id;
+        srvSocket fd;
+        std::string in;
+        std::string out;
+        bool sub;
+        bool closed;
+    };
+    struct reply
+    {
+        uint64_t client;
+        std::string tag;
+        cmdType type;
+        cmdFuture fut;
+    };
+    struct scanJob
+    {
+        std::shared_ptr<ScanTask> task; // latest scan, touched by the event loop only
+        std::atomic<bool> active;       // cleared before the final event is posted, so a reply to it can start the next scan
+        uint64_t client;
+    };
+    void Accept(srvSocket lfd);
+    void Receive(client *c);
+    void Send(client *c);
+    void Handle(client *c, char *line);
+    void Queue(client *c, const char *tag, cmdType type, cmdFuture fut);
+    void StartScan(client *c, const char *tag, long idx, const scanParams &p);
+    long ScanFcn(ScanTask *task, long idx, uint64_t id, scanParams p);
+    void StopScans();
+    void Post(uint64_t id, const std::string &msg);
+    void Push(uint64_t id, const std::string &msg);
+    client *Find(uint64_t id);
+    void CheckReplies();
+    void PushStates();
+
+    MotorDriver *drv;
+    MotorTelemetry *tel;
+    CommandQueue *cmd;
+    Measurement *meas;
+    MotionModel *model;
+    const SafetyEnvelope *env;
+    StatusBus *bus;
+    std::vector<long> serNums;
+    std::vector<srvSocket> listeners;
+    std::string unixPath;
+    int port;
+    srvSocket wakeFd; // loopback UDP socket connected to itself
+    std::atomic<bool> running;
+    std::atomic<int> pushMs;
+    uint64_t nextId;
+    std::atomic<uint64_t> requests;
+    std::vector<std::unique_ptr<client>> clients;
+    std::vector<reply> replies;
+    std::vector<std::unique_ptr<scanJob>> scans;
+    std::vector<motorState> pushed; // last state pushed per motor
+    std::mutex eventLock;
+    std::vector<std::pair<uint64_t, std::string>> events; // posted by scan threads
+    ScanTaskManager tasks; // last, so its threads are gone before anything they use
+};
+
+#endif // _CTLSERVER_H
@@ -0,0 +1,108 @@
+// Software safety envelope: travel limits, forbidden zones and velocity caps, checked before anything moves.
+#ifndef _ENVELOPE_H
+#define _ENVELOPE_H
+
+#include "telemetry.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define ENV_ERR_TRAVEL 21301 // target beyond the travel limits of the axis, or not a number
+#define ENV_ERR_ZONE 21302   // the path of the move reaches into a forbidden zone
+#define ENV_ERR_VEL 21303    // velocity or acceleration above the cap of the axis
+#define ENV_ERR_PARAM 21304  // malformed limit or zone, or more than ENV_MAX_ZONES
+#define ENV_ERR_FILE 21305   // envelope file could not be read
+
+#define ENV_MAX_ZONES 64 // a zone is a bit of the lookup masks
+
+typedef struct
+{
+    long serNum;
+    float min; // the zone spans min <= pos < max of this axis
+    float max;
+} envBound;
+
+typedef struct
+{
+    float min; // travel, inclusive
+    float max;
+    float maxVel;
+    float maxAccel;
+} envLimits;
+
+// Limits and zones are keyed by serial number, so they follow a device to whatever slot it gets. A
+// zone is a box over the axes it bounds, any position of the others; a move is refused if the box
+// its axes sweep, from where they are to where they go, reaches into one. Each axis bounded by a
+// zone has its zone edges sorted once, with the zones covering every interval between two edges as
+// a mask, so a check costs a binary search per axis whatever the number of zones.
+//
+// Limits and zones are set up before the envelope is used, and are read without locking from then
+// on; device limits may come in at any time. A home is checked for the zones on its way to 0 but
+// not against the travel limits, it finds the reference they are measured from.
+class SafetyEnvelope
+{
+public:
+    SafetyEnvelope();
+    long SetTravel(long serNum, float min, float max);
+    // caps of the user, the device's own still apply
+    long SetCaps(long serNum, float maxVel, float maxAccel);
+    long AddZone(const envBound *bounds, long numBounds);
+    // one limit per line, '#' starts a comment:
+    //   travel SERIAL MIN MAX
+    //   caps SERIAL MAXVEL MAXACCEL
+    //   zone SERIAL MIN MAX [SERIAL MIN MAX ...]
+    // returns ENV_ERR_FILE or ENV_ERR_PARAM with the line at fault in msg (may be nullptr)
+    long Load(const char *path, std::string *msg);
+    // the limits the device reports, as read at its init
+    void SetDeviceLimits(long serNum, float maxAccel, float maxVel);
+    envLimits Limits(long serNum) const;
+    long NumZones() const;
+
+    // the axes bounded by a zone: the positions the checks need, indexed as here
+    long NumAxes() const;
+    long SerialNum(long axis) const;
+    long Axis(long serNum) const; // -1 if no zone bounds it
+    // where every axis of a zone may be: from its position to the target of a move in progress.
+    // NaN where not known (not present, not polled yet, in error), which any zone takes as inside
+    void Where(const MotorTelemetry *tel, float *lo, float *hi) const;
+
+    long CheckTarget(long serNum, float pos) const;
+    // the zones on the way of serNum to pos, not its travel (e.g. for a home); lo/hi as from
+    // Where(), the range of serNum included
+    long CheckPath(long serNum, float pos, const float *lo, const float *hi) const;
+    // CheckTarget() and CheckPath()
+    long CheckMove(long serNum, float pos, const float *lo, const float *hi) const;
+    long CheckVel(long serNum, float minVel, float accel, float maxVel) const;
+    // a single axis scan through start..stop, from where lo/hi have the axis
+    long CheckScan(long serNum, float start, float stop, const float *lo, const float *hi) const;
+    // every point of a plan from first on, numAxes coordinates each, and every move between them,
+    // from where lo/hi have the axes; *bad is the first point refused, -1 if none
+    long CheckPlan(const long *serNums, long numAxes, const float *points, long numPoints, long first,
+                   const float *lo, const float *hi, long *bad) const;
+
+private:
+    struct axisLookup
+    {
+        long serNum;
+        std::vector<float> edges;    // sorted, every min and max of the zones bounding the axis
+        std::vector<uint64_t> masks; // zones covering [edges[k - 1], edges[k]), edges.size() + 1 of them
+        uint64_t any;                // zones the axis can be in somewhere
+    };
+    void Build();
+    uint64_t Span(const axisLookup &l, float lo, float hi) const;
+    // zones the box lo..hi reaches into, axis overridden with a0..a1 unless -1
+    uint64_t Hits(const float *lo, const float *hi, long axis, float a0, float a1) const;
+
+    std::unordered_map<long, envLimits> limits;
+    std::vector<std::vector<envBound>> zones;
+    std::vector<axisLookup> axes;
+    std::unordered_map<long, long> axisOf;
+    uint64_t all; // one bit per zone
+    mutable std::mutex devLock;
+    std::unordered_map<long, std::pair<float, float>> devLimits; // maxAccel, maxVel
+};
+
+#endif // _ENVELOPE_H
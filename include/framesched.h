@@ -0,0 +1,69 @@
+// Frame pacing for the control panel: every frame while something moves or the user interacts,
+// otherwise a frame on each change and a few per second, so the window costs next to nothing at rest.
+#ifndef _FRAMESCHED_H
+#define _FRAMESCHED_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#define FRAME_HOLD_MS 500 // full rate this long after the last input or activity
+#define FRAME_IDLE_MS 500 // longest wait between frames at rest
+
+enum frameWake
+{
+    WAKE_NONE,    // did not wait
+    WAKE_CHANGE,  // Changed(), e.g. a motor state changed
+    WAKE_INPUT,   // Input(), or window messages
+    WAKE_TIMEOUT, // the idle frame interval ran out
+};
+
+typedef struct
+{
+    uint64_t frames;
+    uint64_t waits;        // frames that waited first
+    uint64_t changeWakes;  // waits ended by a change
+    uint64_t inputWakes;   // waits ended by input
+    uint64_t timeouts;     // waits ended by the idle interval
+    double waited;         // s spent waiting
+} frameSchedStats;
+
+class FrameScheduler
+{
+public:
+    FrameScheduler(int holdMs = FRAME_HOLD_MS, int idleMs = FRAME_IDLE_MS);
+    // disabled, every frame renders at once
+    void SetEnabled(bool enabled);
+    bool Enabled() const;
+    // user input seen: full rate for the hold time; ends a Wait(), from any thread
+    void Input();
+    // a state shown changed; ends a Wait(), from any thread
+    void Changed();
+    // once per frame: busy if anything moves, scans or animates, full rate while it does
+    void Frame(bool busy);
+    // ms to wait before the next frame, 0 to render at once
+    int Timeout() const;
+    // waits up to Timeout() for Changed() or Input(); front-ends that wait for their own events
+    // instead report how the wait ended with Woken()
+    frameWake Wait();
+    void Woken(frameWake why, double waited);
+    void GetStats(frameSchedStats *stats) const;
+
+private:
+    typedef std::chrono::steady_clock schedClock;
+    int TimeoutLocked(schedClock::time_point now) const;
+
+    int holdMs;
+    int idleMs;
+    bool enabled;
+    bool changed;
+    bool input;
+    schedClock::time_point lastActive;
+    schedClock::time_point lastFrame;
+    frameSchedStats stats;
+    mutable std::mutex lock;
+    std::condition_variable wake;
+};
+
+#endif // _FRAMESCHED_H
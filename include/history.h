@@ -0,0 +1,84 @@
+// Motion history of one motor at several resolutions, constant memory however long it runs.
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <mutex>
+#include <vector>
+
+#define HIST_LEVELS 6 // resolutions kept, level 0 holds the samples themselves
+#define HIST_FANOUT 8 // buckets of one level merged into one bucket of the next
+
+enum histChannel
+{
+    HIST_POS,    // position
+    HIST_VEL,    // velocity, derived from consecutive positions
+    HIST_TARGET, // last commanded target
+    HIST_CHANNELS,
+};
+
+// envelope of the samples taken from t0 to t1
+typedef struct
+{
+    double t0;
+    double t1;
+    float min[HIST_CHANNELS];
+    float max[HIST_CHANNELS];
+} histBucket;
+
+// Each level is a ring of capacity buckets; a bucket of level k spans HIST_FANOUT^k samples, so
+// at 50 samples/s and the default capacity level 0 holds 20 s and level 5 more than a week.
+// Add() is amortized O(1), Query() reads the finest level that covers the span in about
+// maxPoints * HIST_FANOUT buckets at most.
+class MotionHistory
+{
+public:
+    MotionHistory(long capacity = 1024);
+    // t in s, increasing
+    void Add(double t, float pos, float target);
+    // envelope of [t0, t1] in at most maxPoints buckets, oldest first; returns the count
+    long Query(double t0, double t1, histBucket *out, long maxPoints) const;
+    // time of the oldest and newest sample held, false if empty
+    bool Range(double *t0, double *t1) const;
+    void Clear();
+    // bytes held, independent of how long it has run
+    size_t Memory() const;
+
+private:
+    typedef struct
+    {
+        std::vector<histBucket> ring;
+        long head;    // next slot written
+        long count;   // buckets held
+        histBucket pending; // being merged from the level below
+        int merged;   // buckets of the level below in pending
+    } level;
+
+    void Push(int k, const histBucket &b); // call with lock held
+    const histBucket &At(const level &l, long i) const; // i = 0 is the oldest
+    long First(const level &l, double t) const;          // first bucket ending at or after t
+
+    long capacity;
+    mutable std::mutex lock;
+    level levels[HIST_LEVELS];
+    bool havePrev;
+    double prevT;
+    float prevPos;
+};
+
+// widens a to cover b
+inline void HistMerge(histBucket *a, const histBucket &b)
+{
+    if (b.t0 < a->t0)
+        a->t0 = b.t0;
+    if (b.t1 > a->t1)
+        a->t1 = b.t1;
+    for (int c = 0; c < HIST_CHANNELS; c++)
+    {
+        if (b.min[c] < a->min[c])
+            a->min[c] = b.min[c];
+        if (b.max[c] > a->max[c])
+            a->max[c] = b.max[c];
+    }
+}
+
+#endif // _HISTORY_H
@@ -0,0 +1,70 @@
+// Homing of many stages at once, in groups for axes that must not move together.
+#ifndef _HOMING_H
+#define _HOMING_H
+
+#include "motordriver.h"
+#include "scanengine.h"
+#include "scantask.h"
+#include "telemetry.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#define HOME_ERR_POSITION 21001 // a stage came to rest away from its home position
+#define HOME_ERR_SYNTAX 21002   // invalid group list
+#define HOME_ERR_SKIPPED 21003  // not homed, an earlier group failed
+
+#define HOME_START_S 0.5 // a stage never seen moving counts as home only after this long
+
+typedef struct
+{
+    long idx;
+    long group;   // 0-based, in the order homed
+    long ret;     // 0 if at home, driver, SCAN_ERR_ or HOME_ERR_ code otherwise
+    float from;   // position when the group started
+    float pos;    // position it came to rest at
+    float ofst;   // home offset from the limit switch; the stage reads 0 there
+    double start; // s from Run() to the home command
+    double time;  // s from the command until at rest at home, to within a poll interval
+} homeResult;
+
+// Commands every motor of a group home, then watches their telemetry until each is at rest at 0,
+// without a thread per motor. Run on a pool thread; the motors are numbered as in serNums.
+class HomeRunner
+{
+public:
+    HomeRunner(MotorDriver *drv, MotorTelemetry *tel, const long *serNums, long numUnits);
+    void SetStatusHook(std::function<void(const std::string &msg)> hook);
+    // cancelling it stops the motors still homing
+    void SetCancelToken(CancelToken *token);
+    // at home when within tol of 0 for count consecutive samples (0.005 mm, 3); a group not home
+    // after timeout s (120) is stopped
+    void SetCriteria(float tol, int count, float timeout);
+    // as each motor is done, from the thread in Run()
+    void SetDoneHook(std::function<void(const homeResult &res)> hook);
+    // groups are homed one after the other, the motors of a group together; motors in no group
+    // are left alone. results gets one entry per motor listed, in group order. 0 if all are home.
+    long Run(const std::vector<std::vector<long>> &groups, std::vector<homeResult> *results);
+    // "1 2; 3; 4,5": groups separated by ';', 1-based motor numbers separated by spaces or commas;
+    // empty for every motor in one group. On failure msg (may be nullptr) tells why.
+    static long ParseGroups(const char *spec, long numUnits, std::vector<std::vector<long>> *groups, std::string *msg);
+
+private:
+    long RunGroup(const std::vector<long> &group, long g, double t0, homeResult *res);
+    void Status(const std::string &msg);
+    double Now() const;
+
+    MotorDriver *drv;
+    MotorTelemetry *tel;
+    std::vector<long> serNums;
+    float tol;
+    int count;
+    float timeout;
+    double offset; // clock s minus telemetry stamp, estimated from the samples read
+    std::function<void(const std::string &msg)> statusHook;
+    std::function<void(const homeResult &res)> doneHook;
+    CancelToken *token;
+};
+
+#endif // _HOMING_H
@@ -0,0 +1,103 @@
+// Latency of every driver call, per call and per device, in front of a MotorDriver.
+#ifndef _INSTRDRIVER_H
+#define _INSTRDRIVER_H
+
+#include "latencyhist.h"
+#include "motordriver.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#define INSTR_ERR_FILE 20801 // could not open or write the dump file
+
+#define INSTR_MAX_DEVICES 64 // devices seen past this are counted together, in the totals only
+
+#define INSTR_MAGIC "# mcpher diagnostics 1"
+
+enum instrCall
+{
+    INSTR_INIT,
+    INSTR_CLEANUP,
+    INSTR_GETNUMUNITS,
+    INSTR_GETSERIALNUM,
+    INSTR_INITDEVICE,
+    INSTR_GETPOSITION,
+    INSTR_GETINMOTION,
+    INSTR_MOVEABSOLUTE,
+    INSTR_MOVEHOME,
+    INSTR_STOP,
+    INSTR_GETVELPARAMS,
+    INSTR_SETVELPARAMS,
+    INSTR_GETVELPARAMLIMITS,
+    INSTR_GETHOMEPARAMS,
+    INSTR_CALLS, // number of call types
+};
+
+// name of the underlying APT call, e.g. "MOT_GetPosition"
+const char *InstrCallName(int call);
+
+// A MotorDriver that forwards every call to drv and records how long it took, in a histogram per
+// call type and device. Recording is lock-free, two atomic adds per call into histograms only
+// that device's callers touch; the totals over all devices are merged when they are read, so the
+// histograms may be read and dumped while the devices are in use.
+class InstrumentedDriver : public MotorDriver
+{
+public:
+    // drv is not owned
+    InstrumentedDriver(MotorDriver *drv);
+    ~InstrumentedDriver();
+    // serNum 0 for all devices and the calls not made to a device; false if no call was made to
+    // serNum; errors (may be nullptr) receives the number of calls that failed
+    bool GetStats(long serNum, int call, latencyStats *stats, uint64_t *errors = nullptr) const;
+    // serial numbers that were called, in order of first call; returns how many there are
+    long Devices(long *serNums, long max) const;
+    void Clear();
+    // text table of every histogram that has samples, times in us
+    void Dump(FILE *fp) const;
+    long Dump(const char *path) const;
+
+    long Init();
+    long Cleanup();
+    long GetNumUnits(long *numUnits);
+    long GetSerialNum(long idx, long *serNum);
+    long InitDevice(long serNum);
+    long GetPosition(long serNum, float *pos);
+    long GetInMotion(long serNum, bool *moving);
+    long MoveAbsolute(long serNum, float pos, bool wait);
+    long MoveHome(long serNum, bool wait);
+    long Stop(long serNum);
+    long GetVelParams(long serNum, float *minVel, float *accel, float *maxVel);
+    long SetVelParams(long serNum, float minVel, float accel, float maxVel);
+    long GetVelParamLimits(long serNum, float *maxAccel, float *maxVel);
+    long GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst);
+
+private:
+    typedef struct
+    {
+        LatencyHistogram calls[INSTR_CALLS];
+        std::atomic<uint64_t> errors[INSTR_CALLS];
+    } deviceHists;
+
+    typedef std::chrono::steady_clock::time_point timePoint;
+
+    static timePoint Now();
+    // serNum 0 for calls not made to a device
+    long Done(int call, long serNum, timePoint t0, long ret);
+    // slot of serNum, claimed on first use; nullptr if the table is full or another thread is
+    // still claiming it
+    deviceHists *Slot(long serNum);
+    const deviceHists *Find(long serNum) const;
+    // samples of one call, all devices for serNum 0; false if no call was made to serNum
+    bool Merge(long serNum, int call, LatencyHistogram *hist, uint64_t *errors) const;
+    static void ClearHists(deviceHists *h);
+
+    MotorDriver *drv;
+    deviceHists driver;   // calls not made to a device
+    deviceHists overflow; // devices past INSTR_MAX_DEVICES
+    std::atomic<long> serNums[INSTR_MAX_DEVICES];        // 0 when free
+    std::atomic<deviceHists *> hists[INSTR_MAX_DEVICES]; // published once the slot is claimed
+};
+
+#endif // _INSTRDRIVER_H
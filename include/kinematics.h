@@ -0,0 +1,82 @@
+// Trapezoidal (or triangular, for short moves) velocity profiles of a single stage move.
+#ifndef _KINEMATICS_H
+#define _KINEMATICS_H
+
+#include <cmath>
+
+typedef struct
+{
+    double dist;  // signed move distance
+    double v0;    // start/end velocity (motorProps::minVel)
+    double vp;    // peak velocity reached
+    double accel; // acceleration (motorProps::Accel)
+    double ta;    // duration of the acceleration (and deceleration) phase
+    double tc;    // duration of the constant velocity phase
+    double total; // duration of the whole move
+} moveProfile;
+
+inline moveProfile ProfileMake(double dist, double minVel, double maxVel, double accel)
+{
+    moveProfile p = {};
+    double d = fabs(dist);
+    p.dist = dist;
+    p.accel = accel;
+    p.v0 = minVel < 0 ? 0 : minVel;
+    if (maxVel <= 0 || d == 0)
+        return p;
+    if (p.v0 > maxVel)
+        p.v0 = maxVel;
+    if (accel <= 0) // no acceleration limit, constant velocity move
+    {
+        p.vp = maxVel;
+        p.tc = d / maxVel;
+        p.total = p.tc;
+        return p;
+    }
+    double da = (maxVel * maxVel - p.v0 * p.v0) / (2 * accel); // distance to reach max velocity
+    if (2 * da >= d) // triangular, never reaches max velocity
+    {
+        p.vp = sqrt(p.v0 * p.v0 + accel * d);
+        p.ta = (p.vp - p.v0) / accel;
+        p.tc = 0;
+    }
+    else
+    {
+        p.vp = maxVel;
+        p.ta = (maxVel - p.v0) / accel;
+        p.tc = (d - 2 * da) / maxVel;
+    }
+    p.total = 2 * p.ta + p.tc;
+    return p;
+}
+
+// signed distance travelled t seconds into the move
+inline double ProfileDistance(const moveProfile *p, double t)
+{
+    double d = fabs(p->dist), s;
+    if (t <= 0)
+        return 0;
+    if (t >= p->total)
+        return p->dist;
+    if (t < p->ta)
+        s = p->v0 * t + 0.5 * p->accel * t * t;
+    else if (t < p->ta + p->tc)
+        s = p->v0 * p->ta + 0.5 * p->accel * p->ta * p->ta + p->vp * (t - p->ta);
+    else
+    {
+        double tr = p->total - t; // decelerating, mirror of the acceleration phase
+        s = d - (p->v0 * tr + 0.5 * p->accel * tr * tr);
+    }
+    if (s > d)
+        s = d;
+    return p->dist < 0 ? -s : s;
+}
+
+// duration of a move of length dist
+inline double MoveTime(double dist, double minVel, double maxVel, double accel)
+{
+    moveProfile p = ProfileMake(dist, minVel, maxVel, accel);
+    return p.total;
+}
+
+#endif // _KINEMATICS_H
@@ -0,0 +1,118 @@
+// Lock-free log-linear latency histograms (HDR style) and per-phase timers built on them.
+#ifndef _LATENCYHIST_H
+#define _LATENCYHIST_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#define LHIST_SUB_BITS 4 // 16 buckets per power of two, values within 1/16 (6%)
+#define LHIST_SUB (1 << LHIST_SUB_BITS)
+#define LHIST_MAX_EXP 40 // ns; longer values (18 min and up) land in the last bucket
+#define LHIST_BUCKETS ((LHIST_MAX_EXP - LHIST_SUB_BITS + 2) * LHIST_SUB)
+
+typedef struct
+{
+    uint64_t count;
+    double mean; // all in us
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    double max;
+} latencyStats;
+
+// Record() is two relaxed atomic adds, safe from any number of threads; readers see a snapshot
+// that may be a few samples behind, never a torn one per bucket. Threads that record often into
+// one histogram contend for its cache lines, so keep one per thread or device and Add() them up.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    void Record(uint64_t ns)
+    {
+        buckets[Bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t m = max.load(std::memory_order_relaxed);
+        while (ns > m && !max.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+            ;
+    }
+    // sums the buckets, not for the hot path
+    uint64_t Count() const;
+    // value below which a fraction q of the samples lie, ns, to within a bucket
+    uint64_t Percentile(double q) const;
+    void GetStats(latencyStats *stats) const;
+    // merges the samples of other into this one
+    void Add(const LatencyHistogram &other);
+    // not atomic with respect to concurrent Record()s, which may survive it
+    void Clear();
+    // one line: "<label> count mean p50 p90 p99 p99.9 max", times in us
+    void Dump(FILE *fp, const char *label) const;
+
+    static int Bucket(uint64_t ns)
+    {
+        if (ns < LHIST_SUB)
+            return (int)ns;
+        int e = 63 - Clz(ns);
+        if (e > LHIST_MAX_EXP)
+            return LHIST_BUCKETS - 1;
+        return (e - LHIST_SUB_BITS + 1) * LHIST_SUB + (int)((ns >> (e - LHIST_SUB_BITS)) & (LHIST_SUB - 1));
+    }
+    // smallest value of a bucket, ns
+    static uint64_t BucketLow(int b);
+
+private:
+    static int Clz(uint64_t v)
+    {
+#if defined(__GNUC__)
+        return __builtin_clzll(v);
+#else
+        int n = 0;
+        while (!(v & (1ull << 63)))
+        {
+            v <<= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    std::atomic<uint64_t> buckets[LHIST_BUCKETS];
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+// wall time per phase of a repeated loop, e.g. the render loop; used from one thread, read from any
+class PhaseTimer
+{
+public:
+    // names must outlive the timer
+    PhaseTimer(const char *const *names, int numPhases);
+    ~PhaseTimer();
+    // start of an iteration; the time since the previous Start() goes to Total()
+    void Start();
+    // the time since Start() or the previous Mark() goes to phase
+    void Mark(int phase);
+    int NumPhases() const;
+    const char *Name(int phase) const;
+    const LatencyHistogram &Phase(int phase) const;
+    const LatencyHistogram &Total() const;
+    // last iteration, us per phase
+    double Last(int phase) const;
+    void Clear();
+    void Dump(FILE *fp, const char *prefix) const;
+
+private:
+    typedef std::chrono::steady_clock::time_point timePoint;
+    const char *const *names;
+    int numPhases;
+    LatencyHistogram *phases;
+    std::atomic<uint64_t> *last; // ns
+    LatencyHistogram total;
+    timePoint start;
+    timePoint mark;
+    bool started;
+};
+
+#endif // _LATENCYHIST_H
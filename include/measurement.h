@@ -0,0 +1,49 @@
+// Measurement hook invoked at every scan point, and a simulated detector.
+#ifndef _MEASUREMENT_H
+#define _MEASUREMENT_H
+
+#include "clock.h"
+
+#include <mutex>
+#include <random>
+#include <vector>
+
+class Measurement
+{
+public:
+    virtual ~Measurement() {}
+    // called with the stage(s) settled at pos (numAxes coordinates); 0 on success
+    virtual long Measure(const float *pos, long numAxes, double *value) = 0;
+};
+
+typedef struct
+{
+    float center[3]; // peak position along (up to) the first three scan axes
+    float width;     // standard deviation, mm
+    double amplitude;
+} simPeak;
+
+// Gaussian peaks on a flat baseline plus white noise, with a fixed integration time.
+class SimDetector : public Measurement
+{
+public:
+    SimDetector(double baseline = 0, double noise = 0, float integration = 0, unsigned seed = 1);
+    void AddPeak(float center, float width, double amplitude);
+    void AddPeak(const simPeak &peak);
+    // the integration time passes on clock, the steady clock unless set
+    void SetClock(Clock *clock);
+    // noiseless signal at pos
+    double Signal(const float *pos, long numAxes) const;
+    long Measure(const float *pos, long numAxes, double *value);
+
+private:
+    double baseline;
+    double noise;
+    float integration; // s
+    Clock *clock;
+    std::vector<simPeak> peaks;
+    std::mutex lock; // guards rng
+    std::mt19937 rng;
+};
+
+#endif // _MEASUREMENT_H
@@ -0,0 +1,55 @@
+// Predicted duration of moves: the trapezoidal profile of each move, scaled and offset per device
+// by what was observed, so command latency, ringing and telemetry sampling are accounted for.
+#ifndef _MOTIONMODEL_H
+#define _MOTIONMODEL_H
+
+#include "kinematics.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#define MOTION_FORGET 0.98    // weight of older moves per new one, ~50 moves remembered
+#define MOTION_MIN_SPREAD 0.1 // s, profile times must vary this much before the scale is fitted
+
+typedef struct
+{
+    uint64_t moves;   // moves observed
+    uint64_t points;  // points observed
+    double scale;     // observed s per profile s
+    double overhead;  // s per move beyond the scaled profile
+    double rms;       // error of the fit over the remembered moves, s
+    double pointTime; // s per point beyond the dwell: measurement and bookkeeping
+} motionFit;
+
+class MotionModel
+{
+public:
+    MotionModel(long numUnits);
+    long NumUnits() const;
+    // a move of dist with the velocity parameters it ran with took seconds, command to settled
+    void ObserveMove(long idx, double dist, double minVel, double maxVel, double accel, double seconds);
+    // time spent at a point once settled, beyond the dwell
+    void ObservePoint(long idx, double seconds);
+    // command to settled; the bare profile until a move was observed
+    double PredictMove(long idx, double dist, double minVel, double maxVel, double accel) const;
+    // per point, beyond the dwell
+    double PointTime(long idx) const;
+    bool GetFit(long idx, motionFit *fit) const;
+
+private:
+    struct sums
+    {
+        // exponentially weighted sums over (profile time x, observed time y)
+        double w, x, y, xx, xy, yy;
+        uint64_t moves;
+        uint64_t points;
+        double pointTime;
+    };
+    static void Fit(const sums &s, motionFit *fit);
+
+    mutable std::mutex lock;
+    std::vector<sums> devices;
+};
+
+#endif // _MOTIONMODEL_H
@@ -0,0 +1,31 @@
+// Hardware abstraction over the Thorlabs APT motor calls used by the controller.
+#ifndef _MOTORDRIVER_H
+#define _MOTORDRIVER_H
+
+// driver side error codes, kept clear of the APT server range
+#define DRV_ERR_NODEVICE 20001 // serial number not known to the driver
+#define DRV_ERR_NOTINIT 20002  // device not initialized
+#define DRV_ERR_PARAM 20003    // invalid parameter
+
+// All calls return 0 on success, and an error code otherwise (same convention as APTAPI.h).
+class MotorDriver
+{
+public:
+    virtual ~MotorDriver() {}
+    virtual long Init() = 0;
+    virtual long Cleanup() = 0;
+    virtual long GetNumUnits(long *numUnits) = 0;
+    virtual long GetSerialNum(long idx, long *serNum) = 0;
+    virtual long InitDevice(long serNum) = 0;
+    virtual long GetPosition(long serNum, float *pos) = 0;
+    virtual long GetInMotion(long serNum, bool *moving) = 0;
+    virtual long MoveAbsolute(long serNum, float pos, bool wait) = 0;
+    virtual long MoveHome(long serNum, bool wait) = 0;
+    virtual long Stop(long serNum) = 0;
+    virtual long GetVelParams(long serNum, float *minVel, float *accel, float *maxVel) = 0;
+    virtual long SetVelParams(long serNum, float minVel, float accel, float maxVel) = 0;
+    virtual long GetVelParamLimits(long serNum, float *maxAccel, float *maxVel) = 0;
+    virtual long GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst) = 0;
+};
+
+#endif // _MOTORDRIVER_H
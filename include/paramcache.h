@@ -0,0 +1,117 @@
+// Per serial number cache of the device parameters, in front of a MotorDriver.
+#ifndef _PARAMCACHE_H
+#define _PARAMCACHE_H
+
+#include "motordriver.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#define PCACHE_ERR_FILE 20701   // could not open or write the cache file
+#define PCACHE_ERR_FORMAT 20702 // not a parameter cache file
+
+#define PCACHE_MAGIC "# mcpher param cache 1"
+
+// parameter groups, read and written as one device call each
+#define PCACHE_VEL 0x1    // minVel, Accel, maxVel
+#define PCACHE_LIMITS 0x2 // limMaxAccel, limMaxVel
+#define PCACHE_HOME 0x4   // homeDir, limSwitch, homeVel, ofst
+#define PCACHE_ALL 0x7
+
+typedef struct
+{
+    long serNum;
+    unsigned valid;    // groups held
+    unsigned verified; // groups read back from the device in this session
+    uint64_t version;  // bumped whenever a held value changes
+    float minVel;
+    float Accel;
+    float maxVel;
+    float limMaxAccel;
+    float limMaxVel;
+    long homeDir;
+    long limSwitch;
+    float homeVel;
+    float ofst;
+} paramEntry;
+
+typedef struct
+{
+    uint64_t hits;          // reads answered from the cache, each one a device round trip saved
+    uint64_t misses;        // reads passed to the device
+    uint64_t writes;        // sets written through
+    uint64_t revalidations; // device reads made by the revalidation thread
+    uint64_t changes;       // revalidations that found a value changed behind the cache
+} paramCacheStats;
+
+// A MotorDriver that forwards every call to drv, except that parameter reads are served from a
+// per serial number cache. Sets are written through and update the cache; a background thread
+// re-reads the cached groups, soon after a set (the device may round the values) and every
+// revalidateMs otherwise, so changes made from elsewhere show up as a new version.
+// Entries loaded from disk are served at once and verified by the same thread.
+class ParamCache : public MotorDriver
+{
+public:
+    // drv is not owned
+    ParamCache(MotorDriver *drv, int revalidateMs = 10000);
+    ~ParamCache();
+    // warm start from a file written by Save(), call before the devices are initialized
+    long Load(const char *path);
+    long Save(const char *path) const;
+    // drops the cached groups of a serial number, the next read goes to the device
+    void Invalidate(long serNum, unsigned groups = PCACHE_ALL);
+    // copy of the entry for a serial number, false if nothing is cached
+    bool GetEntry(long serNum, paramEntry *entry) const;
+    // 0 if nothing is cached; compare with a previous value to find out about changes cheaply
+    uint64_t Version(long serNum) const;
+    void GetStats(paramCacheStats *stats) const;
+
+    long Init();
+    long Cleanup();
+    long GetNumUnits(long *numUnits);
+    long GetSerialNum(long idx, long *serNum);
+    long InitDevice(long serNum);
+    long GetPosition(long serNum, float *pos);
+    long GetInMotion(long serNum, bool *moving);
+    long MoveAbsolute(long serNum, float pos, bool wait);
+    long MoveHome(long serNum, bool wait);
+    long Stop(long serNum);
+    long GetVelParams(long serNum, float *minVel, float *accel, float *maxVel);
+    long SetVelParams(long serNum, float minVel, float accel, float maxVel);
+    long GetVelParamLimits(long serNum, float *maxAccel, float *maxVel);
+    long GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst);
+
+private:
+    typedef struct
+    {
+        paramEntry p;
+        bool online;       // initialized through this driver, safe to revalidate
+        unsigned long seq; // bumped by writes and invalidations, a read started before is stale
+    } cacheSlot;
+
+    // reads groups from the device and merges them, returns the first error; out (may be nullptr)
+    // receives the values read
+    long Fetch(long serNum, unsigned groups, bool revalidate, paramEntry *out = nullptr);
+    void Merge(cacheSlot *s, unsigned group, const paramEntry &p, bool revalidate); // call with lock held
+    void RevalidateFcn();
+
+    MotorDriver *drv;
+    int revalidateMs;
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    std::map<long, cacheSlot> slots;
+    bool running;
+    bool kicked;
+    std::thread revalidator;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> revalidations;
+    std::atomic<uint64_t> changes;
+};
+
+#endif // _PARAMCACHE_H
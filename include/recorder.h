@@ -0,0 +1,99 @@
+// Telemetry recorder: fixed size records in a preallocated, memory-mapped ring file.
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include "clock.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#define REC_ERR_FILE 20301   // could not create, map or read the recording
+#define REC_ERR_FORMAT 20302 // not a recording, or an incompatible one
+
+#define REC_MAGIC "MCPREC1"
+#define REC_VERSION 1
+
+enum recType
+{
+    REC_STATE = 1,   // telemetry sample: pos, flags = moving
+    REC_COMMAND = 2, // motor command sent: code = cmdType, aux = argument, ret = driver return
+    REC_SCAN = 3,    // scan point done: aux = target, code = point index, value = measurement
+};
+
+#define REC_FLAG_MOVING 0x1
+#define REC_FLAG_ERROR 0x2
+
+typedef struct
+{
+    uint64_t stamp; // wall clock, us since the unix epoch; clock us if SetClock() was called
+    int32_t serNum;
+    uint16_t type;  // recType
+    uint16_t flags;
+    float pos;
+    float aux;
+    int32_t code;
+    int32_t ret;
+    float value;
+    uint32_t seq; // low bits of the record index + 1, zeroed first and written last; a mismatch marks a torn or stale slot
+} recRecord;
+
+static_assert(sizeof(recRecord) == 40, "recorder record layout changed");
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;          // records in the ring
+    std::atomic<uint64_t> head; // records ever written
+    char reserved[32];
+} recHeader;
+
+static_assert(sizeof(recHeader) == 64, "recorder header layout changed");
+
+class Recorder
+{
+public:
+    Recorder();
+    ~Recorder();
+    // maps path, creating or resizing it to hold capacity records; an existing recording of the
+    // same capacity is continued
+    long Open(const char *path, uint64_t capacity);
+    void Close();
+    bool IsOpen() const;
+    // stamps records with the time of clock instead of the wall clock, e.g. a simulation's; set before logging
+    void SetClock(const Clock *clock);
+    // lock-free, may be called from any thread; no allocation and no system call per record
+    void Log(recRecord rec);
+    void LogState(long serNum, float pos, bool moving, long ret);
+    void LogCommand(long serNum, int cmd, float arg, long ret);
+    void LogScan(long serNum, long index, float target, float actual, double value);
+    // asks the OS to write dirty pages back, e.g. before exporting
+    long Flush();
+    uint64_t Written() const;
+    uint64_t Capacity() const;
+
+private:
+    uint64_t Stamp() const;
+
+    const Clock *clock;
+    recHeader *hdr;
+    recRecord *ring;
+    uint64_t mapSize;
+#ifdef _WIN32
+    void *file;
+    void *mapping;
+#else
+    int fd;
+#endif
+};
+
+// Reads the records still held in a recording, oldest first, skipping torn ones.
+long RecorderRead(const char *recPath, std::vector<recRecord> *records);
+
+// Writes the records still held in a recording, oldest first, as CSV. Returns 0 on success and
+// the number of exported records in count (may be nullptr).
+long RecorderExportCsv(const char *recPath, const char *csvPath, uint64_t *count);
+
+#endif // _RECORDER_H
@@ -0,0 +1,79 @@
+// Motor registry: stable slots keyed by serial number, with the telemetry of every slot laid out as
+// one array per field so a pass over hundreds of motors touches only the fields it reads.
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#define REG_ERR_FULL 21101    // every slot belongs to a serial number already
+#define REG_ERR_NOSLOT 21102  // no such slot, or its device is not present
+#define REG_ERR_PRESENT 21103 // the device is present already
+
+#define REG_LINE 64 // cache line; every hot array starts on one and fills whole lines
+
+typedef struct
+{
+    float curPos;
+    bool moving;
+    long ret;      // last driver error, 0 if the last poll succeeded
+    double stamp;  // time of the last poll, s since telemetry start
+    uint64_t polls; // number of completed polls
+} motorState;
+
+// Membership changes (Add/Remove) take a lock; everything else is lock-free. The state of a slot
+// has a single writer, its poller, and readers retry if they overlap a store, as with SeqLock.
+// Capacity is fixed, so the arrays never move under a reader.
+class MotorRegistry
+{
+public:
+    MotorRegistry(long capacity);
+    ~MotorRegistry();
+    long Capacity() const;
+    // one past the highest slot ever used; loops over the motors run to this, skipping absent ones
+    long NumSlots() const;
+    // devices present
+    long Count() const;
+    // the slot of serNum, -1 if it was never added
+    long Find(long serNum) const;
+    // a device was plugged in: it gets back the slot it had, or the next free one
+    long Add(long serNum, long *slot);
+    // a device was unplugged: its slot is kept for it, with the last state
+    long Remove(long slot);
+    bool Present(long slot) const;
+    long SerialNum(long slot) const;
+    // Capacity() entries, 0 for slots not used yet; an entry never changes once set
+    const long *SerialNums() const;
+    // changes every time the device of a slot is added or removed
+    uint32_t Generation(long slot) const;
+
+    // poller side, one thread per slot
+    void Store(long slot, const motorState &state);
+    bool Load(long slot, motorState *state) const;
+    // without the retry loop, for a reader that wants to know whether there is news
+    uint64_t Polls(long slot) const;
+    // positions and motion of slots [0, n), each pair consistent; returns how many were copied
+    long Snapshot(float *pos, uint8_t *moving, long n) const;
+
+private:
+    long capacity;
+    // hot, written at the poll rate
+    std::atomic<uint32_t> *seq;
+    std::atomic<float> *pos;
+    std::atomic<uint8_t> *moving;
+    std::atomic<long> *ret;
+    std::atomic<double> *stamp;
+    std::atomic<uint64_t> *polls;
+    // cold, written when devices come and go
+    mutable std::mutex lock;
+    long *serNums;
+    std::atomic<uint8_t> *present;
+    std::atomic<uint32_t> *gen;
+    std::atomic<long> numSlots;
+    std::atomic<long> count;
+    std::unordered_map<long, long> slots; // serial number to slot
+};
+
+#endif // _REGISTRY_H
@@ -0,0 +1,62 @@
+// Recorded telemetry played back as K-Cubes, to rerun the controller on a captured device trace.
+#ifndef _REPLAYDRIVER_H
+#define _REPLAYDRIVER_H
+
+#include "recorder.h"
+#include "simdriver.h"
+
+#include <mutex>
+#include <vector>
+
+#define REPLAY_ERR_EMPTY 21201 // the recording holds no telemetry
+
+#define REPLAY_TOL 0.01f // mm; a recorded move ending further than this from the target commanded is a mismatch
+
+typedef struct
+{
+    double t; // s since the first sample of the recording
+    float pos;
+    bool moving;
+    long ret;
+} replaySample;
+
+// Each stage of a recording plays back its telemetry on the clock. A move commanded jumps the stage
+// to the next move in the recording, so the controller sees the motion the hardware showed as long
+// as it commands the moves of the recording in the same order; one that does not match, or that the
+// recording has run out of, counts as a mismatch. Enumeration, initialization, parameters, latency
+// and faults are those of SimDriver, which every call goes through first.
+class ReplayDriver : public SimDriver
+{
+public:
+    ReplayDriver();
+    // the stages are the serial numbers with telemetry in the recording, in order of appearance
+    long Load(const char *recPath);
+    long Load(const std::vector<recRecord> &records);
+    // moves that did not match the recording, or that it had run out of
+    long Mismatches() const;
+
+    long GetPosition(long serNum, float *pos);
+    long GetInMotion(long serNum, bool *moving);
+    long MoveAbsolute(long serNum, float pos, bool wait);
+    long MoveHome(long serNum, bool wait);
+    long Stop(long serNum);
+
+private:
+    struct trace
+    {
+        long serNum;
+        std::vector<replaySample> samples;
+        size_t base;   // first sample of the move played back
+        size_t end;    // start of the next move, or the end of the samples
+        double offset; // recording time minus clock time
+    };
+    trace *Find(long serNum); // call with lock held
+    size_t Current(const trace *tr) const;
+    void Jump(long serNum, float target);
+
+    mutable std::mutex lock;
+    std::vector<trace> traces;
+    long mismatches;
+};
+
+#endif // _REPLAYDRIVER_H
@@ -0,0 +1,144 @@
+// Single axis scan that advances as soon as the stage has settled at each point.
+#ifndef _SCANENGINE_H
+#define _SCANENGINE_H
+
+#include "backlash.h"
+#include "envelope.h"
+#include "motordriver.h"
+#include "measurement.h"
+#include "motionmodel.h"
+#include "scantask.h"
+#include "telemetry.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define SCAN_ERR_PARAM 20201   // invalid scan parameters
+#define SCAN_ERR_TIMEOUT 20202 // stage did not settle in time
+#define SCAN_ERR_STOPPED 20203 // scan stopped by the user
+
+typedef struct
+{
+    float start;
+    float stop;
+    float step;
+    float dwell;     // minimum time spent at each point once settled, s
+    float settleTol; // stage is settled when within settleTol of the target...
+    int settleCount; // ...for this many consecutive telemetry samples
+    float timeout;   // maximum time to reach and settle at a point, s
+    float minStep;   // adaptive scans: smallest step, step is the largest
+    double adaptTol; // adaptive scans: targeted change of the measured signal between points
+} scanParams;
+
+typedef struct
+{
+    int approach;       // 1 to approach every point from below, -1 from above
+    float overshoot;    // mm; a point not reached from this far on the approach side is gone past first, 0 to move straight
+    float tol;          // mm; corrective moves until the position read back is within tol of the point, 0 for none
+    int maxCorrections; // ...but no more than this many per point
+    bool compensate;    // command each move offset by the error learned for its direction
+} precisionParams;
+
+typedef struct
+{
+    long points;      // reached in precision mode
+    long corrections; // corrective moves made
+    long approaches;  // points gone past to approach them from the approach side
+    long misses;      // points left out of tol after maxCorrections
+} precisionStats;
+
+class ScanEngine
+{
+public:
+    ScanEngine(MotorDriver *drv, MotorTelemetry *tel, long idx, long serNum);
+    // status messages for the UI
+    void SetStatusHook(std::function<void(const std::string &msg)> hook);
+    // polled between and during waits, return false to stop the scan
+    void SetRunHook(std::function<bool()> hook);
+    // cancelling it stops the scan, waking a settle or dwell in progress at once
+    void SetCancelToken(CancelToken *token);
+    // measurement taken at every point after the dwell, nullptr to only dwell
+    void SetMeasurement(Measurement *meas);
+    // called after every measured point
+    void SetPointHook(std::function<void(long i, float target, float actual, double value)> hook);
+    // learns from every move and point, and predicts the rest of the scan; nullptr for the bare profiles
+    void SetMotionModel(MotionModel *model);
+    // at the start and after every point: points done, of total (0 if not known in advance), and the
+    // predicted time left (NaN if not known)
+    void SetProgressHook(std::function<void(long done, long total, double remaining)> hook);
+    // a scan that would leave it is refused before anything moves, nullptr for none
+    void SetEnvelope(const SafetyEnvelope *env);
+    // every point reached in precision mode, as prec (nullptr for plain moves): from one side, read back
+    // and corrected; table learns the error of every move and supplies the compensation (may be nullptr)
+    void SetPrecision(const precisionParams *prec, BacklashTable *table);
+    void GetPrecisionStats(precisionStats *stats) const;
+    // clamps step/dwell/tolerance into range, returns SCAN_ERR_PARAM (and a message, if msg is given) if unusable
+    static long Sanitize(scanParams *p, std::string *msg);
+    // blocks until the scan completes, starting at point first (to resume a scan); 0 on success
+    long Run(scanParams p, long first = 0);
+    // steps between minStep and step, finer where the measured signal changes quickly
+    long RunAdaptive(scanParams p);
+    // command a move and wait for the stage to settle at pos
+    long MoveAndSettle(float pos, const scanParams &p, float *actual = nullptr);
+    // the two halves of MoveAndSettle, so several axes can move at once
+    long Command(float pos);
+    long WaitSettled(float pos, const scanParams &p, float *actual = nullptr);
+    // like Command(), to the home position; wait for it with WaitSettled(0, ...)
+    long CommandHome();
+    // wait at the current point, SCAN_ERR_STOPPED if stopped meanwhile
+    long Dwell(float seconds);
+    static long NumPoints(const scanParams &p);
+    static float Point(const scanParams &p, long i);
+    // predicted duration of Run(p, first) for a stage at from with these velocity parameters;
+    // p must be sanitized, model may be nullptr
+    static double Predict(const MotionModel *model, long idx, const scanParams &p, float from, float minVel, float maxVel, float accel, long first = 0);
+
+private:
+    void Status(const std::string &msg);
+    void Progress(long done, long total, double remaining);
+    bool KeepRunning();
+    long CheckEnvelope(float start, float stop);
+    long Send(float to);
+    float Limit(float pos) const;
+    float Compensated(float pos, int dir) const;
+    float Approach(float pos) const;
+    long Settle(float pos, const scanParams &p, double deadline, const std::atomic<bool> *abort, motorState *state);
+    long Correct(float pos, const scanParams &p, double deadline, const std::atomic<bool> *abort, motorState *state);
+    long MeasurePoint(float pos, const scanParams &p, double *value);
+    long Refine(float x0, double v0, float x1, double v1, const scanParams &p, std::vector<float> *xs, std::vector<double> *vs);
+    float NextStep(const std::vector<float> &xs, const std::vector<double> &vs, const scanParams &p) const;
+
+    MotorDriver *drv;
+    MotorTelemetry *tel;
+    long idx;
+    long serNum;
+    uint64_t cmdPoll; // last telemetry sample taken before the latest Command()
+    bool cmdPending;  // a Command() whose move has not been waited for
+    float cmdFrom;    // position when it was commanded
+    double cmdTime;   // telemetry clock s
+    bool velOk;       // velocity parameters of the latest Command() were read
+    float vel[3];     // minVel, accel, maxVel
+    std::function<void(const std::string &msg)> statusHook;
+    std::function<bool()> runHook;
+    std::function<void(long i, float target, float actual, double value)> pointHook;
+    std::function<void(long done, long total, double remaining)> progressHook;
+    MotionModel *model;
+    CancelToken *token;
+    Measurement *meas;
+    const SafetyEnvelope *env;
+    long npoint; // points measured so far in the current scan
+    bool precise;
+    precisionParams prec;
+    BacklashTable *table;
+    precisionStats pstats;
+    float sentTo;      // the latest move sent
+    float sentFrom;    // where it started
+    int sentDir;       // and its direction
+    int lastDir;       // of the move before it, 0 if not known
+    bool approaching;  // the latest move goes past the point, to approach it from the approach side
+};
+
+#endif // _SCANENGINE_H
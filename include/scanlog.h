@@ -0,0 +1,100 @@
+// Append-only, chunked scan data files with checkpoints, so an interrupted scan can be resumed.
+#ifndef _SCANLOG_H
+#define _SCANLOG_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define SCANLOG_ERR_FILE 20401   // could not open or write the file
+#define SCANLOG_ERR_FORMAT 20402 // not a scan log
+#define SCANLOG_ERR_PLAN 20403   // log was written for a different scan plan
+
+#define SCANLOG_MAGIC "MCPSCAN1"
+#define SCANLOG_VERSION 1
+
+enum scanLogChunk
+{
+    SCANLOG_DATA = 1,       // point records
+    SCANLOG_CHECKPOINT = 2, // every point before next has been written
+};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numAxes;
+    uint64_t planHash; // identifies the scan plan, checked on resume
+    char reserved[40];
+} scanLogHeader;
+
+typedef struct
+{
+    uint32_t type; // scanLogChunk
+    uint32_t count; // point records in a data chunk
+    uint32_t size; // payload bytes
+    uint32_t crc;  // crc32 of the payload
+} scanLogChunkHeader;
+
+// fixed part of a point record, followed by numAxes target and numAxes actual positions (float)
+typedef struct
+{
+    int64_t index;
+    double tStart; // s since the unix epoch, when the move to this point was commanded
+    double tDone;  // when the measurement completed
+    double value;
+} scanLogPoint;
+
+typedef struct
+{
+    uint64_t next; // index of the first point not yet done
+    uint64_t points; // point records in the file
+} scanLogCheckpoint;
+
+class ScanLog
+{
+public:
+    // records are written in batches of batchSize, or every flushMs, by a background thread
+    ScanLog(size_t batchSize = 256, int flushMs = 500);
+    ~ScanLog();
+    // starts a new log, truncating path
+    long Create(const char *path, uint32_t numAxes, uint64_t planHash);
+    // continues the log at path; next receives the index to resume the scan from
+    long Resume(const char *path, uint32_t numAxes, uint64_t planHash, uint64_t *next);
+    // buffers a point, never blocks on I/O; points must be appended in index order
+    void Append(int64_t index, const float *target, const float *actual, double value);
+    // writes out everything buffered and a final checkpoint
+    long Close();
+    long LastError() const;
+
+private:
+    long Open(const char *path, bool append);
+    void WriterFcn();
+    long WriteChunk(const std::vector<char> &buf, uint32_t count, uint64_t next);
+
+    FILE *fp;
+    uint32_t naxes;
+    size_t recSize;
+    size_t batchSize;
+    int flushMs;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<char> pending; // records not yet handed to the writer
+    uint32_t pendingCount;
+    uint64_t next;
+    uint64_t points;
+    double lastDone;
+    bool running;
+    long err;
+};
+
+// FNV-1a over a block of memory, for ScanLog plan hashes
+uint64_t ScanLogHash(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL);
+// crc32 (IEEE) of a block of memory
+uint32_t ScanLogCrc(const void *data, size_t size);
+
+#endif // _SCANLOG_H
@@ -0,0 +1,33 @@
+// Scans over arbitrary point lists: loading, and visiting order optimised for travel time.
+#ifndef _SCANORDER_H
+#define _SCANORDER_H
+
+#include "scanplan.h"
+
+#include <vector>
+
+#define SCAN_ERR_FILE 20204 // point list could not be read
+
+typedef struct
+{
+    double before;   // projected travel time in the input order, s
+    double after;    // projected travel time in the optimised order, s
+    double planTime; // time spent optimising, s
+    long twoOptMoves;
+} scanOrderStats;
+
+// Reads one point per line: numAxes coordinates separated by whitespace or commas, optionally
+// followed by an integer ordering group. Blank lines and lines starting with # are skipped.
+// groups receives one entry per point (0 if absent); pass nullptr to ignore the column.
+long ScanPlanLoad(const char *path, long numAxes, ScanPlan *plan, std::vector<long> *groups);
+
+// Writes the plan in the format read by ScanPlanLoad, in visiting order and without groups.
+// Coordinates round-trip exactly.
+long ScanPlanSave(const char *path, const ScanPlan &plan);
+
+// Reorders the plan to shorten total travel time (nearest neighbour followed by 2-opt), using the
+// concurrent-move time of ScanPointMoveTime as the cost. If groups is given, every point of a group
+// is visited before any point of a higher group. from: stage positions before the scan, or nullptr.
+long ScanPlanOptimize(const scanAxis *axes, ScanPlan *plan, const std::vector<long> *groups, const float *from, scanOrderStats *stats);
+
+#endif // _SCANORDER_H
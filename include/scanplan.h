@@ -0,0 +1,102 @@
+// Multi-axis scan plans: grid generation, path cost estimate and synchronized execution.
+#ifndef _SCANPLAN_H
+#define _SCANPLAN_H
+
+#include "motionmodel.h"
+#include "motordriver.h"
+#include "scanengine.h"
+#include "telemetry.h"
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+typedef struct
+{
+    long idx;    // telemetry index of the motor
+    long serNum;
+    float start; // grid range along this axis
+    float stop;
+    float step;
+    float minVel; // kinematics, for the cost estimate
+    float maxVel;
+    float Accel;
+} scanAxis;
+
+enum scanOrder
+{
+    SCAN_RASTER,     // every line starts at the same end
+    SCAN_SERPENTINE, // alternate lines are reversed (boustrophedon)
+};
+
+// flat list of points, numAxes coordinates each
+class ScanPlan
+{
+public:
+    ScanPlan(long numAxes = 1);
+    void Clear(long numAxes);
+    void Add(const float *pt);
+    long NumAxes() const;
+    long NumPoints() const;
+    const float *Point(long i) const;
+    float *Point(long i);
+
+private:
+    long naxes;
+    std::vector<float> pts;
+};
+
+// axis 0 is the fastest varying; returns SCAN_ERR_PARAM on an empty range, or a start or stop that is
+// negative or not a number
+long ScanPlanGrid(const scanAxis *axes, long numAxes, scanOrder order, ScanPlan *plan);
+// time to move all axes concurrently from one point to the next, i.e. of the slowest axis
+double ScanPointMoveTime(const scanAxis *axes, long numAxes, const float *from, const float *to);
+// projected duration of the whole plan; overhead (settling, dwell) is added per point.
+// from: positions before the scan starts, or nullptr to start at the first point
+double ScanPlanCost(const scanAxis *axes, const ScanPlan &plan, double overhead, const float *from = nullptr);
+// predicted duration from point first on, each point taking as long as its slowest axis as learned by
+// model (nullptr for the bare profiles), plus the dwell; from as for ScanPlanCost
+double ScanPlanPredict(const MotionModel *model, const scanAxis *axes, const ScanPlan &plan, double dwell, long first = 0, const float *from = nullptr);
+
+class PlanRunner
+{
+public:
+    PlanRunner(MotorDriver *drv, MotorTelemetry *tel);
+    void SetStatusHook(std::function<void(const std::string &msg)> hook);
+    void SetRunHook(std::function<bool()> hook);
+    // cancelling it stops the scan, waking the settle or dwell in progress at once
+    void SetCancelToken(CancelToken *token);
+    // learns from every move, and predicts the rest of the plan
+    void SetMotionModel(MotionModel *model);
+    // at the start and after every point: points done, of total, and the predicted time left
+    void SetProgressHook(std::function<void(long done, long total, double remaining)> hook);
+    // measurement taken at every point after the dwell, nullptr to only dwell
+    void SetMeasurement(Measurement *meas);
+    // per point callback, after all axes settled and the measurement was taken
+    void SetPointHook(std::function<void(long i, const float *actual, double value)> hook);
+    // a plan with a point or a move that would leave it is refused before anything moves, nullptr for none
+    void SetEnvelope(const SafetyEnvelope *env);
+    // every axis reaches each point in precision mode, see ScanEngine::SetPrecision(); the approaches
+    // stay within the travel limits of the envelope but are not checked for its zones
+    void SetPrecision(const precisionParams *prec, BacklashTable *table);
+    // moves all axes of each point at once and waits for the slowest; settle/dwell from p
+    long Run(const scanAxis *axes, long numAxes, const ScanPlan &plan, const scanParams &p, long first = 0);
+
+private:
+    MotorDriver *drv;
+    MotorTelemetry *tel;
+    std::function<void(const std::string &msg)> statusHook;
+    std::function<bool()> runHook;
+    std::function<void(long i, const float *actual, double value)> pointHook;
+    std::function<void(long done, long total, double remaining)> progressHook;
+    MotionModel *model;
+    CancelToken *token;
+    Measurement *meas;
+    const SafetyEnvelope *env;
+    bool precise;
+    precisionParams prec;
+    BacklashTable *table;
+};
+
+#endif // _SCANPLAN_H
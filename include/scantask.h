@@ -0,0 +1,137 @@
+// Scans run as cancellable tasks on a fixed pool of threads, reporting to the UI through lock-free queues.
+#ifndef _SCANTASK_H
+#define _SCANTASK_H
+
+#include "clock.h"
+#include "seqlock.h"
+#include "spscqueue.h"
+
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define SCAN_TASK_MSG_LEN 256 // longest status message, longer ones are cut
+#define SCAN_TASK_QUEUE 64    // status messages held for the UI, a power of two
+
+enum taskState
+{
+    TASK_QUEUED, // waiting for a pool thread
+    TASK_RUNNING,
+    TASK_DONE,   // result is final, no more messages will be posted
+};
+
+typedef struct
+{
+    char text[SCAN_TASK_MSG_LEN];
+} taskMessage;
+
+typedef struct
+{
+    long done;        // points measured
+    long total;       // points in the scan, 0 if not known in advance
+    double remaining; // predicted s left when reported, NaN if not known
+    double stamp;     // when reported, steady clock s
+} taskProgress;
+
+// set once by whoever stops the scan; waits that subscribe are woken at once instead of at their next timeout
+class CancelToken
+{
+public:
+    // Sleep() keeps the time of clock, the steady clock if nullptr
+    CancelToken(Clock *clock = nullptr);
+    void Cancel();
+    bool Cancelled() const;
+    // the flag Cancel() sets, for waits that test it under their own lock
+    const std::atomic<bool> *Flag() const;
+    // sleeps for seconds; false, as soon as it happens, if cancelled before or meanwhile
+    bool Sleep(double seconds);
+    // fn runs on the cancelling thread, or right away if already cancelled; returns an id for Unsubscribe()
+    long Subscribe(std::function<void()> fn);
+    // once it returns, fn is not running and will not run
+    void Unsubscribe(long id);
+
+private:
+    std::atomic<bool> cancelled;
+    Clock *clock;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::pair<long, std::function<void()>>> subs;
+    long nextId;
+};
+
+class ScanTask
+{
+public:
+    ScanTask(std::function<long(ScanTask *task)> fn);
+    taskState State() const;
+    // SCAN_ERR_STOPPED and friends from the scan, valid once done
+    long Result() const;
+    void Cancel();
+    CancelToken *Token();
+    // task side: status for the UI; dropped, and counted, when the UI is SCAN_TASK_QUEUE messages behind
+    void Post(const char *fmt, ...);
+    // UI side, one thread only: next status message, false when there is none
+    bool Pop(taskMessage *msg);
+    uint64_t Dropped() const;
+    // last measured value, for display
+    void SetValue(double value);
+    double Value() const;
+    // task side: points done of total and the predicted time left
+    void SetProgress(long done, long total, double remaining);
+    // latest progress, remaining counted down to now; false before the first report
+    bool Progress(long *done, long *total, double *remaining) const;
+    // blocks until the task is done
+    void Wait();
+
+private:
+    friend class ScanTaskManager;
+    void Run();
+    void Finish();
+
+    std::function<long(ScanTask *task)> fn;
+    std::atomic<int> state;
+    std::atomic<long> result;
+    std::atomic<double> value;
+    std::atomic<uint64_t> dropped;
+    CancelToken token;
+    SpscQueue<taskMessage, SCAN_TASK_QUEUE> msgs;
+    SeqLock<taskProgress> progress;
+    std::mutex lock;
+    std::condition_variable done;
+};
+
+class ScanTaskManager
+{
+public:
+    // threads bounds the scans running at once, later ones wait in the queue; a thread is started
+    // only when a task finds none idle, so a large bound costs nothing until it is used
+    ScanTaskManager(int threads);
+    // cancels every task not yet done and joins the pool
+    ~ScanTaskManager();
+    // nullptr once the manager is shutting down
+    std::shared_ptr<ScanTask> Submit(std::function<long(ScanTask *task)> fn);
+    void CancelAll();
+    // tasks queued or running
+    long Pending();
+
+private:
+    void WorkerFcn();
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<std::shared_ptr<ScanTask>> queue;
+    std::vector<std::shared_ptr<ScanTask>> running;
+    size_t maxThreads;
+    size_t idle; // workers waiting for a task
+    bool stopping;
+};
+
+#endif // _SCANTASK_H
@@ -0,0 +1,65 @@
+// Single-writer sequence lock for small trivially copyable records.
+#ifndef _SEQLOCK_H
+#define _SEQLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+template <typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock requires a trivially copyable type");
+    static const size_t nwords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    SeqLock() : seq(0)
+    {
+        for (size_t i = 0; i < nwords; i++)
+            data[i].store(0, std::memory_order_relaxed);
+    }
+
+    // writer side, only one thread may store at a time
+    void Store(const T &val)
+    {
+        uint64_t buf[nwords] = {0};
+        memcpy(buf, &val, sizeof(T));
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < nwords; i++)
+            data[i].store(buf[i], std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    // reader side, never blocks the writer; retries if a store was in progress
+    T Load() const
+    {
+        uint64_t buf[nwords];
+        uint32_t s0, s1;
+        do
+        {
+            s0 = seq.load(std::memory_order_acquire);
+            for (size_t i = 0; i < nwords; i++)
+                buf[i] = data[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s1 = seq.load(std::memory_order_relaxed);
+        } while ((s0 & 1) || s0 != s1);
+        T val;
+        memcpy(&val, buf, sizeof(T));
+        return val;
+    }
+
+    // changes every time a new value is stored
+    uint32_t Version() const
+    {
+        return seq.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> data[nwords];
+};
+
+#endif // _SEQLOCK_H
@@ -0,0 +1,135 @@
+// Motion sequences: a small line-oriented language, compiled once into an array of ops and run by
+// an interpreter on a pool thread, so a protocol runs to the end without the UI taking part.
+//
+//   # comment                text from # to the end of the line is ignored
+//   move M POS               absolute move of motor M (1-based, as numbered in the panel), then settle
+//   rmove M DIST             move by DIST from the last target of M (its position if none), then settle
+//   home M                   home, then settle at 0
+//   settle M                 wait until M has settled at its last target
+//   wait S                   pause for S seconds
+//   measure                  read the measurement, with every motor where it is
+//   loop N ... end           repeat the block N >= 1 times; loops nest
+//   parallel ... end         the moves and homes in the block start together, and the block ends once
+//                            every motor it moved has settled; only move, rmove and home inside
+//   tolerance MM [COUNT]     settling criteria from here on: within MM for COUNT samples (0.005, 3)
+//   timeout S                longest wait for a motor to settle from here on (60)
+#ifndef _SEQUENCE_H
+#define _SEQUENCE_H
+
+#include "envelope.h"
+#include "measurement.h"
+#include "motionmodel.h"
+#include "motordriver.h"
+#include "scanengine.h"
+#include "scantask.h"
+#include "telemetry.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define SEQ_ERR_SYNTAX 20901 // the program does not compile
+#define SEQ_ERR_FILE 20902   // could not read the program file
+
+#define SEQ_MAX_DEPTH 16  // loops nested at most this deep
+#define SEQ_MAX_LINE 1024 // longer lines are an error
+
+enum seqOpcode
+{
+    SEQ_MOVE,    // command motor to x
+    SEQ_RMOVE,   // command motor to its last target + x
+    SEQ_HOME,    // command motor home
+    SEQ_SETTLE,  // wait for motor to settle at its last target: within x for n samples, y s at most
+    SEQ_WAIT,    // x s
+    SEQ_MEASURE, // read the measurement
+    SEQ_LOOP,    // push n, the number of passes
+    SEQ_NEXT,    // count down the innermost loop, and go back to op n (its SEQ_LOOP) until it is done
+};
+
+typedef struct
+{
+    uint16_t op;    // seqOpcode
+    uint16_t motor; // 0-based
+    int32_t line;   // source line, for messages
+    int32_t n;
+    float x;
+    float y;
+} seqOp;
+
+class SeqProgram
+{
+public:
+    SeqProgram();
+    // parses text for a rig of numUnits motors; on failure msg (may be nullptr) tells the line and
+    // what is wrong with it, and the program is left empty
+    long Compile(const char *text, long numUnits, std::string *msg);
+    long Load(const char *path, long numUnits, std::string *msg);
+    long NumOps() const;
+    const seqOp *Ops() const;
+    long NumUnits() const;
+    // motors the program moves or waits for, ascending
+    const std::vector<long> &Motors() const;
+    // identifies the program, e.g. for the data file it writes
+    uint64_t Hash() const;
+
+private:
+    std::vector<seqOp> ops;
+    std::vector<long> motors;
+    long numUnits;
+};
+
+// Runs compiled programs on one set of motors. Moves go through one ScanEngine per motor, so
+// settling, cancellation and the motion model work as in a scan.
+class SeqRunner
+{
+public:
+    // the motors are numbered as in serNums
+    SeqRunner(MotorDriver *drv, MotorTelemetry *tel, const long *serNums, long numUnits);
+    ~SeqRunner();
+    // errors, with the line they happened on
+    void SetStatusHook(std::function<void(const std::string &msg)> hook);
+    // cancelling it stops the program, waking a settle or wait in progress at once
+    void SetCancelToken(CancelToken *token);
+    void SetMotionModel(MotionModel *model);
+    // read at every measure op; nullptr to record the positions only, with a NaN value
+    void SetMeasurement(Measurement *meas);
+    // after every measure op: its number, the last target (NaN if none) and the position of every motor
+    void SetMeasureHook(std::function<void(long i, const float *target, const float *actual, double value)> hook);
+    // before every op but the loop bookkeeping: ops run so far, and the source line of this one
+    void SetStepHook(std::function<void(uint64_t steps, long line)> hook);
+    // every move and home is checked against it as the op comes up, nullptr for none
+    void SetEnvelope(const SafetyEnvelope *env);
+    // every move reaches its target in precision mode, see ScanEngine::SetPrecision(); the approaches
+    // stay within the travel limits of the envelope but are not checked for its zones
+    void SetPrecision(const precisionParams *prec, BacklashTable *table);
+    // blocks until the program ends; 0 on success
+    long Run(const SeqProgram &prog);
+    // ops run by the last Run()
+    uint64_t Steps() const;
+
+private:
+    float Position(long m) const;
+    long Measure(long i);
+    void Status(const seqOp &op, const std::string &msg);
+    long Check(const seqOp &op, float pos);
+
+    MotorTelemetry *tel;
+    long numUnits;
+    std::vector<long> serNums;
+    std::vector<std::unique_ptr<ScanEngine>> engines;
+    std::vector<float> target;
+    std::vector<float> actual;
+    std::function<void(const std::string &msg)> statusHook;
+    std::function<void(long i, const float *target, const float *actual, double value)> measureHook;
+    std::function<void(uint64_t steps, long line)> stepHook;
+    CancelToken *token;
+    Measurement *meas;
+    const SafetyEnvelope *env;
+    std::vector<float> lo; // where the axes of the envelope may be
+    std::vector<float> hi;
+    uint64_t steps;
+};
+
+#endif // _SEQUENCE_H
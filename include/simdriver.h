@@ -0,0 +1,132 @@
+// Simulated KST101 K-Cubes, for running the controller without hardware.
+#ifndef _SIMDRIVER_H
+#define _SIMDRIVER_H
+
+#include "clock.h"
+#include "motordriver.h"
+#include "kinematics.h"
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+typedef struct
+{
+    long serNum;
+    bool present; // plugged in
+    bool init;
+    float startPos; // position at start of the current move
+    float target;   // destination of the current move
+    double t0;      // move start time, s
+    moveProfile profile;
+    double tEnd;    // time the last move ended, s
+    bool moving;
+    float stall;    // the next move sticks after this fraction of its duration, <0 if it does not
+    double stuckAt; // s into the current move at which it stuck, <0 if it did not
+    float backlash; // mm of play between the motor and the carriage, which is what GetPosition reads
+    float play;     // carriage - motor at the start of the current move, within +-backlash / 2
+    float noise;    // mm, spread of where a move ends
+    float errFrom;  // error of where the carriage ends, at the start of the current move...
+    float errTo;    // ...and once it ends, drawn at its start
+    uint64_t rng;
+    float minVel;
+    float Accel;
+    float maxVel;
+    float homeVel;
+    float ofst;
+} simStage;
+
+enum simCall
+{
+    SIM_ANY,
+    SIM_INITDEVICE,
+    SIM_GETPOSITION,
+    SIM_GETINMOTION,
+    SIM_MOVE, // MoveAbsolute and MoveHome
+    SIM_STOP,
+    SIM_GETVELPARAMS,
+    SIM_SETVELPARAMS,
+};
+
+typedef struct
+{
+    long serNum;  // 0 for every stage
+    simCall call;
+    long ret;     // returned instead of making the call
+    long after;   // matching calls that go through before the first failure
+    long count;   // matching calls that fail, then the fault is spent; 0 for all of them from then on
+} simFault;
+
+class SimDriver : public MotorDriver
+{
+public:
+    // latencyUs is added to every call, emulating the USB round trip
+    SimDriver(long numUnits, unsigned latencyUs = 0);
+    void SetLatency(unsigned latencyUs);
+    unsigned GetLatency() const;
+    // damped ringing about the target once a move ends: amplitude (mm) and decay time (s)
+    void SetRinging(float amplitude, float tau);
+    // InitDevice takes initMs plus up to jitterMs (fixed per serial number), like a K-Cube
+    // downloading its settings
+    void SetInitTime(unsigned initMs, unsigned jitterMs = 0);
+    // hot-plug: a stage unplugged stops answering and must be initialized again once plugged back
+    // in; plugging in an unknown serial number adds a stage
+    void Plug(long serNum);
+    void Unplug(long serNum);
+    // time of the stages and of the latency, the steady clock unless set; set before use
+    void SetClock(Clock *clock);
+    // injected errors, e.g. a MOT_GetInMotion that fails on the 100th poll; in the order added, the
+    // first fault that matches a call decides
+    void AddFault(const simFault &fault);
+    void ClearFaults();
+    // calls failed by a fault so far
+    long FaultsHit() const;
+    // the next move of serNum stops after fraction of its duration, and then reports moving without
+    // getting anywhere until Stop(), like a stage that stalls
+    void Stall(long serNum, float fraction);
+    // play of the lead screw, taken up whenever a move reverses, and the standard deviation of
+    // where a move ends, about where it should; both 0 for an ideal stage (the default)
+    void SetBacklash(long serNum, float backlash, float noise);
+
+    long Init();
+    long Cleanup();
+    long GetNumUnits(long *numUnits);
+    long GetSerialNum(long idx, long *serNum);
+    long InitDevice(long serNum);
+    long GetPosition(long serNum, float *pos);
+    long GetInMotion(long serNum, bool *moving);
+    long MoveAbsolute(long serNum, float pos, bool wait);
+    long MoveHome(long serNum, bool wait);
+    long Stop(long serNum);
+    long GetVelParams(long serNum, float *minVel, float *accel, float *maxVel);
+    long SetVelParams(long serNum, float minVel, float accel, float maxVel);
+    long GetVelParamLimits(long serNum, float *maxAccel, float *maxVel);
+    long GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst);
+
+protected:
+    double Now() const; // s since SetClock()
+    void Delay() const;
+
+private:
+    simStage *Find(long serNum); // call with lock held, nullptr if not plugged in
+    long Inject(long serNum, simCall call); // call with lock held, the error a fault makes the call return
+    float Motor(const simStage *s, double now) const;
+    float Position(const simStage *s, double now) const; // of the carriage
+    void Update(simStage *s, double now);
+    long StartMove(long serNum, float pos, bool home, bool wait);
+
+    mutable std::mutex lock;
+    std::vector<simStage> stages;
+    std::atomic<unsigned> latencyUs;
+    std::atomic<unsigned> initMs;
+    std::atomic<unsigned> jitterMs;
+    float ringAmp;
+    float ringTau;
+    std::vector<std::pair<simFault, long>> faults; // and the matching calls seen
+    long faultsHit;
+    Clock *clock;
+    double epoch;
+};
+
+#endif // _SIMDRIVER_H
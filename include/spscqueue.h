@@ -0,0 +1,56 @@
+// Bounded lock-free queue between exactly one producing and one consuming thread.
+#ifndef _SPSCQUEUE_H
+#define _SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+template <typename T, size_t N>
+class SpscQueue
+{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "SpscQueue requires a trivially copyable type");
+
+public:
+    SpscQueue() : head(0), tail(0)
+    {
+    }
+
+    // producer side; false, and val dropped, when the consumer is N entries behind
+    bool Push(const T &val)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        buf[t & (N - 1)] = val;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side; false when empty
+    bool Pop(T *val)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        *val = buf[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // either side, a snapshot
+    size_t Size() const
+    {
+        size_t h = head.load(std::memory_order_acquire); // first, head never passes tail
+        return tail.load(std::memory_order_acquire) - h;
+    }
+
+private:
+    // on separate cache lines so the two threads do not invalidate each other's index
+    alignas(64) std::atomic<size_t> head; // next entry to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail; // next entry to push, written by the producer
+    alignas(64) T buf[N];
+};
+
+#endif // _SPSCQUEUE_H
@@ -0,0 +1,133 @@
+// Status bus: the state of every motor in a named shared-memory segment, for other local processes.
+#ifndef _STATUSBUS_H
+#define _STATUSBUS_H
+
+#include "registry.h"
+#include "seqlock.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#define BUS_ERR_OPEN 21501   // could not create, open or map the segment or its wake object, or a live publisher holds the name
+#define BUS_ERR_LAYOUT 21502 // not a status bus, one of another layout version, or not set up yet
+
+#define BUS_MAGIC 0x3153554248504dULL // "MPHBUS1"
+#define BUS_VERSION 1
+#define BUS_DEFAULT_NAME "mcpher_status"
+
+// Fixed-width fields, so a reader built with another compiler sees the same layout
+typedef struct
+{
+    int64_t serNum;    // 0 for a slot not used yet
+    int64_t scanIndex; // point reached by the scan driving the motor, -1 if none
+    uint64_t polls;    // completed polls of the motor, as of this record
+    uint64_t stampNs;  // steady clock at publish (CLOCK_MONOTONIC on Linux, QPC on Windows), ns
+    int32_t ret;       // last driver error, 0 if the last poll succeeded
+    float pos;
+    uint8_t moving;
+    uint8_t present;   // the device is plugged in
+    uint8_t pad[6];
+} busMotor;
+
+struct busHeader
+{
+    std::atomic<uint64_t> magic; // BUS_MAGIC once the rest is set up
+    uint32_t version;
+    uint32_t capacity;  // slots
+    uint32_t slotSize;  // bytes, a check of the layout
+    uint32_t headerSize;
+    std::atomic<uint32_t> seq;       // bumped by every record, what Wait() sleeps on
+    std::atomic<uint32_t> waiters;   // readers in Wait(), the publisher wakes one of them if any
+    std::atomic<uint32_t> relayed;   // last sequence the reader woken by it passed on to the others
+    std::atomic<uint32_t> numSlots;  // one past the highest slot used
+    std::atomic<uint32_t> open;      // 0 once the publisher closed the bus
+    uint32_t pid;                    // the publisher's process, POSIX only: a segment whose publisher exited is replaced
+    std::atomic<uint64_t> publishes; // records written
+};
+
+struct alignas(REG_LINE) busSlot
+{
+    SeqLock<busMotor> state;
+};
+
+// Publisher side. A slot has the record of the registry slot of the same index, rewritten whenever
+// the position, motion or error of the motor changes (the telemetry change hook calls Publish() on
+// the poller's thread) or its scan index does. Writes to a slot are serialized, so any thread may
+// publish; a record costs a seqlock store and an atomic increment, plus, while readers wait, a
+// syscall waking one of them, which wakes the rest: the cost to the poller does not grow with the
+// number of readers.
+class StatusBus
+{
+public:
+    StatusBus();
+    ~StatusBus();
+    // creates the segment for every slot of reg, replacing a stale one of the same name, and
+    // publishes them all; name is a plain token, e.g. BUS_DEFAULT_NAME
+    long Open(const char *name, const MotorRegistry *reg);
+    // readers see the bus closed; call once nothing publishes any more
+    void Close();
+    bool IsOpen() const;
+    // republishes slot idx from the registry; does nothing until Open()
+    void Publish(long idx);
+    // the point reached by the scan driving slot idx, -1 when it ends
+    void SetScanIndex(long idx, long index);
+    uint64_t Publishes() const;
+
+private:
+    void Write(long idx);
+    void Wake();
+
+    const MotorRegistry *reg;
+    std::atomic<bool> ready;
+    long capacity;
+    busHeader *hdr;
+    busSlot *slots;
+    std::unique_ptr<std::mutex[]> locks;          // one writer per slot at a time
+    std::unique_ptr<std::atomic<int64_t>[]> scan; // scan index of every slot
+    std::string name;
+    size_t mapSize;
+#ifdef _WIN32
+    void *mapping;
+    void *wake; // semaphore released once per waiting reader
+#endif
+};
+
+// Reader side, for any number of local processes: reads each record in place from the mapping,
+// retrying if the publisher was writing it, and writes nothing there but to wait and wake
+class StatusReader
+{
+public:
+    StatusReader();
+    ~StatusReader();
+    // BUS_ERR_OPEN if no publisher created it, BUS_ERR_LAYOUT if it is not one this reader knows
+    long Open(const char *name);
+    void Close();
+    long Capacity() const;
+    long NumSlots() const;
+    // false once the publisher closed the bus
+    bool Alive() const;
+    // false if slot is beyond the capacity
+    bool Read(long slot, busMotor *motor) const;
+    // version of a slot without reading its record, to look for news
+    uint64_t Version(long slot) const;
+    // records of slots [0, n), each consistent; returns how many were copied
+    long Snapshot(busMotor *motors, long n) const;
+    // changes with every record published
+    uint32_t Sequence() const;
+    // blocks until the sequence differs from *seq, which is updated, or timeoutMs passes
+    bool Wait(uint32_t *seq, int timeoutMs) const;
+
+private:
+    busHeader *hdr;
+    const busSlot *slots;
+    size_t mapSize;
+#ifdef _WIN32
+    void *mapping;
+    void *wake;
+#endif
+};
+
+#endif // _STATUSBUS_H
@@ -0,0 +1,97 @@
+// Background polling of motor position/motion state, published lock-free for the UI.
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include "clock.h"
+#include "history.h"
+#include "motordriver.h"
+#include "recorder.h"
+#include "registry.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class MotorTelemetry
+{
+public:
+    MotorTelemetry(MotorDriver *drv, int pollMs = 20);
+    ~MotorTelemetry();
+    // every poll is also logged to rec, set before Start()
+    void SetRecorder(Recorder *rec);
+    // keeps a MotionHistory of capacity buckets per level for each motor, set before Start()
+    void EnableHistory(long capacity);
+    // called from a poller when the position, motion or error of a motor changes, and on its
+    // first poll; e.g. to wake a UI that draws only on change. Set before Start()
+    void SetChangeHook(std::function<void(long idx)> hook);
+    // time source of the pollers and of every wait on them, the steady clock unless set; set before Start()
+    void SetClock(Clock *clock);
+    Clock *GetClock() const;
+    // spawns one polling thread per serial number; inactive pollers wait for Activate(). Up to
+    // capacity motors (at least numUnits) can be polled, the ones beyond numUnits added with Add()
+    void Start(const long *serNums, long numUnits, bool active = true, long capacity = 0);
+    // polls a device plugged in while running, in the slot it had before if it had one; the others
+    // carry on meanwhile
+    long Add(long serNum, bool active, long *idx);
+    // stops polling an unplugged device; waits on it wake with DRV_ERR_NODEVICE
+    long Remove(long idx);
+    // starts polling a motor, e.g. once its device has been initialized
+    void Activate(long idx);
+    void Stop();
+    void SetPollInterval(int ms);
+    int GetPollInterval() const;
+    // slots in use, including those of devices unplugged since
+    long NumUnits() const;
+    // where the state is published; nullptr before Start()
+    const MotorRegistry *Registry() const;
+    // latest published state, never touches the driver
+    bool GetState(long idx, motorState *state) const;
+    // wake the poller of a motor now, e.g. right after a move command
+    void Kick(long idx);
+    // target of the last move commanded, recorded in the history along with the position
+    void SetTarget(long idx, float target);
+    float Target(long idx) const;
+    // nullptr unless EnableHistory() was called
+    const MotionHistory *History(long idx) const;
+    // block until a poll newer than state->polls is published, timeout, or *abort is set; state is updated
+    bool WaitForUpdate(long idx, motorState *state, int timeoutMs, const std::atomic<bool> *abort = nullptr);
+    // wake the waits on a motor so they look at their abort flag now
+    void Interrupt(long idx);
+
+private:
+    struct poller
+    {
+        long idx;
+        long serNum;
+        std::thread thr;
+        std::mutex lock;
+        std::condition_variable cond;
+        std::condition_variable updated;
+        bool kick;
+        bool active;
+        bool stop; // unplugged, the thread ends
+        std::atomic<float> target; // NaN until a move is commanded
+        std::unique_ptr<MotionHistory> histOwner;
+        std::atomic<MotionHistory *> hist; // set once, when the slot is first used
+    };
+    void Launch(poller *p, long serNum, bool active);
+    void PollFcn(poller *p);
+
+    MotorDriver *drv;
+    Recorder *rec;
+    Clock *clock;
+    std::function<void(long idx)> changeHook;
+    long histCapacity;
+    std::atomic<int> pollMs;
+    std::atomic<bool> running;
+    std::unique_ptr<MotorRegistry> reg;
+    std::vector<std::unique_ptr<poller>> pollers; // one per slot of reg, made in Start()
+    std::mutex addLock;                           // Add() and Remove()
+    double epoch; // clock time at which stamps start
+};
+
+#endif // _TELEMETRY_H
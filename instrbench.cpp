@@ -0,0 +1,128 @@
+// Cost of the instrumentation itself: histogram inserts, alone and contended, the frame phase
+// timer, and driver calls to simulated stages with no added latency, bare and through
+// InstrumentedDriver, so the difference is the overhead of timing every call.
+//
+// usage: mcpher_instrbench [--calls N] [--threads N] [--frames N]
+
+#include "instrdriver.h"
+#include "latencyhist.h"
+#include "simdriver.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double Seconds(benchClock::time_point t0)
+{
+    return std::chrono::duration<double>(benchClock::now() - t0).count();
+}
+
+// ns per GetPosition with one thread per stage, all at once
+static double DriverCalls(MotorDriver *drv, const std::vector<long> &serNums, long calls)
+{
+    std::vector<std::thread> threads;
+    auto t0 = benchClock::now();
+    for (size_t t = 0; t < serNums.size(); t++)
+        threads.push_back(std::thread([drv, &serNums, t, calls]
+                                      {
+                                          float pos;
+                                          for (long i = 0; i < calls; i++)
+                                              drv->GetPosition(serNums[t], &pos); }));
+    for (auto &th : threads)
+        th.join();
+    return Seconds(t0) * 1e9 / calls;
+}
+
+int main(int argc, char **argv)
+{
+    long calls = 2000000, frames = 1000000;
+    int threads = 4;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--calls"))
+            calls = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--threads"))
+            threads = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--frames"))
+            frames = atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_instrbench [--calls N] [--threads N] [--frames N]\n");
+            return 1;
+        }
+    }
+    if (calls < 1 || threads < 1 || frames < 1)
+        return 1;
+    // the clock read around every call
+    auto t0 = benchClock::now();
+    uint64_t sink = 0;
+    for (long i = 0; i < calls; i++)
+        sink += benchClock::now().time_since_epoch().count();
+    double clockNs = Seconds(t0) * 1e9 / calls;
+    // inserts, spread over the buckets a USB round trip lands in
+    LatencyHistogram hist;
+    t0 = benchClock::now();
+    for (long i = 0; i < calls; i++)
+        hist.Record(100000 + (uint64_t)(i & 0xffff) * 31);
+    double recordNs = Seconds(t0) * 1e9 / calls;
+    // all threads on one histogram, the worst case for the shared counters
+    LatencyHistogram shared;
+    std::vector<std::thread> pool;
+    t0 = benchClock::now();
+    for (int t = 0; t < threads; t++)
+        pool.push_back(std::thread([&shared, calls, t]
+                                   {
+                                       for (long i = 0; i < calls; i++)
+                                           shared.Record(100000 + (uint64_t)((i + t) & 0xffff) * 31); }));
+    for (auto &th : pool)
+        th.join();
+    double sharedNs = Seconds(t0) * 1e9 / calls;
+    latencyStats s;
+    t0 = benchClock::now();
+    for (int i = 0; i < 1000; i++)
+        shared.GetStats(&s);
+    double statsUs = Seconds(t0) * 1e6 / 1000;
+    printf("steady_clock::now: %.1f ns\n", clockNs);
+    printf("Record: %.1f ns, %d threads on one histogram %.1f ns per insert per thread\n", recordNs, threads, sharedNs);
+    printf("GetStats: %.1f us (%d buckets), %llu samples, p50 %.1f us, p99 %.1f us, max %.1f us\n", statsUs, LHIST_BUCKETS,
+           (unsigned long long)s.count, s.p50, s.p99, s.max);
+    // a frame of the control panel: start and five phases
+    const char *names[] = {"events", "update", "build", "render", "present"};
+    PhaseTimer frame(names, 5);
+    t0 = benchClock::now();
+    for (long i = 0; i < frames; i++)
+    {
+        frame.Start();
+        for (int p = 0; p < 5; p++)
+            frame.Mark(p);
+    }
+    printf("PhaseTimer: %.1f ns per frame of 5 phases\n", Seconds(t0) * 1e9 / frames);
+    // driver calls, each thread on its own stage as the telemetry poller and scans are
+    SimDriver sim(threads);
+    InstrumentedDriver instr(&sim);
+    sim.Init();
+    std::vector<long> serNums(threads);
+    for (int t = 0; t < threads; t++)
+    {
+        sim.GetSerialNum(t, &serNums[t]);
+        sim.InitDevice(serNums[t]);
+    }
+    double bare1 = DriverCalls(&sim, std::vector<long>(1, serNums[0]), calls);
+    double instr1 = DriverCalls(&instr, std::vector<long>(1, serNums[0]), calls);
+    double bareN = DriverCalls(&sim, serNums, calls);
+    double instrN = DriverCalls(&instr, serNums, calls);
+    printf("GetPosition, 1 thread: bare %.1f ns, instrumented %.1f ns, overhead %+.1f ns\n", bare1, instr1, instr1 - bare1);
+    // more threads than cores take turns, and the time per call grows with them
+    printf("GetPosition, %d threads on %u cores: bare %.1f ns, instrumented %.1f ns, overhead %+.1f ns per call\n", threads,
+           std::thread::hardware_concurrency(), bareN, instrN, instrN - bareN);
+    instr.GetStats(0, INSTR_GETPOSITION, &s);
+    printf("recorded %llu calls: p50 %.3f us, p99 %.3f us, p99.9 %.3f us, max %.1f us\n", (unsigned long long)s.count, s.p50,
+           s.p99, s.p999, s.max);
+    sim.Cleanup();
+    return sink == 1 ? 1 : 0; // keeps the clock loop
+}
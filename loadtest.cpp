@@ -0,0 +1,234 @@
+// Load generator for mcpher_srv: many concurrent clients sending pipelined requests, reporting
+// round-trip latency and throughput.
+//
+// usage: mcpher_load [--port N | --unix PATH] [--clients C] [--requests N] [--window W] [--op ping|status|move]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET sock_t;
+#define SOCK_INVALID INVALID_SOCKET
+#define SockClose closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int sock_t;
+#define SOCK_INVALID (-1)
+#define SockClose close
+#endif
+
+typedef std::chrono::steady_clock loadClock;
+
+typedef struct
+{
+    int port;
+    const char *unixPath;
+    int requests;
+    int window;
+    const char *op;
+} loadParams;
+
+typedef struct
+{
+    std::vector<double> latency; // s, one per reply
+    long errors;
+    bool failed;
+} loadResult;
+
+static sock_t Connect(const loadParams &p)
+{
+    sock_t fd;
+#ifndef _WIN32
+    if (p.unixPath != nullptr)
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, p.unixPath, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != SOCK_INVALID && connect(fd, (sockaddr *)&addr, sizeof(addr)))
+        {
+            SockClose(fd);
+            fd = SOCK_INVALID;
+        }
+        return fd;
+    }
+#endif
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)p.port);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != SOCK_INVALID && connect(fd, (sockaddr *)&addr, sizeof(addr)))
+    {
+        SockClose(fd);
+        return SOCK_INVALID;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+    return fd;
+}
+
+static void ClientFcn(int id, const loadParams &p, long numUnits, loadResult *res)
+{
+    res->errors = 0;
+    res->failed = true;
+    sock_t fd = Connect(p);
+    if (fd == SOCK_INVALID)
+        return;
+    std::vector<loadClock::time_point> sent(p.requests);
+    res->latency.reserve(p.requests);
+    long idx = numUnits > 0 ? id % numUnits : 0;
+    int nsent = 0, nrecv = 0;
+    std::string in, out;
+    char buf[65536];
+    while (nrecv < p.requests)
+    {
+        // keep up to window requests in flight, written in one go
+        out.clear();
+        while (nsent < p.requests && nsent - nrecv < p.window)
+        {
+            char line[128];
+            if (!strcmp(p.op, "move"))
+                snprintf(line, sizeof(line), "%d move %ld %.3f\n", nsent, idx, 1.0 + (nsent % 2) * 0.01);
+            else if (!strcmp(p.op, "status"))
+                snprintf(line, sizeof(line), "%d status %ld\n", nsent, idx);
+            else
+                snprintf(line, sizeof(line), "%d ping\n", nsent);
+            out += line;
+            sent[nsent++] = loadClock::now();
+        }
+        if (out.size() && send(fd, out.data(), (int)out.size(), 0) != (int)out.size())
+            break;
+        int n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        auto now = loadClock::now();
+        in.append(buf, n);
+        size_t start = 0, end;
+        while ((end = in.find('\n', start)) != std::string::npos)
+        {
+            in[end] = '\0';
+            const char *line = &in[start];
+            if (*line != '*')
+            {
+                int tag = atoi(line);
+                if (tag >= 0 && tag < nsent)
+                    res->latency.push_back(std::chrono::duration<double>(now - sent[tag]).count());
+                if (strstr(line, " err ") != nullptr)
+                    res->errors++;
+                nrecv++;
+            }
+            start = end + 1;
+        }
+        in.erase(0, start);
+    }
+    res->failed = nrecv < p.requests;
+    SockClose(fd);
+}
+
+// number of motors served, from the units command
+static long QueryUnits(const loadParams &p)
+{
+    sock_t fd = Connect(p);
+    if (fd == SOCK_INVALID)
+        return -1;
+    long n = 0;
+    char buf[1024];
+    int len = 0;
+    if (send(fd, "0 units\n", 8, 0) == 8)
+    {
+        while (len < (int)sizeof(buf) - 1 && (len == 0 || buf[len - 1] != '\n'))
+        {
+            int r = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+            if (r <= 0)
+                break;
+            len += r;
+        }
+        buf[len] = '\0';
+        sscanf(buf, "0 ok %ld", &n);
+    }
+    SockClose(fd);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    loadParams p = {5025, nullptr, 10000, 16, "ping"};
+    int numClients = 16;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--port"))
+            p.port = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--unix"))
+            p.unixPath = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--clients"))
+            numClients = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--requests"))
+            p.requests = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--window"))
+            p.window = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--op"))
+            p.op = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: mcpher_load [--port N | --unix PATH] [--clients C] [--requests N] [--window W] [--op ping|status|move]\n");
+            return 1;
+        }
+    }
+    if (p.window < 1)
+        p.window = 1;
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+    long numUnits = QueryUnits(p);
+    if (numUnits < 0)
+    {
+        fprintf(stderr, "Could not connect to the server.\n");
+        return 1;
+    }
+    std::vector<loadResult> results(numClients);
+    std::vector<std::thread> threads;
+    auto t0 = loadClock::now();
+    for (int i = 0; i < numClients; i++)
+        threads.push_back(std::thread(ClientFcn, i, std::cref(p), numUnits, &results[i]));
+    for (int i = 0; i < numClients; i++)
+        threads[i].join();
+    double elapsed = std::chrono::duration<double>(loadClock::now() - t0).count();
+    std::vector<double> all;
+    long errors = 0, failed = 0;
+    for (int i = 0; i < numClients; i++)
+    {
+        all.insert(all.end(), results[i].latency.begin(), results[i].latency.end());
+        errors += results[i].errors;
+        failed += results[i].failed ? 1 : 0;
+    }
+    if (all.empty())
+    {
+        fprintf(stderr, "No replies.\n");
+        return 1;
+    }
+    std::sort(all.begin(), all.end());
+    printf("%d clients x %d '%s' requests, window %d: %zu replies in %.3f s, %.0f req/s\n",
+           numClients, p.requests, p.op, p.window, all.size(), elapsed, all.size() / elapsed);
+    printf("round trip: p50 %.1f us, p99 %.1f us, max %.1f us; %ld errors, %ld clients failed\n",
+           all[all.size() / 2] * 1e6, all[all.size() * 99 / 100] * 1e6, all.back() * 1e6, errors, failed);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+// Interrupted scan logs: a log is written, then cut short at every chunk and checkpoint boundary and
+// inside each chunk, and has each chunk, or its size, corrupted in turn, as a crash or a bad disk
+// would leave it.
+// Every copy must resume at the last checkpoint it still holds intact, and once the rest of the scan
+// is appended, hold every point exactly once, in order. Exits 1 if a check fails.
+//
+// usage: mcpher_logstress [--points N] [--batch N] [--file PATH]
+
+#include "scanlog.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+#define LOG_AXES 2
+#define LOG_HASH 0x5ca1ab1eULL
+
+typedef struct
+{
+    long start; // offset of the chunk header
+    long end;   // one past the payload
+    uint32_t type;
+    scanLogCheckpoint cp; // of a checkpoint
+} chunkSpan;
+
+static bool ReadFile(const std::string &path, std::vector<char> *data)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    data->clear();
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data->insert(data->end(), buf, buf + n);
+    fclose(f);
+    return true;
+}
+
+static bool WriteFile(const std::string &path, const char *data, size_t size)
+{
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(data, 1, size, f) == size;
+    return fclose(f) == 0 && ok;
+}
+
+// the intact chunks of a log, and the indices of the points in its data chunks; false if the log
+// does not end with its last intact chunk
+static bool Walk(const std::vector<char> &data, std::vector<chunkSpan> *chunks, std::vector<int64_t> *indices)
+{
+    size_t recSize = sizeof(scanLogPoint) + 2 * LOG_AXES * sizeof(float);
+    chunks->clear();
+    indices->clear();
+    size_t at = sizeof(scanLogHeader);
+    while (at + sizeof(scanLogChunkHeader) <= data.size())
+    {
+        scanLogChunkHeader ch;
+        memcpy(&ch, &data[at], sizeof(ch));
+        size_t payload = at + sizeof(ch);
+        if (payload + ch.size > data.size() || ScanLogCrc(&data[payload], ch.size) != ch.crc)
+            return false;
+        chunkSpan span = {(long)at, (long)(payload + ch.size), ch.type, {}};
+        if (ch.type == SCANLOG_CHECKPOINT)
+            memcpy(&span.cp, &data[payload], sizeof(span.cp));
+        else
+        {
+            for (uint32_t k = 0; k < ch.count; k++)
+            {
+                scanLogPoint pt;
+                memcpy(&pt, &data[payload + k * recSize], sizeof(pt));
+                indices->push_back(pt.index);
+            }
+        }
+        chunks->push_back(span);
+        at = span.end;
+    }
+    return at == data.size();
+}
+
+static long FileSize(const std::string &path)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+// appends points [from, to) and closes the log; with a path, waits for the writer to put each batch
+// in the file before going on, so the log has a chunk per batch however the threads are scheduled
+static long AppendPoints(ScanLog *log, long from, long to, long batch = 0, const std::string &path = "")
+{
+    for (long i = from; i < to; i++)
+    {
+        float target[LOG_AXES] = {(float)i, (float)(2 * i)};
+        float actual[LOG_AXES] = {(float)i + 0.001f, (float)(2 * i) - 0.001f};
+        bool wait = !path.empty() && (i - from + 1) % batch == 0;
+        long size = wait ? FileSize(path) : 0;
+        log->Append(i, target, actual, 0.5 * i);
+        if (wait)
+        {
+            for (int k = 0; k < 1000 && FileSize(path) == size; k++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    return log->Close();
+}
+
+// where a copy cut to size bytes, or with the chunk at corrupt damaged, must resume: after the last
+// checkpoint before the damage
+static uint64_t Expected(const std::vector<chunkSpan> &chunks, long size, long corrupt)
+{
+    uint64_t next = 0;
+    for (const chunkSpan &c : chunks)
+    {
+        if (c.end > size || c.start == corrupt)
+            break;
+        if (c.type == SCANLOG_CHECKPOINT)
+            next = c.cp.next;
+    }
+    return next;
+}
+
+typedef struct
+{
+    long copies;
+    long resumedRight; // at the expected point
+    long complete;     // every point once and in order after the rest was appended
+} resumeStats;
+
+// resumes the damaged copy, finishes the scan, and checks the log it leaves
+static void ResumeCopy(const std::string &path, const std::vector<char> &data, long size, uint64_t expected, long points, resumeStats *st)
+{
+    st->copies++;
+    if (!WriteFile(path, data.data(), size))
+        return;
+    ScanLog log(8, 10000);
+    uint64_t next = ~0ULL;
+    if (log.Resume(path.c_str(), LOG_AXES, LOG_HASH, &next))
+        return;
+    st->resumedRight += next == expected;
+    if (AppendPoints(&log, (long)next, points))
+        return;
+    std::vector<char> out;
+    std::vector<chunkSpan> chunks;
+    std::vector<int64_t> indices;
+    if (!ReadFile(path, &out) || !Walk(out, &chunks, &indices) || chunks.empty())
+        return;
+    bool ok = (long)indices.size() == points && chunks.back().type == SCANLOG_CHECKPOINT && chunks.back().cp.next == (uint64_t)points &&
+              chunks.back().cp.points == (uint64_t)points;
+    for (long i = 0; ok && i < points; i++)
+        ok = indices[i] == i;
+    st->complete += ok;
+}
+
+int main(int argc, char **argv)
+{
+    long points = 200, batch = 8;
+    std::string path = "mcpher_logstress.log";
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--points"))
+            points = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--batch"))
+            batch = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--file"))
+            path = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: mcpher_logstress [--points N] [--batch N] [--file PATH]\n");
+            return 1;
+        }
+    }
+    if (points < 2 || batch < 1)
+        return 1;
+    std::string ref = path + ".ref";
+
+    // the log of an uninterrupted scan, in chunks of a batch or so
+    ScanLog log(batch, 10000);
+    if (log.Create(ref.c_str(), LOG_AXES, LOG_HASH) || AppendPoints(&log, 0, points, batch, ref))
+    {
+        fprintf(stderr, "Could not write %s\n", ref.c_str());
+        return 1;
+    }
+    std::vector<char> data;
+    std::vector<chunkSpan> chunks;
+    std::vector<int64_t> indices;
+    bool intact = ReadFile(ref, &data) && Walk(data, &chunks, &indices) && (long)indices.size() == points;
+    long checkpoints = 0;
+    for (const chunkSpan &c : chunks)
+        checkpoints += c.type == SCANLOG_CHECKPOINT;
+    printf("%ld points, %zu chunks, %ld checkpoints, %zu bytes\n", points, chunks.size(), checkpoints, data.size());
+
+    // cut at every boundary, just before and after it, and in the middle of every chunk
+    resumeStats cut = {};
+    for (const chunkSpan &c : chunks)
+    {
+        long sizes[] = {c.start, c.start + 1, c.start + (long)sizeof(scanLogChunkHeader), (c.start + c.end) / 2, c.end - 1, c.end};
+        for (long size : sizes)
+            ResumeCopy(path, data, size, Expected(chunks, size, -1), points, &cut);
+    }
+    printf("cut short:  %ld copies, %ld resumed at the last checkpoint, %ld complete after\n", cut.copies, cut.resumedRight, cut.complete);
+
+    // a byte of each chunk's header and of its payload flipped, the rest of the file left as it was
+    resumeStats bad = {};
+    for (const chunkSpan &c : chunks)
+    {
+        long offsets[] = {c.start + (long)offsetof(scanLogChunkHeader, crc), c.start + (long)sizeof(scanLogChunkHeader), c.end - 1};
+        for (long off : offsets)
+        {
+            std::vector<char> copy(data);
+            copy[off] ^= 0x5a;
+            ResumeCopy(path, copy, (long)copy.size(), Expected(chunks, (long)copy.size(), c.start), points, &bad);
+        }
+    }
+    printf("corrupted:  %ld copies, %ld resumed at the last checkpoint, %ld complete after\n", bad.copies, bad.resumedRight, bad.complete);
+
+    // a chunk's size damaged, past the end of the file or far beyond it: nothing is allocated for it
+    resumeStats badSize = {};
+    for (const chunkSpan &c : chunks)
+    {
+        uint32_t sizes[] = {(uint32_t)(data.size() - c.start), 0xffffffffU};
+        for (uint32_t size : sizes)
+        {
+            std::vector<char> copy(data);
+            memcpy(&copy[c.start + offsetof(scanLogChunkHeader, size)], &size, sizeof(size));
+            ResumeCopy(path, copy, (long)copy.size(), Expected(chunks, (long)copy.size(), c.start), points, &badSize);
+        }
+    }
+    printf("bad size:   %ld copies, %ld resumed at the last checkpoint, %ld complete after\n", badSize.copies, badSize.resumedRight,
+           badSize.complete);
+
+    // a copy cut inside the file header is not a log any more, and another plan's is refused
+    uint64_t next = 0;
+    ScanLog other;
+    WriteFile(path, data.data(), sizeof(scanLogHeader) - 1);
+    bool refused = other.Resume(path.c_str(), LOG_AXES, LOG_HASH, &next) == SCANLOG_ERR_FORMAT;
+    WriteFile(path, data.data(), data.size());
+    refused &= other.Resume(path.c_str(), LOG_AXES, LOG_HASH + 1, &next) == SCANLOG_ERR_PLAN;
+    refused &= other.Resume(path.c_str(), LOG_AXES + 1, LOG_HASH, &next) == SCANLOG_ERR_PLAN;
+    remove(path.c_str());
+    remove(ref.c_str());
+
+    Check(intact && checkpoints > 2, "an uninterrupted log holds every point, checkpointed");
+    Check(cut.resumedRight == cut.copies, "a log cut short resumes at its last whole checkpoint");
+    Check(cut.complete == cut.copies, "and holds every point once, in order, when finished");
+    Check(bad.resumedRight == bad.copies, "a corrupted chunk resumes at the checkpoint before it");
+    Check(bad.complete == bad.copies, "and drops nothing else nor repeats a point");
+    Check(badSize.resumedRight == badSize.copies && badSize.complete == badSize.copies, "a chunk of a damaged size resumes at the checkpoint before");
+    Check(refused, "a damaged header or another plan's log is refused");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
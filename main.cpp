@@ -10,9 +10,33 @@
 #include <tchar.h>
 
 #include <string>
-#include <APTAPI.h>
+#include "motordriver.h"
+#include "aptdriver.h"
+#include "simdriver.h"
+#include "controller.h"
+#include "paramcache.h"
+#include "instrdriver.h"
+#include "latencyhist.h"
+#include "motorpanel.h"
+#include "diagpanel.h"
+#include "framesched.h"
+#include "scanengine.h"
+#include "scanplan.h"
+#include "scanorder.h"
+#include "measurement.h"
+#include "recorder.h"
+#include "scanlog.h"
+#include "scantask.h"
+#include "sequence.h"
+#include "homing.h"
+#include "statusbus.h"
+#include <chrono>
+#include <thread>
+#include <vector>
 
-#pragma comment(lib, "APT.lib")
+#ifndef SIM_DRIVER_UNITS
+#define SIM_DRIVER_UNITS 4 // number of simulated K-Cubes when built with SIM_DRIVER
+#endif
 
 // Data
 static LPDIRECT3D9 g_pD3D = NULL;
@@ -25,194 +49,576 @@ void CleanupDeviceD3D();
 void ResetDevice();
 LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 
-typedef struct
-{
-    int index;
-    long serNum;
-    float minVel;
-    float set_minVel;
-    float maxVel;
-    float set_maxVel;
-    float Accel;
-    float set_Accel;
-    float limMaxAccel;
-    float limMaxVel;
-    float curPos;
-    float destPos;
-    float lastPos; // used to detect home position
-    float homeVel;
-    float ofst;
-    BOOL moving;
-    bool warn;
-    float start; // scan start
-    float stop; // scan stop
-    float step; // scan step
-    float scanDelay; // in seconds
-    bool scanning;
-    bool scanfcninuse; // scan function done
-    bool scanmsg;
-} motorProps;
-
 bool init = true;
 bool failed = false;
 std::string failmsg = "";
 long numUnits = 0;
 
-motorProps *motors = nullptr;
-std::string *warnText = nullptr;
-std::string *scanText = nullptr;
-HANDLE *scanFcnHdl = nullptr;
-DWORD *scanFcnId = nullptr;
+MotorPanel *panel = nullptr;
+motorProps *motors = nullptr; // owned by panel
 
+MotorDriver *driver = nullptr; // paramCache, in front of instrDriver, in front of hwDriver
+MotorDriver *hwDriver = nullptr;
+InstrumentedDriver *instrDriver = nullptr; // times every call that reaches the devices
+ParamCache *paramCache = nullptr;
+#define PARAM_CACHE_FILE "params.cache"
+MotorController *controller = nullptr;
+#define INIT_WORKERS 8 // devices initialized at once
+#define ENVELOPE_FILE "envelope.txt" // travel limits, velocity caps and forbidden zones, if present
+#define BACKLASH_FILE "backlash.table" // learned by the scans in precision mode, kept across sessions
+#define PRECISION_CORRECTIONS 3 // most corrective moves per point in precision mode
+StatusBus *statusBus = nullptr; // motor state for other local processes, see statusbus.h
+#define STATUS_BUS_NAME BUS_DEFAULT_NAME
+Measurement *measurement = nullptr; // detector read at every scan point, if any
+Recorder *recorder = nullptr;
+#define RECORDER_FILE "telemetry.rec"
+#define RECORDER_CSV "telemetry.csv"
+#define RECORDER_CAPACITY (1 << 20) // records, 40 MB
+std::string recText = "";
+std::shared_ptr<ScanTask> exportTask; // writes RECORDER_CSV on a pool thread, a full ring takes seconds
+MotorTelemetry *telemetry = nullptr; // owned by controller
+int pollInterval = 20; // telemetry poll interval, ms
+#define HISTORY_CAPACITY 1024 // buckets per resolution, ~240 kB per motor
 
-DWORD WINAPI MotorScanFcn(LPVOID _in)
+enum framePhase
 {
-    motorProps *props = (motorProps *) _in; // get motor props
-    int idx = props->index;
-    props->scanfcninuse = true; // scan function in use
-    // check start - stop - step
-    float step = props->step;
-    float start = props->start;
-    float stop = props->stop;
-    float sleepTime = props->scanDelay;
-    if (sleepTime < 0)
-        sleepTime = 0.1;
-    if (sleepTime > 10)
-        sleepTime = 10;
-        props->scanDelay = sleepTime;
-    float pos = start;
-    bool scanning = true;
-    // sanitize step size
-    step = props->step;
-    step = step < 0 ? -step : step;
-    step = step == 0 ? 0.1 : step;
-    props->step = step;
-    bool mov_dir = start < stop;
-    if (start < 0)
-    {
-        scanText[idx] = "Start position is negative, invalid.";
-        props->scanmsg = true;
-        goto end; 
-    }
-    if (stop < 0)
-    {
-        scanText[idx] = "Start position is negative, invalid.";
-        props->scanmsg = true;
-        goto end;
-    }
-    if (start == stop)
-    {
-        scanText[idx] = "Scan start and stop locations are same, invalid.";
-        props->scanmsg = true;
-        goto end;
-    }
-    scanText[idx] = "Moving to starting position...";
-    if (MOT_MoveAbsoluteEx(props->serNum, start, true))
+    FRAME_WAIT,    // blocked until input, a change, or the next idle frame
+    FRAME_EVENTS,  // window messages
+    FRAME_UPDATE,  // new ImGui frame, telemetry and scan messages
+    FRAME_BUILD,   // widgets
+    FRAME_RENDER,  // draw data to the back buffer
+    FRAME_PRESENT, // includes the wait for vsync
+    FRAME_PHASES,
+};
+const char *framePhaseNames[FRAME_PHASES] = {"wait", "events", "update", "build", "render", "present"};
+PhaseTimer frameTimer(framePhaseNames, FRAME_PHASES);
+DiagPanel *diagPanel = nullptr;
+FrameScheduler frameSched;
+bool frameThrottle = true; // draw only on change while nothing moves
+HANDLE wakeEvent = NULL;   // auto-reset, set when a motor state shown changes
+
+bool multiSerpentine = true;
+bool multiPointList = false;  // scan the points listed in multiPointFile instead of a grid
+bool multiOptimize = true;    // reorder the point list to minimize travel
+char multiPointFile[260] = ""; // MAX_PATH
+bool multiScanInUse = false;
+char multiScanText[PANEL_TEXT_LEN] = "";
+std::shared_ptr<ScanTask> multiTask;
+std::vector<long> multiAxes; // motors held by multiTask
+ScanTaskManager *scanTasks = nullptr; // at most a thread per registry slot, and one each for the multi-axis scan, sequences, home all and rescans
+#define SCAN_MULTI_DATA "scan_multi.dat"
+#define SCAN_MULTI_PLAN "scan_multi.pts" // points of the last multi-axis scan, in visiting order
+
+char seqFile[260] = ""; // MAX_PATH
+char seqText[PANEL_TEXT_LEN] = "";
+std::shared_ptr<ScanTask> seqTask;
+std::vector<long> seqAxes; // motors held by seqTask
+#define SEQ_DATA "sequence.dat" // every measure op of the last sequence, with all motors
+
+char homeGroups[128] = ""; // groups homed one after the other, see HomeRunner::ParseGroups()
+char homeText[PANEL_TEXT_LEN] = "";
+std::shared_ptr<ScanTask> homeTask;
+std::vector<long> homeAxes; // motors held by homeTask
+std::shared_ptr<std::vector<homeResult>> homeResults; // written by homeTask, read once it is done
+
+char rescanText[PANEL_TEXT_LEN] = "";
+std::shared_ptr<ScanTask> rescanTask;
+bool devicesChanged = false; // set by WM_DEVICECHANGE, a rescan follows
+
+
+long MotorScanFcn(ScanTask *task, motorProps props, scanParams params)
+{
+    // every point goes to scan_<serial>.dat; a grid scan can be resumed from it
+    std::string path = "scan_" + std::to_string(props.serNum) + ".dat";
+    float range[3] = {params.start, params.stop, params.step};
+    uint64_t hash = ScanLogHash(range, sizeof(range));
+    uint64_t next = 0;
+    ScanLog log;
+    long ret;
+    if (props.resume && !props.adaptive)
+        ret = log.Resume(path.c_str(), 1, hash, &next);
+    else
+        ret = log.Create(path.c_str(), 1, hash);
+    if (ret == SCANLOG_ERR_PLAN)
+        task->Post("Scan range differs from the one in %s, cannot resume.", path.c_str());
+    else if (ret)
+        task->Post("Could not open %s.", path.c_str());
+    if (ret)
+        return ret;
+    ScanEngine engine(driver, telemetry, props.index, props.serNum);
+    engine.SetMeasurement(measurement);
+    engine.SetCancelToken(task->Token());
+    engine.SetMotionModel(controller->Motion());
+    engine.SetEnvelope(controller->Envelope());
+    precisionParams prec = {};
+    prec.approach = 1;
+    prec.overshoot = props.overshoot;
+    prec.tol = props.precTol;
+    prec.maxCorrections = PRECISION_CORRECTIONS;
+    prec.compensate = true;
+    engine.SetPrecision(props.precise ? &prec : nullptr, controller->Backlash());
+    engine.SetProgressHook([task](long done, long total, double remaining)
+                           { task->SetProgress(done, total, remaining); });
+    engine.SetPointHook([task, &props, &log](long i, float target, float actual, double value)
+                        {
+                            task->SetValue(value);
+                            log.Append(i, &target, &actual, value);
+                            recorder->LogScan(props.serNum, i, target, actual, value);
+                            statusBus->SetScanIndex(props.index, i); });
+    engine.SetStatusHook([task](const std::string &msg)
+                         { task->Post("%s", msg.c_str()); });
+    if (props.adaptive)
+        ret = engine.RunAdaptive(params);
+    else
+        ret = engine.Run(params, (long)next);
+    statusBus->SetScanIndex(props.index, -1);
+    if (log.Close())
+        task->Post("Could not write %s.", path.c_str());
+    return ret;
+}
+
+// motors marked for the multi-axis scan, in panel order; the first one varies fastest
+void MultiScanAxes(std::vector<scanAxis> *axes)
+{
+    axes->clear();
+    for (long i = 0; i < numUnits; i++)
     {
-        scanText[idx] = "Could not move to starting position for scan.";
-        props->scanmsg = true;
+        if (!motors[i].multiScan || !motors[i].ready)
+            continue;
+        scanAxis ax;
+        ax.idx = i;
+        ax.serNum = motors[i].serNum;
+        ax.start = motors[i].start;
+        ax.stop = motors[i].stop;
+        ax.step = motors[i].step;
+        ax.minVel = motors[i].minVel;
+        ax.maxVel = motors[i].maxVel;
+        ax.Accel = motors[i].Accel;
+        axes->push_back(ax);
     }
-    if (!mov_dir)
-        step = -step;
-    scanText[idx] = "Starting scan...";
-    props->scanning = true;
-    while (props->scanning & scanning)
+}
+
+// everything the multi-axis scan needs, read on the UI thread when it is started
+typedef struct
+{
+    std::vector<scanAxis> axes;
+    std::vector<float> from; // current position of every axis
+    scanParams params;
+    bool resume;
+    bool pointList;
+    bool optimize;
+    bool serpentine;
+    std::string pointFile;
+} multiScanSetup;
+
+long MultiScanFcn(ScanTask *task, const multiScanSetup &setup)
+{
+    const std::vector<scanAxis> &axes = setup.axes;
+    ScanPlan plan;
+    if (setup.resume)
     {
-        // make measurement
-        scanText[idx] = "Making measurement...";
-        Sleep(sleepTime * 1000);
-        pos += step;
-        if (mov_dir)
+        // the interrupted scan's points, already in visiting order
+        if (ScanPlanLoad(SCAN_MULTI_PLAN, axes.size(), &plan, nullptr) || plan.NumPoints() == 0)
         {
-            scanning = pos < stop;
+            task->Post("No %zu-axis scan to resume.", axes.size());
+            return SCAN_ERR_PARAM;
         }
-        else
+    }
+    else if (setup.pointList)
+    {
+        std::vector<long> groups;
+        task->Post("Loading point list...");
+        if (ScanPlanLoad(setup.pointFile.c_str(), axes.size(), &plan, &groups) || plan.NumPoints() == 0)
         {
-            scanning = pos > stop;
+            task->Post("Could not read %zu-axis points from %s.", axes.size(), setup.pointFile.c_str());
+            return SCAN_ERR_PARAM;
         }
-        if (props->scanning != true)
-            continue;
-        scanText[idx] = "Moving to " + std::to_string(pos) + "...";
-        if (MOT_MoveAbsoluteEx(props->serNum, pos, false))
+        if (setup.optimize)
         {
-            scanText[idx] = "Could not move to position " + std::to_string(pos) + ", invalid.";
-            props->scanmsg = true;
-            break;
+            task->Post("Optimizing order of %ld points...", plan.NumPoints());
+            scanOrderStats st;
+            ScanPlanOptimize(axes.data(), &plan, &groups, setup.from.data(), &st);
+            task->Post("Travel %.1f s -> %.1f s (planned in %.2f s)", st.before, st.after, st.planTime);
         }
     }
-    scanText[idx] = "Finished scan.";
-    props->scanmsg = true;
-end:
-    props->scanning = false;
-    props->scanfcninuse = false;
-    return NULL;
+    else if (ScanPlanGrid(axes.data(), axes.size(), setup.serpentine ? SCAN_SERPENTINE : SCAN_RASTER, &plan))
+    {
+        task->Post("Invalid scan range.");
+        return SCAN_ERR_PARAM;
+    }
+    if (!setup.resume && ScanPlanSave(SCAN_MULTI_PLAN, plan))
+    {
+        task->Post("Could not write " SCAN_MULTI_PLAN ".");
+        return SCAN_ERR_FILE;
+    }
+    uint64_t hash = ScanLogHash(plan.Point(0), plan.NumPoints() * plan.NumAxes() * sizeof(float));
+    uint64_t next = 0;
+    ScanLog log;
+    long ret = setup.resume ? log.Resume(SCAN_MULTI_DATA, axes.size(), hash, &next) : log.Create(SCAN_MULTI_DATA, axes.size(), hash);
+    if (ret)
+    {
+        task->Post(ret == SCANLOG_ERR_PLAN ? "Scan plan differs from the one in " SCAN_MULTI_DATA ", cannot resume." : "Could not open " SCAN_MULTI_DATA ".");
+        return ret;
+    }
+    PlanRunner runner(driver, telemetry);
+    runner.SetStatusHook([task](const std::string &msg)
+                         { task->Post("%s", msg.c_str()); });
+    runner.SetCancelToken(task->Token());
+    runner.SetMotionModel(controller->Motion());
+    runner.SetEnvelope(controller->Envelope());
+    runner.SetProgressHook([task](long done, long total, double remaining)
+                           { task->SetProgress(done, total, remaining); });
+    runner.SetMeasurement(measurement);
+    runner.SetPointHook([task, &axes, &plan, &log](long i, const float *actual, double value)
+                        {
+                            task->SetValue(value);
+                            log.Append(i, plan.Point(i), actual, value);
+                            for (size_t j = 0; j < axes.size(); j++)
+                            {
+                                recorder->LogScan(axes[j].serNum, i, plan.Point(i)[j], actual[j], value);
+                                statusBus->SetScanIndex(axes[j].idx, i);
+                            } });
+    if ((long)next >= plan.NumPoints())
+        task->Post("Scan already complete.");
+    else
+        ret = runner.Run(axes.data(), axes.size(), plan, setup.params, (long)next);
+    for (size_t j = 0; j < axes.size(); j++)
+        statusBus->SetScanIndex(axes[j].idx, -1);
+    if (log.Close())
+        task->Post("Could not write " SCAN_MULTI_DATA ".");
+    return ret;
 }
 
-DWORD WINAPI InitThreadFcn(LPVOID _in)
+// checks and captures the multi-axis scan on the UI thread, then hands it to a pool thread
+void StartMultiScan(bool resume)
 {
-    while (init)
+    multiScanSetup setup;
+    MultiScanAxes(&setup.axes);
+    if (setup.axes.size() == 0)
     {
-        // perform init tasks
-        long ret = APTInit();
-        if (ret)
-        {
-            init = false;
-            failed = true;
-            failmsg = "Failed to initialize APT library.";
-            continue;
-        }
-        ret = GetNumHWUnitsEx(HWTYPE_KST101, &numUnits);
-        if (ret)
-        {
-            init = false;
-            failed = true;
-            failmsg = "Failed to enumerate K-Cubes.";
-            continue;
-        }
-        else if (numUnits == 0)
+        snprintf(multiScanText, sizeof(multiScanText), "No motors selected for the multi-axis scan.");
+        return;
+    }
+    for (size_t j = 0; j < setup.axes.size(); j++)
+    {
+        if (motors[setup.axes[j].idx].scanBusy)
         {
-            init = false;
-            failed = true;
-            failmsg = "Could not find any K-Cubes.";
-            continue;
+            snprintf(multiScanText, sizeof(multiScanText), "Motor %ld is already scanning.", setup.axes[j].idx + 1);
+            return;
         }
-        motors = new motorProps[numUnits];
-        warnText = new std::string[numUnits];
-        scanText = new std::string[numUnits];
-        scanFcnHdl = new HANDLE[numUnits];
-        scanFcnId = new DWORD[numUnits];
-        if (motors == nullptr)
+        setup.from.push_back(panel->Position(setup.axes[j].idx));
+    }
+    // dwell and settling criteria of the first axis apply to every point
+    motorProps *first = &motors[setup.axes[0].idx];
+    setup.params = {};
+    setup.params.dwell = first->scanDelay < 0 ? 0 : first->scanDelay;
+    setup.params.settleTol = first->settleTol > 0 ? first->settleTol : 0.005f;
+    setup.params.settleCount = first->settleCount > 0 ? first->settleCount : 3;
+    setup.params.timeout = 60;
+    setup.resume = resume;
+    setup.pointList = multiPointList;
+    setup.optimize = multiOptimize;
+    setup.serpentine = multiSerpentine;
+    setup.pointFile = multiPointFile;
+    multiTask = scanTasks->Submit([setup](ScanTask *task)
+                                  { return MultiScanFcn(task, setup); });
+    if (!multiTask)
+        return;
+    multiScanInUse = true;
+    multiScanText[0] = '\0';
+    for (size_t j = 0; j < setup.axes.size(); j++)
+    {
+        multiAxes.push_back(setup.axes[j].idx);
+        motors[setup.axes[j].idx].inMultiScan = true;
+    }
+}
+
+// once per frame: messages of the multi-axis scan, and the motors back once it is done
+void UpdateMultiScan()
+{
+    if (!multiTask)
+        return;
+    bool done = multiTask->State() == TASK_DONE;
+    taskMessage msg;
+    while (multiTask->Pop(&msg))
+        snprintf(multiScanText, sizeof(multiScanText), "%s", msg.text);
+    if (!done)
+        return;
+    for (size_t j = 0; j < multiAxes.size(); j++)
+        motors[multiAxes[j]].inMultiScan = false;
+    multiAxes.clear();
+    multiTask.reset();
+    multiScanInUse = false;
+}
+
+long SeqFcn(ScanTask *task, std::shared_ptr<SeqProgram> prog, const std::vector<long> &serNums)
+{
+    ScanLog log;
+    if (log.Create(SEQ_DATA, prog->NumUnits(), prog->Hash()))
+    {
+        task->Post("Could not open " SEQ_DATA ".");
+        return SCAN_ERR_FILE;
+    }
+    SeqRunner runner(driver, telemetry, serNums.data(), serNums.size());
+    runner.SetStatusHook([task](const std::string &msg)
+                         { task->Post("%s", msg.c_str()); });
+    runner.SetCancelToken(task->Token());
+    runner.SetMotionModel(controller->Motion());
+    runner.SetEnvelope(controller->Envelope());
+    runner.SetMeasurement(measurement);
+    runner.SetStepHook([task](uint64_t steps, long line)
+                       {
+                           // the op count is not known ahead of loops, so show where the program is
+                           if (steps % 16 == 0)
+                               task->Post("Line %ld, %llu steps", line, (unsigned long long)steps); });
+    runner.SetMeasureHook([task, &log, &serNums](long i, const float *target, const float *actual, double value)
+                          {
+                              task->SetValue(value);
+                              log.Append(i, target, actual, value);
+                              for (size_t j = 0; j < serNums.size(); j++)
+                                  recorder->LogScan(serNums[j], i, target[j], actual[j], value); });
+    long ret = runner.Run(*prog);
+    if (!ret)
+        task->Post("Done, %llu steps.", (unsigned long long)runner.Steps());
+    if (log.Close())
+        task->Post("Could not write " SEQ_DATA ".");
+    return ret;
+}
+
+// compiles the sequence on the UI thread, so errors show at once, then hands it to a pool thread
+void StartSequence()
+{
+    auto prog = std::make_shared<SeqProgram>();
+    std::string msg;
+    if (prog->Load(seqFile, numUnits, &msg))
+    {
+        snprintf(seqText, sizeof(seqText), "%s", msg.c_str());
+        return;
+    }
+    const std::vector<long> &axes = prog->Motors();
+    for (size_t j = 0; j < axes.size(); j++)
+    {
+        if (motors[axes[j]].scanBusy || !motors[axes[j]].ready)
         {
-            init = false;
-            failed = true;
-            failmsg = "Failed to allocate memory for units.";
-            continue;
+            snprintf(seqText, sizeof(seqText), "Motor %ld is busy or not ready.", axes[j] + 1);
+            return;
         }
-        memset(motors, 0x0, sizeof(motorProps) * numUnits);
-        memset(scanFcnHdl, 0x0, sizeof(HANDLE) * numUnits);
-        for (long i = 0; i < numUnits; i++)
+    }
+    std::vector<long> serNums(numUnits);
+    for (long i = 0; i < numUnits; i++)
+        serNums[i] = motors[i].serNum;
+    seqTask = scanTasks->Submit([prog, serNums](ScanTask *task)
+                                { return SeqFcn(task, prog, serNums); });
+    if (!seqTask)
+        return;
+    snprintf(seqText, sizeof(seqText), "%ld ops.", prog->NumOps());
+    seqAxes = axes;
+    for (size_t j = 0; j < axes.size(); j++)
+        motors[axes[j]].inMultiScan = true;
+}
+
+// once per frame, as UpdateMultiScan()
+void UpdateSequence()
+{
+    if (!seqTask)
+        return;
+    bool done = seqTask->State() == TASK_DONE;
+    taskMessage msg;
+    while (seqTask->Pop(&msg))
+        snprintf(seqText, sizeof(seqText), "%s", msg.text);
+    if (!done)
+        return;
+    for (size_t j = 0; j < seqAxes.size(); j++)
+        motors[seqAxes[j]].inMultiScan = false;
+    seqAxes.clear();
+    seqTask.reset();
+}
+
+long HomeFcn(ScanTask *task, const std::vector<std::vector<long>> &groups, const std::vector<long> &serNums, std::vector<homeResult> *results)
+{
+    HomeRunner runner(driver, telemetry, serNums.data(), serNums.size());
+    runner.SetStatusHook([task](const std::string &msg)
+                         { task->Post("%s", msg.c_str()); });
+    runner.SetCancelToken(task->Token());
+    runner.SetDoneHook([task](const homeResult &res)
+                       {
+                           if (!res.ret)
+                               task->Post("Motor %ld home in %.2f s.", res.idx + 1, res.time); });
+    auto t0 = std::chrono::steady_clock::now();
+    long ret = runner.Run(groups, results);
+    if (!ret)
+        task->Post("All home in %.1f s.", std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    return ret;
+}
+
+// checks the groups on the UI thread, then homes them on a pool thread
+void StartHomeAll()
+{
+    std::vector<std::vector<long>> groups;
+    std::string msg;
+    if (HomeRunner::ParseGroups(homeGroups, numUnits, &groups, &msg))
+    {
+        snprintf(homeText, sizeof(homeText), "Home groups: %s", msg.c_str());
+        return;
+    }
+    std::vector<long> axes;
+    for (const std::vector<long> &group : groups)
+        axes.insert(axes.end(), group.begin(), group.end());
+    for (size_t j = 0; j < axes.size(); j++)
+    {
+        if (motors[axes[j]].scanBusy || !motors[axes[j]].ready)
         {
-            ret = GetHWSerialNumEx(HWTYPE_KST101, i, &motors[i].serNum);
-            if (ret)
-            {
-                init = false;
-                failed = true;
-                failmsg = "Failed to get serial number for device " + std::to_string(i);
-                continue;
-            }
-            ret = InitHWDevice(motors[i].serNum);
-            motors[i].index = i;
-            if (ret)
-            {
-                init = false;
-                failed = true;
-                failmsg = "Failed to init device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
-                continue;
-            }
+            snprintf(homeText, sizeof(homeText), "Motor %ld is busy or not ready.", axes[j] + 1);
+            return;
         }
+    }
+    std::vector<long> serNums(numUnits);
+    for (long i = 0; i < numUnits; i++)
+        serNums[i] = motors[i].serNum;
+    auto results = std::make_shared<std::vector<homeResult>>();
+    homeTask = scanTasks->Submit([groups, serNums, results](ScanTask *task)
+                                 { return HomeFcn(task, groups, serNums, results.get()); });
+    if (!homeTask)
+        return;
+    snprintf(homeText, sizeof(homeText), "Homing %zu motors in %zu groups...", axes.size(), groups.size());
+    homeResults = results;
+    homeAxes = axes;
+    for (size_t j = 0; j < axes.size(); j++)
+        motors[axes[j]].inMultiScan = true;
+}
+
+// once per frame, as UpdateMultiScan(); the results stay for display until the next home all
+void UpdateHomeAll()
+{
+    if (!homeTask)
+        return;
+    bool done = homeTask->State() == TASK_DONE;
+    taskMessage msg;
+    while (homeTask->Pop(&msg))
+        snprintf(homeText, sizeof(homeText), "%s", msg.text);
+    if (!done)
+        return;
+    for (size_t j = 0; j < homeAxes.size(); j++)
+        motors[homeAxes[j]].inMultiScan = false;
+    homeAxes.clear();
+    homeTask.reset();
+}
+
+// enumerates the devices again on a pool thread; new ones come up in the background, as at start
+void StartRescan()
+{
+    devicesChanged = false;
+    if (rescanTask)
+        return;
+    rescanTask = scanTasks->Submit([](ScanTask *task)
+                                   {
+                                       long added, removed;
+                                       std::string msg;
+                                       long ret = controller->Rescan(&added, &removed, &msg);
+                                       if (ret)
+                                           task->Post("%s (%ld)", msg.c_str(), ret);
+                                       else
+                                           task->Post("%ld added, %ld removed, %ld present.", added, removed, controller->Telemetry()->Registry()->Count());
+                                       return ret; });
+    if (rescanTask)
+        snprintf(rescanText, sizeof(rescanText), "Looking for devices...");
+}
+
+void UpdateRescan()
+{
+    if (!rescanTask)
+    {
+        // any device may have come or gone; a rescan that finds no change is cheap
+        if (devicesChanged)
+            StartRescan();
+        return;
+    }
+    bool done = rescanTask->State() == TASK_DONE;
+    taskMessage msg;
+    while (rescanTask->Pop(&msg))
+        snprintf(rescanText, sizeof(rescanText), "%s", msg.text);
+    if (done)
+        rescanTask.reset();
+}
+
+// exports the recording on a pool thread, the UI keeps running; the result comes back as its message
+void StartExport()
+{
+    if (exportTask)
+        return;
+    exportTask = scanTasks->Submit([](ScanTask *task)
+                                   {
+                                       uint64_t count;
+                                       recorder->Flush();
+                                       long ret = RecorderExportCsv(RECORDER_FILE, RECORDER_CSV, &count);
+                                       if (ret)
+                                           task->Post("Could not export " RECORDER_CSV ".");
+                                       else
+                                           task->Post("Exported %llu records to " RECORDER_CSV ".", (unsigned long long)count);
+                                       return ret; });
+    if (exportTask)
+        recText = "Exporting to " RECORDER_CSV "...";
+}
+
+void UpdateExport()
+{
+    if (!exportTask)
+        return;
+    bool done = exportTask->State() == TASK_DONE;
+    taskMessage msg;
+    while (exportTask->Pop(&msg))
+        recText = msg.text;
+    if (done)
+        exportTask.reset();
+}
+
+void InitThreadFcn()
+{
+    recorder = new Recorder();
+    if (recorder->Open(RECORDER_FILE, RECORDER_CAPACITY))
+        recText = "Could not open " RECORDER_FILE ", telemetry is not recorded.";
+    controller = new MotorController(driver, pollInterval);
+    controller->SetRecorder(recorder);
+    controller->Telemetry()->EnableHistory(HISTORY_CAPACITY);
+    // before anything returns, shutdown saves the table back
+    controller->Backlash()->Load(BACKLASH_FILE);
+    // no file, no limits but the devices' own; a file that does not parse keeps every stage still
+    if (controller->Envelope()->Load(ENVELOPE_FILE, &failmsg) == ENV_ERR_PARAM)
+    {
+        failed = true;
+        init = false;
+        ::SetEvent(wakeEvent);
+        return;
+    }
+    failmsg = "";
+    // the UI sleeps while nothing moves, these wake it; other processes follow on the status bus
+    statusBus = new StatusBus();
+    controller->Telemetry()->SetChangeHook([](long idx)
+                                           {
+                                               statusBus->Publish(idx);
+                                               ::SetEvent(wakeEvent); });
+    controller->SetDeviceHook([](long, const deviceInfo &)
+                              { ::SetEvent(wakeEvent); });
+    // returns once the devices are enumerated, they come up in the background
+    if (controller->Init(&failmsg, INIT_WORKERS))
+    {
+        failed = true;
         init = false;
+        ::SetEvent(wakeEvent);
+        return;
     }
-    return NULL;
+    numUnits = controller->NumUnits();
+    telemetry = controller->Telemetry();
+    // not fatal, the panel does not need it
+    statusBus->Open(STATUS_BUS_NAME, telemetry->Registry());
+    // a rescan adds motors up to the registry's capacity, each of which may run a scan of its own;
+    // threads start as scans need them, so a rig with two stages runs a handful
+    scanTasks = new ScanTaskManager((int)telemetry->Registry()->Capacity() + 4);
+    panel = new MotorPanel(controller, paramCache, measurement, scanTasks);
+    panel->SetScanFcn(MotorScanFcn);
+    motors = panel->Motors();
+    init = false;
+    ::SetEvent(wakeEvent);
 }
 
 BOOL WindowPositionGet(HWND h, RECT *rect)
@@ -301,15 +707,23 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
     // Main loop
     bool done = false;
-    bool firstRun = true;
-    DWORD InitThreadId;
-    HANDLE InitThreadHdl = CreateThread(NULL, 0, InitThreadFcn, 0, 0, &InitThreadId);
-    if (InitThreadHdl == NULL)
-    {
-        init = false;
-        failed = true;
-        failmsg = "Could not start initialization thread";
-    }
+#ifdef SIM_DRIVER
+    hwDriver = new SimDriver(SIM_DRIVER_UNITS);
+    SimDetector *detector = new SimDetector(0.01, 0.002);
+    detector->AddPeak(5.0f, 0.05f, 1.0);
+    detector->AddPeak(12.0f, 0.2f, 0.4);
+    measurement = detector;
+#else
+    hwDriver = new AptDriver();
+#endif
+    instrDriver = new InstrumentedDriver(hwDriver);
+    diagPanel = new DiagPanel(instrDriver, &frameTimer);
+    // parameters from the last session, so the devices come up without reading them again
+    paramCache = new ParamCache(instrDriver);
+    paramCache->Load(PARAM_CACHE_FILE);
+    driver = paramCache;
+    wakeEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    std::thread initThread(InitThreadFcn);
     while (!done)
     {
         // Poll and handle messages (inputs, window resize, etc.)
@@ -317,9 +731,21 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
         // - When io.WantCaptureMouse is true, do not dispatch mouse input data to your main application.
         // - When io.WantCaptureKeyboard is true, do not dispatch keyboard input data to your main application.
         // Generally you may always pass all inputs to dear imgui, and hide them from your application based on those two flags.
+        frameTimer.Start();
+        // at rest, sleep until input, a telemetry change or the next idle frame
+        int timeout = frameSched.Timeout();
+        if (timeout > 0)
+        {
+            auto tw = std::chrono::steady_clock::now();
+            DWORD woken = ::MsgWaitForMultipleObjectsEx(1, &wakeEvent, timeout, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+            frameSched.Woken(woken == WAIT_OBJECT_0 ? WAKE_CHANGE : woken == WAIT_OBJECT_0 + 1 ? WAKE_INPUT : WAKE_TIMEOUT,
+                             std::chrono::duration<double>(std::chrono::steady_clock::now() - tw).count());
+        }
+        frameTimer.Mark(FRAME_WAIT);
         MSG msg;
         while (::PeekMessage(&msg, NULL, 0U, 0U, PM_REMOVE))
         {
+            frameSched.Input();
             ::TranslateMessage(&msg);
             ::DispatchMessage(&msg);
             if (msg.message == WM_QUIT)
@@ -327,13 +753,26 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
         }
         if (done)
             break;
+        frameTimer.Mark(FRAME_EVENTS);
 
         // Start the Dear ImGui frame
         ImGui_ImplDX9_NewFrame();
         ImGui_ImplWin32_NewFrame();
         ImGui::NewFrame();
+        bool initializing = init; // the same for the whole frame, the panel is updated only if drawn
+        if (!initializing && !failed)
+        {
+            UpdateMultiScan();
+            UpdateSequence();
+            UpdateHomeAll();
+            UpdateRescan();
+            UpdateExport();
+            panel->Update();
+            numUnits = panel->NumUnits(); // grows when a rescan finds new devices
+        }
+        frameTimer.Mark(FRAME_UPDATE);
 
-        if (init)
+        if (initializing)
         {
             static int frameCtr = 0;
             static char initBuf[] = {'-', '\\', '|', '/'};
@@ -386,199 +825,148 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
             }
             ImGui::SetWindowSize(ImVec2(width, height), ImGuiCond_Always);
             ImGui::SetWindowPos(ImVec2(0, 0), ImGuiCond_Always);
-            if (firstRun) // get info
+            panel->Draw(multiScanInUse);
+            if (ImGui::CollapsingHeader("Motion history"))
+                panel->DrawHistory();
+            // multi-axis scan over the selected motors, each using its own start/stop/step
+            ImGui::Text("Multi-axis scan");
+            ImGui::Checkbox("Point list", &multiPointList);
+            ImGui::SameLine();
+            if (multiPointList)
             {
-                long homeDir, limSw;
-                for (long i = 0; i < numUnits; i++)
-                {
-                    long ret = MOT_GetHomeParams(motors[i].serNum, &homeDir, &limSw, &motors[i].homeVel, &motors[i].ofst);
-                    if (ret)
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Failed to get home info for device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
-                    }
-                    ret = MOT_GetPosition(motors[i].serNum, &motors[i].curPos);
-                    if (ret)
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Failed to get current pos info for device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
-                    }
-                    motors[i].lastPos = motors[i].curPos;
-                    motors[i].destPos = motors[i].lastPos;
-                    ret = MOT_GetVelParamLimits(motors[i].serNum, &motors[i].limMaxAccel, &motors[i].limMaxVel);
-                    if (ret)
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Failed to get velocity limit info for device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
-                    }
-                    ret = MOT_GetVelParams(motors[i].serNum, &motors[i].minVel, &motors[i].Accel, &motors[i].maxVel);
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Failed to get velocity params info for device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
-                    }
-                    motors[i].set_Accel = motors[i].Accel;
-                    motors[i].set_minVel = motors[i].minVel;
-                    motors[i].set_maxVel = motors[i].maxVel;
-                }
-                firstRun = false;
+                ImGui::Checkbox("Optimize order", &multiOptimize);
+                ImGui::InputText("Point file", multiPointFile, sizeof(multiPointFile), multiScanInUse ? ImGuiInputTextFlags_ReadOnly : 0);
             }
-            for (long i = 0; i < numUnits; i++)
+            else
+                ImGui::Checkbox("Serpentine", &multiSerpentine);
+            if (!multiScanInUse)
             {
-                long ret;
-                if (motors[i].moving)
+                if (!multiPointList && ImGui::Button("Estimate"))
                 {
-                    ret = MOT_GetPosition(motors[i].serNum, &motors[i].curPos);
-                    if (ret)
+                    std::vector<scanAxis> axes;
+                    MultiScanAxes(&axes);
+                    ScanPlan raster, serp;
+                    if (axes.size() == 0 ||
+                        ScanPlanGrid(axes.data(), axes.size(), SCAN_RASTER, &raster) ||
+                        ScanPlanGrid(axes.data(), axes.size(), SCAN_SERPENTINE, &serp))
+                        snprintf(multiScanText, sizeof(multiScanText), "Invalid scan range.");
+                    else
                     {
-                        motors[i].warn = true;
-                        warnText[i] = "Failed to get moving status info for device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
+                        // as learned from the moves so far, from where the stages are now
+                        double dwell = motors[axes[0].idx].scanDelay;
+                        std::vector<float> from(axes.size());
+                        for (size_t j = 0; j < axes.size(); j++)
+                            from[j] = panel->Position(axes[j].idx);
+                        char rasterEta[32], serpEta[32];
+                        PanelDuration(rasterEta, sizeof(rasterEta), ScanPlanPredict(controller->Motion(), axes.data(), raster, dwell, 0, from.data()));
+                        PanelDuration(serpEta, sizeof(serpEta), ScanPlanPredict(controller->Motion(), axes.data(), serp, dwell, 0, from.data()));
+                        snprintf(multiScanText, sizeof(multiScanText), "%ld points, raster %s, serpentine %s", raster.NumPoints(), rasterEta, serpEta);
                     }
                 }
-                ret = MOT_GetInMotion(motors[i].serNum, &motors[i].moving);
-                bool updateVel = false;
-                if (ret)
-                {
-                    failed = true;
-                    failmsg = "Failed to get moving status info for device " + std::to_string(i) + ": " + std::to_string(motors[i].serNum);
-                    continue;
-                }
-                ImGui::Separator();
-                ImGui::Text("Motor: %d | Serial: %ld", i + 1, motors[i].serNum);
-                // Velocities
-                ImGui::Text("Velocity parameters");
-                ImGui::Text("Min: %f | Max: %f | Accel: %f", motors[i].minVel, motors[i].maxVel, motors[i].Accel);
-                ImGui::Text("Set Velocity Parameters");
-                ImGui::Columns(3);
-                if (ImGui::InputFloat((std::string("Min##Vel") + std::to_string(i)).c_str(),
-                                      &motors[i].set_minVel, 0, 0, "%.3f", motors[i].moving ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue))
-                {
-                    updateVel = true;
-                }
-                ImGui::NextColumn();
-                if (ImGui::InputFloat((std::string("Max##Vel") + std::to_string(i)).c_str(),
-                                      &motors[i].set_maxVel, 0, 0, "%.3f", motors[i].moving ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue))
-                {
-                    updateVel = true;
-                }
-                ImGui::NextColumn();
-                if (ImGui::InputFloat((std::string("Accel##Vel") + std::to_string(i)).c_str(),
-                                      &motors[i].set_Accel, 0, 0, "%.3f", motors[i].moving ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue))
-                {
-                    updateVel = true;
-                }
-                ImGui::Columns(1);
-                if (updateVel)
-                {
-                    updateVel = false;
-                    ret = MOT_SetVelParams(motors[i].serNum,
-                                           motors[i].set_minVel,
-                                           motors[i].set_Accel,
-                                           motors[i].set_maxVel);
-                    if (ret)
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Could not set velocity parameters: " + std::to_string(ret);
-                    }
-                    else if ((ret = MOT_GetVelParams(motors[i].serNum,
-                                                     &motors[i].minVel,
-                                                     &motors[i].Accel,
-                                                     &motors[i].maxVel)))
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Could not retrieve velocity parameters: " + std::to_string(ret);
-                    }
-                }
-                ImGui::Text("Current position: %f", motors[i].curPos);
-                if (ImGui::InputFloat((std::string("Destination##") + std::to_string(i)).c_str(), &motors[i].destPos, 0, 0, "%.3f", motors[i].moving ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue))
-                {
-                    ret = MOT_MoveAbsoluteEx(motors[i].serNum, motors[i].destPos, false);
-                    if (ret)
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Could not go to position: " + std::to_string(ret);
-                    }
-                }
-                if (ImGui::Button((std::string("Go Home##") + std::to_string(i)).c_str()) && !(motors[i].moving))
-                {
-                    ret = MOT_MoveHome(motors[i].serNum, false);
-                    if (ret)
-                    {
-                        motors[i].warn = true;
-                        warnText[i] = "Could not go home: " + std::to_string(ret);
-                    }
-                }
-                ImGui::Separator();
-                // scan window
-                ImGui::Text("Scan");
-                ImGui::Columns(4);
-                ImGui::InputFloat((std::string("Start##") + std::to_string(i)).c_str(), &motors[i].start, 0, 0, "%.3f", motors[i].scanfcninuse ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_AllowTabInput | ImGuiInputTextFlags_AutoSelectAll);
-                ImGui::NextColumn();
-                ImGui::InputFloat((std::string("Stop##") + std::to_string(i)).c_str(), &motors[i].stop, 0, 0, "%.3f", motors[i].scanfcninuse ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_AllowTabInput | ImGuiInputTextFlags_AutoSelectAll);
-                ImGui::NextColumn();
-                ImGui::InputFloat((std::string("Step##") + std::to_string(i)).c_str(), &motors[i].step, 0, 0, "%.3f", motors[i].scanfcninuse ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_AllowTabInput | ImGuiInputTextFlags_AutoSelectAll);
-                ImGui::NextColumn();
-                ImGui::InputFloat((std::string("Delay##") + std::to_string(i)).c_str(), &motors[i].scanDelay, 0, 0, "%.3f", motors[i].scanfcninuse ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_AllowTabInput | ImGuiInputTextFlags_AutoSelectAll);
-                ImGui::NextColumn();
-                ImGui::NextColumn();
-                ImGui::NextColumn();
-                if (!motors[i].scanfcninuse) // start scanning
-                {
-                    if (ImGui::Button((std::string("Start Scan##") + std::to_string(i)).c_str()))
-                    {
-                        scanFcnHdl[i] = CreateThread(NULL, 0, MotorScanFcn, &motors[i], 0, &scanFcnId[i]);
-                        if (scanFcnHdl[i] == NULL) // failure
-                        {
-                            scanText[i] = "Could not start scanning thread.";
-                            motors[i].scanmsg = true;
-                        }
-                    }
-                }
-                else
-                {
-                    if (ImGui::Button((std::string("Stop Scan##") + std::to_string(i)).c_str()))
-                    {
-                        motors[i].scanning = false;
-                    }
-                }
-                ImGui::Text("Scan: %s", scanText[i].c_str());
-                if (motors[i].scanmsg)
-                    ImGui::PushStyleColor(0, IM_COL32(30, 30, 30, 255));
-                else
-                    ImGui::PushStyleColor(0, IM_COL32(0, 166, 44, 255));
-                if (ImGui::Button((std::string("OKAY##ScanAckBtn") + std::to_string(i)).c_str()))
-                {
-                    motors[i].scanmsg = false;
-                    scanText[i] = "";
-                }
-                ImGui::PopStyleColor();
-                if (scanFcnHdl[i] != NULL && motors[i].scanfcninuse == false) // was in use
-                {
-                    TerminateThread(scanFcnHdl[i], NULL);
-                    scanFcnHdl[i] = NULL;
-                }
-                ImGui::Separator();
-                if (motors[i].warn)
-                {
-
-                    ImGui::Text("Status: %s", warnText[i].c_str());
+                if (!multiPointList)
                     ImGui::SameLine();
-                    if (ImGui::Button((std::string("OKAY##") + std::to_string(i)).c_str()))
-                    {
-                        motors[i].warn = false;
-                    }
-                }
-                else
+                bool start = ImGui::Button("Start Multi-axis Scan");
+                ImGui::SameLine();
+                bool resume = ImGui::Button("Resume Multi-axis Scan");
+                if (start || resume)
+                    StartMultiScan(resume);
+            }
+            else if (ImGui::Button("Stop Multi-axis Scan"))
+            {
+                multiTask->Cancel();
+            }
+            ImGui::Text("Multi-axis: %s", multiScanText);
+            // a program of moves, waits and measurements, see sequence.h
+            ImGui::Text("Sequence");
+            ImGui::InputText("Sequence file", seqFile, sizeof(seqFile), seqTask ? ImGuiInputTextFlags_ReadOnly : 0);
+            if (!seqTask)
+            {
+                if (ImGui::Button("Run Sequence"))
+                    StartSequence();
+            }
+            else if (ImGui::Button("Stop Sequence"))
+            {
+                seqTask->Cancel();
+            }
+            ImGui::Text("Sequence: %s", seqText);
+            // every motor home at once, or group by group for axes that must not move together
+            ImGui::Text("Home all");
+            ImGui::InputText("Home groups", homeGroups, sizeof(homeGroups), homeTask ? ImGuiInputTextFlags_ReadOnly : 0);
+            if (!homeTask)
+            {
+                if (ImGui::Button("Home All"))
+                    StartHomeAll();
+            }
+            else if (ImGui::Button("Stop Homing"))
+            {
+                homeTask->Cancel();
+            }
+            ImGui::Text("Home all: %s", homeText);
+            if (homeResults && !homeTask)
+            {
+                for (const homeResult &r : *homeResults)
                 {
-                    ImGui::Text("Status: OKAY");
+                    if (!r.ret)
+                        ImGui::Text("  Motor %ld (group %ld): %.3f -> %.4f mm in %.2f s", r.idx + 1, r.group + 1, r.from, r.pos, r.time);
+                    else
+                        ImGui::Text("  Motor %ld (group %ld): not home (%ld), at %.4f mm", r.idx + 1, r.group + 1, r.ret, r.pos);
                 }
-                ImGui::Separator();
             }
+            long multiDone, multiTotal;
+            double multiLeft;
+            if (multiTask && multiTask->Progress(&multiDone, &multiTotal, &multiLeft))
+            {
+                char eta[32];
+                PanelDuration(eta, sizeof(eta), multiLeft);
+                ImGui::Text("Point %ld of %ld, %s left", multiDone, multiTotal, eta);
+            }
+            ImGui::Separator();
+            if (recorder->IsOpen())
+            {
+                ImGui::Text("Recorded %llu samples", (unsigned long long)recorder->Written());
+                ImGui::SameLine();
+                if (!exportTask && ImGui::Button("Export CSV"))
+                    StartExport();
+                else if (exportTask)
+                    ImGui::Text("Export CSV");
+            }
+            if (recText.size())
+                ImGui::Text("%s", recText.c_str());
+            if (ImGui::InputInt("Poll interval (ms)", &pollInterval, 1, 10, ImGuiInputTextFlags_EnterReturnsTrue))
+            {
+                telemetry->SetPollInterval(pollInterval);
+                pollInterval = telemetry->GetPollInterval();
+            }
+            if (!rescanTask && ImGui::Button("Rescan devices"))
+                StartRescan();
+            else if (rescanTask)
+                ImGui::Text("Rescan devices");
+            ImGui::SameLine();
+            ImGui::Text("%ld slots in use of %ld. %s", numUnits, controller->Telemetry()->Registry()->Capacity(), rescanText);
+            paramCacheStats cs;
+            paramCache->GetStats(&cs);
+            ImGui::Text("Parameter cache: %llu hits (device reads saved), %llu misses, %llu read back, %llu changed",
+                        (unsigned long long)cs.hits, (unsigned long long)cs.misses, (unsigned long long)cs.revalidations, (unsigned long long)cs.changes);
             ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+            if (ImGui::CollapsingHeader("Diagnostics"))
+            {
+                diagPanel->Draw();
+                if (ImGui::Checkbox("Draw only on change when idle", &frameThrottle))
+                    frameSched.SetEnabled(frameThrottle);
+                frameSchedStats fs;
+                frameSched.GetStats(&fs);
+                ImGui::Text("%llu frames, %llu after a wait (%llu on change, %llu on input, %llu idle), %.0f s waited",
+                            (unsigned long long)fs.frames, (unsigned long long)fs.waits, (unsigned long long)fs.changeWakes,
+                            (unsigned long long)fs.inputWakes, (unsigned long long)fs.timeouts, fs.waited);
+            }
             ImGui::End();
         }
 
+        // full rate while anything moves, animates or is being edited
+        frameSched.Frame(initializing || (!failed && (panel->Busy() || multiScanInUse || seqTask || homeTask || rescanTask || exportTask)) || ImGui::IsAnyItemActive());
         // Rendering
         ImGui::EndFrame();
+        frameTimer.Mark(FRAME_BUILD);
         g_pd3dDevice->SetRenderState(D3DRS_ZENABLE, FALSE);
         g_pd3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
         g_pd3dDevice->SetRenderState(D3DRS_SCISSORTESTENABLE, FALSE);
@@ -590,19 +978,57 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
             ImGui_ImplDX9_RenderDrawData(ImGui::GetDrawData());
             g_pd3dDevice->EndScene();
         }
+        frameTimer.Mark(FRAME_RENDER);
         HRESULT result = g_pd3dDevice->Present(NULL, NULL, NULL, NULL);
+        frameTimer.Mark(FRAME_PRESENT);
 
         // Handle loss of D3D9 device
         if (result == D3DERR_DEVICELOST && g_pd3dDevice->TestCooperativeLevel() == D3DERR_DEVICENOTRESET)
             ResetDevice();
     }
-    WaitForSingleObject(InitThreadHdl, 10000);
-    CloseHandle(InitThreadHdl);
-    if (motors != nullptr)
-        delete[] motors;
-    if (warnText != nullptr)
-        delete[] warnText;
-    APTCleanUp();
+    initThread.join();
+    // cancelled scans return at once, then nothing uses the motors any more
+    if (multiTask)
+    {
+        multiTask->Cancel();
+        multiTask->Wait();
+    }
+    if (seqTask)
+    {
+        seqTask->Cancel();
+        seqTask->Wait();
+    }
+    if (homeTask)
+    {
+        homeTask->Cancel();
+        homeTask->Wait();
+    }
+    if (rescanTask)
+        rescanTask->Wait();
+    if (exportTask)
+        exportTask->Wait(); // reads the recorder, deleted below
+    if (panel != nullptr)
+        delete panel; // cancels and waits for the single-axis scans
+    if (scanTasks != nullptr)
+        delete scanTasks;
+    if (controller != nullptr)
+    {
+        controller->Backlash()->Save(BACKLASH_FILE);
+        delete controller;
+    }
+    if (statusBus != nullptr)
+        delete statusBus; // once nothing polls
+    if (recorder != nullptr)
+        delete recorder;
+    paramCache->Save(PARAM_CACHE_FILE);
+    driver->Cleanup();
+    delete paramCache;
+    delete diagPanel;
+    delete instrDriver;
+    delete hwDriver;
+    if (measurement != nullptr)
+        delete measurement;
+    ::CloseHandle(wakeEvent);
     ImGui_ImplDX9_Shutdown();
     ImGui_ImplWin32_Shutdown();
     ImGui::DestroyContext();
@@ -682,6 +1108,9 @@ LRESULT WINAPI WndProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
         if ((wParam & 0xfff0) == SC_KEYMENU) // Disable ALT application menu
             return 0;
         break;
+    case WM_DEVICECHANGE:
+        devicesChanged = true;
+        break;
     case WM_DESTROY:
         ::PostQuitMessage(0);
         return 0;
@@ -0,0 +1,153 @@
+// Calibration of MotionModel on a simulated stage: random moves are predicted before they are made,
+// from the bare profile and from what the model learned so far, and the errors are reported; then a
+// grid scan is predicted and timed.
+//
+// usage: mcpher_motionbench [--moves N] [--warmup N] [--latency US] [--poll MS] [--ringing MM] [--points N]
+
+#include "controller.h"
+#include "motionmodel.h"
+#include "scanengine.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static void Report(const char *label, std::vector<double> err)
+{
+    if (err.empty())
+        return;
+    double mean = 0;
+    for (double e : err)
+        mean += e;
+    mean /= err.size();
+    for (double &e : err)
+        e = fabs(e);
+    std::sort(err.begin(), err.end());
+    size_t n = err.size();
+    printf("%-10s mean %+8.1f ms | abs error median %7.1f ms, 90%% %7.1f ms, 99%% %7.1f ms, max %7.1f ms\n",
+           label, mean * 1e3, err[n / 2] * 1e3, err[n * 9 / 10] * 1e3, err[n * 99 / 100] * 1e3, err[n - 1] * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    long moves = 200, warmup = 20, points = 50;
+    unsigned latencyUs = 2000;
+    int pollMs = 20;
+    float ringing = 0.002f;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--moves"))
+            moves = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--warmup"))
+            warmup = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--ringing"))
+            ringing = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--points"))
+            points = atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_motionbench [--moves N] [--warmup N] [--latency US] [--poll MS] [--ringing MM] [--points N]\n");
+            return 1;
+        }
+    }
+    if (moves < 1 || warmup < 0 || points < 2)
+        return 1;
+    SimDriver sim(1, latencyUs);
+    sim.SetRinging(ringing, 0.05f);
+    MotorController controller(&sim, pollMs);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stage: %s\n", msg.c_str());
+        return 1;
+    }
+    long serNum = controller.SerialNums()[0];
+    MotionModel *model = controller.Motion();
+    ScanEngine engine(&sim, controller.Telemetry(), 0, serNum);
+    engine.SetMotionModel(model);
+    scanParams p = {};
+    p.settleTol = 0.005f;
+    p.settleCount = 3;
+    p.timeout = 60;
+    sim.SetVelParams(serNum, 0, 4.0f, 2.6f); // as fast as a KST101 with a ZST225B goes
+    float minVel, accel, maxVel;
+    sim.GetVelParams(serNum, &minVel, &accel, &maxVel);
+    // mostly short steps, as in a scan, with the odd long traverse
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> where(0, 10);
+    std::uniform_real_distribution<float> step(0.02f, 0.5f);
+    std::uniform_real_distribution<float> coin(0, 1);
+    std::vector<double> bare, learned;
+    float pos = 0;
+    engine.MoveAndSettle(pos, p);
+    auto t0 = benchClock::now();
+    for (long i = 0; i < warmup + moves; i++)
+    {
+        float to = coin(rng) < 0.2f ? where(rng) : pos + (coin(rng) < 0.5f ? -1 : 1) * step(rng);
+        if (to < 0 || to > 10)
+            to = pos - (to - pos);
+        double profile = MoveTime(to - pos, minVel, maxVel, accel);
+        double predicted = model->PredictMove(0, to - pos, minVel, maxVel, accel);
+        auto t = benchClock::now();
+        long ret = engine.MoveAndSettle(to, p);
+        double took = std::chrono::duration<double>(benchClock::now() - t).count();
+        if (ret)
+        {
+            fprintf(stderr, "Move to %.3f failed: %ld\n", to, ret);
+            return 1;
+        }
+        if (i >= warmup)
+        {
+            bare.push_back(profile - took);
+            learned.push_back(predicted - took);
+        }
+        pos = to;
+    }
+    double elapsed = std::chrono::duration<double>(benchClock::now() - t0).count();
+    motionFit fit;
+    model->GetFit(0, &fit);
+    printf("%ld moves after %ld warm-up moves in %.1f s (latency %u us, poll %d ms, ringing %.3f mm)\n",
+           moves, warmup, elapsed, latencyUs, pollMs, ringing);
+    printf("fit: %.3f x profile + %.1f ms, rms %.1f ms\n", fit.scale, fit.overhead * 1e3, fit.rms * 1e3);
+    printf("prediction error (predicted - observed):\n");
+    Report("profile", bare);
+    Report("learned", learned);
+    // a whole grid scan, predicted from where the stage is
+    p.start = pos < 5 ? pos + 0.5f : pos - 0.5f;
+    p.step = 0.1f;
+    p.stop = p.start < pos ? p.start - (points - 1) * p.step : p.start + (points - 1) * p.step;
+    p.dwell = 0.05f;
+    std::string err;
+    if (ScanEngine::Sanitize(&p, &err))
+    {
+        fprintf(stderr, "%s\n", err.c_str());
+        return 1;
+    }
+    double predicted = ScanEngine::Predict(model, 0, p, pos, minVel, maxVel, accel);
+    double profile = ScanEngine::Predict(nullptr, 0, p, pos, minVel, maxVel, accel);
+    auto ts = benchClock::now();
+    long ret = engine.Run(p);
+    double took = std::chrono::duration<double>(benchClock::now() - ts).count();
+    if (ret)
+    {
+        fprintf(stderr, "Scan failed: %ld\n", ret);
+        return 1;
+    }
+    printf("%ld point scan: took %.2f s, predicted %.2f s (%+.1f%%), bare profile %.2f s (%+.1f%%)\n",
+           ScanEngine::NumPoints(p), took, predicted, (predicted - took) / took * 100, profile, (profile - took) / took * 100);
+    controller.Shutdown();
+    return 0;
+}
@@ -0,0 +1,530 @@
+#include "motorpanel.h"
+#include "imgui/imgui.h"
+
+#include <cstdio>
+#include <cstring>
+
+MotorPanel::MotorPanel(MotorController *controller, ParamCache *cache, Measurement *measurement, ScanTaskManager *tasks) : controller(controller), cache(cache), measurement(measurement), tasks(tasks)
+{
+    tel = controller->Telemetry();
+    reg = tel->Registry();
+    cmd = controller->Commands();
+    model = controller->Motion();
+    numUnits = 0;
+    capacity = reg->Capacity();
+    busy = false;
+    motors = new motorProps[capacity];
+    pos = new float[capacity]();
+    moving = new uint8_t[capacity]();
+    moveCmd = new cmdFuture[capacity];
+    velCmd = new cmdFuture[capacity];
+    scanTask = new std::shared_ptr<ScanTask>[capacity];
+    plotMotor = 1;
+    plotSpan = 0;
+    plotBuf = new histBucket[HIST_PLOT_POINTS];
+    memset(motors, 0x0, sizeof(motorProps) * capacity);
+    Grow();
+}
+
+// rows for the slots added since, e.g. by a rescan
+void MotorPanel::Grow()
+{
+    long n = controller->NumUnits();
+    for (; numUnits < n; numUnits++)
+    {
+        motorProps *m = &motors[numUnits];
+        m->index = numUnits;
+        m->serNum = controller->SerialNums()[numUnits];
+        // scan settings start at these once, a device that reconnects keeps what the user set
+        m->settleTol = 0.005;
+        m->settleCount = 3;
+        m->adaptTol = 0.05;
+        m->overshoot = 0.05;
+        m->precTol = 0.002;
+    }
+}
+
+MotorPanel::~MotorPanel()
+{
+    // cancel them all before waiting for any
+    for (long i = 0; i < numUnits; i++)
+    {
+        if (scanTask[i])
+            scanTask[i]->Cancel();
+    }
+    for (long i = 0; i < numUnits; i++)
+    {
+        if (scanTask[i])
+            scanTask[i]->Wait();
+    }
+    delete[] plotBuf;
+    delete[] scanTask;
+    delete[] velCmd;
+    delete[] moveCmd;
+    delete[] moving;
+    delete[] pos;
+    delete[] motors;
+}
+
+void MotorPanel::SetScanFcn(motorScanFcn fcn)
+{
+    scanFcn = fcn;
+}
+
+long MotorPanel::NumUnits() const
+{
+    return numUnits;
+}
+
+motorProps *MotorPanel::Motors()
+{
+    return motors;
+}
+
+// copies in the parameters of a motor once its device is ready, again after it reconnects
+bool MotorPanel::Ready(long i)
+{
+    deviceInfo info;
+    controller->GetDevice(i, &info);
+    if (info.state != DEV_READY || !reg->Present(i))
+        return false;
+    motorProps *m = &motors[i];
+    if (info.ret)
+    {
+        m->warn = true;
+        snprintf(m->warnText, sizeof(m->warnText), "Failed to get device info (%s): %ld", info.call, info.ret);
+    }
+    m->homeVel = info.homeVel;
+    m->ofst = info.ofst;
+    m->destPos = info.pos;
+    m->limMaxAccel = info.limMaxAccel;
+    m->limMaxVel = info.limMaxVel;
+    m->minVel = m->set_minVel = info.minVel;
+    m->Accel = m->set_Accel = info.Accel;
+    m->maxVel = m->set_maxVel = info.maxVel;
+    m->paramVersion = cache->Version(m->serNum);
+    m->ready = true;
+    return true;
+}
+
+// picks up parameters the cache found changed, by a background read-back or from elsewhere
+void MotorPanel::Refresh(motorProps *m)
+{
+    uint64_t version = cache->Version(m->serNum);
+    paramEntry p;
+    if (version == m->paramVersion || !cache->GetEntry(m->serNum, &p))
+        return;
+    m->paramVersion = version;
+    if (p.valid & PCACHE_VEL)
+    {
+        m->minVel = p.minVel;
+        m->Accel = p.Accel;
+        m->maxVel = p.maxVel;
+    }
+    if (p.valid & PCACHE_LIMITS)
+    {
+        m->limMaxAccel = p.limMaxAccel;
+        m->limMaxVel = p.limMaxVel;
+    }
+    if (p.valid & PCACHE_HOME)
+    {
+        m->homeVel = p.homeVel;
+        m->ofst = p.ofst;
+    }
+}
+
+void MotorPanel::Update()
+{
+    busy = false;
+    Grow();
+    // published by the pollers, no driver round trip here; one pass over two packed arrays
+    reg->Snapshot(pos, moving, numUnits);
+    for (long i = 0; i < numUnits; i++)
+    {
+        motorProps *m = &motors[i];
+        if (m->ready && !reg->Present(i))
+            m->ready = false; // unplugged, its row comes back once it is ready again
+        if (!m->ready && !Ready(i))
+            continue; // still initializing, failed or unplugged
+        Refresh(m);
+        if (CmdReady(velCmd[i]))
+        {
+            cmdResult res = velCmd[i].get();
+            if (res.ret == 0) // readback is part of the command; the cache reads the device back later
+            {
+                m->minVel = res.minVel;
+                m->Accel = res.Accel;
+                m->maxVel = res.maxVel;
+            }
+            else if (res.ret != CMD_ERR_SUPERSEDED)
+            {
+                m->warn = true;
+                snprintf(m->warnText, sizeof(m->warnText), "Could not set velocity parameters: %ld", res.ret);
+            }
+            velCmd[i] = cmdFuture();
+        }
+        if (CmdReady(moveCmd[i]))
+        {
+            cmdResult res = moveCmd[i].get();
+            if (res.ret && res.ret != CMD_ERR_SUPERSEDED)
+            {
+                m->warn = true;
+                snprintf(m->warnText, sizeof(m->warnText), "Could not execute motion command: %ld", res.ret);
+            }
+            moveCmd[i] = cmdFuture();
+        }
+        if (scanTask[i])
+        {
+            // state first: once done is seen, every message posted before is in the queue
+            bool done = scanTask[i]->State() == TASK_DONE;
+            taskMessage msg;
+            while (scanTask[i]->Pop(&msg))
+                snprintf(m->scanText, sizeof(m->scanText), "%s", msg.text);
+            m->lastValue = scanTask[i]->Value();
+            if (done)
+            {
+                m->scanmsg = true;
+                scanTask[i].reset();
+            }
+        }
+        m->scanBusy = scanTask[i] || m->inMultiScan;
+        busy |= moving[i] || m->scanBusy || velCmd[i].valid() || moveCmd[i].valid();
+    }
+}
+
+bool MotorPanel::Busy() const
+{
+    return busy;
+}
+
+float MotorPanel::Position(long i) const
+{
+    return i >= 0 && i < numUnits ? pos[i] : 0;
+}
+
+bool MotorPanel::Moving(long i) const
+{
+    return i >= 0 && i < numUnits && moving[i];
+}
+
+void PanelDuration(char *buf, size_t len, double seconds)
+{
+    if (!(seconds >= 0))
+        snprintf(buf, len, "unknown");
+    else if (seconds < 60)
+        snprintf(buf, len, "%.1f s", seconds);
+    else if (seconds < 3600)
+        snprintf(buf, len, "%d:%02d", (int)seconds / 60, (int)seconds % 60);
+    else
+        snprintf(buf, len, "%d:%02d:%02d", (int)seconds / 3600, (int)seconds / 60 % 60, (int)seconds % 60);
+}
+
+static scanParams RowParams(const motorProps *m)
+{
+    scanParams p = {};
+    p.start = m->start;
+    p.stop = m->stop;
+    p.step = m->step;
+    p.dwell = m->scanDelay;
+    p.settleTol = m->settleTol;
+    p.settleCount = m->settleCount;
+    p.timeout = 60;
+    p.minStep = m->minStep;
+    p.adaptTol = m->adaptTol;
+    return p;
+}
+
+// sanitized on the UI thread, so the row shows the values the scan uses
+void MotorPanel::StartScan(long i, bool resume)
+{
+    motorProps *m = &motors[i];
+    scanParams p = RowParams(m);
+    std::string msg;
+    if (ScanEngine::Sanitize(&p, &msg))
+    {
+        snprintf(m->scanText, sizeof(m->scanText), "%s", msg.c_str());
+        m->scanmsg = true;
+        return;
+    }
+    m->step = p.step;
+    m->scanDelay = p.dwell;
+    m->settleTol = p.settleTol;
+    m->settleCount = p.settleCount;
+    m->minStep = p.minStep;
+    m->resume = resume;
+    motorScanFcn fcn = scanFcn;
+    motorProps props = *m;
+    scanTask[i] = tasks->Submit([fcn, props, p](ScanTask *task)
+                                { return fcn(task, props, p); });
+    if (!scanTask[i])
+        return; // shutting down
+    m->scanBusy = true;
+    m->scanmsg = false;
+    snprintf(m->scanText, sizeof(m->scanText), "Waiting for a scan thread...");
+}
+
+void MotorPanel::Draw(bool multiScanInUse)
+{
+    // every motor gets the same height, so the rows out of view are skipped without being laid out
+    float height = MOTOR_PANEL_ROWS * ImGui::GetFrameHeightWithSpacing();
+    ImGuiListClipper clipper;
+    clipper.Begin((int)numUnits, height + ImGui::GetStyle().ItemSpacing.y);
+    while (clipper.Step())
+    {
+        for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++)
+        {
+            ImGui::PushID(i); // labels below are unique within a motor
+            ImGui::BeginChild("Motor", ImVec2(0, height), true);
+            DrawMotor(i, multiScanInUse);
+            ImGui::EndChild();
+            ImGui::PopID();
+        }
+    }
+    clipper.End();
+}
+
+void MotorPanel::DrawMotor(long i, bool multiScanInUse)
+{
+    motorProps *m = &motors[i];
+    if (!m->ready)
+    {
+        deviceInfo info;
+        controller->GetDevice(i, &info);
+        if (info.state == DEV_FAILED)
+            ImGui::Text("Motor: %ld | Serial: %ld | Failed to init device: %ld", i + 1, m->serNum, info.ret);
+        else if (info.state == DEV_REMOVED || (info.state == DEV_READY && !reg->Present(i)))
+            ImGui::Text("Motor: %ld | Serial: %ld | Unplugged", i + 1, m->serNum);
+        else
+            ImGui::Text("Motor: %ld | Serial: %ld | %s", i + 1, m->serNum, info.state == DEV_PENDING ? "Waiting..." : "Initializing...");
+        return;
+    }
+    motorState state;
+    tel->GetState(i, &state);
+    if (state.ret)
+    {
+        ImGui::Text("Motor: %ld | Serial: %ld | Failed to get moving status: %ld", i + 1, m->serNum, state.ret);
+        return;
+    }
+    ImGuiInputTextFlags velFlags = moving[i] ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue;
+    ImGuiInputTextFlags scanFlags = m->scanBusy ? ImGuiInputTextFlags_ReadOnly : ImGuiInputTextFlags_EnterReturnsTrue | ImGuiInputTextFlags_AllowTabInput | ImGuiInputTextFlags_AutoSelectAll;
+    ImGui::Text("Motor: %ld | Serial: %ld", i + 1, m->serNum);
+    // Velocities
+    ImGui::Text("Velocity parameters");
+    ImGui::Text("Min: %f | Max: %f | Accel: %f", m->minVel, m->maxVel, m->Accel);
+    ImGui::Text("Set Velocity Parameters");
+    ImGui::Columns(3);
+    bool updateVel = ImGui::InputFloat("Min##Vel", &m->set_minVel, 0, 0, "%.3f", velFlags);
+    ImGui::NextColumn();
+    updateVel |= ImGui::InputFloat("Max##Vel", &m->set_maxVel, 0, 0, "%.3f", velFlags);
+    ImGui::NextColumn();
+    updateVel |= ImGui::InputFloat("Accel##Vel", &m->set_Accel, 0, 0, "%.3f", velFlags);
+    ImGui::Columns(1);
+    if (updateVel)
+        velCmd[i] = cmd->SetVel(i, m->set_minVel, m->set_Accel, m->set_maxVel);
+    motionFit fit;
+    if (model->GetFit(i, &fit) && fit.moves)
+        ImGui::Text("Move time: %.2f x profile + %.3f s (%llu moves, rms %.3f s)", fit.scale, fit.overhead, (unsigned long long)fit.moves, fit.rms);
+    ImGui::Text("Current position: %f", pos[i]);
+    double now = ImGui::GetTime();
+    if (moving[i] && m->moveEnd > now)
+    {
+        ImGui::SameLine();
+        ImGui::Text("| arriving in %.1f s", m->moveEnd - now);
+    }
+    if (ImGui::InputFloat("Destination", &m->destPos, 0, 0, "%.3f", velFlags))
+    {
+        moveCmd[i] = cmd->Move(i, m->destPos);
+        m->moveEnd = now + model->PredictMove(i, m->destPos - pos[i], m->minVel, m->maxVel, m->Accel);
+    }
+    if (ImGui::Button("Go Home") && !moving[i])
+        moveCmd[i] = cmd->Home(i);
+    ImGui::SameLine();
+    if (ImGui::Button("Stop"))
+        moveCmd[i] = cmd->Halt(i);
+    if (velCmd[i].valid() || (moveCmd[i].valid() && !CmdReady(moveCmd[i])))
+    {
+        ImGui::SameLine();
+        ImGui::Text("Sending (%d queued)...", (int)cmd->Pending(i));
+    }
+    ImGui::Separator();
+    // scan window
+    ImGui::Text("Scan");
+    ImGui::Columns(4);
+    ImGui::InputFloat("Start", &m->start, 0, 0, "%.3f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::InputFloat("Stop##Scan", &m->stop, 0, 0, "%.3f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::InputFloat("Step", &m->step, 0, 0, "%.3f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::InputFloat("Dwell", &m->scanDelay, 0, 0, "%.3f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::InputFloat("Tol", &m->settleTol, 0, 0, "%.4f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::InputInt("Settle", &m->settleCount, 0, 0, scanFlags);
+    ImGui::NextColumn();
+    if (measurement != nullptr) // adaptive steps need a signal to adapt to
+    {
+        ImGui::Checkbox("Adaptive", &m->adaptive);
+        ImGui::NextColumn();
+        ImGui::InputFloat("Min step", &m->minStep, 0, 0, "%.4f", scanFlags);
+        ImGui::NextColumn();
+        ImGui::InputFloat("Sig tol", &m->adaptTol, 0, 0, "%.4f", scanFlags);
+        ImGui::NextColumn();
+    }
+    ImGui::Checkbox("Precision", &m->precise);
+    ImGui::NextColumn();
+    ImGui::InputFloat("Overshoot", &m->overshoot, 0, 0, "%.4f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::InputFloat("Pos tol", &m->precTol, 0, 0, "%.4f", scanFlags);
+    ImGui::NextColumn();
+    ImGui::Columns(1);
+    if (!m->scanBusy) // start scanning
+    {
+        bool start = ImGui::Button("Start Scan");
+        ImGui::SameLine();
+        bool resume = !m->adaptive && ImGui::Button("Resume Scan");
+        if ((start || resume) && scanFcn)
+            StartScan(i, resume);
+    }
+    else if (scanTask[i])
+    {
+        if (ImGui::Button("Stop Scan"))
+            scanTask[i]->Cancel(); // wakes the scan wherever it waits
+    }
+    else
+        ImGui::Text("Part of the multi-axis scan");
+    ImGui::Text("Scan: %s", m->scanText);
+    char eta[32];
+    long done, total;
+    double left;
+    if (scanTask[i] && scanTask[i]->Progress(&done, &total, &left))
+    {
+        PanelDuration(eta, sizeof(eta), left);
+        if (total)
+            ImGui::Text("Point %ld of %ld, %s left", done, total, eta);
+        else
+            ImGui::Text("%ld points", done);
+    }
+    else if (!m->scanBusy && !m->adaptive) // the steps of an adaptive scan depend on the signal
+    {
+        scanParams p = RowParams(m);
+        if (!ScanEngine::Sanitize(&p, nullptr))
+        {
+            PanelDuration(eta, sizeof(eta), ScanEngine::Predict(model, i, p, pos[i], m->minVel, m->maxVel, m->Accel));
+            ImGui::Text("%ld points, about %s", ScanEngine::NumPoints(p), eta);
+        }
+    }
+    if (measurement != nullptr)
+        ImGui::Text("Last measurement: %g", m->lastValue);
+    if (m->scanmsg)
+        ImGui::PushStyleColor(0, IM_COL32(30, 30, 30, 255));
+    else
+        ImGui::PushStyleColor(0, IM_COL32(0, 166, 44, 255));
+    if (ImGui::Button("OKAY##ScanAck"))
+    {
+        m->scanmsg = false;
+        m->scanText[0] = '\0';
+    }
+    ImGui::PopStyleColor();
+    if (!multiScanInUse)
+        ImGui::Checkbox("Include in multi-axis scan", &m->multiScan);
+    ImGui::Separator();
+    if (m->warn)
+    {
+        ImGui::Text("Status: %s", m->warnText);
+        ImGui::SameLine();
+        if (ImGui::Button("OKAY"))
+            m->warn = false;
+    }
+    else
+    {
+        ImGui::Text("Status: OKAY");
+    }
+}
+
+static const char *histSpanNames[] = {"10 s", "1 min", "10 min", "1 h", "All"};
+static const double histSpans[] = {10, 60, 600, 3600, 0}; // s, 0 for everything held
+
+void MotorPanel::DrawHistory()
+{
+    ImGui::InputInt("Motor##Plot", &plotMotor);
+    if (plotMotor < 1)
+        plotMotor = 1;
+    if (plotMotor > numUnits)
+        plotMotor = (int)numUnits;
+    ImGui::Combo("Span##Plot", &plotSpan, histSpanNames, IM_ARRAYSIZE(histSpanNames));
+    const MotionHistory *hist = tel->History(plotMotor - 1);
+    double t0, t1;
+    if (hist == nullptr)
+    {
+        ImGui::Text("Motion history is not recorded.");
+        return;
+    }
+    if (!hist->Range(&t0, &t1))
+    {
+        ImGui::Text("No samples yet.");
+        return;
+    }
+    if (histSpans[plotSpan] > 0 && t1 - histSpans[plotSpan] > t0)
+        t0 = t1 - histSpans[plotSpan];
+    // one bucket per pixel column at most, so the cost stays the same however much is held
+    long maxPoints = (long)ImGui::GetContentRegionAvail().x;
+    if (maxPoints > HIST_PLOT_POINTS)
+        maxPoints = HIST_PLOT_POINTS;
+    long n = hist->Query(t0, t1, plotBuf, maxPoints);
+    PlotEnvelope("Position (target dashed)", HIST_POS, HIST_TARGET, t0, t1, n);
+    PlotEnvelope("Velocity", HIST_VEL, -1, t0, t1, n);
+}
+
+// min/max envelope of channel, and of overlay (-1 for none) on the same scale
+void MotorPanel::PlotEnvelope(const char *label, int channel, int overlay, double t0, double t1, long n)
+{
+    int chans[2] = {channel, overlay};
+    int numChans = overlay < 0 ? 1 : 2;
+    float lo = n ? plotBuf[0].min[channel] : 0, hi = n ? plotBuf[0].max[channel] : 0;
+    for (long i = 0; i < n; i++)
+    {
+        for (int k = 0; k < numChans; k++)
+        {
+            int c = chans[k];
+            if (plotBuf[i].min[c] < lo)
+                lo = plotBuf[i].min[c];
+            if (plotBuf[i].max[c] > hi)
+                hi = plotBuf[i].max[c];
+        }
+    }
+    if (hi - lo < 1e-6f)
+    {
+        lo -= 0.5f;
+        hi += 0.5f;
+    }
+    ImGui::Text("%s: %.4f to %.4f over %.1f s", label, lo, hi, t1 - t0);
+    ImVec2 p0 = ImGui::GetCursorScreenPos();
+    ImVec2 size(ImGui::GetContentRegionAvail().x, HIST_PLOT_HEIGHT);
+    ImGui::Dummy(size);
+    ImDrawList *dl = ImGui::GetWindowDrawList();
+    dl->AddRect(p0, ImVec2(p0.x + size.x, p0.y + size.y), IM_COL32(128, 128, 128, 255));
+    if (n == 0 || t1 <= t0)
+        return;
+    float xs = (float)(size.x / (t1 - t0));
+    float ys = size.y / (hi - lo);
+    for (int k = 0; k < numChans; k++)
+    {
+        int c = chans[k];
+        ImU32 col = k == 0 ? IM_COL32(0, 200, 255, 255) : IM_COL32(255, 160, 0, 255);
+        ImVec2 prev;
+        for (long i = 0; i < n; i++)
+        {
+            const histBucket &b = plotBuf[i];
+            float x = p0.x + (float)((0.5 * (b.t0 + b.t1) - t0) * xs);
+            float yMin = p0.y + size.y - (b.min[c] - lo) * ys;
+            float yMax = p0.y + size.y - (b.max[c] - lo) * ys;
+            ImVec2 mid(x, 0.5f * (yMin + yMax));
+            if (yMin - yMax >= 1) // the bucket spans more than a pixel, draw its extent
+                dl->AddLine(ImVec2(x, yMin), ImVec2(x, yMax), col);
+            if (i > 0 && (k == 0 || i % 2)) // the overlay is dashed
+                dl->AddLine(prev, mid, col);
+            prev = mid;
+        }
+    }
+}
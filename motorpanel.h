@@ -0,0 +1,125 @@
+// Per-motor rows of the control panel, apart from the Win32/D3D9 window so the frame can be
+// built against any ImGui backend. Nothing here allocates once every row has been drawn once.
+#ifndef _MOTORPANEL_H
+#define _MOTORPANEL_H
+
+#include "cmdqueue.h"
+#include "controller.h"
+#include "measurement.h"
+#include "paramcache.h"
+#include "scanengine.h"
+#include "scantask.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#define PANEL_TEXT_LEN 256 // longest message shown, longer ones are cut
+#define MOTOR_PANEL_ROWS 21 // frame rows reserved for one motor
+#define HIST_PLOT_POINTS 512 // most buckets drawn per plot, at most one per pixel column
+#define HIST_PLOT_HEIGHT 120 // pixels
+
+typedef struct
+{
+    int index;
+    long serNum;
+    float minVel;
+    float set_minVel;
+    float maxVel;
+    float set_maxVel;
+    float Accel;
+    float set_Accel;
+    float limMaxAccel;
+    float limMaxVel;
+    float destPos;
+    double moveEnd; // predicted arrival of the last move commanded, ImGui::GetTime() s
+    float homeVel;
+    float ofst;
+    bool warn;
+    char warnText[PANEL_TEXT_LEN];
+    float start; // scan start
+    float stop; // scan stop
+    float step; // scan step
+    float scanDelay; // minimum dwell at each point, in seconds
+    float settleTol; // settled when within this distance of the scan point...
+    int settleCount; // ...for this many consecutive position samples
+    bool scanBusy; // a scan, single or multi-axis, drives the motor
+    bool inMultiScan; // part of the running multi-axis scan, sequence or home all, set by its owner
+    bool scanmsg; // the message of a finished scan is not acknowledged yet
+    char scanText[PANEL_TEXT_LEN]; // latest scan status
+    bool multiScan; // include in the multi-axis scan
+    bool adaptive; // adaptive step scan, step is the largest step
+    float minStep; // adaptive scan: smallest step
+    float adaptTol; // adaptive scan: targeted signal change between points
+    bool precise; // precision mode: every point approached from below, read back and corrected
+    float overshoot; // precision mode: points are approached from this far below
+    float precTol; // precision mode: corrective moves until within this of the point, 0 for none
+    double lastValue; // last measurement
+    bool ready; // device initialized and its parameters copied in
+    bool resume; // continue the scan recorded in its data file instead of starting over
+    uint64_t paramVersion; // cache version of the parameters shown
+} motorProps; // configuration and UI state, owned by the UI thread, scans get a copy; the
+               // position and motion are read from the telemetry registry instead
+
+// runs a single-axis scan on a pool thread, with the motor as it was when the scan was started
+typedef std::function<long(ScanTask *task, motorProps props, scanParams params)> motorScanFcn;
+
+// "12.3 s", "4:05" or "1:02:03"; "unknown" for NaN
+void PanelDuration(char *buf, size_t len, double seconds);
+
+class MotorPanel
+{
+public:
+    // the controller must be initialized; measurement may be nullptr; scans are submitted to tasks
+    MotorPanel(MotorController *controller, ParamCache *cache, Measurement *measurement, ScanTaskManager *tasks);
+    // cancels the single-axis scans and waits for them
+    ~MotorPanel();
+    // set before the first frame
+    void SetScanFcn(motorScanFcn fcn);
+    // once per frame, for every motor: telemetry, parameter changes, command results and scan messages
+    void Update();
+    // as of the last Update(): a motor moves, scans or has a command in flight
+    bool Busy() const;
+    // as of the last Update()
+    float Position(long i) const;
+    bool Moving(long i) const;
+    // rows of the motors in view, inside the current window
+    void Draw(bool multiScanInUse);
+    // position/target and velocity plots of one motor, from the telemetry history
+    void DrawHistory();
+    // grows as devices are plugged in, see MotorController::Rescan()
+    long NumUnits() const;
+    motorProps *Motors();
+
+private:
+    void Grow();
+    bool Ready(long i);
+    void Refresh(motorProps *m);
+    void DrawMotor(long i, bool multiScanInUse);
+    void StartScan(long i, bool resume);
+    void PlotEnvelope(const char *label, int channel, int overlay, double t0, double t1, long n);
+
+    MotorController *controller;
+    ParamCache *cache;
+    Measurement *measurement;
+    ScanTaskManager *tasks;
+    MotorTelemetry *tel;
+    const MotorRegistry *reg;
+    CommandQueue *cmd;
+    MotionModel *model;
+    long numUnits;
+    long capacity;
+    motorProps *motors; // capacity of each of these, so rows of devices plugged in later need no allocation
+    float *pos;         // copied from the registry in one pass per Update()
+    uint8_t *moving;
+    cmdFuture *moveCmd; // last move/home/stop per motor
+    cmdFuture *velCmd;  // last velocity update per motor
+    std::shared_ptr<ScanTask> *scanTask; // single-axis scan per motor, until its end is shown
+    motorScanFcn scanFcn;
+    bool busy;
+    int plotMotor; // 1-based, as in the rows
+    int plotSpan;  // index into the spans offered
+    histBucket *plotBuf;
+};
+
+#endif // _MOTORPANEL_H
@@ -0,0 +1,181 @@
+// Visiting order of point lists: ScanPlanOptimize() on synthetic sets of 1k to 100k points of two
+// axes, uniformly spread, in clusters and a shuffled grid, plus one set in ordering groups. Prints
+// the projected travel time in input order and optimised, and the time the optimisation took.
+// Exits 1 if a check fails.
+//
+// usage: mcpher_orderbench [--max-points N] [--seed N]
+
+#include "kinematics.h"
+#include "scanorder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+enum pointSet
+{
+    SET_UNIFORM,
+    SET_CLUSTERS,
+    SET_GRID,
+};
+
+static const char *setNames[] = {"uniform", "clusters", "shuffled grid"};
+
+// n points within 20 mm on both axes, in random order
+static void MakeSet(pointSet set, long n, std::mt19937 *rng, ScanPlan *plan)
+{
+    std::uniform_real_distribution<float> u(0, 20);
+    std::normal_distribution<float> g(0, 0.3f);
+    std::vector<float> centres;
+    for (long c = 0; c < 2 * 16; c++)
+        centres.push_back(u(*rng));
+    long side = 1;
+    while (side * side < n)
+        side++;
+    plan->Clear(2);
+    for (long i = 0; i < n; i++)
+    {
+        float pt[2];
+        if (set == SET_UNIFORM)
+        {
+            pt[0] = u(*rng);
+            pt[1] = u(*rng);
+        }
+        else if (set == SET_CLUSTERS)
+        {
+            long c = (*rng)() % 16;
+            pt[0] = std::min(20.0f, std::max(0.0f, centres[2 * c] + g(*rng)));
+            pt[1] = std::min(20.0f, std::max(0.0f, centres[2 * c + 1] + g(*rng)));
+        }
+        else
+        {
+            pt[0] = 20.0f * (i % side) / side;
+            pt[1] = 20.0f * (i / side) / side;
+        }
+        plan->Add(pt);
+    }
+    if (set == SET_GRID)
+    {
+        for (long i = n - 1; i > 0; i--)
+        {
+            long j = (*rng)() % (i + 1);
+            std::swap_ranges(plan->Point(i), plan->Point(i) + 2, plan->Point(j));
+        }
+    }
+}
+
+// the same points, each as often, in whatever order
+static bool SamePoints(const ScanPlan &a, const ScanPlan &b)
+{
+    if (a.NumPoints() != b.NumPoints())
+        return false;
+    std::vector<std::pair<float, float>> pa, pb;
+    for (long i = 0; i < a.NumPoints(); i++)
+    {
+        pa.push_back(std::make_pair(a.Point(i)[0], a.Point(i)[1]));
+        pb.push_back(std::make_pair(b.Point(i)[0], b.Point(i)[1]));
+    }
+    std::sort(pa.begin(), pa.end());
+    std::sort(pb.begin(), pb.end());
+    return pa == pb;
+}
+
+int main(int argc, char **argv)
+{
+    long maxPoints = 100000;
+    unsigned seed = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--max-points"))
+            maxPoints = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--seed"))
+            seed = (unsigned)atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_orderbench [--max-points N] [--seed N]\n");
+            return 1;
+        }
+    }
+    if (maxPoints < 1000)
+        return 1;
+
+    // the simulated stages' velocity parameters
+    scanAxis axes[2] = {};
+    for (long j = 0; j < 2; j++)
+    {
+        axes[j].idx = j;
+        axes[j].maxVel = 1;
+        axes[j].Accel = 1;
+    }
+    std::mt19937 rng(seed);
+    printf("set             points   input s  optimised s   ratio  2-opt moves   plan s\n");
+    bool shorter = true, same = true, good = true, near = true;
+    double perPoint1k = 0, perPointMax = 0;
+    for (long n = 1000; n <= maxPoints; n *= 10)
+    {
+        for (int s = SET_UNIFORM; s <= SET_GRID; s++)
+        {
+            ScanPlan plan, in;
+            MakeSet((pointSet)s, n, &rng, &plan);
+            in = plan;
+            scanOrderStats st;
+            long ret = ScanPlanOptimize(axes, &plan, nullptr, nullptr, &st);
+            printf("%-14s %7ld %9.0f %12.0f %7.3f %12ld %8.3f\n", setNames[s], n, st.before, st.after, st.after / st.before, st.twoOptMoves,
+                   st.planTime);
+            shorter &= !ret && st.after < st.before && st.after == ScanPlanCost(axes, plan, 0);
+            same &= SamePoints(in, plan);
+            // a random order crosses the set every move, a good tour a fraction of it
+            good &= st.after < 0.2 * st.before;
+            // no tour of a grid is shorter than a step per point
+            if (s == SET_GRID)
+            {
+                long side = 1;
+                while (side * side < n)
+                    side++;
+                near &= st.after < 1.3 * (n - 1) * MoveTime(20.0 / side, 0, 1, 1);
+            }
+            if (s == SET_UNIFORM && n == 1000)
+                perPoint1k = st.planTime / n;
+            if (s == SET_UNIFORM)
+                perPointMax = st.planTime / n;
+        }
+    }
+
+    // groups: every point of one visited before any of the next, starting from the stages' position
+    ScanPlan plan, in;
+    MakeSet(SET_UNIFORM, 1000, &rng, &plan);
+    in = plan;
+    std::vector<long> groups(plan.NumPoints());
+    for (long i = 0; i < plan.NumPoints(); i++)
+        groups[i] = plan.Point(i)[0] < 10 ? 2 : 1;
+    const float from[2] = {20, 20};
+    scanOrderStats st;
+    long ret = ScanPlanOptimize(axes, &plan, &groups, from, &st);
+    bool inOrder = !ret;
+    for (long i = 0; i < plan.NumPoints(); i++)
+        inOrder &= (plan.Point(i)[0] < 10) == (i >= plan.NumPoints() - std::count(groups.begin(), groups.end(), 2));
+    printf("%-14s %7ld %9.0f %12.0f %7.3f %12ld %8.3f\n", "two groups", plan.NumPoints(), st.before, st.after, st.after / st.before,
+           st.twoOptMoves, st.planTime);
+
+    Check(shorter, "every optimised tour is shorter than the input order");
+    Check(same, "and visits the same points");
+    Check(good, "at most a fifth of the travel of a random order");
+    Check(near, "within 30% of the shortest tour of a grid");
+    Check(perPointMax < 20 * perPoint1k + 1e-5, "planning time per point grows slowly with the points");
+    Check(inOrder && st.after < st.before && SamePoints(in, plan), "groups are visited in order, and shorter");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
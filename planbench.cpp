@@ -0,0 +1,187 @@
+// Grid scans of two simulated stages on a virtual clock, run by PlanRunner in raster and in serpentine
+// order: prints the time each order takes against the travel ScanPlanCost() predicts for it, and the
+// speed-up of the serpentine path. Also checks that grids with a negative, infinite or NaN axis are
+// refused. Exits 1 if a check fails.
+//
+// usage: mcpher_planbench [--side N] [--step MM] [--dwell S] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "scanplan.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+typedef struct
+{
+    long side; // points per axis
+    float step;
+    float dwell;
+    unsigned latencyUs;
+    int pollMs;
+} planConfig;
+
+typedef struct
+{
+    long ret;
+    long points;
+    float maxErr;   // mm, farthest any axis was from its point when it was measured
+    double seconds; // virtual, for the whole plan
+    double cost;    // travel ScanPlanCost() predicts, s
+} planRun;
+
+// the grid in order on two fresh stages, both starting at the first point
+static bool Run(const planConfig &cfg, scanOrder order, planRun *r)
+{
+    VirtualClock clock;
+    SimDriver sim(2, cfg.latencyUs);
+    sim.SetClock(&clock);
+    MotorController controller(&sim, cfg.pollMs);
+    controller.SetClock(&clock);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return false;
+    }
+    scanAxis axes[2];
+    for (long j = 0; j < 2; j++)
+    {
+        axes[j] = {};
+        axes[j].idx = j;
+        axes[j].serNum = controller.SerialNums()[j];
+        axes[j].start = 1;
+        axes[j].stop = 1 + cfg.step * (cfg.side - 1);
+        axes[j].step = cfg.step;
+        if (sim.GetVelParams(axes[j].serNum, &axes[j].minVel, &axes[j].Accel, &axes[j].maxVel))
+            return false;
+    }
+    ScanPlan plan;
+    if (ScanPlanGrid(axes, 2, order, &plan))
+        return false;
+    scanParams p = {};
+    p.dwell = cfg.dwell;
+    p.settleTol = 0.001f;
+    p.settleCount = 2;
+    p.timeout = 30;
+    r->ret = 0;
+    r->points = 0;
+    r->maxErr = 0;
+    PlanRunner runner(&sim, controller.Telemetry());
+    runner.SetPointHook([r, &plan](long i, const float *actual, double)
+                        {
+                            for (long j = 0; j < 2; j++)
+                                r->maxErr = std::max(r->maxErr, (float)fabs(actual[j] - plan.Point(i)[j]));
+                            r->points++;
+                        });
+    // the first point on its own, so both orders time the same grid from the same place
+    ScanPlan first(2);
+    first.Add(plan.Point(0));
+    r->ret = runner.Run(axes, 2, first, p);
+    double t0 = clock.Now();
+    if (!r->ret)
+    {
+        r->points = 0;
+        r->ret = runner.Run(axes, 2, plan, p);
+    }
+    r->seconds = clock.Now() - t0;
+    r->cost = ScanPlanCost(axes, plan, 0);
+    controller.Shutdown();
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    planConfig cfg;
+    cfg.side = 11;
+    cfg.step = 0.5f;
+    cfg.dwell = 0.05f;
+    cfg.latencyUs = 2000;
+    cfg.pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--side"))
+            cfg.side = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--step"))
+            cfg.step = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--dwell"))
+            cfg.dwell = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            cfg.latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            cfg.pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_planbench [--side N] [--step MM] [--dwell S] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (cfg.side < 2 || !(cfg.step > 0) || 1 + cfg.step * (cfg.side - 1) > 24 || cfg.dwell < 0 || cfg.pollMs < 1)
+        return 1;
+
+    printf("%ld x %ld grid, step %.3f mm, dwell %.3f s, %u us per driver call, poll %d ms\n", cfg.side, cfg.side, cfg.step, cfg.dwell,
+           cfg.latencyUs, cfg.pollMs);
+    planRun raster, serp;
+    if (!Run(cfg, SCAN_RASTER, &raster) || !Run(cfg, SCAN_SERPENTINE, &serp))
+        return 1;
+    printf("order        points   s/plan   s/point   predicted travel s   max err mm\n");
+    printf("%-12s %6ld %8.2f %9.3f %20.2f %12.4f\n", "raster", raster.points, raster.seconds, raster.seconds / raster.points, raster.cost,
+           raster.maxErr);
+    printf("%-12s %6ld %8.2f %9.3f %20.2f %12.4f\n", "serpentine", serp.points, serp.seconds, serp.seconds / serp.points, serp.cost,
+           serp.maxErr);
+    double saved = raster.seconds - serp.seconds, predicted = raster.cost - serp.cost;
+    printf("serpentine %.2fx faster, saves %.2f s (%.2f s predicted)\n", raster.seconds / serp.seconds, saved, predicted);
+
+    long n = cfg.side * cfg.side;
+    Check(!raster.ret && !serp.ret && raster.points == n && serp.points == n, "both orders run every point of the grid");
+    Check(raster.maxErr <= 0.001f && serp.maxErr <= 0.001f, "with every axis settled on its point");
+    Check(serp.seconds < raster.seconds, "the serpentine path is faster");
+    Check(fabs(saved - predicted) < 0.25 * predicted, "by the travel ScanPlanCost() predicts, within 25%");
+
+    // the same rules as a single axis scan
+    scanAxis bad[2] = {};
+    for (long j = 0; j < 2; j++)
+    {
+        bad[j].start = 1;
+        bad[j].stop = 3;
+        bad[j].step = 1;
+    }
+    ScanPlan plan;
+    bool ok = !ScanPlanGrid(bad, 2, SCAN_SERPENTINE, &plan) && plan.NumPoints() == 9;
+    bad[1].start = -1;
+    ok &= ScanPlanGrid(bad, 2, SCAN_SERPENTINE, &plan) == SCAN_ERR_PARAM && plan.NumPoints() == 0;
+    bad[1].start = 1;
+    bad[0].stop = NAN;
+    ok &= ScanPlanGrid(bad, 2, SCAN_RASTER, &plan) == SCAN_ERR_PARAM;
+    bad[0].stop = INFINITY;
+    ok &= ScanPlanGrid(bad, 2, SCAN_RASTER, &plan) == SCAN_ERR_PARAM;
+    bad[0].stop = 3;
+    bad[0].step = NAN;
+    ok &= ScanPlanGrid(bad, 2, SCAN_RASTER, &plan) == SCAN_ERR_PARAM;
+    Check(ok, "a negative, infinite or NaN axis is refused");
+    scanParams sp = {};
+    sp.start = NAN;
+    sp.stop = 3;
+    ok = ScanEngine::Sanitize(&sp, nullptr) == SCAN_ERR_PARAM;
+    sp.start = 1;
+    sp.stop = -INFINITY;
+    ok &= ScanEngine::Sanitize(&sp, nullptr) == SCAN_ERR_PARAM;
+    Check(ok, "as by a single axis scan");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
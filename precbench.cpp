@@ -0,0 +1,254 @@
+// Precision mode: bidirectional scans of a simulated stage with backlash and a spread of where its
+// moves end, on a virtual clock, reached by plain moves and by each precision setting in turn. Prints
+// how far from its target each point was measured against the time a point takes, and the backlash
+// the table learned. Exits 1 if a check fails.
+//
+// usage: mcpher_precbench [--backlash MM] [--noise MM] [--points N] [--scans N] [--latency US] [--poll MS]
+
+#include "backlash.h"
+#include "controller.h"
+#include "scanengine.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+typedef struct
+{
+    float backlash; // mm
+    float noise;    // mm
+    long points;    // per scan
+    long scans;     // alternately up and down
+    unsigned latencyUs;
+    int pollMs;
+} precConfig;
+
+typedef struct
+{
+    long ret;
+    std::vector<float> err[2]; // actual - target, scanning up and down
+    double seconds;            // virtual, per point
+    precisionStats stats;
+    backlashFit fit;
+    bool learned;
+} precRun;
+
+// the scans on a fresh stage, in precision mode if prec is given; the table carries over between runs
+static bool Run(const precConfig &cfg, const precisionParams *prec, BacklashTable *table, precRun *r)
+{
+    VirtualClock clock;
+    SimDriver sim(1, cfg.latencyUs);
+    sim.SetClock(&clock);
+    MotorController controller(&sim, cfg.pollMs);
+    controller.SetClock(&clock);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stage: %s\n", msg.c_str());
+        return false;
+    }
+    long serNum = controller.SerialNums()[0];
+    sim.SetBacklash(serNum, cfg.backlash, cfg.noise);
+    ScanEngine eng(&sim, controller.Telemetry(), 0, serNum);
+    eng.SetPrecision(prec, table);
+    int dir = 0;
+    eng.SetPointHook([r, &dir](long, float target, float actual, double)
+                     { r->err[dir].push_back(actual - target); });
+    scanParams p = {};
+    p.start = 5;
+    p.stop = 10;
+    p.step = (p.stop - p.start) / (cfg.points - 1);
+    // plain moves are settled on the target, they must take the play and the spread as arrived;
+    // in precision mode the stage is settled wherever it stops, and corrected from there
+    p.settleTol = prec != nullptr ? 0.001f : cfg.backlash / 2 + 5 * cfg.noise + 0.005f;
+    p.settleCount = 3;
+    p.timeout = 30;
+    for (int k = 0; k < 2; k++)
+        r->err[k].clear();
+    r->ret = 0;
+    double t0 = clock.Now();
+    for (long s = 0; s < cfg.scans && !r->ret; s++)
+    {
+        dir = s % 2;
+        r->ret = eng.Run(p);
+        std::swap(p.start, p.stop);
+    }
+    r->seconds = (clock.Now() - t0) / (cfg.scans * cfg.points);
+    eng.GetPrecisionStats(&r->stats);
+    r->learned = table != nullptr && table->GetFit(serNum, &r->fit);
+    controller.Shutdown();
+    return true;
+}
+
+static float Percentile(std::vector<float> v, double q)
+{
+    if (v.empty())
+        return NAN;
+    for (float &x : v)
+        x = fabs(x);
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(q * v.size()))];
+}
+
+static float Mean(const std::vector<float> &v)
+{
+    double sum = 0;
+    for (float x : v)
+        sum += x;
+    return v.empty() ? NAN : (float)(sum / v.size());
+}
+
+static std::vector<float> Both(const precRun &r)
+{
+    std::vector<float> v(r.err[0]);
+    v.insert(v.end(), r.err[1].begin(), r.err[1].end());
+    return v;
+}
+
+static void Report(const char *what, const precRun &r)
+{
+    std::vector<float> all = Both(r);
+    long n = (long)all.size();
+    printf("%-22s %8.4f %8.4f %8.4f %8.4f %8.4f %7.3f %6.2f %5ld\n", what, Mean(r.err[0]), Mean(r.err[1]),
+           Percentile(all, 0.5), Percentile(all, 0.95), Percentile(all, 1), r.seconds,
+           n ? (double)r.stats.corrections / n : 0.0, r.stats.misses);
+}
+
+int main(int argc, char **argv)
+{
+    precConfig cfg;
+    cfg.backlash = 0.02f;
+    cfg.noise = 0.002f;
+    cfg.points = 51;
+    cfg.scans = 4;
+    cfg.latencyUs = 2000;
+    cfg.pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--backlash"))
+            cfg.backlash = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--noise"))
+            cfg.noise = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--points"))
+            cfg.points = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--scans"))
+            cfg.scans = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            cfg.latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            cfg.pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_precbench [--backlash MM] [--noise MM] [--points N] [--scans N] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (cfg.backlash < 0 || cfg.noise < 0 || cfg.points < 2 || cfg.scans < 2 || cfg.pollMs < 1)
+        return 1;
+
+    printf("backlash %.4f mm, spread %.4f mm; %ld scans of %ld points, alternately up and down\n", cfg.backlash, cfg.noise, cfg.scans, cfg.points);
+    printf("mode                    mean up  mean dn   |err|50  |err|95  max      s/pt   corr/pt miss\n");
+    precRun plain, comp, side, sideComp, loop, loopOnly;
+    if (!Run(cfg, nullptr, nullptr, &plain))
+        return 1;
+    Report("plain moves", plain);
+
+    // compensation from a table learned on the scans before, as it would be across sessions
+    BacklashTable table;
+    precisionParams prec = {};
+    prec.approach = 1;
+    prec.compensate = true;
+    Run(cfg, &prec, &table, &comp);
+    Run(cfg, &prec, &table, &comp);
+    Report("compensated", comp);
+
+    prec.compensate = false;
+    prec.overshoot = 2 * cfg.backlash + 0.01f;
+    Run(cfg, &prec, nullptr, &side);
+    Report("one-sided", side);
+
+    prec.compensate = true;
+    Run(cfg, &prec, &table, &sideComp);
+    Report("one-sided compensated", sideComp);
+
+    float tol = std::max(1.5f * cfg.noise, 0.001f);
+    prec.tol = tol;
+    prec.maxCorrections = 3;
+    Run(cfg, &prec, &table, &loop);
+    Report("closed loop", loop);
+
+    prec.overshoot = 0;
+    Run(cfg, &prec, &table, &loopOnly);
+    Report("closed loop, two-sided", loopOnly);
+    printf("closed loop tolerance %.4f mm, at most %d corrections per point\n", tol, prec.maxCorrections);
+    if (comp.learned)
+        printf("learned: backlash %.4f mm over %llu moves, spread %.4f / %.4f mm\n", comp.fit.backlash,
+               (unsigned long long)comp.fit.moves, comp.fit.spread[0], comp.fit.spread[1]);
+
+    bool ok = !plain.ret && !comp.ret && !side.ret && !sideComp.ret && !loop.ret && !loopOnly.ret;
+    Check(ok, "every scan completes");
+    Check(fabs(Mean(plain.err[1]) - Mean(plain.err[0]) - cfg.backlash) < 0.2f * cfg.backlash + 2 * cfg.noise,
+          "plain moves land a backlash apart by direction");
+    Check(comp.learned && fabs(comp.fit.backlash - cfg.backlash) < 0.2f * cfg.backlash + cfg.noise, "the table learns the backlash");
+    float plainErr = Percentile(Both(plain), 0.5);
+    Check(Percentile(Both(comp), 0.5) < plainErr / 2, "compensation halves the error of plain moves");
+    Check(fabs(Mean(side.err[1]) - Mean(side.err[0])) < 0.2f * cfg.backlash + 2 * cfg.noise, "a one-sided approach lands the same both ways");
+    Check(Percentile(Both(sideComp), 0.5) < plainErr / 2, "and compensated, near the target");
+    Check(Percentile(Both(loop), 0.95) <= tol && loop.stats.misses <= (long)Both(loop).size() / 100,
+          "the closed loop brings 95% within tolerance");
+    Check(Percentile(Both(loopOnly), 0.95) <= tol, "also without the one-sided approach");
+    Check(loop.seconds > plain.seconds, "at the cost of time per point");
+
+    const char *path = "mcpher_precbench.bl";
+    BacklashTable loaded;
+    long ret = table.Save(path);
+    if (!ret)
+        ret = loaded.Load(path);
+    remove(path);
+    long serNum = 26000001;
+    ok = !ret;
+    for (float pos = 0; pos < 12; pos += 0.5f)
+    {
+        for (int d = -1; d <= 1; d += 2)
+            ok &= fabs(loaded.Offset(serNum, d, pos) - table.Offset(serNum, d, pos)) < 1e-6f;
+    }
+    Check(ok, "a saved table loads the same");
+
+    // a damaged table: bins far past any travel, and moves to where a stage cannot be sent
+    FILE *fp = fopen(path, "w");
+    ret = fp == nullptr;
+    if (fp != nullptr)
+    {
+        fprintf(fp, "%s\nwidth 1\n7 4000000000000 0 1 0.1 0.01 1\n7 -1 0 1 0.1 0.01 1\n7 2 1 1 nan 0.01 1\n", BACKLASH_MAGIC);
+        ret = fclose(fp);
+    }
+    BacklashTable damaged;
+    if (!ret)
+        ret = damaged.Load(path);
+    remove(path);
+    ok = !ret && fabs(damaged.Offset(7, 1, 4e12f) - 0.1f) < 1e-6f && damaged.Offset(7, -1, 2) == 0;
+    damaged.Observe(7, 1, INFINITY, 1);
+    damaged.Observe(7, 1, 1e30f, 1e30f);
+    ok &= damaged.Offset(7, 1, 1e30f) == damaged.Offset(7, 1, 0);
+    Check(ok, "a damaged table loads what it can, the rest is skipped");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,251 @@
+// Telemetry recorder: records per second logged by 1 to 8 threads into a ring of 100k, readers copying
+// the ring while writers fill it (no torn record may come out), the rate a controller polling many
+// simulated stages records at, and write amplification, the bytes of pages the recording makes the
+// kernel write back per byte of record, with the file synced after every batch of records as the
+// kernel's writeback would. Linux only, page writes are read from /proc/self/io. Exits 1 if a check
+// fails.
+//
+// usage: mcpher_recbench [--records N] [--motors N] [--seconds S] [--file PATH]
+
+#include "controller.h"
+#include "recorder.h"
+#include "simdriver.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+static double Seconds(benchClock::time_point t0)
+{
+    return std::chrono::duration<double>(benchClock::now() - t0).count();
+}
+
+// bytes of pages this process dirtied so far, -1 if not known
+static long long WriteBytes()
+{
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+        return -1;
+    char line[128];
+    long long n = -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (!strncmp(line, "write_bytes:", 12))
+            n = atoll(line + 12);
+    }
+    fclose(f);
+    return n;
+}
+
+// a record whose fields all follow from its code, so a torn one shows
+static recRecord Tagged(long thread, long k)
+{
+    recRecord rec = {};
+    rec.stamp = (uint64_t)k * 3;
+    rec.serNum = (int32_t)thread;
+    rec.type = REC_STATE;
+    rec.pos = (float)k;
+    rec.aux = -(float)k;
+    rec.code = (int32_t)k;
+    rec.ret = (int32_t)(thread * 7);
+    rec.value = (float)(k % 1000);
+    return rec;
+}
+
+static bool Whole(const recRecord &rec)
+{
+    long k = rec.code;
+    return rec.stamp == (uint64_t)k * 3 && rec.pos == (float)k && rec.aux == -(float)k && rec.ret == rec.serNum * 7 && rec.value == (float)(k % 1000);
+}
+
+int main(int argc, char **argv)
+{
+    long records = 2000000, motors = 64;
+    double seconds = 2;
+    std::string path = "mcpher_recbench.rec";
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--records"))
+            records = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--motors"))
+            motors = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--seconds"))
+            seconds = atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--file"))
+            path = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: mcpher_recbench [--records N] [--motors N] [--seconds S] [--file PATH]\n");
+            return 1;
+        }
+    }
+    if (records < 100000 || motors < 1 || seconds <= 0)
+        return 1;
+    const uint64_t capacity = 100000;
+
+    // throughput, every thread logging as fast as it can
+    printf("threads   records/s   ns/record\n");
+    double rate1 = 0;
+    bool all = true;
+    for (long threads = 1; threads <= 8; threads *= 2)
+    {
+        Recorder rec;
+        remove(path.c_str()); // a new recording, not the one of the run before continued
+        if (rec.Open(path.c_str(), capacity))
+        {
+            fprintf(stderr, "Could not open %s\n", path.c_str());
+            return 1;
+        }
+        std::vector<std::thread> thr;
+        auto t0 = benchClock::now();
+        for (long t = 0; t < threads; t++)
+            thr.push_back(std::thread([&rec, t, threads, records]()
+                                      {
+                                          for (long k = t; k < records; k += threads)
+                                              rec.LogState(k % 64, (float)k, k & 1, 0);
+                                      }));
+        for (std::thread &th : thr)
+            th.join();
+        double s = Seconds(t0);
+        printf("%7ld %11.0f %11.1f\n", threads, records / s, s * 1e9 / records);
+        if (threads == 1)
+            rate1 = records / s;
+        all &= rec.Written() == (uint64_t)records;
+        rec.Close();
+    }
+
+    // readers copying the ring while four threads overwrite it
+    long torn = 0, read = 0, reads = 0, held = 0;
+    {
+        Recorder rec;
+        remove(path.c_str());
+        rec.Open(path.c_str(), capacity);
+        std::atomic<bool> done(false);
+        std::vector<std::thread> thr;
+        for (long t = 0; t < 4; t++)
+            thr.push_back(std::thread([&rec, t, records]()
+                                      {
+                                          for (long k = 0; k < records / 4; k++)
+                                              rec.Log(Tagged(t, k));
+                                      }));
+        std::thread reader([&]()
+                           {
+                               std::vector<recRecord> got;
+                               while (!done.load())
+                               {
+                                   RecorderRead(path.c_str(), &got);
+                                   for (const recRecord &r : got)
+                                       torn += !Whole(r);
+                                   read += (long)got.size();
+                                   reads++;
+                               }
+                           });
+        for (std::thread &th : thr)
+            th.join();
+        done = true;
+        reader.join();
+        std::vector<recRecord> got;
+        RecorderRead(path.c_str(), &got);
+        for (const recRecord &r : got)
+            torn += !Whole(r);
+        // a writer preempted between claiming a slot and filling it may be lapped, and its record, left
+        // with a stale sequence number, is dropped
+        held = (long)got.size();
+        rec.Close();
+    }
+    printf("%ld copies of the ring taken while it was written: %ld records, %ld torn; %ld held after\n", reads, read, torn, held);
+
+    // the pollers of many stages, recording every sample
+    double polled = 0;
+    {
+        Recorder rec;
+        rec.Open(path.c_str(), capacity);
+        SimDriver sim(motors, 0);
+        MotorController controller(&sim, 1);
+        controller.SetRecorder(&rec);
+        std::string msg;
+        if (controller.Init(&msg) || !controller.WaitAll(10000))
+        {
+            fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+            return 1;
+        }
+        for (long i = 0; i < motors; i += 2)
+            controller.Commands()->Move(i, 24);
+        uint64_t w0 = rec.Written();
+        auto t0 = benchClock::now();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        polled = (rec.Written() - w0) / Seconds(t0);
+        controller.Shutdown();
+        rec.Close();
+    }
+    printf("%ld stages polled every ms: %.0f records/s\n", motors, polled);
+
+    // write amplification: batches of records, the file synced after each
+    printf("records/sync   page bytes/record byte   pages/sync\n");
+    const long batches[] = {100, 1000, 3200, 16000};
+    bool measured = true, low = true;
+    for (long batch : batches)
+    {
+        Recorder rec;
+        rec.Open(path.c_str(), capacity);
+        int fd = open(path.c_str(), O_RDWR);
+        fdatasync(fd); // the pages of a fresh file, so they are clean
+        long syncs = 40;
+        long long b0 = WriteBytes();
+        for (long s = 0; s < syncs; s++)
+        {
+            for (long k = 0; k < batch; k++)
+                rec.LogState(k % 64, (float)k, false, 0);
+            fdatasync(fd);
+        }
+        long long b1 = WriteBytes();
+        close(fd);
+        rec.Close();
+        if (b0 < 0 || b1 <= b0)
+        {
+            measured = false;
+            break;
+        }
+        double amp = (double)(b1 - b0) / ((double)syncs * batch * sizeof(recRecord));
+        printf("%12ld %24.2f %12.1f\n", batch, amp, (double)(b1 - b0) / syncs / 4096);
+        // the pages the batch spans, one it shares with the batch before, and the header's
+        double model = (batch * sizeof(recRecord) / 4096.0 + 2) * 4096 / (batch * sizeof(recRecord));
+        low &= amp < 1.25 * model;
+        if (batch >= 3200)
+            low &= amp < 1.2;
+    }
+    if (!measured)
+        printf("no page writes accounted for %s, write amplification not measured\n", path.c_str());
+    remove(path.c_str());
+
+    Check(all, "every record is logged");
+    Check(held + 4 >= (long)capacity, "the ring holds the latest, but for a lapped writer's");
+    Check(rate1 > 1e6, "one thread logs a million records a second or more");
+    Check(torn == 0, "a reader never gets a torn record");
+    Check(polled > 0.5 * motors * 1000, "the pollers record 500 samples a second per stage or more");
+    if (measured)
+        Check(low, "pages written per record stay near the record's size");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,297 @@
+// Motor registry: the cost of publishing and of reading the state of every motor each frame, from 8
+// to 512 axes, with the state of each poller in its own SeqLock and the panel copying it into its
+// per-motor structs, as before, against the registry's arrays and one Snapshot(). Then hot-plug on
+// simulated stages: unplugged, plugged back in and a new stage, while the others keep polling.
+// Exits 1 if a check fails.
+//
+// usage: mcpher_regbench [--frames N] [--units N] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "registry.h"
+#include "seqlock.h"
+#include "simdriver.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+// what the panel kept per motor: the hot fields among a few hundred bytes of settings and text
+typedef struct
+{
+    long serNum;
+    float settings[24];
+    char text[2][128];
+    float curPos;
+    bool moving;
+    long stateRet;
+} wideProps;
+
+typedef struct
+{
+    double store; // ns per axis, publishing a poll
+    double scan;  // ns per axis, a frame reading every motor
+} layoutCost;
+
+static double Ns(benchClock::time_point t0, long n)
+{
+    return std::chrono::duration<double, std::nano>(benchClock::now() - t0).count() / n;
+}
+
+// one SeqLock per poller, each allocated with it, read into the panel's structs
+static layoutCost Aos(long units, long frames, double *sum)
+{
+    std::vector<std::unique_ptr<SeqLock<motorState>>> states;
+    std::vector<std::unique_ptr<std::string>> spacers; // other allocations of a poller between them
+    for (long i = 0; i < units; i++)
+    {
+        states.emplace_back(new SeqLock<motorState>());
+        spacers.emplace_back(new std::string(200, ' '));
+    }
+    std::vector<wideProps> props(units);
+    layoutCost c = {};
+    motorState st = {};
+    for (long f = 0; f < frames; f++)
+    {
+        auto t0 = benchClock::now();
+        for (long i = 0; i < units; i++)
+        {
+            st.curPos = (float)(f + i);
+            st.moving = (f + i) & 1;
+            st.polls = f;
+            states[i]->Store(st);
+        }
+        c.store += Ns(t0, units * frames);
+        t0 = benchClock::now();
+        for (long i = 0; i < units; i++)
+        {
+            motorState s = states[i]->Load();
+            props[i].curPos = s.curPos;
+            props[i].moving = s.moving;
+            props[i].stateRet = s.ret;
+        }
+        c.scan += Ns(t0, units * frames);
+        for (long i = 0; i < units; i++)
+            *sum += props[i].curPos + props[i].moving;
+    }
+    return c;
+}
+
+static layoutCost Soa(long units, long frames, double *sum, bool *same)
+{
+    MotorRegistry reg(units);
+    for (long i = 0; i < units; i++)
+    {
+        long slot;
+        reg.Add(1000 + i, &slot);
+    }
+    std::vector<float> pos(units);
+    std::vector<uint8_t> moving(units);
+    layoutCost c = {};
+    motorState st = {};
+    *same = true;
+    for (long f = 0; f < frames; f++)
+    {
+        auto t0 = benchClock::now();
+        for (long i = 0; i < units; i++)
+        {
+            st.curPos = (float)(f + i);
+            st.moving = (f + i) & 1;
+            st.polls = f;
+            reg.Store(i, st);
+        }
+        c.store += Ns(t0, units * frames);
+        t0 = benchClock::now();
+        reg.Snapshot(pos.data(), moving.data(), units);
+        c.scan += Ns(t0, units * frames);
+        for (long i = 0; i < units; i++)
+        {
+            *sum += pos[i] + moving[i];
+            *same &= pos[i] == (float)(f + i) && moving[i] == ((f + i) & 1);
+        }
+    }
+    return c;
+}
+
+// a writer per slot storing pairs that belong together, a reader taking snapshots
+static bool Torn(long units, double seconds)
+{
+    MotorRegistry reg(units);
+    for (long i = 0; i < units; i++)
+    {
+        long slot;
+        reg.Add(1000 + i, &slot);
+    }
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> writers;
+    for (long i = 0; i < units; i++)
+        writers.emplace_back([&reg, &stop, i]()
+                             {
+                                 motorState st = {};
+                                 for (long k = 0; !stop.load(std::memory_order_relaxed); k++)
+                                 {
+                                     st.curPos = (float)(k & 0xffff);
+                                     st.moving = k & 1;
+                                     reg.Store(i, st);
+                                 } });
+    std::vector<float> pos(units);
+    std::vector<uint8_t> moving(units);
+    bool torn = false;
+    auto end = benchClock::now() + std::chrono::duration<double>(seconds);
+    while (benchClock::now() < end)
+    {
+        reg.Snapshot(pos.data(), moving.data(), units);
+        for (long i = 0; i < units; i++)
+            torn |= moving[i] != ((long)pos[i] & 1);
+    }
+    stop = true;
+    for (std::thread &w : writers)
+        w.join();
+    return torn;
+}
+
+static void PollsOf(MotorController *controller, std::vector<uint64_t> *polls)
+{
+    const MotorRegistry *reg = controller->Telemetry()->Registry();
+    polls->resize(controller->NumUnits());
+    for (long i = 0; i < controller->NumUnits(); i++)
+        (*polls)[i] = reg->Polls(i);
+}
+
+// every present motor but skip polled since before
+static bool OthersPolled(MotorController *controller, const std::vector<uint64_t> &before, long skip)
+{
+    const MotorRegistry *reg = controller->Telemetry()->Registry();
+    bool ok = true;
+    for (long i = 0; i < (long)before.size(); i++)
+    {
+        if (i != skip && reg->Present(i))
+            ok &= reg->Polls(i) > before[i];
+    }
+    return ok;
+}
+
+static bool Ready(MotorController *controller, long idx)
+{
+    deviceInfo info;
+    return controller->GetDevice(idx, &info) && info.state == DEV_READY && !info.ret;
+}
+
+int main(int argc, char **argv)
+{
+    long frames = 20000;
+    long units = 8;
+    unsigned latencyUs = 2000;
+    int pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--frames"))
+            frames = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--units"))
+            units = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_regbench [--frames N] [--units N] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (frames < 1 || units < 3)
+        return 1;
+
+    printf("axes   store ns/axis    frame ns/axis     speedup\n");
+    printf("       seqlocks   reg   structs  snapshot\n");
+    double sum = 0;
+    bool same = true;
+    const long sizes[] = {8, 32, 128, 512};
+    for (long n : sizes)
+    {
+        long f = frames * 8 / n; // about the same work at every size
+        layoutCost aos = Aos(n, f, &sum);
+        bool ok;
+        layoutCost soa = Soa(n, f, &sum, &ok);
+        same &= ok;
+        printf("%4ld %9.2f %6.2f %9.2f %9.2f %8.2fx\n", n, aos.store, soa.store, aos.scan, soa.scan, aos.scan / soa.scan);
+    }
+    printf("(checksum %.0f)\n", sum);
+    Check(same, "snapshots hold what was stored");
+    Check(!Torn(4, 0.5), "no torn snapshot while every slot is written");
+
+    SimDriver sim(units, latencyUs);
+    MotorController controller(&sim, pollMs);
+    controller.SetCapacity(units + 1);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return 1;
+    }
+    const MotorRegistry *reg = controller.Telemetry()->Registry();
+    const long *serNums = controller.SerialNums();
+    const long gone = 2, serNum = serNums[gone];
+    std::vector<uint64_t> before;
+    long added, removed;
+
+    sim.Unplug(serNum);
+    PollsOf(&controller, &before);
+    long ret = controller.Rescan(&added, &removed, &msg);
+    std::this_thread::sleep_for(std::chrono::milliseconds(4 * pollMs + 50));
+    deviceInfo info;
+    controller.GetDevice(gone, &info);
+    Check(!ret && added == 0 && removed == 1 && !reg->Present(gone) && info.state == DEV_REMOVED, "an unplugged stage is removed");
+    Check(OthersPolled(&controller, before, gone), "the other stages keep polling");
+    motorState st;
+    controller.Telemetry()->GetState(gone, &st);
+    cmdResult res = controller.Commands()->Move(gone, 1).get();
+    Check(st.ret == DRV_ERR_NODEVICE && res.ret == DRV_ERR_NODEVICE, "its state and commands say it is gone");
+
+    sim.Plug(serNum);
+    PollsOf(&controller, &before);
+    ret = controller.Rescan(&added, &removed, &msg);
+    bool up = controller.WaitAll(10000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(4 * pollMs + 50));
+    Check(!ret && added == 1 && removed == 0 && up && reg->Find(serNum) == gone && Ready(&controller, gone),
+          "plugged back in, it is ready in the slot it had");
+    Check(OthersPolled(&controller, before, -1) && controller.NumUnits() == units, "it polls again, with no new slot");
+
+    const long newSer = 90000001;
+    sim.Plug(newSer);
+    PollsOf(&controller, &before);
+    ret = controller.Rescan(&added, &removed, &msg);
+    up = controller.WaitAll(10000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(4 * pollMs + 50));
+    Check(!ret && added == 1 && up && reg->Find(newSer) == units && controller.NumUnits() == units + 1 &&
+              controller.SerialNums()[units] == newSer && Ready(&controller, units) && reg->Polls(units) > 0,
+          "a new stage gets the next slot");
+    Check(controller.SerialNums() == serNums && serNums[gone] == serNum, "serial numbers stay where they were");
+    res = controller.Commands()->Move(units, 0.5f).get();
+    Check(!res.ret, "the new stage takes commands");
+
+    sim.Plug(newSer + 1);
+    ret = controller.Rescan(&added, &removed, &msg);
+    Check(ret == REG_ERR_FULL && added == 0 && controller.NumUnits() == units + 1, "no slot beyond the capacity");
+
+    controller.Shutdown();
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+// Scans of a simulated stage on a virtual clock, for a range of step sizes: advancing once the stage
+// has settled at each point, against the old fixed delay per point. The delay is either tuned to the
+// step, as short as it can be for the stage to arrive before the point is measured (the step's move
+// time, the dwell and two polls, rounded up to 0.1 s), or the one delay that is safe for every step
+// here, as it would be set once for a stage. Prints the time a scan takes each way and the speed-ups.
+// Exits 1 if a check fails.
+//
+// usage: mcpher_scanbench [--points N] [--dwell S] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "kinematics.h"
+#include "scanengine.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+typedef struct
+{
+    long points;
+    float dwell; // s
+    unsigned latencyUs;
+    int pollMs;
+} scanConfig;
+
+typedef struct
+{
+    long ret;
+    double seconds; // virtual, per scan
+    float maxErr;   // |actual - target| when each point was measured, mm
+    long points;
+} scanRun;
+
+// one scan of a fresh stage from 5 mm, by the scan engine, or with a fixed delay per point if delay > 0
+static bool Run(const scanConfig &cfg, float step, double delay, scanRun *r)
+{
+    VirtualClock clock;
+    SimDriver sim(1, cfg.latencyUs);
+    sim.SetClock(&clock);
+    MotorController controller(&sim, cfg.pollMs);
+    controller.SetClock(&clock);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stage: %s\n", msg.c_str());
+        return false;
+    }
+    long serNum = controller.SerialNums()[0];
+    scanParams p = {};
+    p.start = 5;
+    p.stop = p.start + step * (cfg.points - 1);
+    p.step = step;
+    p.dwell = cfg.dwell;
+    p.settleTol = 0.001f;
+    p.settleCount = 2;
+    p.timeout = 30;
+    r->ret = 0;
+    r->maxErr = 0;
+    r->points = 0;
+    ScanEngine eng(&sim, controller.Telemetry(), 0, serNum);
+    if (delay > 0)
+    {
+        // the old loop: the start reached with a waited move, then a delay at every point, during
+        // which the stage has to get there and the point is measured, then the move to the next
+        r->ret = eng.MoveAndSettle(p.start, p);
+        double t0 = clock.Now();
+        long n = ScanEngine::NumPoints(p);
+        for (long i = 0; i < n && !r->ret; i++)
+        {
+            float target = ScanEngine::Point(p, i), pos = 0;
+            if (i > 0)
+                r->ret = sim.MoveAbsolute(serNum, target, false);
+            clock.Sleep(delay);
+            if (!r->ret)
+                r->ret = sim.GetPosition(serNum, &pos);
+            r->maxErr = std::max(r->maxErr, (float)fabs(pos - target));
+            r->points++;
+        }
+        r->seconds = clock.Now() - t0;
+    }
+    else
+    {
+        eng.SetPointHook([r](long, float target, float actual, double)
+                         {
+                             r->maxErr = std::max(r->maxErr, (float)fabs(actual - target));
+                             r->points++;
+                         });
+        // from the start, as the fixed delay scan, so both time the points alone
+        r->ret = eng.MoveAndSettle(p.start, p);
+        double t0 = clock.Now();
+        if (!r->ret)
+            r->ret = eng.Run(p);
+        r->seconds = clock.Now() - t0;
+    }
+    controller.Shutdown();
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    scanConfig cfg;
+    cfg.points = 41;
+    cfg.dwell = 0.05f;
+    cfg.latencyUs = 2000;
+    cfg.pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--points"))
+            cfg.points = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--dwell"))
+            cfg.dwell = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            cfg.latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            cfg.pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_scanbench [--points N] [--dwell S] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (cfg.points < 2 || cfg.dwell < 0 || cfg.pollMs < 1)
+        return 1;
+
+    float minVel = 0, accel = 0, maxVel = 0;
+    {
+        SimDriver sim(1, 0);
+        long serNum = 0;
+        if (sim.Init() || sim.GetSerialNum(0, &serNum) || sim.InitDevice(serNum) || sim.GetVelParams(serNum, &minVel, &accel, &maxVel))
+        {
+            fprintf(stderr, "Could not read the velocity parameters of the simulated stage\n");
+            return 1;
+        }
+    }
+    printf("%ld points per scan, dwell %.3f s, %u us per driver call, poll %d ms\n", cfg.points, cfg.dwell, cfg.latencyUs, cfg.pollMs);
+    const float steps[] = {0.01f, 0.05f, 0.2f, 0.5f};
+    const long numSteps = sizeof(steps) / sizeof(steps[0]);
+    double delays[numSteps], safe = 0;
+    for (long k = 0; k < numSteps; k++)
+    {
+        moveProfile prof = ProfileMake(steps[k], minVel, maxVel, accel);
+        delays[k] = ceil((prof.total + cfg.dwell + 2e-3 * cfg.pollMs + 4e-6 * cfg.latencyUs) * 10) / 10;
+        safe = std::max(safe, delays[k]);
+    }
+    printf("                   tuned delay          one delay, %.1f s   settled           speed-up\n", safe);
+    printf("step mm  delay s  s/scan   err mm     s/scan   err mm     s/scan   err mm   tuned    one\n");
+    bool ok = true, arrived = true, settled = true, faster = true;
+    double tunedAll = 0, safeAll = 0, settledAll = 0;
+    for (long k = 0; k < numSteps; k++)
+    {
+        scanRun tuned, one, settle;
+        if (!Run(cfg, steps[k], delays[k], &tuned) || !Run(cfg, steps[k], safe, &one) || !Run(cfg, steps[k], 0, &settle))
+            return 1;
+        printf("%7.3f %8.1f %7.2f %8.4f %10.2f %8.4f %10.2f %8.4f %7.2f %6.2f\n", steps[k], delays[k], tuned.seconds, tuned.maxErr,
+               one.seconds, one.maxErr, settle.seconds, settle.maxErr, tuned.seconds / settle.seconds, one.seconds / settle.seconds);
+        ok &= !tuned.ret && !one.ret && !settle.ret && tuned.points == cfg.points && one.points == cfg.points && settle.points == cfg.points;
+        arrived &= tuned.maxErr < 0.001f && one.maxErr < 0.001f;
+        settled &= settle.maxErr < 0.001f;
+        faster &= settle.seconds < tuned.seconds;
+        tunedAll += tuned.seconds;
+        safeAll += one.seconds;
+        settledAll += settle.seconds;
+    }
+    printf("all steps: %.2f s settled, %.2fx faster than tuned delays, %.2fx than one delay\n", settledAll, tunedAll / settledAll,
+           safeAll / settledAll);
+
+    Check(ok, "every scan completes, measuring every point");
+    Check(arrived, "the fixed delays are long enough to arrive");
+    Check(settled, "the settled scan measures every point on its target");
+    Check(faster, "and beats even a delay tuned to each step");
+    Check(safeAll > 1.5 * settledAll, "and one delay for every step by half again overall");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
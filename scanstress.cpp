@@ -0,0 +1,160 @@
+// Rapid start/stop of scans on simulated stages: every scan is cancelled at a random moment and
+// must finish promptly, whatever it was waiting on: within two poll intervals, and a margin for the
+// scheduler. Build with MCPHER_SANITIZE=thread to check the task manager, the cancellation and the
+// status queues for races. Exits 1 if a check fails.
+//
+// usage: mcpher_scanstress [--units N] [--cycles N] [--max-run-ms MS] [--poll MS]
+
+#include "controller.h"
+#include "scanengine.h"
+#include "scantask.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock stressClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+int main(int argc, char **argv)
+{
+    long units = 4, cycles = 400;
+    int maxRunMs = 200, pollMs = 100;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--units"))
+            units = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--cycles"))
+            cycles = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--max-run-ms"))
+            maxRunMs = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_scanstress [--units N] [--cycles N] [--max-run-ms MS] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (units < 1 || cycles < 1 || maxRunMs < 1)
+        return 1;
+    SimDriver sim(units);
+    MotorController controller(&sim, pollMs);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return 1;
+    }
+    long errors = 0, pending = 0;
+    double maxLatency = 0;
+    {
+        ScanTaskManager tasks((int)units);
+        std::vector<std::shared_ptr<ScanTask>> running(units);
+        std::vector<double> latency; // cancel to done, ms
+        uint64_t messages = 0, dropped = 0;
+        long completed = 0, stopped = 0;
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> where(0, 5);
+        std::uniform_int_distribution<int> runMs(0, maxRunMs);
+        // the UI side: takes each task's messages and result
+        auto reap = [&](std::shared_ptr<ScanTask> &task)
+        {
+            taskMessage m;
+            while (task->Pop(&m))
+                messages++;
+            dropped += task->Dropped();
+            long ret = task->Result();
+            if (ret == SCAN_ERR_STOPPED)
+                stopped++;
+            else if (ret == 0)
+                completed++;
+            else
+            {
+                fprintf(stderr, "Scan failed: %ld\n", ret);
+                errors++;
+            }
+            task.reset();
+        };
+        auto t0 = stressClock::now();
+        for (long c = 0; c < cycles; c++)
+        {
+            long idx = c % units;
+            if (running[idx])
+            {
+                auto tc = stressClock::now();
+                running[idx]->Cancel();
+                running[idx]->Wait();
+                latency.push_back(std::chrono::duration<double, std::milli>(stressClock::now() - tc).count());
+                reap(running[idx]);
+            }
+            scanParams p = {};
+            p.start = where(rng);
+            p.stop = p.start + 0.5f;
+            p.step = 0.1f;
+            p.dwell = 0.05f;
+            p.timeout = 10;
+            long serNum = controller.SerialNums()[idx];
+            running[idx] = tasks.Submit([&controller, &sim, idx, serNum, p](ScanTask *task)
+                                        {
+                                            ScanEngine engine(&sim, controller.Telemetry(), idx, serNum);
+                                            engine.SetCancelToken(task->Token());
+                                            engine.SetStatusHook([task](const std::string &msg)
+                                                                 { task->Post("%s", msg.c_str()); });
+                                            return engine.Run(p); });
+            // drain the others like a frame would, while this one gets going
+            for (long j = 0; j < units; j++)
+            {
+                taskMessage m;
+                while (running[j] && running[j]->Pop(&m))
+                    messages++;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(runMs(rng) / units));
+        }
+        for (long j = 0; j < units; j++)
+        {
+            if (!running[j])
+                continue;
+            running[j]->Cancel();
+            running[j]->Wait();
+            reap(running[j]);
+        }
+        double elapsed = std::chrono::duration<double>(stressClock::now() - t0).count();
+        pending = tasks.Pending();
+        std::sort(latency.begin(), latency.end());
+        size_t n = latency.size();
+        printf("%ld scans on %ld stages in %.1f s: %ld stopped, %ld completed, %ld failed\n",
+               cycles, units, elapsed, stopped, completed, errors);
+        printf("%llu status messages, %llu dropped\n", (unsigned long long)messages, (unsigned long long)dropped);
+        if (n)
+        {
+            maxLatency = latency[n - 1];
+            printf("cancel to done: median %.2f ms, 99%% %.2f ms, max %.2f ms (poll interval %d ms)\n",
+                   latency[n / 2], latency[n * 99 / 100], latency[n - 1], pollMs);
+        }
+    } // pool joined here, before the stages go away
+    controller.Shutdown();
+
+    Check(errors == 0, "every scan stops or completes, none fails");
+    Check(pending == 0, "no task is left once every one was waited for");
+    Check(maxLatency <= 2 * pollMs + 50, "a cancelled scan is done within two poll intervals");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+// Sequence programs on simulated stages: compile speed and interpreter throughput, then a few
+// protocols whose outcome is checked (positions, measurement count, parallel timing, cancel,
+// rejected programs), and the cost of a step against driving ScanEngine directly.
+//
+// usage: mcpher_seqbench [--ops N] [--lines N] [--poll MS]
+
+#include "controller.h"
+#include "measurement.h"
+#include "scanengine.h"
+#include "scantask.h"
+#include "sequence.h"
+#include "simdriver.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+static double Seconds(benchClock::time_point t0)
+{
+    return std::chrono::duration<double>(benchClock::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+    long iters = 1000000, lines = 100000;
+    int pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--ops"))
+            iters = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--lines"))
+            lines = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_seqbench [--ops N] [--lines N] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (iters < 1 || lines < 4)
+        return 1;
+    const long units = 2;
+    SimDriver sim(units);
+    MotorController controller(&sim, pollMs);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return 1;
+    }
+    const long *serNums = controller.SerialNums();
+    for (long i = 0; i < units; i++)
+        sim.SetVelParams(serNums[i], 0, 4.0f, 2.6f);
+    SimDetector detector;
+    detector.AddPeak(1.0f, 0.2f, 1.0);
+    SeqRunner runner(&sim, controller.Telemetry(), serNums, units);
+    runner.SetMeasurement(&detector);
+    runner.SetStatusHook([](const std::string &msg)
+                         { printf("  %s\n", msg.c_str()); });
+    long measured = 0;
+    runner.SetMeasureHook([&measured](long, const float *, const float *, double)
+                          { measured++; });
+
+    // compile speed
+    std::string text;
+    for (long i = 0; i < lines / 4; i++)
+        text += "loop 10\n  rmove 1 0.1   # step\n  measure\nend\n";
+    SeqProgram prog;
+    auto t0 = benchClock::now();
+    long ret = prog.Compile(text.c_str(), units, &msg);
+    double took = Seconds(t0);
+    printf("compile: %ld lines in %.1f ms, %.0f ns per line, %ld ops of %zu bytes\n", lines / 4 * 4, took * 1e3,
+           took * 1e9 / (lines / 4 * 4), prog.NumOps(), sizeof(seqOp));
+    Check(!ret && prog.NumOps() == lines / 4 * 5, "compiles to loop, rmove, settle, measure, next");
+
+    // dispatch: the interpreter alone, and with a measurement that takes no time
+    prog.Compile(("loop " + std::to_string(iters) + "\nwait 0\nend\n").c_str(), units, nullptr);
+    t0 = benchClock::now();
+    ret = runner.Run(prog);
+    took = Seconds(t0);
+    printf("dispatch: %llu ops in %.1f ms, %.1f ns per op, %.1f M ops/s\n", (unsigned long long)runner.Steps(), took * 1e3,
+           took * 1e9 / runner.Steps(), runner.Steps() / took * 1e-6);
+    Check(!ret && runner.Steps() == (uint64_t)(2 * iters + 1), "every pass of a loop runs");
+    measured = 0;
+    prog.Compile(("loop " + std::to_string(iters / 10) + "\nmeasure\nend\n").c_str(), units, nullptr);
+    t0 = benchClock::now();
+    ret = runner.Run(prog);
+    took = Seconds(t0);
+    printf("measure: %.1f ns per op, positions of %ld motors and the detector read\n", took * 1e9 / (iters / 10), units);
+    Check(!ret && measured == iters / 10, "one measurement per measure op");
+
+    // a protocol, checked where it ends
+    measured = 0;
+    std::vector<float> targets;
+    runner.SetMeasureHook([&measured, &targets](long, const float *target, const float *, double)
+                          { measured++; targets.push_back(target[0]); });
+    prog.Compile("tolerance 0.005 3\n"
+                 "move 1 0.5\n"
+                 "loop 2\n"
+                 "  loop 3\n"
+                 "    rmove 1 0.1\n"
+                 "    measure\n"
+                 "  end\n"
+                 "  rmove 1 -0.3\n"
+                 "end\n",
+                 units, nullptr);
+    ret = runner.Run(prog);
+    motorState st;
+    controller.Telemetry()->GetState(0, &st);
+    Check(!ret && fabs(st.curPos - 0.5f) < 0.005f, "nested loops of relative moves end where they began");
+    Check(measured == 6 && fabs(targets[2] - 0.8f) < 1e-5f && fabs(targets[3] - 0.6f) < 1e-5f, "measured at every target");
+
+    // parallel moves take as long as the longest one, sequential ones add up
+    const char *apart = "move 1 0\nmove 2 0\n";
+    prog.Compile(apart, units, nullptr);
+    runner.Run(prog);
+    prog.Compile("move 1 1.5\nmove 2 1.0\n", units, nullptr);
+    t0 = benchClock::now();
+    ret = runner.Run(prog);
+    double sequential = Seconds(t0);
+    prog.Compile(apart, units, nullptr);
+    runner.Run(prog);
+    prog.Compile("parallel\n  move 1 1.5\n  move 2 1.0\nend\n", units, nullptr);
+    t0 = benchClock::now();
+    ret |= runner.Run(prog);
+    double parallel = Seconds(t0);
+    printf("two moves: one after the other %.2f s, in parallel %.2f s\n", sequential, parallel);
+    Check(!ret && parallel < sequential * 0.8, "a parallel block moves the motors together");
+    controller.Telemetry()->GetState(1, &st);
+    Check(fabs(st.curPos - 1.0f) < 0.005f, "and waits for every one of them");
+    prog.Compile("home 1\nhome 2\n", units, nullptr);
+    ret = runner.Run(prog);
+    controller.Telemetry()->GetState(0, &st);
+    Check(!ret && fabs(st.curPos) < 0.005f, "home settles at 0");
+
+    // a step costs no more than the same move driven through ScanEngine
+    const int steps = 10;
+    ScanEngine engine(&sim, controller.Telemetry(), 0, serNums[0]);
+    scanParams p = {};
+    p.settleTol = 0.005f;
+    p.settleCount = 3;
+    p.timeout = 60;
+    t0 = benchClock::now();
+    for (int i = 1; i <= steps; i++)
+        engine.MoveAndSettle(i * 0.05f, p);
+    double direct = Seconds(t0);
+    prog.Compile(("move 1 0\nloop " + std::to_string(steps) + "\nrmove 1 0.05\nend\n").c_str(), units, nullptr);
+    engine.MoveAndSettle(0, p);
+    t0 = benchClock::now();
+    ret = runner.Run(prog);
+    double viaSeq = Seconds(t0);
+    printf("%d steps of 0.05 mm: ScanEngine %.3f s, sequence %.3f s (%+.1f ms per step)\n", steps, direct, viaSeq,
+           (viaSeq - direct) / steps * 1e3);
+    Check(!ret, "steps through the interpreter");
+
+    // cancel wakes a wait at once
+    {
+        ScanTaskManager tasks(1);
+        prog.Compile("wait 30\n", units, nullptr);
+        auto task = tasks.Submit([&](ScanTask *task)
+                                 {
+                                     SeqRunner r(&sim, controller.Telemetry(), serNums, units);
+                                     r.SetCancelToken(task->Token());
+                                     return r.Run(prog); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        t0 = benchClock::now();
+        task->Cancel();
+        task->Wait();
+        took = Seconds(t0);
+        printf("cancel to done: %.2f ms\n", took * 1e3);
+        Check(task->Result() == SCAN_ERR_STOPPED && took < 0.1, "cancel stops a program in a wait");
+    }
+
+    // programs that must not compile
+    const char *bad[] = {"mvoe 1 2", "move 3 1", "move 1", "move 1 x", "loop 0\nend", "end", "loop 2\nmeasure",
+                         "parallel\nwait 1\nend", "parallel\nmove 1 1", "tolerance -1", "measure now"};
+    long rejected = 0;
+    for (const char *b : bad)
+    {
+        if (prog.Compile(b, units, &msg) == SEQ_ERR_SYNTAX && prog.NumOps() == 0)
+            rejected++;
+        else
+            printf("  accepted: %s\n", b);
+    }
+    prog.Compile("loop 2\n  measure\n", units, &msg);
+    printf("e.g. %s\n", msg.c_str());
+    Check(rejected == (long)(sizeof(bad) / sizeof(bad[0])), "malformed programs are rejected");
+
+    controller.Shutdown();
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,243 @@
+// Headless controller: serves the motor operations over a local socket, see ctlserver.h for the protocol.
+//
+// usage: mcpher_srv [--port N] [--unix PATH] [--sim UNITS] [--latency US] [--push MS] [--workers N]
+//                   [--init-ms MS] [--init-jitter MS] [--cache PATH] [--diag PATH] [--envelope PATH] [--bus NAME]
+//                   [--startup]
+//
+// Without --sim the K-Cubes are driven through APT (Windows only); elsewhere the stages are simulated.
+// --startup initializes the devices, reports how long each took and exits.
+// Device parameters are cached; with --cache they are loaded from PATH at start and saved on exit,
+// so the next start does not read them from the devices again.
+// Every device call is timed; with --diag the latency histograms are written to PATH on exit.
+// With --envelope, moves and scans beyond the travel limits, caps and zones in PATH are refused (see envelope.h).
+// With --bus, the state of every motor is published to the shared-memory status bus NAME for other
+// local processes (see statusbus.h).
+
+#include "motordriver.h"
+#ifdef _WIN32
+#include "aptdriver.h"
+#endif
+#include "simdriver.h"
+#include "controller.h"
+#include "paramcache.h"
+#include "instrdriver.h"
+#include "measurement.h"
+#include "ctlserver.h"
+#include "statusbus.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define SRV_DEFAULT_PORT 5025
+
+static ControlServer *server = nullptr;
+static StatusBus *statusBus = nullptr;
+
+static void OnSignal(int)
+{
+    if (server != nullptr)
+        server->Shutdown();
+}
+
+static void Usage()
+{
+    fprintf(stderr, "usage: mcpher_srv [--port N] [--unix PATH] [--sim UNITS] [--latency US] [--push MS] [--workers N]\n"
+                    "                  [--init-ms MS] [--init-jitter MS] [--cache PATH] [--diag PATH] [--envelope PATH] [--bus NAME]\n"
+                    "                  [--startup]\n");
+}
+
+static void PrintCacheStats(ParamCache *cache)
+{
+    paramCacheStats s;
+    cache->GetStats(&s);
+    printf("Parameter cache: %llu hits (device round trips saved), %llu misses, %llu writes, %llu read back, %llu changed\n",
+           (unsigned long long)s.hits, (unsigned long long)s.misses, (unsigned long long)s.writes,
+           (unsigned long long)s.revalidations, (unsigned long long)s.changes);
+}
+
+static void Teardown(ParamCache *cache, const char *cachePath, InstrumentedDriver *instr, const char *diagPath,
+                     MotorDriver *hwDriver, Measurement *measurement)
+{
+    if (cachePath != nullptr && cache->Save(cachePath))
+        fprintf(stderr, "Could not save the parameter cache to %s\n", cachePath);
+    cache->Cleanup();
+    if (diagPath != nullptr && instr->Dump(diagPath))
+        fprintf(stderr, "Could not write the diagnostics to %s\n", diagPath);
+    delete cache;
+    delete instr;
+    delete hwDriver;
+    if (measurement != nullptr)
+        delete measurement;
+}
+
+int main(int argc, char **argv)
+{
+    int port = SRV_DEFAULT_PORT;
+    const char *unixPath = nullptr;
+#ifdef _WIN32
+    long simUnits = 0;
+#else
+    long simUnits = 4; // no APT here
+#endif
+    unsigned latencyUs = 0;
+    int pushMs = 50;
+    int workers = 8;
+    unsigned initMs = 0, initJitter = 0;
+    const char *cachePath = nullptr;
+    const char *diagPath = nullptr;
+    const char *envPath = nullptr;
+    const char *busName = nullptr;
+    bool startupOnly = false;
+    long ret;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--port"))
+            port = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--unix"))
+            unixPath = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--sim"))
+            simUnits = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--push"))
+            pushMs = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--workers"))
+            workers = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--init-ms"))
+            initMs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--init-jitter"))
+            initJitter = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--cache"))
+            cachePath = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--diag"))
+            diagPath = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--envelope"))
+            envPath = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--bus"))
+            busName = argv[++i];
+        else if (!strcmp(argv[i], "--startup"))
+            startupOnly = true;
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+    MotorDriver *hwDriver;
+    Measurement *measurement = nullptr;
+    if (simUnits > 0)
+    {
+        SimDriver *sim = new SimDriver(simUnits, latencyUs);
+        sim->SetInitTime(initMs, initJitter);
+        hwDriver = sim;
+        SimDetector *det = new SimDetector(0.01, 0.002);
+        det->AddPeak(5.0f, 0.05f, 1.0);
+        det->AddPeak(12.0f, 0.2f, 0.4);
+        measurement = det;
+    }
+    else
+    {
+#ifdef _WIN32
+        hwDriver = new AptDriver();
+#else
+        Usage();
+        return 1;
+#endif
+    }
+    InstrumentedDriver *instr = new InstrumentedDriver(hwDriver);
+    ParamCache *cache = new ParamCache(instr);
+    if (cachePath != nullptr && (ret = cache->Load(cachePath)))
+        printf("No parameter cache loaded from %s (%ld)\n", cachePath, ret);
+    MotorDriver *driver = cache;
+    MotorController *controller = new MotorController(driver);
+    controller->SetSentHook([](long)
+                            {
+                                if (server != nullptr)
+                                    server->Wake(); });
+    controller->SetDeviceHook([](long idx, const deviceInfo &info)
+                              {
+                                  if (info.state == DEV_FAILED)
+                                      printf("Device %ld failed: %s returned %ld\n", idx, info.call, info.ret);
+                                  else if (info.ret)
+                                      printf("Device %ld ready in %.3f s, %s returned %ld\n", idx, info.initTime, info.call, info.ret);
+                                  else
+                                      printf("Device %ld ready in %.3f s\n", idx, info.initTime); });
+    if (busName != nullptr)
+    {
+        statusBus = new StatusBus();
+        controller->Telemetry()->SetChangeHook([](long idx)
+                                               { statusBus->Publish(idx); });
+    }
+    std::string msg;
+    if (envPath != nullptr && (ret = controller->Envelope()->Load(envPath, &msg)))
+    {
+        fprintf(stderr, "%s (%ld)\n", msg.c_str(), ret);
+        return 1;
+    }
+    ret = controller->Init(&msg, workers);
+    if (ret)
+    {
+        fprintf(stderr, "%s (%ld)\n", msg.c_str(), ret);
+        return 1;
+    }
+    // commands to a device still initializing would fail, so serve once every device is settled
+    controller->WaitAll(24 * 3600 * 1000);
+    double first = 1e9, all = 0;
+    for (long i = 0; i < controller->NumUnits(); i++)
+    {
+        deviceInfo info;
+        controller->GetDevice(i, &info);
+        if (info.state == DEV_READY && info.readyTime < first)
+            first = info.readyTime;
+        if (info.readyTime > all)
+            all = info.readyTime;
+    }
+    printf("%ld devices, %d workers: first usable after %.3f s, all done after %.3f s\n", controller->NumUnits(), workers, first, all);
+    if (statusBus != nullptr && (ret = statusBus->Open(busName, controller->Telemetry()->Registry())))
+        fprintf(stderr, "Could not open the status bus %s (%ld)\n", busName, ret);
+    else if (statusBus != nullptr)
+        printf("Publishing to the status bus %s\n", busName);
+    PrintCacheStats(cache);
+    if (startupOnly)
+    {
+        delete controller;
+        delete statusBus;
+        Teardown(cache, cachePath, instr, diagPath, hwDriver, measurement);
+        return 0;
+    }
+    server = new ControlServer(driver, controller->Telemetry(), controller->Commands(), controller->SerialNums(), controller->NumUnits());
+    server->SetMeasurement(measurement);
+    server->SetMotionModel(controller->Motion());
+    server->SetEnvelope(controller->Envelope());
+    server->SetStatusBus(statusBus);
+    server->SetPushInterval(pushMs);
+    if (server->ListenTcp(port))
+        fprintf(stderr, "Could not listen on 127.0.0.1:%d\n", port);
+    else
+        printf("Listening on 127.0.0.1:%d\n", server->Port());
+    if (unixPath != nullptr)
+    {
+        if (server->ListenUnix(unixPath))
+            fprintf(stderr, "Could not listen on %s\n", unixPath);
+        else
+            printf("Listening on %s\n", unixPath);
+    }
+    fflush(stdout);
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    ret = server->Run();
+    if (ret)
+        fprintf(stderr, "Server failed: %ld\n", ret);
+    printf("Served %llu requests\n", (unsigned long long)server->Requests());
+    controller->Shutdown(); // no more sent hooks into the server
+    delete server;
+    server = nullptr;
+    delete controller;
+    delete statusBus; // once nothing polls
+    PrintCacheStats(cache);
+    Teardown(cache, cachePath, instr, diagPath, hwDriver, measurement);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+// Deterministic simulation of the whole controller: simulated stages, telemetry, init workers and
+// scans on a virtual clock, so an hour of scanning runs in seconds and the same every time. Then
+// injected faults, a stage that stalls and a GetInMotion that fails, and the replay of a recording
+// against the same scans. The times printed are a baseline for performance regressions of the
+// controller's own code, free of the timing noise of real sleeps. Exits 1 if a check fails.
+//
+// usage: mcpher_simbench [--units N] [--minutes N] [--points N] [--dwell S] [--latency US] [--poll MS]
+
+#include "controller.h"
+#include "measurement.h"
+#include "recorder.h"
+#include "replaydriver.h"
+#include "scanengine.h"
+#include "simdriver.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+typedef struct
+{
+    long units;
+    double seconds; // virtual s to keep scanning for; every axis completes at least one scan
+    long points;
+    float span;     // mm
+    float dwell;    // s
+    float timeout;  // s, to settle at a point
+    unsigned latencyUs;
+    int pollMs;
+} simConfig;
+
+typedef struct
+{
+    long index;
+    float target;
+    float actual;
+    double value;
+} simPoint;
+
+typedef struct
+{
+    std::vector<long> rets;                      // per axis, of the scan that ended it
+    std::map<long, std::vector<simPoint>> points; // by serial number
+    long scans;
+    uint64_t digest;
+    double virtualTime;
+    double realTime;
+    uint64_t switches;
+} simRun;
+
+// FNV-1a, over the bytes of every point in order
+static void Digest(uint64_t *h, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < n; i++)
+        *h = (*h ^ p[i]) * 1099511628211ULL;
+}
+
+// every axis scans back and forth, on a thread of the clock of its own, until cfg.seconds have passed
+static bool Run(const simConfig &cfg, SimDriver *sim, VirtualClock *clock, Recorder *rec, std::function<void(const long *serNums)> setup, simRun *r)
+{
+    auto t0 = benchClock::now();
+    double v0 = clock->Now();
+    MotorController controller(sim, cfg.pollMs);
+    controller.SetClock(clock);
+    if (rec != nullptr)
+        controller.SetRecorder(rec);
+    std::string msg;
+    if (controller.Init(&msg) || !controller.WaitAll(10000))
+    {
+        fprintf(stderr, "Could not initialize the simulated stages: %s\n", msg.c_str());
+        return false;
+    }
+    long units = controller.NumUnits();
+    const long *serNums = controller.SerialNums();
+    if (setup)
+        setup(serNums);
+    r->rets.assign(units, 0);
+    r->points.clear();
+    std::vector<long> scans(units, 0);
+    std::vector<std::vector<simPoint>> points(units);
+    std::vector<std::thread> threads;
+    for (long i = 0; i < units; i++)
+    {
+        threads.push_back(clock->Spawn([&, i]()
+                                       {
+                                           ScanEngine eng(sim, controller.Telemetry(), i, serNums[i]);
+                                           CancelToken token(clock);
+                                           SimDetector det(0.1, 0.01, 0, 1 + (unsigned)i);
+                                           det.AddPeak(cfg.span / 2, cfg.span / 8, 1);
+                                           det.SetClock(clock);
+                                           eng.SetCancelToken(&token);
+                                           eng.SetMeasurement(&det);
+                                           eng.SetPointHook([&points, i](long idx, float target, float actual, double value)
+                                                            { points[i].push_back({idx, target, actual, value}); });
+                                           scanParams p = {};
+                                           p.start = 0;
+                                           p.stop = cfg.span;
+                                           p.step = cfg.span / (cfg.points - 1);
+                                           p.dwell = cfg.dwell;
+                                           p.settleTol = 0.005f;
+                                           p.settleCount = 3;
+                                           p.timeout = cfg.timeout;
+                                           long ret;
+                                           do
+                                           {
+                                               ret = eng.Run(p);
+                                               std::swap(p.start, p.stop);
+                                               scans[i]++;
+                                           } while (!ret && clock->Now() - v0 < cfg.seconds);
+                                           r->rets[i] = ret; }));
+    }
+    for (std::thread &thr : threads)
+        clock->Join(thr);
+    controller.Shutdown();
+
+    r->scans = 0;
+    r->digest = 14695981039346656037ULL;
+    for (long i = 0; i < units; i++)
+    {
+        r->scans += scans[i];
+        for (const simPoint &pt : points[i])
+        {
+            Digest(&r->digest, &pt.index, sizeof(pt.index));
+            Digest(&r->digest, &pt.target, sizeof(pt.target));
+            Digest(&r->digest, &pt.actual, sizeof(pt.actual));
+            Digest(&r->digest, &pt.value, sizeof(pt.value));
+        }
+        r->points[serNums[i]].swap(points[i]);
+    }
+    r->virtualTime = clock->Now() - v0;
+    Digest(&r->digest, &r->virtualTime, sizeof(r->virtualTime));
+    r->realTime = std::chrono::duration<double>(benchClock::now() - t0).count();
+    r->switches = clock->Switches();
+    return true;
+}
+
+static void Report(const char *what, const simRun &r)
+{
+    long points = 0;
+    for (const auto &pts : r.points)
+        points += (long)pts.second.size();
+    printf("%-16s %9.1f %8.3f %9.0fx %6ld %8ld %10llu  %016llx\n", what, r.virtualTime, r.realTime,
+           r.virtualTime / r.realTime, r.scans, points, (unsigned long long)r.switches, (unsigned long long)r.digest);
+}
+
+// the same points on every axis, at positions within tol
+static bool SamePoints(const simRun &a, const simRun &b, float tol)
+{
+    if (a.points.size() != b.points.size())
+        return false;
+    for (const auto &pts : a.points)
+    {
+        auto it = b.points.find(pts.first);
+        if (it == b.points.end() || it->second.size() != pts.second.size())
+            return false;
+        for (size_t k = 0; k < pts.second.size(); k++)
+        {
+            const simPoint &p = pts.second[k], &q = it->second[k];
+            if (p.index != q.index || p.target != q.target || fabs(p.actual - q.actual) > tol)
+                return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    simConfig cfg;
+    cfg.units = 4;
+    cfg.seconds = 3600;
+    cfg.points = 51;
+    cfg.span = 5;
+    cfg.dwell = 0.5f;
+    cfg.timeout = 30;
+    cfg.latencyUs = 2000;
+    cfg.pollMs = 20;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--units"))
+            cfg.units = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--minutes"))
+            cfg.seconds = 60 * atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--points"))
+            cfg.points = atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--dwell"))
+            cfg.dwell = (float)atof(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--latency"))
+            cfg.latencyUs = (unsigned)atol(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--poll"))
+            cfg.pollMs = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_simbench [--units N] [--minutes N] [--points N] [--dwell S] [--latency US] [--poll MS]\n");
+            return 1;
+        }
+    }
+    if (cfg.units < 3 || cfg.points < 2 || cfg.seconds < 0 || cfg.dwell < 0 || cfg.pollMs < 1)
+        return 1;
+
+    printf("run               virtual s   real s    speedup  scans   points   switches  digest\n");
+    simRun first, again;
+    {
+        VirtualClock clock;
+        SimDriver sim(cfg.units, cfg.latencyUs);
+        sim.SetClock(&clock);
+        if (!Run(cfg, &sim, &clock, nullptr, nullptr, &first))
+            return 1;
+        Report("scenario", first);
+    }
+    {
+        VirtualClock clock;
+        SimDriver sim(cfg.units, cfg.latencyUs);
+        sim.SetClock(&clock);
+        if (!Run(cfg, &sim, &clock, nullptr, nullptr, &again))
+            return 1;
+        Report("again", again);
+    }
+    bool ok = first.virtualTime >= cfg.seconds;
+    for (long ret : first.rets)
+        ok &= !ret;
+    Check(ok, "every axis scans for the whole scenario");
+    Check(first.digest == again.digest && first.switches == again.switches, "a rerun is the same to the last bit");
+
+    // one scan per axis from here on
+    simConfig one = cfg;
+    one.seconds = 0;
+    one.timeout = 5;
+    simRun stall;
+    {
+        VirtualClock clock;
+        SimDriver sim(cfg.units, cfg.latencyUs);
+        sim.SetClock(&clock);
+        if (!Run(one, &sim, &clock, nullptr, [&sim](const long *serNums)
+                 { sim.Stall(serNums[1], 0.5f); },
+                 &stall))
+            return 1;
+        Report("stalled stage", stall);
+    }
+    ok = stall.rets[1] == SCAN_ERR_TIMEOUT;
+    for (long i = 0; i < cfg.units; i++)
+        ok &= i == 1 || !stall.rets[i];
+    Check(ok, "a stalled stage times out, the others complete");
+
+    const long aptErr = 10004; // an error of the APT server
+    simRun fault;
+    long hit;
+    {
+        VirtualClock clock;
+        SimDriver sim(cfg.units, cfg.latencyUs);
+        sim.SetClock(&clock);
+        if (!Run(one, &sim, &clock, nullptr, [&sim](const long *serNums)
+                 { sim.AddFault({serNums[2], SIM_GETINMOTION, aptErr, 200, 0}); },
+                 &fault))
+            return 1;
+        hit = sim.FaultsHit();
+        Report("GetInMotion fault", fault);
+    }
+    ok = fault.rets[2] == aptErr && hit > 0;
+    for (long i = 0; i < cfg.units; i++)
+        ok &= i == 2 || !fault.rets[i];
+    Check(ok, "a failing GetInMotion ends its scan with the error");
+
+    const char *recPath = "mcpher_simbench.rec";
+    simRun recorded, replayed;
+    long mismatches;
+    {
+        VirtualClock clock;
+        SimDriver sim(cfg.units, cfg.latencyUs);
+        sim.SetClock(&clock);
+        Recorder rec;
+        rec.SetClock(&clock);
+        if (rec.Open(recPath, 1 << 20))
+        {
+            fprintf(stderr, "Could not open %s\n", recPath);
+            return 1;
+        }
+        if (!Run(one, &sim, &clock, &rec, nullptr, &recorded))
+            return 1;
+        rec.Close();
+        Report("recorded", recorded);
+    }
+    {
+        VirtualClock clock;
+        ReplayDriver replay;
+        replay.SetClock(&clock);
+        replay.SetLatency(cfg.latencyUs);
+        long ret = replay.Load(recPath);
+        if (ret)
+        {
+            fprintf(stderr, "Could not load %s: %ld\n", recPath, ret);
+            return 1;
+        }
+        if (!Run(one, &replay, &clock, nullptr, nullptr, &replayed))
+            return 1;
+        mismatches = replay.Mismatches();
+        Report("replayed", replayed);
+    }
+    remove(recPath);
+    ok = mismatches == 0;
+    for (long ret : replayed.rets)
+        ok &= !ret;
+    Check(ok, "the replayed scans match the recording");
+    Check(SamePoints(recorded, replayed, 0.005f), "they reach the recorded positions");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}
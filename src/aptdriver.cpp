@@ -0,0 +1,79 @@
+#include "aptdriver.h"
+
+#include <windows.h>
+#include <APTAPI.h>
+
+#pragma comment(lib, "APT.lib")
+
+long AptDriver::Init()
+{
+    return APTInit();
+}
+
+long AptDriver::Cleanup()
+{
+    return APTCleanUp();
+}
+
+long AptDriver::GetNumUnits(long *numUnits)
+{
+    return GetNumHWUnitsEx(HWTYPE_KST101, numUnits);
+}
+
+long AptDriver::GetSerialNum(long idx, long *serNum)
+{
+    return GetHWSerialNumEx(HWTYPE_KST101, idx, serNum);
+}
+
+long AptDriver::InitDevice(long serNum)
+{
+    return InitHWDevice(serNum);
+}
+
+long AptDriver::GetPosition(long serNum, float *pos)
+{
+    return MOT_GetPosition(serNum, pos);
+}
+
+long AptDriver::GetInMotion(long serNum, bool *moving)
+{
+    BOOL val = FALSE;
+    long ret = MOT_GetInMotion(serNum, &val);
+    *moving = val ? true : false;
+    return ret;
+}
+
+long AptDriver::MoveAbsolute(long serNum, float pos, bool wait)
+{
+    return MOT_MoveAbsoluteEx(serNum, pos, wait);
+}
+
+long AptDriver::MoveHome(long serNum, bool wait)
+{
+    return MOT_MoveHome(serNum, wait);
+}
+
+long AptDriver::Stop(long serNum)
+{
+    return MOT_StopProfiled(serNum);
+}
+
+long AptDriver::GetVelParams(long serNum, float *minVel, float *accel, float *maxVel)
+{
+    return MOT_GetVelParams(serNum, minVel, accel, maxVel);
+}
+
+long AptDriver::SetVelParams(long serNum, float minVel, float accel, float maxVel)
+{
+    return MOT_SetVelParams(serNum, minVel, accel, maxVel);
+}
+
+long AptDriver::GetVelParamLimits(long serNum, float *maxAccel, float *maxVel)
+{
+    return MOT_GetVelParamLimits(serNum, maxAccel, maxVel);
+}
+
+long AptDriver::GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst)
+{
+    return MOT_GetHomeParams(serNum, homeDir, limSwitch, homeVel, ofst);
+}
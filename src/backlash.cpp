@@ -0,0 +1,185 @@
+#include "backlash.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+BacklashTable::BacklashTable(float binWidth) : binWidth(binWidth > 0 ? binWidth : 1.0f)
+{
+}
+
+void BacklashTable::Add(entry *s, double x)
+{
+    s->w = s->w * BACKLASH_FORGET + 1;
+    s->x = s->x * BACKLASH_FORGET + x;
+    s->xx = s->xx * BACKLASH_FORGET + x * x;
+    s->n++;
+}
+
+float BacklashTable::Mean(const entry &s)
+{
+    return s.w > 0 ? (float)(s.x / s.w) : 0;
+}
+
+long BacklashTable::Bin(float pos) const
+{
+    // compared before the cast, so a huge or infinite position never becomes an index
+    double b = floor(pos / binWidth);
+    if (!(b < BACKLASH_MAX_BINS))
+        return -1;
+    return b < 0 ? 0 : (long)b;
+}
+
+void BacklashTable::Observe(long serNum, int dir, float cmd, float actual)
+{
+    if (!std::isfinite(actual) || !std::isfinite(cmd))
+        return;
+    int d = dir < 0;
+    long b = Bin(cmd);
+    std::lock_guard<std::mutex> lk(lock);
+    device &dev = devices[serNum];
+    Add(&dev.all[d], actual - cmd);
+    if (b < 0)
+        return;
+    if ((long)dev.bins.size() < 2 * (b + 1))
+        dev.bins.resize(2 * (b + 1), entry());
+    Add(&dev.bins[2 * b + d], actual - cmd);
+}
+
+float BacklashTable::Offset(long serNum, int dir, float pos) const
+{
+    int d = dir < 0;
+    long b = Bin(pos);
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = devices.find(serNum);
+    if (it == devices.end())
+        return 0;
+    const device &dev = it->second;
+    if (b >= 0 && 2 * b + d < (long)dev.bins.size() && dev.bins[2 * b + d].n > 0)
+        return Mean(dev.bins[2 * b + d]);
+    return Mean(dev.all[d]);
+}
+
+float BacklashTable::Backlash(long serNum) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = devices.find(serNum);
+    if (it == devices.end() || !it->second.all[0].n || !it->second.all[1].n)
+        return NAN;
+    return Mean(it->second.all[1]) - Mean(it->second.all[0]);
+}
+
+bool BacklashTable::GetFit(long serNum, backlashFit *fit) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = devices.find(serNum);
+    if (it == devices.end())
+        return false;
+    const device &dev = it->second;
+    fit->moves = dev.all[0].n + dev.all[1].n;
+    for (int d = 0; d < 2; d++)
+    {
+        const entry &s = dev.all[d];
+        fit->offset[d] = Mean(s);
+        double var = s.w > 0 ? s.xx / s.w - (s.x / s.w) * (s.x / s.w) : 0;
+        fit->spread[d] = s.n > 1 && var > 0 ? (float)sqrt(var) : 0;
+    }
+    fit->backlash = dev.all[0].n && dev.all[1].n ? fit->offset[1] - fit->offset[0] : NAN;
+    return true;
+}
+
+void BacklashTable::Clear(long serNum)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    devices.erase(serNum);
+}
+
+// one line per direction of every bin, bin -1 for the whole device
+long BacklashTable::Load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr)
+        return BACKLASH_ERR_FILE;
+    char line[256];
+    float width;
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, BACKLASH_MAGIC, strlen(BACKLASH_MAGIC)) ||
+        !fgets(line, sizeof(line), fp) || sscanf(line, "width %g", &width) != 1)
+    {
+        fclose(fp);
+        return BACKLASH_ERR_FORMAT;
+    }
+    std::lock_guard<std::mutex> lk(lock);
+    while (fgets(line, sizeof(line), fp))
+    {
+        long serNum, b;
+        int d;
+        entry s;
+        unsigned long long n;
+        // a damaged line is skipped, not allowed to size the table
+        if (sscanf(line, "%ld %ld %d %lg %lg %lg %llu", &serNum, &b, &d, &s.w, &s.x, &s.xx, &n) != 7 || d < 0 || d > 1 || b < -1 ||
+            b >= BACKLASH_MAX_BINS || !std::isfinite(s.w) || !std::isfinite(s.x) || !std::isfinite(s.xx))
+            continue;
+        s.n = n;
+        device &dev = devices[serNum];
+        if (b < 0)
+        {
+            if (!dev.all[d].n)
+                dev.all[d] = s;
+            continue;
+        }
+        if (width != binWidth) // bins of another size, only the device means apply
+            continue;
+        if ((long)dev.bins.size() < 2 * (b + 1))
+            dev.bins.resize(2 * (b + 1), entry());
+        if (!dev.bins[2 * b + d].n)
+            dev.bins[2 * b + d] = s;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// replaces path with tmp in one step, so a reader or a crash sees the old table or the new one
+static bool ReplaceTable(const std::string &tmp, const char *path)
+{
+#ifdef _WIN32
+    return MoveFileExA(tmp.c_str(), path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(tmp.c_str(), path) == 0;
+#endif
+}
+
+long BacklashTable::Save(const char *path) const
+{
+    // written beside the table and moved over it once whole, a failed write leaves the old one
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == nullptr)
+        return BACKLASH_ERR_FILE;
+    fprintf(fp, "%s\nwidth %.9g\n", BACKLASH_MAGIC, binWidth);
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        for (auto it = devices.begin(); it != devices.end(); ++it)
+        {
+            const device &dev = it->second;
+            for (long k = -2; k < (long)dev.bins.size(); k++)
+            {
+                const entry &s = k < 0 ? dev.all[k + 2] : dev.bins[k];
+                if (s.n)
+                    fprintf(fp, "%ld %ld %d %.9g %.9g %.9g %llu\n", it->first, k < 0 ? -1 : k / 2, (int)((k + 2) % 2), s.w, s.x, s.xx,
+                            (unsigned long long)s.n);
+            }
+        }
+    }
+    bool ok = !ferror(fp);
+    if (fclose(fp) || !ok || !ReplaceTable(tmp, path))
+    {
+        remove(tmp.c_str());
+        return BACKLASH_ERR_FILE;
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+#include "clock.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+class SteadyClock : public Clock
+{
+public:
+    double Now() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void Sleep(double seconds)
+    {
+        if (seconds > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    }
+
+    bool Wait(std::unique_lock<std::mutex> &lk, std::condition_variable &cv, double seconds, const std::function<bool()> &pred)
+    {
+        if (std::isinf(seconds))
+        {
+            cv.wait(lk, pred);
+            return true;
+        }
+        return cv.wait_for(lk, std::chrono::duration<double>(seconds > 0 ? seconds : 0), pred);
+    }
+
+    void Notify(std::condition_variable &cv)
+    {
+        cv.notify_all();
+    }
+
+    std::thread Spawn(std::function<void()> fn)
+    {
+        return std::thread(fn);
+    }
+
+    void Join(std::thread &thr)
+    {
+        if (thr.joinable())
+            thr.join();
+    }
+};
+
+Clock *DefaultClock()
+{
+    static SteadyClock clock;
+    return &clock;
+}
+
+VirtualClock::VirtualClock() : now(0), order(0), switches(0)
+{
+    std::unique_ptr<member> m(new member());
+    m->run = true;
+    m->done = false;
+    m->queued = false;
+    m->on = nullptr;
+    members[std::this_thread::get_id()] = std::move(m);
+}
+
+double VirtualClock::Now() const
+{
+    std::lock_guard<std::mutex> ck(lock);
+    return now;
+}
+
+uint64_t VirtualClock::Switches() const
+{
+    std::lock_guard<std::mutex> ck(lock);
+    return switches;
+}
+
+VirtualClock::member *VirtualClock::Self()
+{
+    auto it = members.find(std::this_thread::get_id());
+    if (it == members.end())
+    {
+        fprintf(stderr, "VirtualClock: a thread it did not spawn sleeps or waits on it\n");
+        abort();
+    }
+    return it->second.get();
+}
+
+void VirtualClock::Queue(member *m, double wake)
+{
+    if (m->queued)
+        ready.erase(m->key);
+    m->key = std::make_pair(wake, order++);
+    ready[m->key] = m;
+    m->queued = true;
+}
+
+void VirtualClock::Block(member *m, std::condition_variable *cv)
+{
+    m->on = cv;
+    waiting.insert(std::make_pair(cv, m));
+}
+
+void VirtualClock::Wake(std::condition_variable *cv)
+{
+    auto range = waiting.equal_range(cv);
+    std::vector<member *> woken;
+    for (auto it = range.first; it != range.second; it++)
+        woken.push_back(it->second);
+    waiting.erase(range.first, range.second);
+    for (member *m : woken)
+    {
+        m->on = nullptr;
+        Queue(m, now);
+    }
+}
+
+// the turn goes to the earliest wakeup; with nothing to wake, every thread waits for another one
+void VirtualClock::Next(member *self)
+{
+    if (ready.empty())
+    {
+        fprintf(stderr, "VirtualClock: deadlock, every thread waits without a timeout\n");
+        abort();
+    }
+    auto first = ready.begin();
+    member *m = first->second;
+    if (first->first.first > now)
+        now = first->first.first;
+    ready.erase(first);
+    m->queued = false;
+    if (m->on != nullptr) // timed out
+    {
+        auto range = waiting.equal_range(m->on);
+        for (auto it = range.first; it != range.second; it++)
+        {
+            if (it->second == m)
+            {
+                waiting.erase(it);
+                break;
+            }
+        }
+        m->on = nullptr;
+    }
+    if (m != self)
+        switches++;
+    m->run = true;
+    m->turn.notify_one();
+}
+
+void VirtualClock::Switch(std::unique_lock<std::mutex> &ck, member *self)
+{
+    self->run = false;
+    Next(self);
+    while (!self->run)
+        self->turn.wait(ck);
+}
+
+void VirtualClock::Sleep(double seconds)
+{
+    std::unique_lock<std::mutex> ck(lock);
+    member *self = Self();
+    Queue(self, now + (seconds > 0 ? seconds : 0));
+    Switch(ck, self);
+}
+
+bool VirtualClock::Wait(std::unique_lock<std::mutex> &lk, std::condition_variable &cv, double seconds, const std::function<bool()> &pred)
+{
+    double deadline = Now() + (seconds > 0 ? seconds : 0);
+    while (!pred())
+    {
+        // no other thread runs until this one blocks, so nothing can make pred true meanwhile
+        std::unique_lock<std::mutex> ck(lock);
+        if (now >= deadline)
+            break;
+        member *self = Self();
+        Block(self, &cv);
+        if (!std::isinf(deadline))
+            Queue(self, deadline);
+        lk.unlock();
+        Switch(ck, self);
+        ck.unlock();
+        lk.lock();
+    }
+    return pred();
+}
+
+void VirtualClock::Notify(std::condition_variable &cv)
+{
+    std::lock_guard<std::mutex> ck(lock);
+    Wake(&cv);
+}
+
+std::thread VirtualClock::Spawn(std::function<void()> fn)
+{
+    std::unique_lock<std::mutex> ck(lock);
+    std::unique_ptr<member> owner(new member());
+    member *m = owner.get();
+    m->run = false;
+    m->done = false;
+    m->queued = false;
+    m->on = nullptr;
+    Queue(m, now);
+    std::thread thr([this, m, fn]()
+                    {
+                        {
+                            std::unique_lock<std::mutex> ck(lock);
+                            while (!m->run)
+                                m->turn.wait(ck);
+                        }
+                        fn();
+                        std::lock_guard<std::mutex> ck(lock);
+                        m->done = true;
+                        Wake(&m->exit);
+                        m->run = false;
+                        Next(m); });
+    members[thr.get_id()] = std::move(owner);
+    return thr;
+}
+
+void VirtualClock::Join(std::thread &thr)
+{
+    if (!thr.joinable())
+        return;
+    {
+        std::unique_lock<std::mutex> ck(lock);
+        auto it = members.find(thr.get_id());
+        if (it != members.end())
+        {
+            member *m = it->second.get();
+            member *self = Self();
+            while (!m->done)
+            {
+                Block(self, &m->exit);
+                Switch(ck, self);
+            }
+        }
+    }
+    std::thread::id id = thr.get_id();
+    thr.join();
+    std::lock_guard<std::mutex> ck(lock);
+    members.erase(id);
+}
@@ -0,0 +1,336 @@
+#include "cmdqueue.h"
+
+#include <algorithm>
+#include <cmath>
+
+CommandQueue::CommandQueue(MotorDriver *drv) : drv(drv), rec(nullptr), clock(DefaultClock()), env(nullptr), tel(nullptr), running(false)
+{
+    stats = {};
+}
+
+CommandQueue::~CommandQueue()
+{
+    Stop();
+}
+
+void CommandQueue::Start(const long *serNums, long numUnits, long capacity)
+{
+    if (running)
+        return;
+    running = true;
+    devices.clear();
+    for (long i = 0; i < (capacity > numUnits ? capacity : numUnits); i++)
+    {
+        std::unique_ptr<device> dev(new device());
+        dev->serNum = 0;
+        dev->present = false;
+        dev->target = NAN;
+        dev->queued = NAN;
+        devices.push_back(std::move(dev));
+    }
+    for (long i = 0; i < numUnits; i++)
+        Add(i, serNums[i]);
+}
+
+long CommandQueue::Add(long idx, long serNum)
+{
+    std::lock_guard<std::mutex> alk(addLock);
+    if (!running || idx < 0 || idx >= (long)devices.size())
+        return DRV_ERR_PARAM;
+    device *dev = devices[idx].get();
+    {
+        std::lock_guard<std::mutex> lk(dev->lock);
+        if (dev->present)
+            return DRV_ERR_PARAM;
+        dev->serNum = serNum;
+        dev->present = true;
+        dev->target = NAN;
+        dev->queued = NAN;
+    }
+    dev->thr = clock->Spawn([this, idx]()
+                            { WorkerFcn(idx); });
+    return 0;
+}
+
+long CommandQueue::Remove(long idx)
+{
+    std::lock_guard<std::mutex> alk(addLock);
+    if (!running || idx < 0 || idx >= (long)devices.size())
+        return DRV_ERR_PARAM;
+    device *dev = devices[idx].get();
+    std::deque<std::unique_ptr<command>> pending;
+    {
+        std::lock_guard<std::mutex> lk(dev->lock);
+        if (!dev->present)
+            return DRV_ERR_NODEVICE;
+        dev->present = false;
+        pending.swap(dev->pending);
+    }
+    clock->Notify(dev->cond);
+    clock->Join(dev->thr);
+    cmdResult res = {};
+    res.ret = CMD_ERR_CANCELLED;
+    for (auto &cmd : pending)
+        Finish(cmd.get(), res);
+    return 0;
+}
+
+void CommandQueue::Stop()
+{
+    std::lock_guard<std::mutex> alk(addLock);
+    if (!running)
+        return;
+    running = false;
+    // a worker checks running under its device lock, so once the lock has been through no worker can
+    // miss the wakeup; one lock at a time, there may be hundreds
+    for (size_t i = 0; i < devices.size(); i++)
+        std::lock_guard<std::mutex> lk(devices[i]->lock);
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        clock->Notify(devices[i]->cond);
+        clock->Join(devices[i]->thr);
+    }
+    cmdResult res = {};
+    res.ret = CMD_ERR_CANCELLED;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        for (auto &cmd : devices[i]->pending)
+            Finish(cmd.get(), res);
+        devices[i]->pending.clear();
+    }
+}
+
+void CommandQueue::SetSentHook(std::function<void(long idx)> hook)
+{
+    sentHook = hook;
+}
+
+void CommandQueue::SetRecorder(Recorder *rec)
+{
+    this->rec = rec;
+}
+
+void CommandQueue::SetClock(Clock *clock)
+{
+    this->clock = clock != nullptr ? clock : DefaultClock();
+}
+
+void CommandQueue::SetEnvelope(const SafetyEnvelope *env, const MotorTelemetry *tel)
+{
+    this->env = env;
+    this->tel = tel;
+}
+
+cmdFuture CommandQueue::Move(long idx, float pos)
+{
+    return Submit(idx, CMD_MOVE, pos, 0, 0);
+}
+
+cmdFuture CommandQueue::Home(long idx)
+{
+    return Submit(idx, CMD_HOME, 0, 0, 0);
+}
+
+cmdFuture CommandQueue::SetVel(long idx, float minVel, float accel, float maxVel)
+{
+    return Submit(idx, CMD_SETVEL, minVel, accel, maxVel);
+}
+
+cmdFuture CommandQueue::Halt(long idx)
+{
+    return Submit(idx, CMD_STOP, 0, 0, 0);
+}
+
+cmdQueueStats CommandQueue::GetStats() const
+{
+    std::lock_guard<std::mutex> lk(statLock);
+    return stats;
+}
+
+size_t CommandQueue::Pending(long idx) const
+{
+    if (idx < 0 || idx >= (long)devices.size())
+        return 0;
+    std::lock_guard<std::mutex> lk(devices[idx]->lock);
+    return devices[idx]->pending.size();
+}
+
+float CommandQueue::Target(long idx) const
+{
+    if (idx < 0 || idx >= (long)devices.size())
+        return NAN;
+    return devices[idx]->target;
+}
+
+// does a pending command of type 'old' become pointless once 'type' is queued?
+static bool Supersedes(cmdType type, cmdType old)
+{
+    switch (type)
+    {
+    case CMD_MOVE:
+        return old == CMD_MOVE; // a pending home still runs first, the target is in the coordinates it sets
+    case CMD_HOME:
+    case CMD_STOP:
+        return old == CMD_MOVE || old == CMD_HOME;
+    case CMD_SETVEL:
+        return old == CMD_SETVEL;
+    }
+    return false;
+}
+
+cmdFuture CommandQueue::Submit(long idx, cmdType type, float a0, float a1, float a2)
+{
+    std::unique_ptr<command> cmd(new command());
+    cmd->type = type;
+    cmd->args[0] = a0;
+    cmd->args[1] = a1;
+    cmd->args[2] = a2;
+    cmd->submitted = clock->Now();
+    cmdFuture fut = cmd->done.get_future().share();
+    {
+        std::lock_guard<std::mutex> lk(statLock);
+        stats.submitted++;
+    }
+    if (!running || idx < 0 || idx >= (long)devices.size())
+    {
+        cmdResult res = {};
+        res.ret = running ? DRV_ERR_PARAM : CMD_ERR_CANCELLED;
+        Finish(cmd.get(), res);
+        return fut;
+    }
+    device *dev = devices[idx].get();
+    std::vector<std::unique_ptr<command>> dropped;
+    {
+        std::lock_guard<std::mutex> lk(dev->lock);
+        if (!running || !dev->present) // raced with Stop(), or unplugged
+        {
+            cmdResult res = {};
+            res.ret = running ? DRV_ERR_NODEVICE : CMD_ERR_CANCELLED;
+            Finish(cmd.get(), res);
+            return fut;
+        }
+        cmdResult res = {};
+        if ((res.ret = Check(dev, type, cmd->args)))
+        {
+            Finish(cmd.get(), res);
+            return fut;
+        }
+        if (type == CMD_MOVE || type == CMD_HOME || type == CMD_STOP)
+            dev->queued = type == CMD_MOVE ? a0 : type == CMD_HOME ? 0 : NAN;
+        for (auto it = dev->pending.begin(); it != dev->pending.end();)
+        {
+            if (Supersedes(type, (*it)->type))
+            {
+                dropped.push_back(std::move(*it));
+                it = dev->pending.erase(it);
+            }
+            else
+                it++;
+        }
+        if (type == CMD_STOP) // stop jumps the queue
+            dev->pending.push_front(std::move(cmd));
+        else
+            dev->pending.push_back(std::move(cmd));
+    }
+    clock->Notify(dev->cond);
+    cmdResult res = {};
+    res.ret = CMD_ERR_SUPERSEDED;
+    for (size_t i = 0; i < dropped.size(); i++)
+        Finish(dropped[i].get(), res);
+    if (dropped.size())
+    {
+        std::lock_guard<std::mutex> lk(statLock);
+        stats.coalesced += dropped.size();
+    }
+    return fut;
+}
+
+long CommandQueue::Check(device *dev, cmdType type, const float *args) const
+{
+    if (env == nullptr)
+        return 0;
+    if (type == CMD_SETVEL)
+        return env->CheckVel(dev->serNum, args[0], args[1], args[2]);
+    if (type != CMD_MOVE && type != CMD_HOME)
+        return 0;
+    long ret;
+    if (type == CMD_MOVE && (ret = env->CheckTarget(dev->serNum, args[0])))
+        return ret;
+    long n = env->NumAxes();
+    if (tel == nullptr || env->Axis(dev->serNum) < 0)
+        return 0;
+    std::vector<float> lo(n), hi(n);
+    env->Where(tel, lo.data(), hi.data());
+    // and where the moves queued but not sent yet take the other axes
+    const MotorRegistry *reg = tel->Registry();
+    for (long a = 0; a < n; a++)
+    {
+        long slot = reg->Find(env->SerialNum(a));
+        if (slot < 0 || slot >= (long)devices.size() || std::isnan(lo[a]))
+            continue;
+        float q = devices[slot]->queued;
+        if (!std::isnan(q))
+        {
+            lo[a] = std::min(lo[a], q);
+            hi[a] = std::max(hi[a], q);
+        }
+    }
+    return env->CheckPath(dev->serNum, type == CMD_MOVE ? args[0] : 0, lo.data(), hi.data());
+}
+
+void CommandQueue::Finish(command *cmd, cmdResult &res)
+{
+    res.latency = clock->Now() - cmd->submitted;
+    cmd->done.set_value(res);
+}
+
+void CommandQueue::WorkerFcn(long idx)
+{
+    device *dev = devices[idx].get();
+    while (true)
+    {
+        std::unique_ptr<command> cmd;
+        {
+            std::unique_lock<std::mutex> lk(dev->lock);
+            clock->Wait(lk, dev->cond, INFINITY, [this, dev]
+                        { return !running || !dev->present || !dev->pending.empty(); });
+            if (!running || !dev->present)
+                break;
+            cmd = std::move(dev->pending.front());
+            dev->pending.pop_front();
+        }
+        cmdResult res = {};
+        dev->target = NAN;
+        switch (cmd->type)
+        {
+        case CMD_MOVE:
+            res.ret = drv->MoveAbsolute(dev->serNum, cmd->args[0], false);
+            if (!res.ret)
+                dev->target = cmd->args[0];
+            break;
+        case CMD_HOME:
+            res.ret = drv->MoveHome(dev->serNum, false);
+            if (!res.ret)
+                dev->target = 0;
+            break;
+        case CMD_SETVEL:
+            res.ret = drv->SetVelParams(dev->serNum, cmd->args[0], cmd->args[1], cmd->args[2]);
+            if (!res.ret)
+                res.ret = drv->GetVelParams(dev->serNum, &res.minVel, &res.Accel, &res.maxVel);
+            break;
+        case CMD_STOP:
+            res.ret = drv->Stop(dev->serNum);
+            break;
+        }
+        if (rec != nullptr)
+            rec->LogCommand(dev->serNum, cmd->type, cmd->args[0], res.ret);
+        Finish(cmd.get(), res);
+        if (sentHook) // after Finish, so the hook may look at the result
+            sentHook(idx);
+        std::lock_guard<std::mutex> lk(statLock);
+        stats.sent++;
+        stats.totalLatency += res.latency;
+        if (res.latency > stats.maxLatency)
+            stats.maxLatency = res.latency;
+    }
+}
@@ -0,0 +1,350 @@
+#include "controller.h"
+
+#include <algorithm>
+#include <cmath>
+
+MotorController::MotorController(MotorDriver *drv, int pollMs) : drv(drv), rec(nullptr), clock(DefaultClock()), capacity(CTL_MAX_UNITS), maxWorkers(1), tel(new MotorTelemetry(drv, pollMs)), cmd(new CommandQueue(drv)),
+                                                                 env(new SafetyEnvelope()), backlash(new BacklashTable()), stopping(false), numPending(0)
+{
+    cmd->SetEnvelope(env.get(), tel.get());
+}
+
+MotorController::~MotorController()
+{
+    Shutdown();
+}
+
+void MotorController::SetRecorder(Recorder *rec)
+{
+    this->rec = rec;
+}
+
+void MotorController::SetSentHook(std::function<void(long idx)> hook)
+{
+    sentHook = hook;
+}
+
+void MotorController::SetDeviceHook(std::function<void(long idx, const deviceInfo &info)> hook)
+{
+    deviceHook = hook;
+}
+
+void MotorController::SetCapacity(long maxUnits)
+{
+    capacity = maxUnits;
+}
+
+void MotorController::SetClock(Clock *clock)
+{
+    this->clock = clock != nullptr ? clock : DefaultClock();
+    tel->SetClock(this->clock);
+    cmd->SetClock(this->clock);
+}
+
+long MotorController::Init(std::string *msg, int maxWorkers)
+{
+    t0 = clock->Now();
+    std::string err;
+    long numUnits = 0;
+    long ret = drv->Init();
+    if (ret)
+        err = "Failed to initialize APT library.";
+    else if ((ret = drv->GetNumUnits(&numUnits)))
+        err = "Failed to enumerate K-Cubes.";
+    else if (numUnits == 0)
+    {
+        ret = CTL_ERR_NOUNITS;
+        err = "Could not find any K-Cubes.";
+    }
+    std::vector<long> serNums(numUnits, 0);
+    for (long i = 0; i < numUnits && !ret; i++)
+    {
+        if ((ret = drv->GetSerialNum(i, &serNums[i])))
+            err = "Failed to get serial number for device " + std::to_string(i);
+    }
+    if (ret)
+    {
+        if (msg != nullptr)
+            *msg = err;
+        return ret;
+    }
+    if (capacity < numUnits)
+        capacity = numUnits;
+    deviceInfo blank = {};
+    blank.state = DEV_PENDING;
+    devices.assign(capacity, blank);
+    numPending = numUnits;
+    motion.reset(new MotionModel(capacity));
+    // pollers and queues exist from the start, a poller begins once its device is ready
+    tel->SetRecorder(rec);
+    tel->Start(serNums.data(), numUnits, false, capacity);
+    cmd->SetRecorder(rec);
+    cmd->SetSentHook([this](long idx)
+                     {
+                         float target = cmd->Target(idx);
+                         if (!std::isnan(target))
+                             tel->SetTarget(idx, target);
+                         tel->Kick(idx);
+                         if (sentHook)
+                             sentHook(idx); });
+    cmd->Start(serNums.data(), numUnits, capacity);
+    stopping = false;
+    this->maxWorkers = maxWorkers < 1 ? 1 : maxWorkers;
+    std::lock_guard<std::mutex> lk(lock);
+    for (long i = 0; i < numUnits; i++)
+        Queue(i);
+    return 0;
+}
+
+void MotorController::Queue(long idx)
+{
+    if (stopping)
+        return;
+    toInit.push_back(idx);
+    if ((long)workers.size() < maxWorkers && (long)workers.size() < numPending)
+        workers.push_back(clock->Spawn([this]()
+                                       { InitFcn(); }));
+    clock->Notify(work);
+}
+
+void MotorController::InitFcn()
+{
+    while (true)
+    {
+        long idx;
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            clock->Wait(lk, work, INFINITY, [this]
+                        { return stopping || !toInit.empty(); });
+            if (stopping)
+                return;
+            idx = toInit.front();
+            toInit.pop_front();
+        }
+        InitDevice(idx);
+    }
+}
+
+void MotorController::InitDevice(long idx)
+{
+    long serNum = SerialNums()[idx];
+    deviceInfo info = {};
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        devices[idx].state = DEV_INITIALIZING;
+    }
+    double start = clock->Now();
+    // the first failure is kept; a failed parameter read leaves the motor usable
+    auto check = [&info](long ret, const char *call)
+    {
+        if (ret && !info.ret)
+        {
+            info.ret = ret;
+            info.call = call;
+        }
+    };
+    // everything the panel needs, read once here instead of on the first frame
+    check(drv->InitDevice(serNum), "InitDevice");
+    bool failed = info.ret != 0;
+    if (!failed)
+    {
+        check(drv->GetHomeParams(serNum, &info.homeDir, &info.limSwitch, &info.homeVel, &info.ofst), "GetHomeParams");
+        check(drv->GetPosition(serNum, &info.pos), "GetPosition");
+        long ret = drv->GetVelParamLimits(serNum, &info.limMaxAccel, &info.limMaxVel);
+        check(ret, "GetVelParamLimits");
+        if (!ret)
+            env->SetDeviceLimits(serNum, info.limMaxAccel, info.limMaxVel);
+        check(drv->GetVelParams(serNum, &info.minVel, &info.Accel, &info.maxVel), "GetVelParams");
+    }
+    double now = clock->Now();
+    info.state = failed ? DEV_FAILED : DEV_READY;
+    info.initTime = now - start;
+    info.readyTime = now - t0;
+    if (info.state == DEV_READY)
+        tel->Activate(idx);
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        devices[idx] = info;
+    }
+    if (deviceHook)
+        deviceHook(idx, info);
+    {
+        std::lock_guard<std::mutex> lk(lock); // WaitAll() returns after the last hook
+        numPending--;
+    }
+    clock->Notify(done);
+}
+
+bool MotorController::WaitAll(int timeoutMs)
+{
+    std::unique_lock<std::mutex> lk(lock);
+    return clock->Wait(lk, done, timeoutMs / 1e3, [this]
+                       { return numPending == 0; });
+}
+
+long MotorController::AddDevice(long serNum, long *idx)
+{
+    std::lock_guard<std::mutex> rlk(rescanLock);
+    if (stopping || tel->Registry() == nullptr)
+        return DRV_ERR_NOTINIT;
+    long ret = tel->Add(serNum, false, idx);
+    if (ret)
+        return ret;
+    cmd->Add(*idx, serNum);
+    std::lock_guard<std::mutex> lk(lock);
+    deviceInfo blank = {};
+    blank.state = DEV_PENDING;
+    devices[*idx] = blank;
+    numPending++;
+    Queue(*idx);
+    return 0;
+}
+
+long MotorController::RemoveDevice(long idx)
+{
+    std::lock_guard<std::mutex> rlk(rescanLock);
+    if (stopping || tel->Registry() == nullptr)
+        return DRV_ERR_NOTINIT;
+    {
+        // one still waiting for a worker is dropped; one being initialized is removed once it is done
+        std::unique_lock<std::mutex> lk(lock);
+        for (auto it = toInit.begin(); it != toInit.end(); it++)
+        {
+            if (*it == idx)
+            {
+                toInit.erase(it);
+                numPending--;
+                break;
+            }
+        }
+        clock->Wait(lk, done, INFINITY, [this, idx]
+                    { return stopping || devices[idx].state != DEV_INITIALIZING; });
+    }
+    long ret = tel->Remove(idx);
+    if (ret)
+        return ret;
+    cmd->Remove(idx);
+    deviceInfo info;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        devices[idx].state = DEV_REMOVED;
+        info = devices[idx];
+    }
+    clock->Notify(done);
+    if (deviceHook)
+        deviceHook(idx, info);
+    return 0;
+}
+
+long MotorController::Rescan(long *added, long *removed, std::string *msg)
+{
+    long numUnits = 0, ret;
+    if ((ret = drv->GetNumUnits(&numUnits)))
+    {
+        if (msg != nullptr)
+            *msg = "Failed to enumerate K-Cubes.";
+        return ret;
+    }
+    std::vector<long> found(numUnits);
+    for (long i = 0; i < numUnits; i++)
+    {
+        if ((ret = drv->GetSerialNum(i, &found[i])))
+        {
+            if (msg != nullptr)
+                *msg = "Failed to get serial number for device " + std::to_string(i);
+            return ret;
+        }
+    }
+    const MotorRegistry *reg = tel->Registry();
+    long numAdded = 0, numRemoved = 0;
+    for (long i = 0; i < NumUnits(); i++)
+    {
+        if (reg->Present(i) && std::find(found.begin(), found.end(), reg->SerialNum(i)) == found.end() && !RemoveDevice(i))
+            numRemoved++;
+    }
+    for (long serNum : found)
+    {
+        long idx;
+        long slot = reg->Find(serNum);
+        if (slot >= 0 && reg->Present(slot))
+            continue;
+        if ((ret = AddDevice(serNum, &idx)))
+        {
+            if (msg != nullptr)
+                *msg = ret == REG_ERR_FULL ? "No slot left for device " + std::to_string(serNum) + "." : "Could not add device " + std::to_string(serNum) + ".";
+            break;
+        }
+        numAdded++;
+    }
+    if (added != nullptr)
+        *added = numAdded;
+    if (removed != nullptr)
+        *removed = numRemoved;
+    return ret;
+}
+
+void MotorController::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        stopping = true;
+    }
+    clock->Notify(work);
+    clock->Notify(done);
+    std::lock_guard<std::mutex> rlk(rescanLock); // an AddDevice() or RemoveDevice() in progress ends first
+    for (size_t i = 0; i < workers.size(); i++)
+        clock->Join(workers[i]);
+    workers.clear();
+    cmd->Stop();
+    tel->Stop();
+}
+
+long MotorController::NumUnits() const
+{
+    return tel->NumUnits();
+}
+
+const long *MotorController::SerialNums() const
+{
+    const MotorRegistry *reg = tel->Registry();
+    return reg != nullptr ? reg->SerialNums() : nullptr;
+}
+
+bool MotorController::GetDevice(long idx, deviceInfo *info) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    if (idx < 0 || idx >= (long)devices.size())
+        return false;
+    *info = devices[idx];
+    return true;
+}
+
+MotorDriver *MotorController::Driver() const
+{
+    return drv;
+}
+
+MotorTelemetry *MotorController::Telemetry() const
+{
+    return tel.get();
+}
+
+CommandQueue *MotorController::Commands() const
+{
+    return cmd.get();
+}
+
+MotionModel *MotorController::Motion() const
+{
+    return motion.get();
+}
+
+SafetyEnvelope *MotorController::Envelope() const
+{
+    return env.get();
+}
+
+BacklashTable *MotorController::Backlash() const
+{
+    return backlash.get();
+}
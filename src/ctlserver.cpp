@@ -0,0 +1,619 @@
+#include "ctlserver.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define poll WSAPoll
+#define SRV_SEND_FLAGS 0
+#define SRV_INVALID INVALID_SOCKET
+static void SockClose(srvSocket fd) { closesocket(fd); }
+static bool SockWouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+static void SockNonBlocking(srvSocket fd)
+{
+    u_long on = 1;
+    ioctlsocket(fd, FIONBIO, &on);
+}
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef MSG_NOSIGNAL
+#define SRV_SEND_FLAGS MSG_NOSIGNAL // a vanished client must not raise SIGPIPE
+#else
+#define SRV_SEND_FLAGS 0
+#endif
+#define SRV_INVALID (-1)
+static void SockClose(srvSocket fd) { close(fd); }
+static bool SockWouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+static void SockNonBlocking(srvSocket fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK); }
+#endif
+
+#define SRV_MAX_LINE 4096        // longer requests close the connection
+#define SRV_MAX_BACKLOG (1 << 20) // bytes queued to a client before state pushes are skipped
+#define SRV_MAX_ARGS 8
+
+ControlServer::ControlServer(MotorDriver *drv, MotorTelemetry *tel, CommandQueue *cmd, const long *serNums, long numUnits)
+    : drv(drv), tel(tel), cmd(cmd), meas(nullptr), model(nullptr), env(nullptr), bus(nullptr), serNums(serNums, serNums + numUnits), port(0), wakeFd(SRV_INVALID),
+      running(true), pushMs(50), nextId(1), requests(0), pushed(numUnits), tasks((int)numUnits)
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+    for (long i = 0; i < numUnits; i++)
+    {
+        scans.push_back(std::unique_ptr<scanJob>(new scanJob()));
+        scans[i]->active = false;
+        scans[i]->client = 0;
+        tel->GetState(i, &pushed[i]);
+    }
+    // a datagram to ourselves wakes poll() on every platform, unlike a pipe on Windows
+    wakeFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wakeFd != SRV_INVALID)
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(wakeFd, (sockaddr *)&addr, sizeof(addr)) || getsockname(wakeFd, (sockaddr *)&addr, &len) ||
+            connect(wakeFd, (sockaddr *)&addr, sizeof(addr)))
+        {
+            SockClose(wakeFd);
+            wakeFd = SRV_INVALID;
+        }
+        else
+            SockNonBlocking(wakeFd);
+    }
+}
+
+ControlServer::~ControlServer()
+{
+    StopScans();
+    for (size_t i = 0; i < clients.size(); i++)
+        SockClose(clients[i]->fd);
+    for (size_t i = 0; i < listeners.size(); i++)
+        SockClose(listeners[i]);
+#ifndef _WIN32
+    if (unixPath.size())
+        unlink(unixPath.c_str());
+#endif
+    if (wakeFd != SRV_INVALID)
+        SockClose(wakeFd);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+void ControlServer::SetMeasurement(Measurement *meas)
+{
+    this->meas = meas;
+}
+
+void ControlServer::SetMotionModel(MotionModel *model)
+{
+    this->model = model;
+}
+
+void ControlServer::SetEnvelope(const SafetyEnvelope *env)
+{
+    this->env = env;
+}
+
+void ControlServer::SetStatusBus(StatusBus *bus)
+{
+    this->bus = bus;
+}
+
+void ControlServer::SetPushInterval(int ms)
+{
+    pushMs = ms < 1 ? 1 : ms;
+}
+
+long ControlServer::ListenTcp(int port)
+{
+    srvSocket fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == SRV_INVALID)
+        return SRV_ERR_SOCKET;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // local automation only
+    addr.sin_port = htons((unsigned short)port);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 128) || getsockname(fd, (sockaddr *)&addr, &len))
+    {
+        SockClose(fd);
+        return SRV_ERR_SOCKET;
+    }
+    SockNonBlocking(fd);
+    this->port = ntohs(addr.sin_port);
+    listeners.push_back(fd);
+    return 0;
+}
+
+int ControlServer::Port() const
+{
+    return port;
+}
+
+#ifndef _WIN32
+// true if nothing accepts connections at addr any more: connecting is refused
+static bool UnixStale(const sockaddr_un *addr)
+{
+    srvSocket fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == SRV_INVALID)
+        return false;
+    SockNonBlocking(fd); // a live server with a full backlog must not block us
+    bool stale = connect(fd, (const sockaddr *)addr, sizeof(*addr)) != 0 && errno == ECONNREFUSED;
+    SockClose(fd);
+    return stale;
+}
+#endif
+
+long ControlServer::ListenUnix(const char *path)
+{
+#ifdef _WIN32
+    (void)path;
+    return SRV_ERR_SOCKET;
+#else
+    sockaddr_un addr = {};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return SRV_ERR_SOCKET;
+    srvSocket fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == SRV_INVALID)
+        return SRV_ERR_SOCKET;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // only the socket of a server that is gone is replaced, never another file or a live server's socket
+    struct stat st;
+    if (lstat(path, &st) == 0 && (!S_ISSOCK(st.st_mode) || !UnixStale(&addr) || unlink(path)))
+    {
+        SockClose(fd);
+        return SRV_ERR_SOCKET;
+    }
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 128))
+    {
+        SockClose(fd);
+        return SRV_ERR_SOCKET;
+    }
+    SockNonBlocking(fd);
+    unixPath = path;
+    listeners.push_back(fd);
+    return 0;
+#endif
+}
+
+void ControlServer::Shutdown()
+{
+    running = false;
+    Wake();
+}
+
+void ControlServer::Wake()
+{
+    if (wakeFd != SRV_INVALID)
+        send(wakeFd, "w", 1, 0); // a full socket buffer already guarantees a wakeup
+}
+
+uint64_t ControlServer::Requests() const
+{
+    return requests;
+}
+
+long ControlServer::Run()
+{
+    if (listeners.empty() || wakeFd == SRV_INVALID)
+        return SRV_ERR_SOCKET;
+    std::vector<pollfd> fds;
+    auto lastPush = std::chrono::steady_clock::now();
+    while (running)
+    {
+        bool subscribed = false;
+        fds.clear();
+        fds.push_back({wakeFd, POLLIN, 0});
+        for (size_t i = 0; i < listeners.size(); i++)
+            fds.push_back({listeners[i], POLLIN, 0});
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            fds.push_back({clients[i]->fd, (short)(POLLIN | (clients[i]->out.size() ? POLLOUT : 0)), 0});
+            subscribed |= clients[i]->sub;
+        }
+        int timeout = -1; // replies and scan events wake us, only state pushes need a timer
+        if (subscribed)
+        {
+            int since = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastPush).count();
+            timeout = since >= pushMs ? 0 : pushMs - since;
+        }
+        if (poll(fds.data(), (unsigned long)fds.size(), timeout) < 0 && !SockWouldBlock())
+            return SRV_ERR_SOCKET;
+        if (fds[0].revents & POLLIN)
+        {
+            char buf[256];
+            while (recv(wakeFd, buf, sizeof(buf), 0) > 0)
+                ;
+        }
+        for (size_t i = 0; i < listeners.size(); i++)
+        {
+            if (fds[1 + i].revents & POLLIN)
+                Accept(listeners[i]);
+        }
+        // clients accepted just now are not in fds yet
+        size_t base = 1 + listeners.size();
+        for (size_t i = 0; i + base < fds.size(); i++)
+        {
+            if (fds[base + i].revents & (POLLIN | POLLERR | POLLHUP))
+                Receive(clients[i].get());
+            if (fds[base + i].revents & POLLOUT)
+                Send(clients[i].get());
+        }
+        CheckReplies();
+        {
+            std::vector<std::pair<uint64_t, std::string>> posted;
+            {
+                std::lock_guard<std::mutex> lk(eventLock);
+                posted.swap(events);
+            }
+            for (size_t i = 0; i < posted.size(); i++)
+                Push(posted[i].first, posted[i].second);
+        }
+        if (subscribed && std::chrono::steady_clock::now() - lastPush >= std::chrono::milliseconds(pushMs))
+        {
+            PushStates();
+            lastPush = std::chrono::steady_clock::now();
+        }
+        // write what we can right away instead of waiting for the next POLLOUT
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            if (clients[i]->out.size() && !clients[i]->closed)
+                Send(clients[i].get());
+        }
+        for (size_t i = 0; i < clients.size();)
+        {
+            if (clients[i]->closed)
+            {
+                SockClose(clients[i]->fd);
+                clients.erase(clients.begin() + i);
+            }
+            else
+                i++;
+        }
+    }
+    StopScans();
+    return 0;
+}
+
+// cancels every scan, then waits for them all
+void ControlServer::StopScans()
+{
+    for (size_t i = 0; i < scans.size(); i++)
+    {
+        if (scans[i]->task)
+            scans[i]->task->Cancel();
+    }
+    for (size_t i = 0; i < scans.size(); i++)
+    {
+        if (scans[i]->task)
+            scans[i]->task->Wait();
+    }
+}
+
+void ControlServer::Accept(srvSocket lfd)
+{
+    while (true)
+    {
+        srvSocket fd = accept(lfd, NULL, NULL);
+        if (fd == SRV_INVALID)
+            return;
+        SockNonBlocking(fd);
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on)); // fails harmlessly on Unix sockets
+        std::unique_ptr<client> c(new client());
+        c->id = nextId++;
+        c->fd = fd;
+        c->sub = false;
+        c->closed = false;
+        clients.push_back(std::move(c));
+    }
+}
+
+void ControlServer::Receive(client *c)
+{
+    char buf[16384];
+    while (!c->closed)
+    {
+        long n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && !SockWouldBlock()))
+        {
+            c->closed = true;
+            return;
+        }
+        if (n < 0)
+            break;
+        c->in.append(buf, n);
+        if ((size_t)n < sizeof(buf))
+            break;
+    }
+    // every complete line is a request; answers to pipelined requests are batched into one send
+    size_t start = 0, end;
+    while (!c->closed && (end = c->in.find('\n', start)) != std::string::npos)
+    {
+        c->in[end] = '\0';
+        if (end > start && c->in[end - 1] == '\r')
+            c->in[end - 1] = '\0';
+        Handle(c, &c->in[start]);
+        start = end + 1;
+    }
+    c->in.erase(0, start);
+    if (c->in.size() > SRV_MAX_LINE)
+        c->closed = true;
+}
+
+void ControlServer::Send(client *c)
+{
+    while (c->out.size())
+    {
+        long n = send(c->fd, c->out.data(), (int)c->out.size(), SRV_SEND_FLAGS);
+        if (n < 0)
+        {
+            if (!SockWouldBlock())
+                c->closed = true;
+            return;
+        }
+        c->out.erase(0, n);
+    }
+}
+
+static bool ParseIndex(const char *s, long numUnits, long *idx)
+{
+    char *end;
+    *idx = strtol(s, &end, 10);
+    return end != s && *end == '\0' && *idx >= 0 && *idx < numUnits;
+}
+
+static bool ParseFloat(const char *s, float *v)
+{
+    char *end;
+    *v = (float)strtod(s, &end);
+    return end != s && *end == '\0';
+}
+
+void ControlServer::Handle(client *c, char *line)
+{
+    char *argv[SRV_MAX_ARGS];
+    int argc = 0;
+    for (char *tok = line; argc < SRV_MAX_ARGS;)
+    {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        if (*tok == '\0')
+            break;
+        argv[argc++] = tok;
+        while (*tok && *tok != ' ' && *tok != '\t')
+            tok++;
+        if (*tok)
+            *tok++ = '\0';
+    }
+    if (argc == 0)
+        return;
+    requests++;
+    const char *tag = argv[0];
+    const char *op = argc > 1 ? argv[1] : "";
+    long numUnits = serNums.size();
+    long idx = 0;
+    bool hasIdx = argc > 2 && ParseIndex(argv[2], numUnits, &idx);
+    char buf[256];
+    buf[0] = '\0';
+    long ret = 0;
+    if (!strcmp(op, "ping") && argc == 2)
+        ;
+    else if (!strcmp(op, "units") && argc == 2)
+    {
+        std::string msg = std::string(tag) + " ok " + std::to_string(numUnits);
+        for (long i = 0; i < numUnits; i++)
+            msg += " " + std::to_string(serNums[i]);
+        c->out += msg + "\n";
+        return;
+    }
+    else if (!strcmp(op, "status") && argc == 3 && hasIdx)
+    {
+        motorState state;
+        tel->GetState(idx, &state);
+        snprintf(buf, sizeof(buf), " %.4f %d %ld", state.curPos, state.moving ? 1 : 0, state.ret);
+    }
+    else if (!strcmp(op, "move") && argc == 4 && hasIdx)
+    {
+        float pos;
+        if (!ParseFloat(argv[3], &pos))
+            ret = SRV_ERR_COMMAND;
+        else if (scans[idx]->active)
+            ret = SRV_ERR_BUSY;
+        else
+            return Queue(c, tag, CMD_MOVE, cmd->Move(idx, pos));
+    }
+    else if (!strcmp(op, "home") && argc == 3 && hasIdx)
+    {
+        if (scans[idx]->active)
+            ret = SRV_ERR_BUSY;
+        else
+            return Queue(c, tag, CMD_HOME, cmd->Home(idx));
+    }
+    else if (!strcmp(op, "stop") && argc == 3 && hasIdx)
+        return Queue(c, tag, CMD_STOP, cmd->Halt(idx));
+    else if (!strcmp(op, "vel") && argc == 6 && hasIdx)
+    {
+        float v[3];
+        if (!ParseFloat(argv[3], &v[0]) || !ParseFloat(argv[4], &v[1]) || !ParseFloat(argv[5], &v[2]))
+            ret = SRV_ERR_COMMAND;
+        else
+            return Queue(c, tag, CMD_SETVEL, cmd->SetVel(idx, v[0], v[1], v[2]));
+    }
+    else if (!strcmp(op, "scan") && argc == 7 && hasIdx)
+    {
+        scanParams p = {};
+        if (!ParseFloat(argv[3], &p.start) || !ParseFloat(argv[4], &p.stop) || !ParseFloat(argv[5], &p.step) || !ParseFloat(argv[6], &p.dwell))
+            ret = SRV_ERR_COMMAND;
+        else
+            return StartScan(c, tag, idx, p);
+    }
+    else if (!strcmp(op, "scanstop") && argc == 3 && hasIdx)
+    {
+        if (scans[idx]->task)
+            scans[idx]->task->Cancel(); // wakes the scan wherever it waits
+    }
+    else if (!strcmp(op, "sub") && argc == 2)
+        c->sub = true;
+    else if (!strcmp(op, "unsub") && argc == 2)
+        c->sub = false;
+    else
+        ret = SRV_ERR_COMMAND;
+    if (ret)
+        snprintf(buf, sizeof(buf), " %ld", ret);
+    c->out.append(tag).append(ret ? " err" : " ok").append(buf).append("\n");
+}
+
+void ControlServer::Queue(client *c, const char *tag, cmdType type, cmdFuture fut)
+{
+    reply r;
+    r.client = c->id;
+    r.tag = tag;
+    r.type = type;
+    r.fut = fut;
+    replies.push_back(std::move(r));
+}
+
+void ControlServer::CheckReplies()
+{
+    size_t keep = 0;
+    for (size_t i = 0; i < replies.size(); i++)
+    {
+        reply &r = replies[i];
+        if (!CmdReady(r.fut))
+        {
+            if (keep != i)
+                replies[keep] = std::move(r);
+            keep++;
+            continue;
+        }
+        client *c = Find(r.client);
+        if (c == nullptr)
+            continue; // went away meanwhile
+        cmdResult res = r.fut.get();
+        char buf[128];
+        if (res.ret)
+            snprintf(buf, sizeof(buf), " err %ld\n", res.ret);
+        else if (r.type == CMD_SETVEL)
+            snprintf(buf, sizeof(buf), " ok %.4f %.4f %.4f\n", res.minVel, res.Accel, res.maxVel);
+        else
+            snprintf(buf, sizeof(buf), " ok\n");
+        c->out.append(r.tag).append(buf);
+    }
+    replies.resize(keep);
+}
+
+ControlServer::client *ControlServer::Find(uint64_t id)
+{
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i]->id == id)
+            return clients[i]->closed ? nullptr : clients[i].get();
+    }
+    return nullptr;
+}
+
+// to the client that started it and to every subscriber
+void ControlServer::Push(uint64_t id, const std::string &msg)
+{
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i]->id == id || clients[i]->sub)
+            clients[i]->out += msg;
+    }
+}
+
+void ControlServer::Post(uint64_t id, const std::string &msg)
+{
+    {
+        std::lock_guard<std::mutex> lk(eventLock);
+        events.push_back(std::make_pair(id, msg));
+    }
+    Wake();
+}
+
+void ControlServer::PushStates()
+{
+    char buf[128];
+    for (size_t i = 0; i < pushed.size(); i++)
+    {
+        motorState state;
+        tel->GetState(i, &state);
+        if (state.curPos == pushed[i].curPos && state.moving == pushed[i].moving && state.ret == pushed[i].ret)
+            continue;
+        pushed[i] = state;
+        int n = snprintf(buf, sizeof(buf), "* state %d %.4f %d %ld\n", (int)i, state.curPos, state.moving ? 1 : 0, state.ret);
+        for (size_t j = 0; j < clients.size(); j++)
+        {
+            // a client that does not read loses state updates, not replies
+            if (clients[j]->sub && clients[j]->out.size() < SRV_MAX_BACKLOG)
+                clients[j]->out.append(buf, n);
+        }
+    }
+}
+
+void ControlServer::StartScan(client *c, const char *tag, long idx, const scanParams &p)
+{
+    scanJob *job = scans[idx].get();
+    if (job->active)
+    {
+        c->out.append(tag).append(" err " + std::to_string(SRV_ERR_BUSY) + "\n");
+        return;
+    }
+    uint64_t id = c->id;
+    job->active = true;
+    std::shared_ptr<ScanTask> task = tasks.Submit([this, idx, id, p](ScanTask *task)
+                                                  { return ScanFcn(task, idx, id, p); });
+    if (!task)
+    {
+        job->active = false;
+        c->out.append(tag).append(" err " + std::to_string(SRV_ERR_BUSY) + "\n");
+        return;
+    }
+    job->task = task;
+    job->client = id;
+    c->out.append(tag).append(" ok\n");
+}
+
+long ControlServer::ScanFcn(ScanTask *task, long idx, uint64_t id, scanParams p)
+{
+    ScanEngine engine(drv, tel, idx, serNums[idx]); // settling criteria left 0 take the defaults
+    engine.SetMeasurement(meas);
+    engine.SetCancelToken(task->Token());
+    engine.SetMotionModel(model);
+    engine.SetEnvelope(env);
+    engine.SetPointHook([this, idx, id](long i, float target, float actual, double value)
+                        {
+                            if (bus != nullptr)
+                                bus->SetScanIndex(idx, i);
+                            char buf[128];
+                            snprintf(buf, sizeof(buf), "* point %ld %ld %.4f %.4f %g\n", idx, i, target, actual, value);
+                            Post(id, buf); });
+    long ret = engine.Run(p);
+    if (bus != nullptr)
+        bus->SetScanIndex(idx, -1);
+    scans[idx]->active = false;
+    Post(id, "* scan " + std::to_string(idx) + " " + std::to_string(ret) + "\n");
+    return ret;
+}
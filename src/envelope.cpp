@@ -0,0 +1,368 @@
+#include "envelope.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static envLimits NoLimits()
+{
+    envLimits l;
+    l.min = -INFINITY;
+    l.max = INFINITY;
+    l.maxVel = INFINITY;
+    l.maxAccel = INFINITY;
+    return l;
+}
+
+SafetyEnvelope::SafetyEnvelope() : all(0)
+{
+}
+
+long SafetyEnvelope::SetTravel(long serNum, float min, float max)
+{
+    if (!(min <= max))
+        return ENV_ERR_PARAM;
+    auto it = limits.find(serNum);
+    if (it == limits.end())
+        it = limits.insert(std::make_pair(serNum, NoLimits())).first;
+    it->second.min = min;
+    it->second.max = max;
+    return 0;
+}
+
+long SafetyEnvelope::SetCaps(long serNum, float maxVel, float maxAccel)
+{
+    if (!(maxVel > 0) || !(maxAccel > 0))
+        return ENV_ERR_PARAM;
+    auto it = limits.find(serNum);
+    if (it == limits.end())
+        it = limits.insert(std::make_pair(serNum, NoLimits())).first;
+    it->second.maxVel = maxVel;
+    it->second.maxAccel = maxAccel;
+    return 0;
+}
+
+long SafetyEnvelope::AddZone(const envBound *bounds, long numBounds)
+{
+    if (numBounds < 1 || zones.size() >= ENV_MAX_ZONES)
+        return ENV_ERR_PARAM;
+    for (long i = 0; i < numBounds; i++)
+    {
+        if (!(bounds[i].min < bounds[i].max))
+            return ENV_ERR_PARAM;
+        for (long j = 0; j < i; j++)
+        {
+            if (bounds[j].serNum == bounds[i].serNum)
+                return ENV_ERR_PARAM;
+        }
+    }
+    zones.push_back(std::vector<envBound>(bounds, bounds + numBounds));
+    Build();
+    return 0;
+}
+
+long SafetyEnvelope::Load(const char *path, std::string *msg)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr)
+    {
+        if (msg != nullptr)
+            *msg = std::string("Could not open ") + path + ".";
+        return ENV_ERR_FILE;
+    }
+    char line[512];
+    long lineNum = 0;
+    long ret = 0;
+    while (!ret && fgets(line, sizeof(line), fp))
+    {
+        lineNum++;
+        char *hash = strchr(line, '#');
+        if (hash != nullptr)
+            *hash = '\0';
+        char kind[16];
+        int used;
+        if (sscanf(line, "%15s%n", kind, &used) != 1)
+            continue; // blank
+        const char *p = line + used;
+        long serNum;
+        float a, b;
+        int n;
+        if (!strcmp(kind, "travel") && sscanf(p, "%ld %g %g %n", &serNum, &a, &b, &n) == 3 && !p[n])
+            ret = SetTravel(serNum, a, b);
+        else if (!strcmp(kind, "caps") && sscanf(p, "%ld %g %g %n", &serNum, &a, &b, &n) == 3 && !p[n])
+            ret = SetCaps(serNum, a, b);
+        else if (!strcmp(kind, "zone"))
+        {
+            std::vector<envBound> bounds;
+            envBound bd;
+            while (sscanf(p, "%ld %g %g%n", &bd.serNum, &bd.min, &bd.max, &n) == 3)
+            {
+                bounds.push_back(bd);
+                p += n;
+            }
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                p++;
+            ret = *p ? ENV_ERR_PARAM : AddZone(bounds.data(), (long)bounds.size());
+        }
+        else
+            ret = ENV_ERR_PARAM;
+    }
+    fclose(fp);
+    if (ret && msg != nullptr)
+        *msg = std::string(path) + " line " + std::to_string(lineNum) + ": not a valid limit or zone.";
+    return ret;
+}
+
+void SafetyEnvelope::SetDeviceLimits(long serNum, float maxAccel, float maxVel)
+{
+    std::lock_guard<std::mutex> lk(devLock);
+    devLimits[serNum] = std::make_pair(maxAccel > 0 ? maxAccel : INFINITY, maxVel > 0 ? maxVel : INFINITY);
+}
+
+envLimits SafetyEnvelope::Limits(long serNum) const
+{
+    auto it = limits.find(serNum);
+    envLimits l = it != limits.end() ? it->second : NoLimits();
+    std::lock_guard<std::mutex> lk(devLock);
+    auto dev = devLimits.find(serNum);
+    if (dev != devLimits.end())
+    {
+        l.maxAccel = std::min(l.maxAccel, dev->second.first);
+        l.maxVel = std::min(l.maxVel, dev->second.second);
+    }
+    return l;
+}
+
+long SafetyEnvelope::NumZones() const
+{
+    return (long)zones.size();
+}
+
+long SafetyEnvelope::NumAxes() const
+{
+    return (long)axes.size();
+}
+
+long SafetyEnvelope::SerialNum(long axis) const
+{
+    return axis >= 0 && axis < NumAxes() ? axes[axis].serNum : 0;
+}
+
+long SafetyEnvelope::Axis(long serNum) const
+{
+    auto it = axisOf.find(serNum);
+    return it != axisOf.end() ? it->second : -1;
+}
+
+void SafetyEnvelope::Build()
+{
+    axes.clear();
+    axisOf.clear();
+    long nz = (long)zones.size();
+    all = nz >= 64 ? ~0ULL : (1ULL << nz) - 1;
+    for (const std::vector<envBound> &z : zones)
+    {
+        for (const envBound &b : z)
+        {
+            if (axisOf.count(b.serNum))
+                continue;
+            axisOf[b.serNum] = (long)axes.size();
+            axes.push_back(axisLookup());
+            axes.back().serNum = b.serNum;
+        }
+    }
+    for (axisLookup &l : axes)
+    {
+        for (const std::vector<envBound> &z : zones)
+        {
+            for (const envBound &b : z)
+            {
+                if (b.serNum != l.serNum)
+                    continue;
+                l.edges.push_back(b.min);
+                l.edges.push_back(b.max);
+            }
+        }
+        std::sort(l.edges.begin(), l.edges.end());
+        l.edges.erase(std::unique(l.edges.begin(), l.edges.end()), l.edges.end());
+        long ne = (long)l.edges.size();
+        // a zone that does not bound the axis covers all of it
+        l.masks.assign(ne + 1, 0);
+        for (long z = 0; z < nz; z++)
+        {
+            const envBound *b = nullptr;
+            for (const envBound &bd : zones[z])
+            {
+                if (bd.serNum == l.serNum)
+                    b = &bd;
+            }
+            for (long k = 0; k <= ne; k++)
+            {
+                if (b == nullptr || (k > 0 && k < ne && l.edges[k - 1] >= b->min && l.edges[k] <= b->max))
+                    l.masks[k] |= 1ULL << z;
+            }
+        }
+        l.any = 0;
+        for (uint64_t m : l.masks)
+            l.any |= m;
+    }
+}
+
+// zones the axis reaches into anywhere in lo..hi
+uint64_t SafetyEnvelope::Span(const axisLookup &l, float lo, float hi) const
+{
+    if (std::isnan(lo) || std::isnan(hi))
+        return l.any;
+    size_t k0 = std::upper_bound(l.edges.begin(), l.edges.end(), lo) - l.edges.begin();
+    size_t k1 = std::upper_bound(l.edges.begin() + k0, l.edges.end(), hi) - l.edges.begin();
+    uint64_t m = 0;
+    for (size_t k = k0; k <= k1; k++)
+        m |= l.masks[k];
+    return m;
+}
+
+uint64_t SafetyEnvelope::Hits(const float *lo, const float *hi, long axis, float a0, float a1) const
+{
+    uint64_t m = all;
+    for (long a = 0; a < (long)axes.size() && m; a++)
+        m &= a == axis ? Span(axes[a], a0, a1) : Span(axes[a], lo[a], hi[a]);
+    return m;
+}
+
+void SafetyEnvelope::Where(const MotorTelemetry *tel, float *lo, float *hi) const
+{
+    const MotorRegistry *reg = tel->Registry();
+    for (long a = 0; a < (long)axes.size(); a++)
+    {
+        lo[a] = hi[a] = NAN;
+        long slot = reg->Find(axes[a].serNum);
+        motorState st;
+        if (slot < 0 || !reg->Present(slot) || !reg->Load(slot, &st) || st.polls == 0 || st.ret)
+            continue;
+        lo[a] = hi[a] = st.curPos;
+        if (!st.moving)
+            continue;
+        float target = tel->Target(slot);
+        if (std::isnan(target))
+            lo[a] = hi[a] = NAN; // a move of unknown destination, e.g. a home
+        else
+        {
+            lo[a] = std::min(lo[a], target);
+            hi[a] = std::max(hi[a], target);
+        }
+    }
+}
+
+long SafetyEnvelope::CheckTarget(long serNum, float pos) const
+{
+    if (std::isnan(pos))
+        return ENV_ERR_TRAVEL;
+    auto it = limits.find(serNum);
+    if (it != limits.end() && !(pos >= it->second.min && pos <= it->second.max))
+        return ENV_ERR_TRAVEL;
+    return 0;
+}
+
+// the range an axis sweeps from lo..hi to pos; NaN if where it starts is not known
+static void Sweep(float lo, float hi, float pos, float *a0, float *a1)
+{
+    if (std::isnan(lo) || std::isnan(hi))
+    {
+        *a0 = *a1 = NAN;
+        return;
+    }
+    *a0 = std::min(lo, pos);
+    *a1 = std::max(hi, pos);
+}
+
+long SafetyEnvelope::CheckPath(long serNum, float pos, const float *lo, const float *hi) const
+{
+    long a = Axis(serNum);
+    if (a < 0)
+        return 0;
+    float a0, a1;
+    Sweep(lo[a], hi[a], pos, &a0, &a1);
+    return Hits(lo, hi, a, a0, a1) ? ENV_ERR_ZONE : 0;
+}
+
+long SafetyEnvelope::CheckMove(long serNum, float pos, const float *lo, const float *hi) const
+{
+    long ret = CheckTarget(serNum, pos);
+    if (ret)
+        return ret;
+    return CheckPath(serNum, pos, lo, hi);
+}
+
+long SafetyEnvelope::CheckVel(long serNum, float minVel, float accel, float maxVel) const
+{
+    envLimits l = Limits(serNum);
+    if (minVel > l.maxVel || maxVel > l.maxVel || accel > l.maxAccel)
+        return ENV_ERR_VEL;
+    return 0;
+}
+
+long SafetyEnvelope::CheckScan(long serNum, float start, float stop, const float *lo, const float *hi) const
+{
+    long ret = CheckTarget(serNum, start);
+    if (!ret)
+        ret = CheckTarget(serNum, stop);
+    long a = Axis(serNum);
+    if (ret || a < 0)
+        return ret;
+    // every point lies between start and stop, so the scan sweeps no more than the hull of the three
+    float a0, a1;
+    Sweep(lo[a], hi[a], start, &a0, &a1);
+    Sweep(a0, a1, stop, &a0, &a1);
+    return Hits(lo, hi, a, a0, a1) ? ENV_ERR_ZONE : 0;
+}
+
+long SafetyEnvelope::CheckPlan(const long *serNums, long numAxes, const float *points, long numPoints, long first,
+                               const float *lo, const float *hi, long *bad) const
+{
+    *bad = -1;
+    std::vector<envLimits> lim(numAxes);
+    std::vector<long> za(numAxes);
+    bool zoned = false;
+    for (long j = 0; j < numAxes; j++)
+    {
+        auto it = limits.find(serNums[j]);
+        lim[j] = it != limits.end() ? it->second : NoLimits();
+        za[j] = Axis(serNums[j]);
+        zoned |= za[j] >= 0;
+    }
+    // the box swept on the way to each point: the axes of the plan from the point before, the others where they are
+    std::vector<float> boxLo(lo, lo + axes.size()), boxHi(hi, hi + axes.size());
+    if (first < 0)
+        first = 0;
+    for (long i = first; i < numPoints; i++)
+    {
+        const float *pt = points + i * numAxes;
+        for (long j = 0; j < numAxes; j++)
+        {
+            if (!(pt[j] >= lim[j].min && pt[j] <= lim[j].max))
+            {
+                *bad = i;
+                return ENV_ERR_TRAVEL;
+            }
+        }
+        if (!zoned)
+            continue;
+        for (long j = 0; j < numAxes; j++)
+        {
+            long a = za[j];
+            if (a < 0)
+                continue;
+            if (i == first)
+                Sweep(lo[a], hi[a], pt[j], &boxLo[a], &boxHi[a]);
+            else
+                Sweep(pt[j - numAxes], pt[j - numAxes], pt[j], &boxLo[a], &boxHi[a]);
+        }
+        if (Hits(boxLo.data(), boxHi.data(), -1, 0, 0))
+        {
+            *bad = i;
+            return ENV_ERR_ZONE;
+        }
+    }
+    return 0;
+}
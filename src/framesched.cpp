@@ -0,0 +1,98 @@
+#include "framesched.h"
+
+FrameScheduler::FrameScheduler(int holdMs, int idleMs) : holdMs(holdMs), idleMs(idleMs), enabled(true), changed(false), input(false),
+                                                         lastActive(schedClock::now()), lastFrame(schedClock::now()), stats()
+{
+}
+
+void FrameScheduler::SetEnabled(bool enabled)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    this->enabled = enabled;
+    wake.notify_all();
+}
+
+bool FrameScheduler::Enabled() const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    return enabled;
+}
+
+void FrameScheduler::Input()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    input = true;
+    lastActive = schedClock::now();
+    wake.notify_all();
+}
+
+void FrameScheduler::Changed()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    changed = true;
+    wake.notify_all();
+}
+
+void FrameScheduler::Frame(bool busy)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    lastFrame = schedClock::now();
+    if (busy)
+        lastActive = lastFrame;
+    stats.frames++;
+}
+
+int FrameScheduler::TimeoutLocked(schedClock::time_point now) const
+{
+    if (!enabled || now - lastActive < std::chrono::milliseconds(holdMs))
+        return 0;
+    long left = idleMs - (long)std::chrono::duration_cast<std::chrono::milliseconds>(now - lastFrame).count();
+    return left > 0 ? (int)left : 0;
+}
+
+int FrameScheduler::Timeout() const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    return TimeoutLocked(schedClock::now());
+}
+
+frameWake FrameScheduler::Wait()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    schedClock::time_point t0 = schedClock::now();
+    int ms = TimeoutLocked(t0);
+    if (ms == 0 || changed || input)
+    {
+        // whatever came in since the last frame is drawn by this one
+        changed = input = false;
+        return WAKE_NONE;
+    }
+    wake.wait_for(lk, std::chrono::milliseconds(ms), [this]
+                  { return changed || input || !enabled; });
+    frameWake why = input ? WAKE_INPUT : changed ? WAKE_CHANGE : enabled ? WAKE_TIMEOUT : WAKE_NONE;
+    changed = input = false;
+    lk.unlock();
+    Woken(why, std::chrono::duration<double>(schedClock::now() - t0).count());
+    return why;
+}
+
+void FrameScheduler::Woken(frameWake why, double waited)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    if (why == WAKE_NONE)
+        return;
+    stats.waits++;
+    stats.waited += waited;
+    if (why == WAKE_CHANGE)
+        stats.changeWakes++;
+    else if (why == WAKE_INPUT)
+        stats.inputWakes++;
+    else
+        stats.timeouts++;
+}
+
+void FrameScheduler::GetStats(frameSchedStats *stats) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    *stats = this->stats;
+}
@@ -0,0 +1,153 @@
+#include "history.h"
+
+MotionHistory::MotionHistory(long capacity) : capacity(capacity < HIST_FANOUT ? HIST_FANOUT : capacity)
+{
+    for (int k = 0; k < HIST_LEVELS; k++)
+        levels[k].ring.resize(this->capacity);
+    Clear();
+}
+
+void MotionHistory::Clear()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    for (int k = 0; k < HIST_LEVELS; k++)
+    {
+        levels[k].head = 0;
+        levels[k].count = 0;
+        levels[k].merged = 0;
+    }
+    havePrev = false;
+}
+
+size_t MotionHistory::Memory() const
+{
+    return sizeof(*this) + HIST_LEVELS * capacity * sizeof(histBucket);
+}
+
+void MotionHistory::Add(double t, float pos, float target)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    float vel = havePrev && t > prevT ? (float)((pos - prevPos) / (t - prevT)) : 0;
+    havePrev = true;
+    prevT = t;
+    prevPos = pos;
+    histBucket b;
+    b.t0 = b.t1 = t;
+    b.min[HIST_POS] = b.max[HIST_POS] = pos;
+    b.min[HIST_VEL] = b.max[HIST_VEL] = vel;
+    b.min[HIST_TARGET] = b.max[HIST_TARGET] = target;
+    Push(0, b);
+}
+
+void MotionHistory::Push(int k, const histBucket &b)
+{
+    level &l = levels[k];
+    l.ring[l.head] = b;
+    l.head = (l.head + 1) % capacity;
+    if (l.count < capacity)
+        l.count++;
+    if (k + 1 == HIST_LEVELS)
+        return;
+    level &up = levels[k + 1];
+    if (up.merged == 0)
+        up.pending = b;
+    else
+        HistMerge(&up.pending, b);
+    if (++up.merged == HIST_FANOUT)
+    {
+        up.merged = 0;
+        Push(k + 1, up.pending);
+    }
+}
+
+const histBucket &MotionHistory::At(const level &l, long i) const
+{
+    return l.ring[(l.head - l.count + i + capacity) % capacity];
+}
+
+long MotionHistory::First(const level &l, double t) const
+{
+    long lo = 0, hi = l.count;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (At(l, mid).t1 < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool MotionHistory::Range(double *t0, double *t1) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    if (levels[0].count == 0)
+        return false;
+    *t0 = At(levels[0], 0).t0;
+    for (int k = 1; k < HIST_LEVELS && levels[k].count; k++)
+    {
+        if (At(levels[k], 0).t0 < *t0)
+            *t0 = At(levels[k], 0).t0;
+    }
+    *t1 = At(levels[0], levels[0].count - 1).t1;
+    return true;
+}
+
+long MotionHistory::Query(double t0, double t1, histBucket *out, long maxPoints) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    if (maxPoints < 1 || levels[0].count == 0 || t1 < t0)
+        return 0;
+    // a level wraps later than the one below it, the deepest one in use holds the oldest sample
+    int deepest = 0;
+    while (deepest + 1 < HIST_LEVELS && levels[deepest + 1].count)
+        deepest++;
+    double from = t0 > At(levels[deepest], 0).t0 ? t0 : At(levels[deepest], 0).t0;
+    // finest level holding the whole span, in few enough buckets to keep the cost bounded
+    int k = deepest;
+    long start = 0;
+    for (int j = 0; j < deepest; j++)
+    {
+        const level &l = levels[j];
+        long first = First(l, t0);
+        if (At(l, 0).t0 <= from && l.count - first <= maxPoints * HIST_FANOUT)
+        {
+            k = j;
+            start = first;
+            break;
+        }
+    }
+    const level &l = levels[k];
+    if (k == deepest)
+        start = First(l, t0);
+    long end = start;
+    while (end < l.count && At(l, end).t0 <= t1)
+        end++;
+    // what has not made it into a whole bucket of level k yet is in the pending buckets below it
+    histBucket tail;
+    bool haveTail = false;
+    for (int j = 1; j <= k; j++)
+    {
+        if (!levels[j].merged)
+            continue;
+        if (!haveTail)
+            tail = levels[j].pending;
+        else
+            HistMerge(&tail, levels[j].pending);
+        haveTail = true;
+    }
+    haveTail = haveTail && tail.t1 >= t0 && tail.t0 <= t1;
+    long n = end - start + (haveTail ? 1 : 0);
+    long per = (n + maxPoints - 1) / maxPoints;
+    long count = 0;
+    for (long i = 0; i < n; i++)
+    {
+        const histBucket &b = start + i < end ? At(l, start + i) : tail;
+        if (i % per == 0)
+            out[count++] = b;
+        else
+            HistMerge(&out[count - 1], b);
+    }
+    return count;
+}
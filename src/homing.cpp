@@ -0,0 +1,291 @@
+#include "homing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#define HOME_MAX_SPEC 1024 // longer group lists are an error
+
+typedef struct
+{
+    long idx;
+    uint64_t cmdPoll; // last sample taken before the home command
+    uint64_t polls;   // last sample looked at
+    double cmdTime;   // telemetry clock s
+    double atHome;    // stamp of the first sample of the run at home
+    bool moved;       // seen moving since the command
+    int inTol;
+    int away;         // consecutive samples at rest, but not at home
+    homeResult *res;
+    bool done;
+} homing;
+
+HomeRunner::HomeRunner(MotorDriver *drv, MotorTelemetry *tel, const long *serNums, long numUnits) : drv(drv), tel(tel), serNums(serNums, serNums + numUnits),
+                                                                                                     tol(0.005f), count(3), timeout(120), offset(std::numeric_limits<double>::infinity()), token(nullptr)
+{
+}
+
+void HomeRunner::SetStatusHook(std::function<void(const std::string &msg)> hook)
+{
+    statusHook = hook;
+}
+
+void HomeRunner::SetCancelToken(CancelToken *token)
+{
+    this->token = token;
+}
+
+void HomeRunner::SetCriteria(float tol, int count, float timeout)
+{
+    this->tol = tol > 0 ? tol : 0.005f;
+    this->count = count > 0 ? count : 3;
+    this->timeout = timeout > 0 ? timeout : 120;
+}
+
+void HomeRunner::SetDoneHook(std::function<void(const homeResult &res)> hook)
+{
+    doneHook = hook;
+}
+
+double HomeRunner::Now() const
+{
+    return tel->GetClock()->Now();
+}
+
+void HomeRunner::Status(const std::string &msg)
+{
+    if (statusHook)
+        statusHook(msg);
+}
+
+long HomeRunner::Run(const std::vector<std::vector<long>> &groups, std::vector<homeResult> *results)
+{
+    size_t n = 0;
+    for (const std::vector<long> &group : groups)
+        n += group.size();
+    results->assign(n, homeResult());
+    double t0 = Now();
+    long ret = 0;
+    n = 0;
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        homeResult *res = results->data() + n;
+        n += groups[g].size();
+        if (!ret)
+        {
+            ret = RunGroup(groups[g], (long)g, t0, res);
+            continue;
+        }
+        for (size_t j = 0; j < groups[g].size(); j++)
+        {
+            motorState state;
+            tel->GetState(groups[g][j], &state);
+            res[j].idx = groups[g][j];
+            res[j].group = (long)g;
+            res[j].ret = HOME_ERR_SKIPPED;
+            res[j].from = res[j].pos = state.curPos;
+            res[j].ofst = NAN;
+            res[j].start = res[j].time = NAN;
+        }
+    }
+    return ret;
+}
+
+long HomeRunner::RunGroup(const std::vector<long> &group, long g, double t0, homeResult *res)
+{
+    std::vector<homing> motors(group.size());
+    long ret = 0;
+    size_t pending = 0;
+    // every motor is commanded before any is waited for, so they move together
+    for (size_t j = 0; j < group.size(); j++)
+    {
+        homing *h = &motors[j];
+        long idx = group[j];
+        motorState state;
+        tel->GetState(idx, &state);
+        *h = homing();
+        h->idx = idx;
+        h->cmdPoll = h->polls = state.polls;
+        h->res = &res[j];
+        res[j].idx = idx;
+        res[j].group = g;
+        res[j].from = res[j].pos = state.curPos;
+        res[j].time = NAN;
+        long homeDir, limSwitch;
+        float homeVel;
+        if (drv->GetHomeParams(serNums[idx], &homeDir, &limSwitch, &homeVel, &res[j].ofst))
+            res[j].ofst = NAN;
+        h->cmdTime = Now();
+        res[j].start = h->cmdTime - t0;
+        res[j].ret = drv->MoveHome(serNums[idx], false);
+        if (res[j].ret)
+        {
+            Status("Could not home motor " + std::to_string(idx + 1) + ": " + std::to_string(res[j].ret));
+            h->done = true;
+            ret = ret ? ret : res[j].ret;
+            if (doneHook)
+                doneHook(res[j]);
+            continue;
+        }
+        tel->SetTarget(idx, 0);
+        tel->Kick(idx);
+        pending++;
+    }
+    double deadline = Now() + timeout;
+    // a cancel interrupts the telemetry wait instead of waiting out its timeout
+    const std::atomic<bool> *abort = token != nullptr ? token->Flag() : nullptr;
+    long sub = token != nullptr ? token->Subscribe([this, &group]()
+                                                   {
+                                                       for (long idx : group)
+                                                           tel->Interrupt(idx); })
+                                : 0;
+    while (pending)
+    {
+        long stop = 0;
+        if (token != nullptr && token->Cancelled())
+            stop = SCAN_ERR_STOPPED;
+        else if (Now() > deadline)
+            stop = SCAN_ERR_TIMEOUT;
+        if (stop)
+        {
+            for (homing &h : motors)
+            {
+                if (h.done)
+                    continue;
+                drv->Stop(serNums[h.idx]);
+                h.res->ret = stop;
+                if (stop == SCAN_ERR_TIMEOUT)
+                    Status("Motor " + std::to_string(h.idx + 1) + " did not reach home in time.");
+            }
+            ret = ret ? ret : stop;
+            break;
+        }
+        // the motors poll at the same rate, so a wait on one wakes about as often as any of them updates
+        homing *first = nullptr;
+        for (homing &h : motors)
+        {
+            if (!h.done)
+            {
+                first = &h;
+                break;
+            }
+        }
+        motorState state;
+        state.polls = first->polls;
+        tel->WaitForUpdate(first->idx, &state, 100, abort);
+        for (homing &h : motors)
+        {
+            if (h.done || !tel->GetState(h.idx, &state) || state.polls == h.polls)
+                continue;
+            h.polls = state.polls;
+            offset = std::min(offset, Now() - state.stamp);
+            if (state.ret)
+            {
+                h.res->ret = state.ret;
+                Status("Motor " + std::to_string(h.idx + 1) + " failed while homing: " + std::to_string(state.ret));
+            }
+            else if (state.polls <= h.cmdPoll + 1) // poll may have been in flight when the home was sent
+                continue;
+            else if (state.moving)
+            {
+                h.moved = true;
+                h.inTol = h.away = 0;
+                continue;
+            }
+            else if (fabs(state.curPos) <= tol)
+            {
+                if (h.inTol++ == 0)
+                    h.atHome = state.stamp;
+                h.away = 0;
+                // a stage at home already may not move at all
+                if (h.inTol < count || (!h.moved && state.stamp + offset - h.cmdTime < HOME_START_S))
+                    continue;
+                h.res->time = std::max(0.0, h.atHome + offset - h.cmdTime);
+            }
+            else if (h.moved && ++h.away >= count)
+            {
+                h.res->ret = HOME_ERR_POSITION;
+                char msg[128];
+                snprintf(msg, sizeof(msg), "Motor %ld came to rest at %.4f mm, not at home (%.3f mm from the limit switch).",
+                         h.idx + 1, state.curPos, h.res->ofst);
+                Status(msg);
+            }
+            else
+            {
+                h.inTol = 0;
+                continue;
+            }
+            h.res->pos = state.curPos;
+            h.done = true;
+            pending--;
+            if (h.res->ret)
+                ret = ret ? ret : h.res->ret;
+            if (doneHook)
+                doneHook(*h.res);
+        }
+    }
+    if (token != nullptr)
+        token->Unsubscribe(sub);
+    return ret;
+}
+
+long HomeRunner::ParseGroups(const char *spec, long numUnits, std::vector<std::vector<long>> *groups, std::string *msg)
+{
+    groups->clear();
+    std::string err;
+    const char *p = spec;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '\0')
+    {
+        groups->push_back(std::vector<long>());
+        for (long i = 0; i < numUnits; i++)
+            groups->back().push_back(i);
+        return 0;
+    }
+    std::vector<bool> used(numUnits, false);
+    if (strlen(spec) > HOME_MAX_SPEC)
+        err = "group list too long";
+    groups->push_back(std::vector<long>());
+    while (err.empty())
+    {
+        if (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        else if (*p == ';' || *p == '\0')
+        {
+            if (groups->back().empty())
+                err = "empty group " + std::to_string(groups->size());
+            else if (*p == '\0')
+                break;
+            else
+                groups->push_back(std::vector<long>());
+            p++;
+        }
+        else
+        {
+            char *end;
+            long m = strtol(p, &end, 10);
+            if (end == p || (*end && !strchr(" \t,;", *end)))
+                err = "not a motor number: " + std::string(p, strcspn(p, " \t,;"));
+            else if (m < 1 || m > numUnits)
+                err = "no motor " + std::to_string(m);
+            else if (used[m - 1])
+                err = "motor " + std::to_string(m) + " is listed twice";
+            else
+            {
+                used[m - 1] = true;
+                groups->back().push_back(m - 1);
+            }
+            p = end;
+        }
+    }
+    if (err.empty())
+        return 0;
+    groups->clear();
+    if (msg != nullptr)
+        *msg = err;
+    return HOME_ERR_SYNTAX;
+}
@@ -0,0 +1,302 @@
+#include "instrdriver.h"
+
+#include <ctime>
+
+static const char *callNames[INSTR_CALLS] = {
+    "APTInit",
+    "APTCleanUp",
+    "GetNumHWUnitsEx",
+    "GetHWSerialNumEx",
+    "InitHWDevice",
+    "MOT_GetPosition",
+    "MOT_GetInMotion",
+    "MOT_MoveAbsoluteEx",
+    "MOT_MoveHome",
+    "MOT_StopProfiled",
+    "MOT_GetVelParams",
+    "MOT_SetVelParams",
+    "MOT_GetVelParamLimits",
+    "MOT_GetHomeParams",
+};
+
+const char *InstrCallName(int call)
+{
+    if (call < 0 || call >= INSTR_CALLS)
+        return "?";
+    return callNames[call];
+}
+
+InstrumentedDriver::InstrumentedDriver(MotorDriver *drv) : drv(drv)
+{
+    ClearHists(&driver);
+    ClearHists(&overflow);
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+    {
+        serNums[i] = 0;
+        hists[i] = nullptr;
+    }
+}
+
+InstrumentedDriver::~InstrumentedDriver()
+{
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+        delete hists[i].load();
+}
+
+bool InstrumentedDriver::GetStats(long serNum, int call, latencyStats *stats, uint64_t *errors) const
+{
+    LatencyHistogram hist;
+    uint64_t n;
+    if (!Merge(serNum, call, &hist, &n))
+        return false;
+    hist.GetStats(stats);
+    if (errors != nullptr)
+        *errors = n;
+    return true;
+}
+
+bool InstrumentedDriver::Merge(long serNum, int call, LatencyHistogram *hist, uint64_t *errors) const
+{
+    if (serNum)
+    {
+        const deviceHists *h = Find(serNum);
+        if (h == nullptr)
+            return false;
+        hist->Add(h->calls[call]);
+        *errors = h->errors[call].load(std::memory_order_relaxed);
+        return true;
+    }
+    hist->Add(driver.calls[call]);
+    hist->Add(overflow.calls[call]);
+    *errors = driver.errors[call].load(std::memory_order_relaxed) + overflow.errors[call].load(std::memory_order_relaxed);
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+    {
+        const deviceHists *h = hists[i].load(std::memory_order_acquire);
+        if (h == nullptr)
+            break;
+        hist->Add(h->calls[call]);
+        *errors += h->errors[call].load(std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void InstrumentedDriver::ClearHists(deviceHists *h)
+{
+    for (int c = 0; c < INSTR_CALLS; c++)
+    {
+        h->calls[c].Clear();
+        h->errors[c] = 0;
+    }
+}
+
+long InstrumentedDriver::Devices(long *serNums, long max) const
+{
+    long n = 0;
+    for (int i = 0; i < INSTR_MAX_DEVICES && n < max; i++)
+    {
+        if (hists[i].load(std::memory_order_acquire) == nullptr)
+            break;
+        serNums[n++] = this->serNums[i].load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+void InstrumentedDriver::Clear()
+{
+    ClearHists(&driver);
+    ClearHists(&overflow);
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+    {
+        deviceHists *h = hists[i].load(std::memory_order_acquire);
+        if (h == nullptr)
+            break;
+        ClearHists(h);
+    }
+}
+
+void InstrumentedDriver::Dump(FILE *fp) const
+{
+    fprintf(fp, "%-32s %10s %10s %10s %10s %10s %10s %10s\n", "# call (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    char label[64];
+    uint64_t errors[INSTR_CALLS];
+    for (int c = 0; c < INSTR_CALLS; c++)
+    {
+        LatencyHistogram hist;
+        Merge(0, c, &hist, &errors[c]);
+        if (hist.Count() == 0)
+            continue;
+        snprintf(label, sizeof(label), "all %s", callNames[c]);
+        hist.Dump(fp, label);
+    }
+    for (int c = 0; c < INSTR_CALLS; c++)
+    {
+        if (errors[c])
+            fprintf(fp, "# %s: %llu errors\n", callNames[c], (unsigned long long)errors[c]);
+    }
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+    {
+        const deviceHists *h = hists[i].load(std::memory_order_acquire);
+        if (h == nullptr)
+            break;
+        for (int c = 0; c < INSTR_CALLS; c++)
+        {
+            if (h->calls[c].Count() == 0)
+                continue;
+            snprintf(label, sizeof(label), "%ld %s", serNums[i].load(std::memory_order_relaxed), callNames[c]);
+            h->calls[c].Dump(fp, label);
+        }
+    }
+}
+
+long InstrumentedDriver::Dump(const char *path) const
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == nullptr)
+        return INSTR_ERR_FILE;
+    time_t now = time(nullptr);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(fp, "%s, %s\n", INSTR_MAGIC, stamp);
+    Dump(fp);
+    return fclose(fp) ? INSTR_ERR_FILE : 0;
+}
+
+InstrumentedDriver::timePoint InstrumentedDriver::Now()
+{
+    return std::chrono::steady_clock::now();
+}
+
+long InstrumentedDriver::Done(int call, long serNum, timePoint t0, long ret)
+{
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Now() - t0).count();
+    deviceHists *h = &driver;
+    if (serNum)
+    {
+        h = Slot(serNum);
+        if (h == nullptr)
+            h = &overflow;
+    }
+    h->calls[call].Record(ns);
+    if (ret)
+        h->errors[call].fetch_add(1, std::memory_order_relaxed);
+    return ret;
+}
+
+InstrumentedDriver::deviceHists *InstrumentedDriver::Slot(long serNum)
+{
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+    {
+        long s = serNums[i].load(std::memory_order_acquire);
+        if (s == serNum)
+            return hists[i].load(std::memory_order_acquire);
+        if (s != 0)
+            continue;
+        // first call to this device: slots are claimed in order, so this one is the end of the table
+        if (serNums[i].compare_exchange_strong(s, serNum, std::memory_order_acq_rel))
+        {
+            deviceHists *h = new deviceHists;
+            hists[i].store(h, std::memory_order_release);
+            return h;
+        }
+        if (s == serNum)
+            return hists[i].load(std::memory_order_acquire); // claimed by another thread just now
+    }
+    return nullptr;
+}
+
+const InstrumentedDriver::deviceHists *InstrumentedDriver::Find(long serNum) const
+{
+    for (int i = 0; i < INSTR_MAX_DEVICES; i++)
+    {
+        long s = serNums[i].load(std::memory_order_acquire);
+        if (s == 0)
+            break;
+        if (s == serNum)
+            return hists[i].load(std::memory_order_acquire);
+    }
+    return nullptr;
+}
+
+long InstrumentedDriver::Init()
+{
+    timePoint t0 = Now();
+    return Done(INSTR_INIT, 0, t0, drv->Init());
+}
+
+long InstrumentedDriver::Cleanup()
+{
+    timePoint t0 = Now();
+    return Done(INSTR_CLEANUP, 0, t0, drv->Cleanup());
+}
+
+long InstrumentedDriver::GetNumUnits(long *numUnits)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETNUMUNITS, 0, t0, drv->GetNumUnits(numUnits));
+}
+
+long InstrumentedDriver::GetSerialNum(long idx, long *serNum)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETSERIALNUM, 0, t0, drv->GetSerialNum(idx, serNum));
+}
+
+long InstrumentedDriver::InitDevice(long serNum)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_INITDEVICE, serNum, t0, drv->InitDevice(serNum));
+}
+
+long InstrumentedDriver::GetPosition(long serNum, float *pos)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETPOSITION, serNum, t0, drv->GetPosition(serNum, pos));
+}
+
+long InstrumentedDriver::GetInMotion(long serNum, bool *moving)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETINMOTION, serNum, t0, drv->GetInMotion(serNum, moving));
+}
+
+long InstrumentedDriver::MoveAbsolute(long serNum, float pos, bool wait)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_MOVEABSOLUTE, serNum, t0, drv->MoveAbsolute(serNum, pos, wait));
+}
+
+long InstrumentedDriver::MoveHome(long serNum, bool wait)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_MOVEHOME, serNum, t0, drv->MoveHome(serNum, wait));
+}
+
+long InstrumentedDriver::Stop(long serNum)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_STOP, serNum, t0, drv->Stop(serNum));
+}
+
+long InstrumentedDriver::GetVelParams(long serNum, float *minVel, float *accel, float *maxVel)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETVELPARAMS, serNum, t0, drv->GetVelParams(serNum, minVel, accel, maxVel));
+}
+
+long InstrumentedDriver::SetVelParams(long serNum, float minVel, float accel, float maxVel)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_SETVELPARAMS, serNum, t0, drv->SetVelParams(serNum, minVel, accel, maxVel));
+}
+
+long InstrumentedDriver::GetVelParamLimits(long serNum, float *maxAccel, float *maxVel)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETVELPARAMLIMITS, serNum, t0, drv->GetVelParamLimits(serNum, maxAccel, maxVel));
+}
+
+long InstrumentedDriver::GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst)
+{
+    timePoint t0 = Now();
+    return Done(INSTR_GETHOMEPARAMS, serNum, t0, drv->GetHomeParams(serNum, homeDir, limSwitch, homeVel, ofst));
+}
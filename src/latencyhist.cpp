@@ -0,0 +1,180 @@
+#include "latencyhist.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+    Clear();
+}
+
+uint64_t LatencyHistogram::Count() const
+{
+    uint64_t n = 0;
+    for (int b = 0; b < LHIST_BUCKETS; b++)
+        n += buckets[b].load(std::memory_order_relaxed);
+    return n;
+}
+
+uint64_t LatencyHistogram::BucketLow(int b)
+{
+    if (b < LHIST_SUB)
+        return (uint64_t)b;
+    int e = b / LHIST_SUB + LHIST_SUB_BITS - 1;
+    return (uint64_t)(LHIST_SUB + b % LHIST_SUB) << (e - LHIST_SUB_BITS);
+}
+
+// value at rank in counts, the middle of its bucket but never past top
+static uint64_t RankValue(const uint64_t *counts, uint64_t rank, uint64_t top)
+{
+    uint64_t seen = 0;
+    for (int b = 0; b < LHIST_BUCKETS; b++)
+    {
+        seen += counts[b];
+        if (seen > rank)
+        {
+            uint64_t lo = LatencyHistogram::BucketLow(b);
+            uint64_t mid = b + 1 < LHIST_BUCKETS ? lo + (LatencyHistogram::BucketLow(b + 1) - lo) / 2 : lo;
+            return mid > top && top >= lo ? top : mid;
+        }
+    }
+    return top;
+}
+
+static uint64_t Rank(double q, uint64_t n)
+{
+    uint64_t rank = (uint64_t)(q * n);
+    return rank < n ? rank : n - 1;
+}
+
+uint64_t LatencyHistogram::Percentile(double q) const
+{
+    uint64_t counts[LHIST_BUCKETS];
+    uint64_t n = 0;
+    for (int b = 0; b < LHIST_BUCKETS; b++)
+        n += counts[b] = buckets[b].load(std::memory_order_relaxed);
+    if (n == 0)
+        return 0;
+    return RankValue(counts, Rank(q, n), max.load(std::memory_order_relaxed));
+}
+
+void LatencyHistogram::GetStats(latencyStats *stats) const
+{
+    // one copy of the buckets, so the percentiles agree with each other while samples come in
+    uint64_t counts[LHIST_BUCKETS];
+    uint64_t n = 0;
+    for (int b = 0; b < LHIST_BUCKETS; b++)
+        n += counts[b] = buckets[b].load(std::memory_order_relaxed);
+    uint64_t top = max.load(std::memory_order_relaxed);
+    stats->count = n;
+    stats->mean = n ? sum.load(std::memory_order_relaxed) / (double)n * 1e-3 : 0;
+    stats->p50 = n ? RankValue(counts, Rank(0.5, n), top) * 1e-3 : 0;
+    stats->p90 = n ? RankValue(counts, Rank(0.9, n), top) * 1e-3 : 0;
+    stats->p99 = n ? RankValue(counts, Rank(0.99, n), top) * 1e-3 : 0;
+    stats->p999 = n ? RankValue(counts, Rank(0.999, n), top) * 1e-3 : 0;
+    stats->max = top * 1e-3;
+}
+
+void LatencyHistogram::Add(const LatencyHistogram &other)
+{
+    for (int b = 0; b < LHIST_BUCKETS; b++)
+    {
+        uint64_t n = other.buckets[b].load(std::memory_order_relaxed);
+        if (n)
+            buckets[b].fetch_add(n, std::memory_order_relaxed);
+    }
+    sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    uint64_t ns = other.max.load(std::memory_order_relaxed);
+    uint64_t m = max.load(std::memory_order_relaxed);
+    while (ns > m && !max.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+        ;
+}
+
+void LatencyHistogram::Clear()
+{
+    for (int b = 0; b < LHIST_BUCKETS; b++)
+        buckets[b].store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Dump(FILE *fp, const char *label) const
+{
+    latencyStats s;
+    GetStats(&s);
+    fprintf(fp, "%-32s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", label, (unsigned long long)s.count,
+            s.mean, s.p50, s.p90, s.p99, s.p999, s.max);
+}
+
+PhaseTimer::PhaseTimer(const char *const *names, int numPhases) : names(names), numPhases(numPhases), started(false)
+{
+    phases = new LatencyHistogram[numPhases];
+    last = new std::atomic<uint64_t>[numPhases];
+    for (int i = 0; i < numPhases; i++)
+        last[i] = 0;
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    delete[] phases;
+    delete[] last;
+}
+
+void PhaseTimer::Start()
+{
+    timePoint now = std::chrono::steady_clock::now();
+    if (started)
+        total.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count());
+    start = mark = now;
+    started = true;
+}
+
+void PhaseTimer::Mark(int phase)
+{
+    timePoint now = std::chrono::steady_clock::now();
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - mark).count();
+    phases[phase].Record(ns);
+    last[phase].store(ns, std::memory_order_relaxed);
+    mark = now;
+}
+
+int PhaseTimer::NumPhases() const
+{
+    return numPhases;
+}
+
+const char *PhaseTimer::Name(int phase) const
+{
+    return names[phase];
+}
+
+const LatencyHistogram &PhaseTimer::Phase(int phase) const
+{
+    return phases[phase];
+}
+
+const LatencyHistogram &PhaseTimer::Total() const
+{
+    return total;
+}
+
+double PhaseTimer::Last(int phase) const
+{
+    return last[phase].load(std::memory_order_relaxed) * 1e-3;
+}
+
+void PhaseTimer::Clear()
+{
+    for (int i = 0; i < numPhases; i++)
+        phases[i].Clear();
+    total.Clear();
+}
+
+void PhaseTimer::Dump(FILE *fp, const char *prefix) const
+{
+    char label[64];
+    for (int i = 0; i < numPhases; i++)
+    {
+        snprintf(label, sizeof(label), "%s %s", prefix, names[i]);
+        phases[i].Dump(fp, label);
+    }
+    snprintf(label, sizeof(label), "%s total", prefix);
+    total.Dump(fp, label);
+}
@@ -0,0 +1,56 @@
+#include "measurement.h"
+
+#include <cmath>
+
+SimDetector::SimDetector(double baseline, double noise, float integration, unsigned seed) : baseline(baseline), noise(noise), integration(integration), clock(DefaultClock()), rng(seed)
+{
+}
+
+void SimDetector::AddPeak(float center, float width, double amplitude)
+{
+    simPeak peak = {{center, 0, 0}, width, amplitude};
+    peaks.push_back(peak);
+}
+
+void SimDetector::AddPeak(const simPeak &peak)
+{
+    peaks.push_back(peak);
+}
+
+void SimDetector::SetClock(Clock *clock)
+{
+    this->clock = clock != nullptr ? clock : DefaultClock();
+}
+
+double SimDetector::Signal(const float *pos, long numAxes) const
+{
+    double val = baseline;
+    long n = numAxes < 3 ? numAxes : 3;
+    for (size_t k = 0; k < peaks.size(); k++)
+    {
+        double r2 = 0;
+        for (long j = 0; j < n; j++)
+        {
+            double d = pos[j] - peaks[k].center[j];
+            r2 += d * d;
+        }
+        double w = peaks[k].width;
+        val += peaks[k].amplitude * exp(-r2 / (2 * w * w));
+    }
+    return val;
+}
+
+long SimDetector::Measure(const float *pos, long numAxes, double *value)
+{
+    if (integration > 0)
+        clock->Sleep(integration);
+    double val = Signal(pos, numAxes);
+    if (noise > 0)
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        std::normal_distribution<double> dist(0, noise);
+        val += dist(rng);
+    }
+    *value = val;
+    return 0;
+}
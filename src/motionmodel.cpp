@@ -0,0 +1,93 @@
+#include "motionmodel.h"
+
+#include <cmath>
+
+MotionModel::MotionModel(long numUnits) : devices(numUnits > 0 ? numUnits : 0)
+{
+    for (auto &s : devices)
+        s = {};
+}
+
+long MotionModel::NumUnits() const
+{
+    return (long)devices.size();
+}
+
+void MotionModel::ObserveMove(long idx, double dist, double minVel, double maxVel, double accel, double seconds)
+{
+    if (idx < 0 || idx >= (long)devices.size() || !(seconds >= 0))
+        return;
+    double x = MoveTime(dist, minVel, maxVel, accel);
+    std::lock_guard<std::mutex> lk(lock);
+    sums &s = devices[idx];
+    // older moves fade out, so the fit follows a stage that wears or is reconfigured
+    s.w = s.w * MOTION_FORGET + 1;
+    s.x = s.x * MOTION_FORGET + x;
+    s.y = s.y * MOTION_FORGET + seconds;
+    s.xx = s.xx * MOTION_FORGET + x * x;
+    s.xy = s.xy * MOTION_FORGET + x * seconds;
+    s.yy = s.yy * MOTION_FORGET + seconds * seconds;
+    s.moves++;
+}
+
+void MotionModel::ObservePoint(long idx, double seconds)
+{
+    if (idx < 0 || idx >= (long)devices.size() || !(seconds >= 0))
+        return;
+    std::lock_guard<std::mutex> lk(lock);
+    sums &s = devices[idx];
+    s.pointTime = s.points ? s.pointTime * MOTION_FORGET + seconds * (1 - MOTION_FORGET) : seconds;
+    s.points++;
+}
+
+// weighted least squares y = overhead + scale * x; the scale stays 1 until the moves differ enough to tell
+void MotionModel::Fit(const sums &s, motionFit *fit)
+{
+    fit->moves = s.moves;
+    fit->points = s.points;
+    fit->pointTime = s.pointTime;
+    fit->scale = 1;
+    fit->overhead = 0;
+    fit->rms = 0;
+    if (s.moves == 0)
+        return;
+    double mx = s.x / s.w;
+    double varx = s.xx / s.w - mx * mx;
+    if (s.moves >= 3 && varx >= MOTION_MIN_SPREAD * MOTION_MIN_SPREAD)
+    {
+        fit->scale = (s.xy / s.w - mx * s.y / s.w) / varx;
+        if (fit->scale < 0.5) // a handful of noisy moves, not a stage at half or twice its settings
+            fit->scale = 0.5;
+        if (fit->scale > 2)
+            fit->scale = 2;
+    }
+    double a = (s.y - fit->scale * s.x) / s.w, b = fit->scale;
+    fit->overhead = a;
+    double sse = s.yy - 2 * a * s.y - 2 * b * s.xy + a * a * s.w + 2 * a * b * s.x + b * b * s.xx;
+    fit->rms = sse > 0 ? sqrt(sse / s.w) : 0;
+}
+
+double MotionModel::PredictMove(long idx, double dist, double minVel, double maxVel, double accel) const
+{
+    double x = MoveTime(dist, minVel, maxVel, accel);
+    motionFit fit;
+    if (!GetFit(idx, &fit))
+        return x;
+    double t = fit.overhead + fit.scale * x;
+    return t > 0 ? t : 0;
+}
+
+double MotionModel::PointTime(long idx) const
+{
+    motionFit fit;
+    return GetFit(idx, &fit) ? fit.pointTime : 0;
+}
+
+bool MotionModel::GetFit(long idx, motionFit *fit) const
+{
+    if (idx < 0 || idx >= (long)devices.size())
+        return false;
+    std::lock_guard<std::mutex> lk(lock);
+    Fit(devices[idx], fit);
+    return true;
+}
@@ -0,0 +1,395 @@
+#include "paramcache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+ParamCache::ParamCache(MotorDriver *drv, int revalidateMs) : drv(drv), revalidateMs(revalidateMs), running(true), kicked(false),
+                                                             hits(0), misses(0), writes(0), revalidations(0), changes(0)
+{
+    revalidator = std::thread(&ParamCache::RevalidateFcn, this);
+}
+
+ParamCache::~ParamCache()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        running = false;
+    }
+    wake.notify_one();
+    if (revalidator.joinable())
+        revalidator.join();
+}
+
+long ParamCache::Load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr)
+        return PCACHE_ERR_FILE;
+    char line[512];
+    if (!fgets(line, sizeof(line), fp) || strncmp(line, PCACHE_MAGIC, strlen(PCACHE_MAGIC)))
+    {
+        fclose(fp);
+        return PCACHE_ERR_FORMAT;
+    }
+    std::lock_guard<std::mutex> lk(lock);
+    while (fgets(line, sizeof(line), fp))
+    {
+        paramEntry p = {};
+        if (sscanf(line, "%ld %u %g %g %g %g %g %ld %ld %g %g", &p.serNum, &p.valid, &p.minVel, &p.Accel, &p.maxVel,
+                   &p.limMaxAccel, &p.limMaxVel, &p.homeDir, &p.limSwitch, &p.homeVel, &p.ofst) != 11)
+            continue;
+        cacheSlot &s = slots[p.serNum];
+        if (s.online)
+            continue; // already read from the device
+        p.valid &= PCACHE_ALL;
+        p.verified = 0;
+        p.version = s.p.version + 1;
+        s.p = p;
+        s.seq++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+long ParamCache::Save(const char *path) const
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == nullptr)
+        return PCACHE_ERR_FILE;
+    fprintf(fp, "%s\n", PCACHE_MAGIC);
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        for (auto it = slots.begin(); it != slots.end(); ++it)
+        {
+            const paramEntry &p = it->second.p;
+            if (!p.valid)
+                continue;
+            fprintf(fp, "%ld %u %.9g %.9g %.9g %.9g %.9g %ld %ld %.9g %.9g\n", p.serNum, p.valid, p.minVel, p.Accel, p.maxVel,
+                    p.limMaxAccel, p.limMaxVel, p.homeDir, p.limSwitch, p.homeVel, p.ofst);
+        }
+    }
+    return fclose(fp) ? PCACHE_ERR_FILE : 0;
+}
+
+void ParamCache::Invalidate(long serNum, unsigned groups)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = slots.find(serNum);
+    if (it == slots.end())
+        return;
+    it->second.p.valid &= ~groups;
+    it->second.p.verified &= ~groups;
+    it->second.seq++; // a read in flight must not bring the values back
+}
+
+bool ParamCache::GetEntry(long serNum, paramEntry *entry) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = slots.find(serNum);
+    if (it == slots.end() || !it->second.p.valid)
+        return false;
+    *entry = it->second.p;
+    return true;
+}
+
+uint64_t ParamCache::Version(long serNum) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = slots.find(serNum);
+    return it == slots.end() ? 0 : it->second.p.version;
+}
+
+void ParamCache::GetStats(paramCacheStats *stats) const
+{
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->writes = writes;
+    stats->revalidations = revalidations;
+    stats->changes = changes;
+}
+
+void ParamCache::Merge(cacheSlot *s, unsigned group, const paramEntry &p, bool revalidate)
+{
+    paramEntry &e = s->p;
+    bool held = (e.valid & group) != 0;
+    bool same = true;
+    switch (group)
+    {
+    case PCACHE_VEL:
+        same = e.minVel == p.minVel && e.Accel == p.Accel && e.maxVel == p.maxVel;
+        e.minVel = p.minVel;
+        e.Accel = p.Accel;
+        e.maxVel = p.maxVel;
+        break;
+    case PCACHE_LIMITS:
+        same = e.limMaxAccel == p.limMaxAccel && e.limMaxVel == p.limMaxVel;
+        e.limMaxAccel = p.limMaxAccel;
+        e.limMaxVel = p.limMaxVel;
+        break;
+    case PCACHE_HOME:
+        same = e.homeDir == p.homeDir && e.limSwitch == p.limSwitch && e.homeVel == p.homeVel && e.ofst == p.ofst;
+        e.homeDir = p.homeDir;
+        e.limSwitch = p.limSwitch;
+        e.homeVel = p.homeVel;
+        e.ofst = p.ofst;
+        break;
+    }
+    if (!held || !same)
+        e.version++;
+    if (held && !same && revalidate)
+        changes++;
+    e.valid |= group;
+    e.verified |= group;
+}
+
+long ParamCache::Fetch(long serNum, unsigned groups, bool revalidate, paramEntry *out)
+{
+    unsigned long seq;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        cacheSlot &s = slots[serNum];
+        s.p.serNum = serNum;
+        seq = s.seq;
+    }
+    long first = 0;
+    paramEntry p = {};
+    const unsigned order[] = {PCACHE_VEL, PCACHE_LIMITS, PCACHE_HOME};
+    for (unsigned g : order)
+    {
+        if (!(groups & g))
+            continue;
+        long ret;
+        if (g == PCACHE_VEL)
+            ret = drv->GetVelParams(serNum, &p.minVel, &p.Accel, &p.maxVel);
+        else if (g == PCACHE_LIMITS)
+            ret = drv->GetVelParamLimits(serNum, &p.limMaxAccel, &p.limMaxVel);
+        else
+            ret = drv->GetHomeParams(serNum, &p.homeDir, &p.limSwitch, &p.homeVel, &p.ofst);
+        if (revalidate)
+            revalidations++;
+        else
+            misses++;
+        if (ret)
+        {
+            if (!first)
+                first = ret;
+            continue;
+        }
+        std::lock_guard<std::mutex> lk(lock);
+        cacheSlot &s = slots[serNum];
+        if (s.seq == seq) // otherwise written or invalidated meanwhile, that is newer than this read
+            Merge(&s, g, p, revalidate);
+    }
+    if (out != nullptr)
+        *out = p;
+    return first;
+}
+
+void ParamCache::RevalidateFcn()
+{
+    auto last = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lk(lock);
+    while (running)
+    {
+        if (revalidateMs > 0)
+            wake.wait_until(lk, last + std::chrono::milliseconds(revalidateMs), [this]
+                            { return kicked || !running; });
+        else
+            wake.wait(lk, [this]
+                      { return kicked || !running; });
+        if (!running)
+            break;
+        kicked = false;
+        bool periodic = revalidateMs > 0 && std::chrono::steady_clock::now() >= last + std::chrono::milliseconds(revalidateMs);
+        if (periodic)
+            last = std::chrono::steady_clock::now();
+        // only devices initialized through this driver are read, the others may not be there
+        std::vector<std::pair<long, unsigned>> todo;
+        for (auto it = slots.begin(); it != slots.end(); ++it)
+        {
+            cacheSlot &s = it->second;
+            if (!s.online)
+                continue;
+            unsigned groups = s.p.valid & ~s.p.verified; // loaded from disk or written through
+            if (periodic)
+                groups = s.p.valid;
+            if (groups)
+                todo.push_back(std::make_pair(it->first, groups));
+        }
+        lk.unlock();
+        for (size_t i = 0; i < todo.size(); i++)
+            Fetch(todo[i].first, todo[i].second, true);
+        lk.lock();
+    }
+}
+
+long ParamCache::Init()
+{
+    return drv->Init();
+}
+
+long ParamCache::Cleanup()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        for (auto it = slots.begin(); it != slots.end(); ++it)
+            it->second.online = false; // no more revalidation reads
+    }
+    return drv->Cleanup();
+}
+
+long ParamCache::GetNumUnits(long *numUnits)
+{
+    return drv->GetNumUnits(numUnits);
+}
+
+long ParamCache::GetSerialNum(long idx, long *serNum)
+{
+    return drv->GetSerialNum(idx, serNum);
+}
+
+long ParamCache::InitDevice(long serNum)
+{
+    long ret = drv->InitDevice(serNum);
+    if (ret)
+        return ret;
+    bool unverified;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        cacheSlot &s = slots[serNum];
+        s.p.serNum = serNum;
+        s.online = true;
+        unverified = (s.p.valid & ~s.p.verified) != 0;
+        kicked = kicked || unverified;
+    }
+    if (unverified)
+        wake.notify_one(); // warm started: check the loaded values in the background
+    return 0;
+}
+
+long ParamCache::GetPosition(long serNum, float *pos)
+{
+    return drv->GetPosition(serNum, pos);
+}
+
+long ParamCache::GetInMotion(long serNum, bool *moving)
+{
+    return drv->GetInMotion(serNum, moving);
+}
+
+long ParamCache::MoveAbsolute(long serNum, float pos, bool wait)
+{
+    return drv->MoveAbsolute(serNum, pos, wait);
+}
+
+long ParamCache::MoveHome(long serNum, bool wait)
+{
+    return drv->MoveHome(serNum, wait);
+}
+
+long ParamCache::Stop(long serNum)
+{
+    return drv->Stop(serNum);
+}
+
+long ParamCache::GetVelParams(long serNum, float *minVel, float *accel, float *maxVel)
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        auto it = slots.find(serNum);
+        if (it != slots.end() && (it->second.p.valid & PCACHE_VEL))
+        {
+            *minVel = it->second.p.minVel;
+            *accel = it->second.p.Accel;
+            *maxVel = it->second.p.maxVel;
+            hits++;
+            return 0;
+        }
+    }
+    paramEntry p;
+    long ret = Fetch(serNum, PCACHE_VEL, false, &p);
+    if (ret)
+        return ret;
+    *minVel = p.minVel;
+    *accel = p.Accel;
+    *maxVel = p.maxVel;
+    return 0;
+}
+
+long ParamCache::SetVelParams(long serNum, float minVel, float accel, float maxVel)
+{
+    long ret = drv->SetVelParams(serNum, minVel, accel, maxVel);
+    writes++;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        cacheSlot &s = slots[serNum];
+        s.p.serNum = serNum;
+        s.seq++;
+        if (ret)
+        {
+            // rejected, or lost on the way: the device may hold either value
+            s.p.valid &= ~PCACHE_VEL;
+            s.p.verified &= ~PCACHE_VEL;
+            return ret;
+        }
+        paramEntry p = s.p;
+        p.minVel = minVel;
+        p.Accel = accel;
+        p.maxVel = maxVel;
+        Merge(&s, PCACHE_VEL, p, false);
+        s.p.verified &= ~PCACHE_VEL; // the device may have rounded them, read back in the background
+        kicked = true;
+    }
+    wake.notify_one();
+    return 0;
+}
+
+long ParamCache::GetVelParamLimits(long serNum, float *maxAccel, float *maxVel)
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        auto it = slots.find(serNum);
+        if (it != slots.end() && (it->second.p.valid & PCACHE_LIMITS))
+        {
+            *maxAccel = it->second.p.limMaxAccel;
+            *maxVel = it->second.p.limMaxVel;
+            hits++;
+            return 0;
+        }
+    }
+    paramEntry p;
+    long ret = Fetch(serNum, PCACHE_LIMITS, false, &p);
+    if (ret)
+        return ret;
+    *maxAccel = p.limMaxAccel;
+    *maxVel = p.limMaxVel;
+    return 0;
+}
+
+long ParamCache::GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst)
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        auto it = slots.find(serNum);
+        if (it != slots.end() && (it->second.p.valid & PCACHE_HOME))
+        {
+            *homeDir = it->second.p.homeDir;
+            *limSwitch = it->second.p.limSwitch;
+            *homeVel = it->second.p.homeVel;
+            *ofst = it->second.p.ofst;
+            hits++;
+            return 0;
+        }
+    }
+    paramEntry p;
+    long ret = Fetch(serNum, PCACHE_HOME, false, &p);
+    if (ret)
+        return ret;
+    *homeDir = p.homeDir;
+    *limSwitch = p.limSwitch;
+    *homeVel = p.homeVel;
+    *ofst = p.ofst;
+    return 0;
+}
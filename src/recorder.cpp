@@ -0,0 +1,301 @@
+#include "recorder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Recorder::Recorder() : clock(nullptr), hdr(nullptr), ring(nullptr), mapSize(0)
+{
+#ifdef _WIN32
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+#else
+    fd = -1;
+#endif
+}
+
+Recorder::~Recorder()
+{
+    Close();
+}
+
+long Recorder::Open(const char *path, uint64_t capacity)
+{
+    Close();
+    if (capacity == 0)
+        return REC_ERR_FORMAT;
+    mapSize = sizeof(recHeader) + capacity * sizeof(recRecord);
+    void *base = nullptr;
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return REC_ERR_FILE;
+    // the mapping grows the file to mapSize
+    mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(mapSize >> 32), (DWORD)(mapSize & 0xffffffff), NULL);
+    if (mapping != NULL)
+        base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mapSize);
+#else
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return REC_ERR_FILE;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size != mapSize && ftruncate(fd, mapSize) == 0)
+        st.st_size = mapSize;
+    if ((uint64_t)st.st_size == mapSize)
+    {
+        base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            base = nullptr;
+    }
+#endif
+    if (base == nullptr)
+    {
+        Close();
+        return REC_ERR_FILE;
+    }
+    hdr = (recHeader *)base;
+    ring = (recRecord *)((char *)base + sizeof(recHeader));
+    if (memcmp(hdr->magic, REC_MAGIC, sizeof(REC_MAGIC)) || hdr->version != REC_VERSION ||
+        hdr->recordSize != sizeof(recRecord) || hdr->capacity != capacity)
+    {
+        // new file, or a layout we can't continue: start over
+        memset((void *)hdr, 0, sizeof(recHeader));
+        memcpy(hdr->magic, REC_MAGIC, sizeof(REC_MAGIC));
+        hdr->version = REC_VERSION;
+        hdr->recordSize = sizeof(recRecord);
+        hdr->capacity = capacity;
+        new (&hdr->head) std::atomic<uint64_t>(0);
+    }
+    return 0;
+}
+
+void Recorder::Close()
+{
+#ifdef _WIN32
+    if (hdr != nullptr)
+        UnmapViewOfFile(hdr);
+    if (mapping != NULL)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (hdr != nullptr)
+        munmap(hdr, mapSize);
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+#endif
+    hdr = nullptr;
+    ring = nullptr;
+}
+
+bool Recorder::IsOpen() const
+{
+    return hdr != nullptr;
+}
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "recorder sequence numbers are updated in place");
+
+// the sequence number of a slot in the mapping, as the writers update it
+static std::atomic<uint32_t> *SlotSeq(recRecord *slot)
+{
+    return reinterpret_cast<std::atomic<uint32_t> *>(&slot->seq);
+}
+
+void Recorder::Log(recRecord rec)
+{
+    if (hdr == nullptr)
+        return;
+    uint64_t idx = hdr->head.fetch_add(1, std::memory_order_relaxed);
+    recRecord *slot = &ring[idx % hdr->capacity];
+    // as a seqlock: the slot is marked torn before any of it changes, and its sequence number goes
+    // in once the rest is written, so a reader that finds the number unchanged after copying the
+    // record knows it is whole
+    std::atomic<uint32_t> *seq = SlotSeq(slot);
+    seq->store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot, &rec, offsetof(recRecord, seq));
+    seq->store((uint32_t)(idx + 1), std::memory_order_release);
+}
+
+void Recorder::SetClock(const Clock *clock)
+{
+    this->clock = clock;
+}
+
+uint64_t Recorder::Stamp() const
+{
+    if (clock != nullptr)
+        return (uint64_t)(clock->Now() * 1e6);
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Recorder::LogState(long serNum, float pos, bool moving, long ret)
+{
+    recRecord rec = {};
+    rec.stamp = Stamp();
+    rec.serNum = serNum;
+    rec.type = REC_STATE;
+    rec.flags = (moving ? REC_FLAG_MOVING : 0) | (ret ? REC_FLAG_ERROR : 0);
+    rec.pos = pos;
+    rec.ret = ret;
+    Log(rec);
+}
+
+void Recorder::LogCommand(long serNum, int cmd, float arg, long ret)
+{
+    recRecord rec = {};
+    rec.stamp = Stamp();
+    rec.serNum = serNum;
+    rec.type = REC_COMMAND;
+    rec.flags = ret ? REC_FLAG_ERROR : 0;
+    rec.aux = arg;
+    rec.code = cmd;
+    rec.ret = ret;
+    Log(rec);
+}
+
+void Recorder::LogScan(long serNum, long index, float target, float actual, double value)
+{
+    recRecord rec = {};
+    rec.stamp = Stamp();
+    rec.serNum = serNum;
+    rec.type = REC_SCAN;
+    rec.pos = actual;
+    rec.aux = target;
+    rec.code = index;
+    rec.value = (float)value;
+    Log(rec);
+}
+
+long Recorder::Flush()
+{
+    if (hdr == nullptr)
+        return REC_ERR_FILE;
+#ifdef _WIN32
+    return FlushViewOfFile(hdr, mapSize) ? 0 : REC_ERR_FILE;
+#else
+    return msync(hdr, mapSize, MS_ASYNC) == 0 ? 0 : REC_ERR_FILE;
+#endif
+}
+
+uint64_t Recorder::Written() const
+{
+    return hdr != nullptr ? hdr->head.load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t Recorder::Capacity() const
+{
+    return hdr != nullptr ? hdr->capacity : 0;
+}
+
+// opens a recording and checks its header; nullptr on failure, with the reason in ret
+static FILE *RecOpen(const char *recPath, recHeader *hdr, long *ret)
+{
+    FILE *in = fopen(recPath, "rb");
+    if (in == NULL)
+    {
+        *ret = REC_ERR_FILE;
+        return NULL;
+    }
+    // every read goes to the file, RecEach() reads the sequence numbers again after the records
+    setvbuf(in, NULL, _IONBF, 0);
+    if (fread(hdr, sizeof(*hdr), 1, in) != 1 || memcmp(hdr->magic, REC_MAGIC, sizeof(REC_MAGIC)) ||
+        hdr->version != REC_VERSION || hdr->recordSize != sizeof(recRecord) || hdr->capacity == 0)
+    {
+        fclose(in);
+        *ret = REC_ERR_FORMAT;
+        return NULL;
+    }
+    *ret = 0;
+    return in;
+}
+
+#define REC_READ_CHUNK 256 // records read at once
+
+// fn gets the records still held, oldest first
+template <typename F>
+static void RecEach(FILE *in, const recHeader &hdr, F fn)
+{
+    uint64_t head = hdr.head.load();
+    uint64_t first = head > hdr.capacity ? head - hdr.capacity : 0;
+    std::vector<recRecord> recs(REC_READ_CHUNK), again(REC_READ_CHUNK);
+    for (uint64_t i = first; i < head;)
+    {
+        // records are contiguous except where the ring wraps
+        uint64_t slot = i % hdr.capacity;
+        size_t n = (size_t)std::min<uint64_t>(REC_READ_CHUNK, std::min(head - i, hdr.capacity - slot));
+        long at = (long)(sizeof(recHeader) + slot * sizeof(recRecord));
+        if (fseek(in, at, SEEK_SET) || fread(recs.data(), sizeof(recRecord), n, in) != n)
+            break;
+        // the sequence numbers once more: a writer zeroes a slot's before changing the rest of it, so a
+        // record whose number is still its own after the copy was not written meanwhile
+        if (fseek(in, at, SEEK_SET) || fread(again.data(), sizeof(recRecord), n, in) != n)
+            break;
+        for (size_t k = 0; k < n; k++)
+        {
+            uint32_t seq = (uint32_t)(i + k + 1);
+            const recRecord &rec = recs[k];
+            if (rec.seq != seq || again[k].seq != seq || rec.type < REC_STATE || rec.type > REC_SCAN)
+                continue; // overwritten or torn while we were reading
+            fn(rec);
+        }
+        i += n;
+    }
+}
+
+long RecorderRead(const char *recPath, std::vector<recRecord> *records)
+{
+    recHeader hdr;
+    long ret;
+    FILE *in = RecOpen(recPath, &hdr, &ret);
+    records->clear();
+    if (in == NULL)
+        return ret;
+    RecEach(in, hdr, [records](const recRecord &rec)
+            { records->push_back(rec); });
+    fclose(in);
+    return 0;
+}
+
+long RecorderExportCsv(const char *recPath, const char *csvPath, uint64_t *count)
+{
+    static const char *typeName[] = {"", "state", "command", "scan"};
+    recHeader hdr;
+    long ret;
+    FILE *in = RecOpen(recPath, &hdr, &ret);
+    if (in == NULL)
+        return ret;
+    FILE *out = fopen(csvPath, "w");
+    if (out == NULL)
+    {
+        fclose(in);
+        return REC_ERR_FILE;
+    }
+    fprintf(out, "time_us,serial,type,moving,error,position,aux,code,ret,value\n");
+    uint64_t n = 0;
+    RecEach(in, hdr, [out, &n](const recRecord &rec)
+            {
+                fprintf(out, "%llu,%d,%s,%d,%d,%.6f,%.6f,%d,%d,%g\n", (unsigned long long)rec.stamp, rec.serNum, typeName[rec.type],
+                        (rec.flags & REC_FLAG_MOVING) ? 1 : 0, (rec.flags & REC_FLAG_ERROR) ? 1 : 0, rec.pos, rec.aux, rec.code, rec.ret, rec.value);
+                n++; });
+    fclose(out);
+    fclose(in);
+    if (count != nullptr)
+        *count = n;
+    return 0;
+}
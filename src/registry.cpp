@@ -0,0 +1,185 @@
+#include "registry.h"
+
+#include <new>
+
+// n values, starting on a cache line and padded to whole lines so no other data shares them
+template <typename V>
+static std::atomic<V> *HotArray(long n)
+{
+    size_t bytes = (n * sizeof(std::atomic<V>) + REG_LINE - 1) / REG_LINE * REG_LINE;
+    std::atomic<V> *a = static_cast<std::atomic<V> *>(::operator new(bytes, std::align_val_t(REG_LINE)));
+    for (long i = 0; i < n; i++)
+        new (&a[i]) std::atomic<V>(V());
+    return a;
+}
+
+template <typename V>
+static void HotFree(std::atomic<V> *a)
+{
+    ::operator delete(a, std::align_val_t(REG_LINE));
+}
+
+MotorRegistry::MotorRegistry(long capacity) : capacity(capacity > 0 ? capacity : 1), numSlots(0), count(0)
+{
+    seq = HotArray<uint32_t>(this->capacity);
+    pos = HotArray<float>(this->capacity);
+    moving = HotArray<uint8_t>(this->capacity);
+    ret = HotArray<long>(this->capacity);
+    stamp = HotArray<double>(this->capacity);
+    polls = HotArray<uint64_t>(this->capacity);
+    present = HotArray<uint8_t>(this->capacity);
+    gen = HotArray<uint32_t>(this->capacity);
+    serNums = new long[this->capacity]();
+}
+
+MotorRegistry::~MotorRegistry()
+{
+    delete[] serNums;
+    HotFree(gen);
+    HotFree(present);
+    HotFree(polls);
+    HotFree(stamp);
+    HotFree(ret);
+    HotFree(moving);
+    HotFree(pos);
+    HotFree(seq);
+}
+
+long MotorRegistry::Capacity() const
+{
+    return capacity;
+}
+
+long MotorRegistry::NumSlots() const
+{
+    return numSlots.load(std::memory_order_acquire);
+}
+
+long MotorRegistry::Count() const
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+long MotorRegistry::Find(long serNum) const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = slots.find(serNum);
+    return it == slots.end() ? -1 : it->second;
+}
+
+long MotorRegistry::Add(long serNum, long *slot)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    auto it = slots.find(serNum);
+    long s = it == slots.end() ? numSlots.load(std::memory_order_relaxed) : it->second;
+    if (it != slots.end() && present[s].load(std::memory_order_relaxed))
+        return REG_ERR_PRESENT;
+    if (s == capacity)
+        return REG_ERR_FULL;
+    if (it == slots.end())
+    {
+        slots[serNum] = s;
+        serNums[s] = serNum;
+        numSlots.store(s + 1, std::memory_order_release); // after the serial number is in place
+    }
+    gen[s].fetch_add(1, std::memory_order_relaxed);
+    present[s].store(1, std::memory_order_release);
+    count.fetch_add(1, std::memory_order_relaxed);
+    *slot = s;
+    return 0;
+}
+
+long MotorRegistry::Remove(long slot)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    if (slot < 0 || slot >= numSlots.load(std::memory_order_relaxed) || !present[slot].load(std::memory_order_relaxed))
+        return REG_ERR_NOSLOT;
+    gen[slot].fetch_add(1, std::memory_order_relaxed);
+    present[slot].store(0, std::memory_order_release);
+    count.fetch_sub(1, std::memory_order_relaxed);
+    return 0;
+}
+
+bool MotorRegistry::Present(long slot) const
+{
+    return slot >= 0 && slot < capacity && present[slot].load(std::memory_order_acquire);
+}
+
+long MotorRegistry::SerialNum(long slot) const
+{
+    if (slot < 0 || slot >= NumSlots())
+        return 0;
+    return serNums[slot];
+}
+
+const long *MotorRegistry::SerialNums() const
+{
+    return serNums;
+}
+
+uint32_t MotorRegistry::Generation(long slot) const
+{
+    if (slot < 0 || slot >= capacity)
+        return 0;
+    return gen[slot].load(std::memory_order_acquire);
+}
+
+void MotorRegistry::Store(long slot, const motorState &state)
+{
+    if (slot < 0 || slot >= capacity)
+        return;
+    uint32_t s = seq[slot].load(std::memory_order_relaxed);
+    seq[slot].store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    pos[slot].store(state.curPos, std::memory_order_relaxed);
+    moving[slot].store(state.moving, std::memory_order_relaxed);
+    ret[slot].store(state.ret, std::memory_order_relaxed);
+    stamp[slot].store(state.stamp, std::memory_order_relaxed);
+    polls[slot].store(state.polls, std::memory_order_relaxed);
+    seq[slot].store(s + 2, std::memory_order_release);
+}
+
+bool MotorRegistry::Load(long slot, motorState *state) const
+{
+    if (slot < 0 || slot >= capacity)
+        return false;
+    uint32_t s0, s1;
+    do
+    {
+        s0 = seq[slot].load(std::memory_order_acquire);
+        state->curPos = pos[slot].load(std::memory_order_relaxed);
+        state->moving = moving[slot].load(std::memory_order_relaxed) != 0;
+        state->ret = ret[slot].load(std::memory_order_relaxed);
+        state->stamp = stamp[slot].load(std::memory_order_relaxed);
+        state->polls = polls[slot].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        s1 = seq[slot].load(std::memory_order_relaxed);
+    } while ((s0 & 1) || s0 != s1);
+    return true;
+}
+
+uint64_t MotorRegistry::Polls(long slot) const
+{
+    if (slot < 0 || slot >= capacity)
+        return 0;
+    return polls[slot].load(std::memory_order_acquire);
+}
+
+long MotorRegistry::Snapshot(float *pos, uint8_t *moving, long n) const
+{
+    if (n > NumSlots())
+        n = NumSlots();
+    for (long i = 0; i < n; i++)
+    {
+        uint32_t s0, s1;
+        do
+        {
+            s0 = seq[i].load(std::memory_order_acquire);
+            pos[i] = this->pos[i].load(std::memory_order_relaxed);
+            moving[i] = this->moving[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s1 = seq[i].load(std::memory_order_relaxed);
+        } while ((s0 & 1) || s0 != s1);
+    }
+    return n;
+}
@@ -0,0 +1,195 @@
+#include "replaydriver.h"
+
+#include <algorithm>
+#include <cmath>
+
+// a move starts where a stage is first seen moving
+static bool MoveStart(const std::vector<replaySample> &s, size_t i)
+{
+    return s[i].moving && (i == 0 || !s[i - 1].moving);
+}
+
+ReplayDriver::ReplayDriver() : SimDriver(0), mismatches(0)
+{
+}
+
+long ReplayDriver::Load(const char *recPath)
+{
+    std::vector<recRecord> records;
+    long ret = RecorderRead(recPath, &records);
+    if (ret)
+        return ret;
+    return Load(records);
+}
+
+long ReplayDriver::Load(const std::vector<recRecord> &records)
+{
+    std::vector<trace> loaded;
+    uint64_t first = 0;
+    bool any = false;
+    for (const recRecord &rec : records)
+    {
+        if (rec.type != REC_STATE)
+            continue;
+        if (!any)
+            first = rec.stamp;
+        any = true;
+        trace *tr = nullptr;
+        for (trace &t : loaded)
+        {
+            if (t.serNum == rec.serNum)
+                tr = &t;
+        }
+        if (tr == nullptr)
+        {
+            loaded.push_back(trace());
+            tr = &loaded.back();
+            tr->serNum = rec.serNum;
+        }
+        replaySample s;
+        s.t = rec.stamp >= first ? (rec.stamp - first) / 1e6 : 0;
+        s.pos = rec.pos;
+        s.moving = (rec.flags & REC_FLAG_MOVING) != 0;
+        s.ret = (rec.flags & REC_FLAG_ERROR) ? rec.ret : 0;
+        tr->samples.push_back(s);
+    }
+    if (!any)
+        return REPLAY_ERR_EMPTY;
+    for (trace &tr : loaded)
+    {
+        // until the first move, the stage holds its first sample
+        tr.base = 0;
+        tr.end = 1;
+        tr.offset = 0;
+        Plug(tr.serNum);
+    }
+    std::lock_guard<std::mutex> lk(lock);
+    traces.swap(loaded);
+    mismatches = 0;
+    return 0;
+}
+
+long ReplayDriver::Mismatches() const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    return mismatches;
+}
+
+ReplayDriver::trace *ReplayDriver::Find(long serNum)
+{
+    for (trace &tr : traces)
+    {
+        if (tr.serNum == serNum)
+            return &tr;
+    }
+    return nullptr;
+}
+
+// the latest sample of the move played back, as of now
+size_t ReplayDriver::Current(const trace *tr) const
+{
+    double t = Now() + tr->offset;
+    auto first = tr->samples.begin() + tr->base, last = tr->samples.begin() + tr->end;
+    auto it = std::upper_bound(first, last, t, [](double t, const replaySample &s)
+                               { return t < s.t; });
+    return it == first ? tr->base : (size_t)(it - tr->samples.begin()) - 1;
+}
+
+void ReplayDriver::Jump(long serNum, float target)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    trace *tr = Find(serNum);
+    if (tr == nullptr)
+        return;
+    const std::vector<replaySample> &s = tr->samples;
+    size_t cur = Current(tr);
+    if (fabs(s[cur].pos - target) <= REPLAY_TOL && !s[cur].moving)
+        return; // already there, the hardware would not have moved either
+    size_t j = tr->end;
+    while (j < s.size() && !MoveStart(s, j))
+        j++;
+    if (j == s.size())
+    {
+        // out of moves: the stage stays where the recording left it
+        mismatches++;
+        tr->base = tr->end = s.size();
+        tr->base--;
+        return;
+    }
+    tr->base = j > 0 ? j - 1 : j; // from the last sample at rest, taken as the time of the command
+    tr->offset = s[tr->base].t - Now();
+    tr->end = j + 1;
+    while (tr->end < s.size() && !MoveStart(s, tr->end))
+        tr->end++;
+    if (fabs(s[tr->end - 1].pos - target) > REPLAY_TOL)
+        mismatches++;
+}
+
+long ReplayDriver::GetPosition(long serNum, float *pos)
+{
+    long ret = SimDriver::GetPosition(serNum, pos);
+    if (ret)
+        return ret;
+    std::lock_guard<std::mutex> lk(lock);
+    trace *tr = Find(serNum);
+    if (tr == nullptr)
+        return DRV_ERR_NODEVICE;
+    const replaySample &s = tr->samples[Current(tr)];
+    if (s.ret)
+        return s.ret;
+    *pos = s.pos;
+    return 0;
+}
+
+long ReplayDriver::GetInMotion(long serNum, bool *moving)
+{
+    long ret = SimDriver::GetInMotion(serNum, moving);
+    if (ret)
+        return ret;
+    std::lock_guard<std::mutex> lk(lock);
+    trace *tr = Find(serNum);
+    if (tr == nullptr)
+        return DRV_ERR_NODEVICE;
+    const replaySample &s = tr->samples[Current(tr)];
+    if (s.ret)
+        return s.ret;
+    *moving = s.moving;
+    return 0;
+}
+
+long ReplayDriver::MoveAbsolute(long serNum, float pos, bool wait)
+{
+    long ret = SimDriver::MoveAbsolute(serNum, pos, false);
+    if (ret)
+        return ret;
+    Jump(serNum, pos);
+    if (wait)
+        return SimDriver::MoveAbsolute(serNum, pos, true);
+    return 0;
+}
+
+long ReplayDriver::MoveHome(long serNum, bool wait)
+{
+    long ret = SimDriver::MoveHome(serNum, false);
+    if (ret)
+        return ret;
+    Jump(serNum, 0);
+    if (wait)
+        return SimDriver::MoveHome(serNum, true);
+    return 0;
+}
+
+long ReplayDriver::Stop(long serNum)
+{
+    long ret = SimDriver::Stop(serNum);
+    if (ret)
+        return ret;
+    std::lock_guard<std::mutex> lk(lock);
+    trace *tr = Find(serNum);
+    if (tr == nullptr)
+        return DRV_ERR_NODEVICE;
+    // the stage stays where it was stopped, the rest of the recorded move is skipped
+    tr->base = Current(tr);
+    tr->end = tr->base + 1;
+    return 0;
+}
@@ -0,0 +1,558 @@
+#include "scanengine.h"
+
+#include <algorithm>
+#include <cmath>
+
+ScanEngine::ScanEngine(MotorDriver *drv, MotorTelemetry *tel, long idx, long serNum) : drv(drv), tel(tel), idx(idx), serNum(serNum), cmdPoll(0), cmdPending(false), cmdFrom(0), cmdTime(0), velOk(false), model(nullptr), token(nullptr), meas(nullptr), env(nullptr), npoint(0),
+      precise(false), prec(), table(nullptr), pstats(), sentTo(0), sentFrom(0), sentDir(0), lastDir(0), approaching(false)
+{
+}
+
+void ScanEngine::SetStatusHook(std::function<void(const std::string &msg)> hook)
+{
+    statusHook = hook;
+}
+
+void ScanEngine::SetRunHook(std::function<bool()> hook)
+{
+    runHook = hook;
+}
+
+void ScanEngine::SetCancelToken(CancelToken *token)
+{
+    this->token = token;
+}
+
+void ScanEngine::SetMeasurement(Measurement *meas)
+{
+    this->meas = meas;
+}
+
+void ScanEngine::SetPointHook(std::function<void(long i, float target, float actual, double value)> hook)
+{
+    pointHook = hook;
+}
+
+void ScanEngine::SetMotionModel(MotionModel *model)
+{
+    this->model = model;
+}
+
+void ScanEngine::SetProgressHook(std::function<void(long done, long total, double remaining)> hook)
+{
+    progressHook = hook;
+}
+
+void ScanEngine::SetEnvelope(const SafetyEnvelope *env)
+{
+    this->env = env;
+}
+
+void ScanEngine::SetPrecision(const precisionParams *prec, BacklashTable *table)
+{
+    precise = prec != nullptr;
+    if (precise)
+        this->prec = *prec;
+    this->prec.approach = this->prec.approach < 0 ? -1 : 1;
+    this->table = table;
+}
+
+void ScanEngine::GetPrecisionStats(precisionStats *stats) const
+{
+    *stats = pstats;
+}
+
+void ScanEngine::Progress(long done, long total, double remaining)
+{
+    if (progressHook)
+        progressHook(done, total, remaining);
+}
+
+void ScanEngine::Status(const std::string &msg)
+{
+    if (statusHook)
+        statusHook(msg);
+}
+
+// the whole range at once, from where the axes are now; the points are not checked one by one
+long ScanEngine::CheckEnvelope(float start, float stop)
+{
+    if (env == nullptr)
+        return 0;
+    std::vector<float> lo(env->NumAxes()), hi(env->NumAxes());
+    env->Where(tel, lo.data(), hi.data());
+    long ret = env->CheckScan(serNum, start, stop, lo.data(), hi.data());
+    // and the approaches from past the points on the approach side
+    if (!ret && precise && prec.overshoot > 0)
+        ret = env->CheckPath(serNum, Approach(prec.approach > 0 ? std::min(start, stop) : std::max(start, stop)), lo.data(), hi.data());
+    if (ret == ENV_ERR_TRAVEL)
+        Status("Scan range is beyond the travel limits.");
+    else if (ret == ENV_ERR_ZONE)
+        Status("Scan passes through a forbidden zone.");
+    return ret;
+}
+
+bool ScanEngine::KeepRunning()
+{
+    if (token != nullptr && token->Cancelled())
+        return false;
+    return runHook ? runHook() : true;
+}
+
+long ScanEngine::Sanitize(scanParams *p, std::string *msg)
+{
+    if (p->dwell < 0)
+        p->dwell = 0;
+    if (p->dwell > 10)
+        p->dwell = 10;
+    p->step = fabs(p->step);
+    if (p->step == 0 || !std::isfinite(p->step))
+        p->step = 0.1f;
+    if (p->settleTol <= 0)
+        p->settleTol = 0.005f;
+    if (p->settleCount < 1)
+        p->settleCount = 3;
+    if (p->timeout <= 0)
+        p->timeout = 60;
+    if (p->minStep <= 0)
+        p->minStep = p->step / 10;
+    if (p->minStep > p->step)
+        p->minStep = p->step;
+    if (!(p->start >= 0 && std::isfinite(p->start)))
+    {
+        if (msg != nullptr)
+            *msg = "Start position is negative or not a number, invalid.";
+        return SCAN_ERR_PARAM;
+    }
+    if (!(p->stop >= 0 && std::isfinite(p->stop)))
+    {
+        if (msg != nullptr)
+            *msg = "Stop position is negative or not a number, invalid.";
+        return SCAN_ERR_PARAM;
+    }
+    if (p->start == p->stop)
+    {
+        if (msg != nullptr)
+            *msg = "Scan start and stop locations are same, invalid.";
+        return SCAN_ERR_PARAM;
+    }
+    return 0;
+}
+
+long ScanEngine::NumPoints(const scanParams &p)
+{
+    return (long)floor(fabs(p.stop - p.start) / p.step + 1e-4) + 1;
+}
+
+float ScanEngine::Point(const scanParams &p, long i)
+{
+    // computed from the index so the rounding error does not accumulate over the scan
+    return p.start < p.stop ? p.start + i * p.step : p.start - i * p.step;
+}
+
+// every step of a grid is the same length, so only the first move differs
+double ScanEngine::Predict(const MotionModel *model, long idx, const scanParams &p, float from, float minVel, float maxVel, float accel, long first)
+{
+    long left = NumPoints(p) - first;
+    if (left <= 0)
+        return 0;
+    if (model == nullptr)
+        return MoveTime(Point(p, first) - from, minVel, maxVel, accel) + (left - 1) * MoveTime(p.step, minVel, maxVel, accel) + left * p.dwell;
+    return model->PredictMove(idx, Point(p, first) - from, minVel, maxVel, accel) +
+           (left - 1) * model->PredictMove(idx, p.step, minVel, maxVel, accel) +
+           left * (p.dwell + model->PointTime(idx));
+}
+
+long ScanEngine::Dwell(float seconds)
+{
+    if (!runHook && token != nullptr) // woken by the cancel itself, nothing to poll
+        return token->Sleep(seconds) ? 0 : SCAN_ERR_STOPPED;
+    Clock *clock = tel->GetClock();
+    double end = clock->Now() + seconds;
+    for (double now = clock->Now(); now < end; now = clock->Now())
+    {
+        if (!KeepRunning())
+            return SCAN_ERR_STOPPED;
+        clock->Sleep(end - now < 0.02 ? end - now : 0.02);
+    }
+    return 0;
+}
+
+long ScanEngine::MoveAndSettle(float pos, const scanParams &p, float *actual)
+{
+    long ret = Command(pos);
+    if (ret)
+        return ret;
+    return WaitSettled(pos, p, actual);
+}
+
+long ScanEngine::Command(float pos)
+{
+    motorState state;
+    tel->GetState(idx, &state);
+    // the parameters the move runs with, from the cache in front of the driver as a rule
+    velOk = (model != nullptr || progressHook) && !drv->GetVelParams(serNum, &vel[0], &vel[1], &vel[2]);
+    cmdFrom = state.curPos;
+    cmdTime = tel->GetClock()->Now();
+    float to = pos;
+    approaching = false;
+    if (precise && prec.overshoot > 0)
+    {
+        // straight there only from the approach side, and from far enough unless already moving that way
+        float ahead = (pos - state.curPos) * prec.approach;
+        approaching = !(ahead > 0 && (ahead >= prec.overshoot || sentDir == prec.approach));
+        to = approaching ? Approach(pos) : Compensated(pos, prec.approach);
+    }
+    else if (precise)
+        to = Compensated(pos, pos >= state.curPos ? 1 : -1);
+    long ret = Send(to);
+    if (ret)
+        return ret;
+    cmdPending = true;
+    return 0;
+}
+
+long ScanEngine::Send(float to)
+{
+    motorState state;
+    tel->GetState(idx, &state);
+    cmdPoll = state.polls; // samples taken before the move was commanded don't count
+    long ret = drv->MoveAbsolute(serNum, to, false);
+    if (ret)
+        return ret;
+    lastDir = sentDir;
+    if (to != state.curPos)
+        sentDir = to > state.curPos ? 1 : -1;
+    sentFrom = state.curPos;
+    sentTo = to;
+    tel->SetTarget(idx, to);
+    tel->Kick(idx);
+    return 0;
+}
+
+// within the travel limits of the envelope, if any, and not below 0
+float ScanEngine::Limit(float pos) const
+{
+    if (env != nullptr)
+    {
+        envLimits l = env->Limits(serNum);
+        pos = std::min(std::max(pos, l.min), l.max);
+    }
+    return pos < 0 ? 0 : pos;
+}
+
+// where to send the stage for it to stop at pos, moving in dir
+float ScanEngine::Compensated(float pos, int dir) const
+{
+    if (prec.compensate && table != nullptr)
+        pos -= table->Offset(serNum, dir, pos);
+    return Limit(pos);
+}
+
+// the point past pos that pos is approached from
+float ScanEngine::Approach(float pos) const
+{
+    return Limit(pos - prec.approach * prec.overshoot);
+}
+
+long ScanEngine::CommandHome()
+{
+    motorState state;
+    tel->GetState(idx, &state);
+    cmdPoll = state.polls;
+    cmdPending = false; // homing runs at the home velocity, nothing for the model to learn
+    long ret = drv->MoveHome(serNum, false);
+    if (ret)
+        return ret;
+    // nothing to correct, and the play is not known after it
+    approaching = false;
+    sentTo = NAN;
+    sentDir = lastDir = 0;
+    tel->SetTarget(idx, 0);
+    tel->Kick(idx);
+    return 0;
+}
+
+long ScanEngine::WaitSettled(float pos, const scanParams &p, float *actual)
+{
+    Clock *clock = tel->GetClock();
+    double deadline = clock->Now() + p.timeout;
+    motorState state;
+    tel->GetState(idx, &state);
+    // an axis already settled while another one was waited for has nothing to teach the model
+    bool observe = cmdPending && velOk && model != nullptr && fabs(pos - cmdFrom) > p.settleTol &&
+                   !(state.polls > cmdPoll + 1 && !state.moving && fabs(state.curPos - pos) <= p.settleTol);
+    cmdPending = false;
+    // a cancel interrupts the telemetry wait instead of waiting out its timeout
+    const std::atomic<bool> *abort = token != nullptr ? token->Flag() : nullptr;
+    long sub = token != nullptr ? token->Subscribe([this]()
+                                                   { tel->Interrupt(idx); })
+                                : 0;
+    // in precision mode the stage is taken to be where it stops, and corrected from there
+    bool correct = precise && !std::isnan(sentTo);
+    long ret = Settle(correct ? NAN : pos, p, deadline, abort, &state);
+    if (!ret && correct)
+        ret = Correct(pos, p, deadline, abort, &state);
+    if (token != nullptr)
+        token->Unsubscribe(sub);
+    if (!ret && observe)
+        model->ObserveMove(idx, pos - cmdFrom, vel[0], vel[2], vel[1], clock->Now() - cmdTime);
+    if (!ret && actual != nullptr)
+        *actual = state.curPos;
+    return ret;
+}
+
+// within settleTol of pos for settleCount samples; of wherever it stopped if pos is NaN
+long ScanEngine::Settle(float pos, const scanParams &p, double deadline, const std::atomic<bool> *abort, motorState *state)
+{
+    Clock *clock = tel->GetClock();
+    int inTol = 0;
+    float at = 0;
+    long ret = 0;
+    while (!ret && inTol < p.settleCount)
+    {
+        if (!KeepRunning())
+            ret = SCAN_ERR_STOPPED;
+        else if (clock->Now() > deadline)
+            ret = SCAN_ERR_TIMEOUT;
+        else if (!tel->WaitForUpdate(idx, state, 100, abort))
+            continue;
+        else if (state->ret)
+            ret = state->ret;
+        else if (state->polls <= cmdPoll + 1) // poll may have been in flight when the move was sent
+            continue;
+        else if (state->moving)
+            inTol = 0;
+        else if (!std::isnan(pos))
+            inTol = fabs(state->curPos - pos) <= p.settleTol ? inTol + 1 : 0;
+        else if (inTol > 0 && fabs(state->curPos - at) <= p.settleTol)
+            inTol++;
+        else
+        {
+            at = state->curPos;
+            inTol = 1;
+        }
+    }
+    return ret;
+}
+
+// the move Command() sent has stopped: the rest of an approach, then corrections until within tol of pos
+long ScanEngine::Correct(float pos, const scanParams &p, double deadline, const std::atomic<bool> *abort, motorState *state)
+{
+    long ret = 0;
+    int n = 0;
+    while (!ret)
+    {
+        // a short move that reverses takes up part of the play only, and would teach the table wrong
+        if (table != nullptr && (sentDir == lastDir || !(fabs(sentTo - sentFrom) <= fabs(table->Backlash(serNum)))))
+            table->Observe(serNum, sentDir, sentTo, state->curPos);
+        float err = state->curPos - pos;
+        if (approaching)
+        {
+            approaching = false;
+            pstats.approaches++;
+            ret = Send(Compensated(pos, prec.approach));
+        }
+        else if (prec.tol <= 0 || fabs(err) <= prec.tol)
+            break;
+        else if (n >= prec.maxCorrections)
+        {
+            pstats.misses++;
+            Status("Stage stopped " + std::to_string(err) + " from " + std::to_string(pos) + " after " + std::to_string(n) + " corrections.");
+            break;
+        }
+        else
+        {
+            n++;
+            pstats.corrections++;
+            int dir = err < 0 ? 1 : -1;
+            if (prec.overshoot > 0 && dir != prec.approach) // gone past, approach it again
+            {
+                approaching = true;
+                ret = Send(Approach(pos));
+            }
+            else // the same way on, the play is taken up; the other way, as learned for it
+                ret = Send(dir == sentDir ? Limit(sentTo - err) : Compensated(pos, dir));
+        }
+        if (!ret)
+            ret = Settle(NAN, p, deadline, abort, state);
+    }
+    if (!ret)
+        pstats.points++;
+    return ret;
+}
+
+long ScanEngine::MeasurePoint(float pos, const scanParams &p, double *value)
+{
+    float actual;
+    long ret = MoveAndSettle(pos, p, &actual);
+    if (ret == SCAN_ERR_TIMEOUT)
+        Status("Stage did not settle at " + std::to_string(pos) + ".");
+    else if (ret && ret != SCAN_ERR_STOPPED)
+        Status("Could not move to position " + std::to_string(pos) + ": " + std::to_string(ret));
+    if (ret)
+        return ret;
+    // make measurement
+    Status("Making measurement...");
+    double settled = tel->GetClock()->Now();
+    ret = Dwell(p.dwell);
+    if (ret)
+        return ret;
+    *value = 0;
+    if (meas != nullptr)
+    {
+        ret = meas->Measure(&actual, 1, value);
+        if (ret)
+        {
+            Status("Measurement failed at " + std::to_string(pos) + ": " + std::to_string(ret));
+            return ret;
+        }
+    }
+    if (model != nullptr)
+        model->ObservePoint(idx, tel->GetClock()->Now() - settled - p.dwell);
+    if (pointHook)
+        pointHook(npoint, pos, actual, *value);
+    npoint++;
+    return 0;
+}
+
+long ScanEngine::Run(scanParams p, long first)
+{
+    std::string msg;
+    long ret = Sanitize(&p, &msg);
+    if (ret)
+    {
+        Status(msg);
+        return ret;
+    }
+    long npts = NumPoints(p);
+    if ((ret = CheckEnvelope(Point(p, first < npts ? first : npts - 1), Point(p, npts - 1))))
+        return ret;
+    npoint = first;
+    if (progressHook)
+    {
+        motorState state;
+        tel->GetState(idx, &state);
+        float v[3];
+        double left = drv->GetVelParams(serNum, &v[0], &v[1], &v[2]) ? NAN : Predict(model, idx, p, state.curPos, v[0], v[2], v[1], first);
+        Progress(first, npts, left);
+    }
+    Status("Moving to starting position...");
+    for (long i = first; i < npts && !ret; i++)
+    {
+        float pos = Point(p, i);
+        double value;
+        if (i > first)
+            Status("Moving to " + std::to_string(pos) + "...");
+        ret = MeasurePoint(pos, p, &value);
+        if (!ret)
+            Progress(i + 1, npts, velOk ? Predict(model, idx, p, pos, vel[0], vel[2], vel[1], i + 1) : NAN);
+    }
+    if (ret && ret != SCAN_ERR_STOPPED)
+        return ret;
+    Status(ret == SCAN_ERR_STOPPED ? "Scan stopped." : "Finished scan.");
+    return ret;
+}
+
+// step that keeps the predicted signal change near adaptTol, from the slope and curvature of the last three points
+float ScanEngine::NextStep(const std::vector<float> &xs, const std::vector<double> &vs, const scanParams &p) const
+{
+    size_t n = xs.size();
+    if (n < 3)
+        return p.step;
+    double h1 = fabs(xs[n - 1] - xs[n - 2]), h0 = fabs(xs[n - 2] - xs[n - 3]);
+    if (h1 == 0 || h0 == 0)
+        return p.step;
+    double g1 = (vs[n - 1] - vs[n - 2]) / h1;
+    double g0 = (vs[n - 2] - vs[n - 3]) / h0;
+    double c = (g1 - g0) / ((h0 + h1) / 2);
+    double h = p.step;
+    if (g1 != 0 && p.adaptTol / fabs(g1) < h)
+        h = p.adaptTol / fabs(g1);
+    if (c != 0 && sqrt(2 * p.adaptTol / fabs(c)) < h)
+        h = sqrt(2 * p.adaptTol / fabs(c));
+    if (h > 2 * h1) // coarsen gradually, a feature may start right after a flat stretch
+        h = 2 * h1;
+    if (h < p.minStep)
+        h = p.minStep;
+    if (h > p.step)
+        h = p.step;
+    return (float)h;
+}
+
+// bisect [x0, x1] while the signal changes by more than twice the target across it
+long ScanEngine::Refine(float x0, double v0, float x1, double v1, const scanParams &p, std::vector<float> *xs, std::vector<double> *vs)
+{
+    if (fabs(v1 - v0) <= 2 * p.adaptTol || fabs(x1 - x0) < 2 * p.minStep)
+        return 0;
+    float xm = (x0 + x1) / 2;
+    double vm;
+    Status("Refining at " + std::to_string(xm) + "...");
+    long ret = MeasurePoint(xm, p, &vm);
+    if (!ret)
+        ret = Refine(x0, v0, xm, vm, p, xs, vs);
+    if (!ret)
+    {
+        xs->push_back(xm);
+        vs->push_back(vm);
+        ret = Refine(xm, vm, x1, v1, p, xs, vs);
+    }
+    return ret;
+}
+
+long ScanEngine::RunAdaptive(scanParams p)
+{
+    std::string msg;
+    long ret = Sanitize(&p, &msg);
+    if (!ret && p.adaptTol <= 0)
+    {
+        msg = "Adaptive scan needs a positive signal tolerance.";
+        ret = SCAN_ERR_PARAM;
+    }
+    if (!ret && meas == nullptr)
+    {
+        msg = "Adaptive scan needs a measurement source.";
+        ret = SCAN_ERR_PARAM;
+    }
+    if (ret)
+    {
+        Status(msg);
+        return ret;
+    }
+    if ((ret = CheckEnvelope(p.start, p.stop)))
+        return ret;
+    float dir = p.start < p.stop ? 1.0f : -1.0f;
+    std::vector<float> xs;  // measured points in scan order
+    std::vector<double> vs;
+    npoint = 0;
+    Progress(0, 0, NAN);
+    Status("Moving to starting position...");
+    double v;
+    ret = MeasurePoint(p.start, p, &v);
+    if (!ret)
+    {
+        xs.push_back(p.start);
+        vs.push_back(v);
+    }
+    while (!ret && xs.back() != p.stop)
+    {
+        float x = xs.back() + dir * NextStep(xs, vs, p);
+        if ((x - p.stop) * dir > 0)
+            x = p.stop;
+        Status("Moving to " + std::to_string(x) + "...");
+        ret = MeasurePoint(x, p, &v);
+        if (!ret)
+            ret = Refine(xs.back(), vs.back(), x, v, p, &xs, &vs);
+        if (!ret)
+            Progress(npoint, 0, NAN); // the steps depend on the signal still to be measured
+        if (!ret)
+        {
+            xs.push_back(x);
+            vs.push_back(v);
+        }
+    }
+    if (ret && ret != SCAN_ERR_STOPPED)
+        return ret;
+    Status((ret == SCAN_ERR_STOPPED ? "Scan stopped after " : "Finished adaptive scan, ") + std::to_string(npoint) + " points.");
+    return ret;
+}
@@ -0,0 +1,260 @@
+#include "scanlog.h"
+
+#include <array>
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#define fileno _fileno
+#define fsync _commit
+#define ftruncate _chsize_s
+#else
+#include <unistd.h>
+#endif
+
+uint64_t ScanLogHash(const void *data, size_t size, uint64_t hash)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t ScanLogCrc(const void *data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = []
+    {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t crc = 0xffffffffU;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffU;
+}
+
+static double LogStamp()
+{
+    return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+ScanLog::ScanLog(size_t batchSize, int flushMs) : fp(NULL), naxes(0), recSize(0), batchSize(batchSize), flushMs(flushMs), pendingCount(0), next(0), points(0), lastDone(0), running(false), err(0)
+{
+}
+
+ScanLog::~ScanLog()
+{
+    Close();
+}
+
+long ScanLog::Open(const char *path, bool append)
+{
+    fp = fopen(path, append ? "r+b" : "wb");
+    if (fp == NULL)
+        return SCANLOG_ERR_FILE;
+    recSize = sizeof(scanLogPoint) + 2 * naxes * sizeof(float);
+    pending.clear();
+    pending.reserve(batchSize * recSize);
+    pendingCount = 0;
+    lastDone = LogStamp();
+    err = 0;
+    running = true;
+    writer = std::thread(&ScanLog::WriterFcn, this);
+    return 0;
+}
+
+long ScanLog::Create(const char *path, uint32_t numAxes, uint64_t planHash)
+{
+    Close();
+    naxes = numAxes;
+    next = 0;
+    points = 0;
+    long ret = Open(path, false);
+    if (ret)
+        return ret;
+    scanLogHeader hdr = {};
+    memcpy(hdr.magic, SCANLOG_MAGIC, sizeof(hdr.magic));
+    hdr.version = SCANLOG_VERSION;
+    hdr.numAxes = numAxes;
+    hdr.planHash = planHash;
+    std::lock_guard<std::mutex> lk(lock); // the writer thread is already up
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 || fflush(fp))
+        err = SCANLOG_ERR_FILE;
+    return err;
+}
+
+long ScanLog::Resume(const char *path, uint32_t numAxes, uint64_t planHash, uint64_t *next)
+{
+    Close();
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+        return SCANLOG_ERR_FILE;
+    scanLogHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, SCANLOG_MAGIC, sizeof(hdr.magic)) || hdr.version != SCANLOG_VERSION)
+    {
+        fclose(in);
+        return SCANLOG_ERR_FORMAT;
+    }
+    if (hdr.numAxes != numAxes || hdr.planHash != planHash)
+    {
+        fclose(in);
+        return SCANLOG_ERR_PLAN;
+    }
+    // walk the chunks; everything after the last intact checkpoint is dropped
+    long validEnd = sizeof(hdr);
+    long fileSize = -1;
+    if (fseek(in, 0, SEEK_END) == 0)
+        fileSize = ftell(in);
+    if (fileSize < 0 || fseek(in, validEnd, SEEK_SET))
+    {
+        fclose(in);
+        return SCANLOG_ERR_FILE;
+    }
+    uint64_t cpNext = 0, cpPoints = 0, nread = 0;
+    std::vector<char> buf;
+    scanLogChunkHeader ch;
+    while (fread(&ch, sizeof(ch), 1, in) == 1)
+    {
+        // a damaged size must not make us allocate what the file cannot hold
+        if (ch.size > (1 << 28) || ch.size > (uint64_t)(fileSize - ftell(in)))
+            break;
+        buf.resize(ch.size);
+        if ((ch.size && fread(buf.data(), ch.size, 1, in) != 1) || ScanLogCrc(buf.data(), ch.size) != ch.crc)
+            break; // torn write at the end of the file
+        if (ch.type == SCANLOG_DATA)
+            nread += ch.count;
+        else if (ch.type == SCANLOG_CHECKPOINT && ch.size == sizeof(scanLogCheckpoint))
+        {
+            scanLogCheckpoint cp;
+            memcpy(&cp, buf.data(), sizeof(cp));
+            if (cp.points != nread)
+                break;
+            cpNext = cp.next;
+            cpPoints = cp.points;
+            validEnd = ftell(in);
+        }
+        else
+            break;
+    }
+    fclose(in);
+    naxes = numAxes;
+    this->next = cpNext;
+    points = cpPoints;
+    long ret = Open(path, true);
+    if (ret)
+        return ret;
+    std::lock_guard<std::mutex> lk(lock);
+    if (fflush(fp) || ftruncate(fileno(fp), validEnd) || fseek(fp, validEnd, SEEK_SET))
+        err = SCANLOG_ERR_FILE;
+    *next = cpNext;
+    return err;
+}
+
+void ScanLog::Append(int64_t index, const float *target, const float *actual, double value)
+{
+    scanLogPoint pt;
+    pt.index = index;
+    pt.tDone = LogStamp();
+    pt.value = value;
+    std::lock_guard<std::mutex> lk(lock);
+    if (!running)
+        return;
+    // the move to a point is commanded as soon as the previous one is done
+    pt.tStart = lastDone;
+    lastDone = pt.tDone;
+    size_t off = pending.size();
+    pending.resize(off + recSize);
+    memcpy(&pending[off], &pt, sizeof(pt));
+    memcpy(&pending[off + sizeof(pt)], target, naxes * sizeof(float));
+    memcpy(&pending[off + sizeof(pt) + naxes * sizeof(float)], actual, naxes * sizeof(float));
+    pendingCount++;
+    next = index + 1;
+    if (pendingCount >= batchSize)
+        cond.notify_one();
+}
+
+long ScanLog::WriteChunk(const std::vector<char> &buf, uint32_t count, uint64_t next)
+{
+    scanLogChunkHeader ch;
+    if (count)
+    {
+        ch.type = SCANLOG_DATA;
+        ch.count = count;
+        ch.size = buf.size();
+        ch.crc = ScanLogCrc(buf.data(), buf.size());
+        if (fwrite(&ch, sizeof(ch), 1, fp) != 1 || fwrite(buf.data(), buf.size(), 1, fp) != 1)
+            return SCANLOG_ERR_FILE;
+        points += count;
+    }
+    scanLogCheckpoint cp = {next, points};
+    ch.type = SCANLOG_CHECKPOINT;
+    ch.count = 0;
+    ch.size = sizeof(cp);
+    ch.crc = ScanLogCrc(&cp, sizeof(cp));
+    if (fwrite(&ch, sizeof(ch), 1, fp) != 1 || fwrite(&cp, sizeof(cp), 1, fp) != 1)
+        return SCANLOG_ERR_FILE;
+    // the checkpoint must reach the disk before it is relied upon
+    if (fflush(fp) || fsync(fileno(fp)))
+        return SCANLOG_ERR_FILE;
+    return 0;
+}
+
+void ScanLog::WriterFcn()
+{
+    std::vector<char> buf;
+    buf.reserve(batchSize * recSize);
+    std::unique_lock<std::mutex> lk(lock);
+    while (true)
+    {
+        cond.wait_for(lk, std::chrono::milliseconds(flushMs), [this]
+                      { return !running || pendingCount >= batchSize; });
+        bool stop = !running;
+        if (pendingCount || stop)
+        {
+            buf.swap(pending);
+            uint32_t count = pendingCount;
+            uint64_t nxt = next;
+            pendingCount = 0;
+            lk.unlock(); // the scan keeps appending while we write
+            long ret = WriteChunk(buf, count, nxt);
+            buf.clear();
+            lk.lock();
+            if (ret)
+                err = ret;
+        }
+        if (stop)
+            break;
+    }
+}
+
+long ScanLog::Close()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        if (!running)
+            return err;
+        running = false;
+    }
+    cond.notify_one();
+    writer.join();
+    fclose(fp);
+    fp = NULL;
+    return err;
+}
+
+long ScanLog::LastError() const
+{
+    return err;
+}
@@ -0,0 +1,247 @@
+#include "scanorder.h"
+#include "kinematics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+
+#define TWO_OPT_WINDOW 64 // segment lengths tried by 2-opt; the NN tour is already locally coherent
+#define TWO_OPT_PASSES 8
+
+long ScanPlanLoad(const char *path, long numAxes, ScanPlan *plan, std::vector<long> *groups)
+{
+    if (numAxes < 1)
+        return SCAN_ERR_PARAM;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return SCAN_ERR_FILE;
+    plan->Clear(numAxes);
+    if (groups != nullptr)
+        groups->clear();
+    std::vector<float> pt(numAxes);
+    char line[1024];
+    long ret = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *c = line;
+        while (isspace((unsigned char)*c))
+            c++;
+        if (*c == '\0' || *c == '#')
+            continue;
+        for (long j = 0; j < numAxes && !ret; j++)
+        {
+            while (*c == ',' || isspace((unsigned char)*c))
+                c++;
+            char *end;
+            pt[j] = (float)strtod(c, &end);
+            if (end == c)
+                ret = SCAN_ERR_FILE;
+            c = end;
+        }
+        if (ret)
+            break;
+        plan->Add(pt.data());
+        if (groups != nullptr)
+        {
+            while (*c == ',' || isspace((unsigned char)*c))
+                c++;
+            groups->push_back(strtol(c, NULL, 10)); // 0 if there is no group column
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+long ScanPlanSave(const char *path, const ScanPlan &plan)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        return SCAN_ERR_FILE;
+    long naxes = plan.NumAxes(), npts = plan.NumPoints();
+    for (long i = 0; i < npts; i++)
+    {
+        const float *pt = plan.Point(i);
+        for (long j = 0; j < naxes; j++)
+            fprintf(fp, j ? " %.9g" : "%.9g", pt[j]);
+        fputc('\n', fp);
+    }
+    return fclose(fp) ? SCAN_ERR_FILE : 0;
+}
+
+// nearest neighbour tour through the points of one group, using a bucket grid over the first two axes
+static void NearestNeighbour(const scanAxis *axes, long naxes, const ScanPlan &plan, const std::vector<long> &pts, const float *start, std::vector<long> *order)
+{
+    long n = pts.size();
+    if (n == 0)
+        return;
+    long gax = naxes > 1 ? 2 : 1;
+    float lo[2] = {0, 0}, hi[2] = {0, 0}, w[2] = {1, 1};
+    long nc[2] = {1, 1};
+    for (long a = 0; a < gax; a++)
+    {
+        lo[a] = hi[a] = plan.Point(pts[0])[a];
+        for (long k = 1; k < n; k++)
+        {
+            float v = plan.Point(pts[k])[a];
+            lo[a] = v < lo[a] ? v : lo[a];
+            hi[a] = v > hi[a] ? v : hi[a];
+        }
+        // about two points per cell
+        nc[a] = gax == 2 ? (long)ceil(sqrt(n / 2.0)) : (n + 1) / 2;
+        nc[a] = nc[a] < 1 ? 1 : nc[a];
+        w[a] = hi[a] > lo[a] ? (hi[a] - lo[a]) / nc[a] : 1;
+    }
+    auto cellOf = [&](const float *p, long a)
+    {
+        long c = (long)((p[a] - lo[a]) / w[a]);
+        return c < 0 ? 0 : (c >= nc[a] ? nc[a] - 1 : c);
+    };
+    std::vector<std::vector<long>> cells(nc[0] * nc[1]);
+    for (long k = 0; k < n; k++)
+    {
+        const float *p = plan.Point(pts[k]);
+        cells[cellOf(p, 0) + (gax > 1 ? cellOf(p, 1) * nc[0] : 0)].push_back(pts[k]);
+    }
+    long ring = nc[0] > nc[1] ? nc[0] : nc[1];
+    const float *cur = start;
+    if (cur == nullptr)
+    {
+        // no start position given, begin with the first point in input order
+        const float *p = plan.Point(pts[0]);
+        std::vector<long> &cell = cells[cellOf(p, 0) + (gax > 1 ? cellOf(p, 1) * nc[0] : 0)];
+        cell.erase(std::find(cell.begin(), cell.end(), pts[0]));
+        order->push_back(pts[0]);
+        cur = p;
+        n--;
+    }
+    for (; n > 0; n--)
+    {
+        long cx = cellOf(cur, 0), cy = gax > 1 ? cellOf(cur, 1) : 0;
+        double best = HUGE_VAL;
+        long bestCell = -1, bestPos = -1;
+        for (long r = 0; r <= ring; r++)
+        {
+            if (r > 0 && bestCell >= 0)
+            {
+                // every point of ring r is at least (r - 1) cells away along one of the grid axes
+                double bound = MoveTime((r - 1) * w[0], axes[0].minVel, axes[0].maxVel, axes[0].Accel);
+                if (gax > 1)
+                {
+                    double b1 = MoveTime((r - 1) * w[1], axes[1].minVel, axes[1].maxVel, axes[1].Accel);
+                    bound = b1 < bound ? b1 : bound;
+                }
+                if (best <= bound)
+                    break;
+            }
+            for (long y = cy - r; y <= cy + r; y++)
+            {
+                if (y < 0 || y >= nc[1])
+                    continue;
+                bool edge = y == cy - r || y == cy + r;
+                for (long x = cx - r; x <= cx + r; x += (edge || r == 0) ? 1 : 2 * r)
+                {
+                    if (x < 0 || x >= nc[0])
+                        continue;
+                    std::vector<long> &cell = cells[x + y * nc[0]];
+                    for (size_t k = 0; k < cell.size(); k++)
+                    {
+                        double c = ScanPointMoveTime(axes, naxes, cur, plan.Point(cell[k]));
+                        if (c < best)
+                        {
+                            best = c;
+                            bestCell = x + y * nc[0];
+                            bestPos = k;
+                        }
+                    }
+                }
+            }
+        }
+        std::vector<long> &cell = cells[bestCell];
+        long next = cell[bestPos];
+        cell[bestPos] = cell.back();
+        cell.pop_back();
+        order->push_back(next);
+        cur = plan.Point(next);
+    }
+}
+
+// windowed 2-opt on an open path that starts at the fixed position start (may be nullptr)
+static long TwoOpt(const scanAxis *axes, long naxes, const ScanPlan &plan, const float *start, std::vector<long> *order)
+{
+    std::vector<long> &ord = *order;
+    long n = ord.size();
+    long moves = 0;
+    auto P = [&](long k)
+    { return k < 0 ? start : plan.Point(ord[k]); };
+    auto cost = [&](const float *a, const float *b)
+    { return ScanPointMoveTime(axes, naxes, a, b); };
+    for (int pass = 0; pass < TWO_OPT_PASSES; pass++)
+    {
+        bool improved = false;
+        for (long i = start != nullptr ? -1 : 0; i < n - 2; i++)
+        {
+            const float *a = P(i), *b = P(i + 1);
+            double dab = cost(a, b);
+            long jmax = i + 2 + TWO_OPT_WINDOW < n ? i + 2 + TWO_OPT_WINDOW : n;
+            for (long j = i + 2; j < jmax; j++)
+            {
+                // replace edges (a,b) and (c,d) with (a,c) and (b,d), reversing b..c
+                const float *c = P(j), *d = j + 1 < n ? P(j + 1) : nullptr;
+                double delta = cost(a, c) - dab;
+                if (d != nullptr)
+                    delta += cost(b, d) - cost(c, d);
+                if (delta < -1e-9)
+                {
+                    std::reverse(ord.begin() + i + 1, ord.begin() + j + 1);
+                    moves++;
+                    improved = true;
+                    b = P(i + 1);
+                    dab = cost(a, b);
+                }
+            }
+        }
+        if (!improved)
+            break;
+    }
+    return moves;
+}
+
+long ScanPlanOptimize(const scanAxis *axes, ScanPlan *plan, const std::vector<long> *groups, const float *from, scanOrderStats *stats)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    long naxes = plan->NumAxes();
+    long npts = plan->NumPoints();
+    if (groups != nullptr && (long)groups->size() != npts)
+        return SCAN_ERR_PARAM;
+    scanOrderStats st = {};
+    st.before = ScanPlanCost(axes, *plan, 0, from);
+    // points of each group, in input order; the map keeps the groups sorted
+    std::map<long, std::vector<long>> byGroup;
+    for (long i = 0; i < npts; i++)
+        byGroup[groups != nullptr ? (*groups)[i] : 0].push_back(i);
+    std::vector<long> order;
+    order.reserve(npts);
+    const float *start = from;
+    for (auto &g : byGroup)
+    {
+        std::vector<long> seg;
+        seg.reserve(g.second.size());
+        NearestNeighbour(axes, naxes, *plan, g.second, start, &seg);
+        st.twoOptMoves += TwoOpt(axes, naxes, *plan, start, &seg);
+        order.insert(order.end(), seg.begin(), seg.end());
+        start = plan->Point(order.back());
+    }
+    ScanPlan out(naxes);
+    for (long i = 0; i < npts; i++)
+        out.Add(plan->Point(order[i]));
+    *plan = out;
+    st.after = ScanPlanCost(axes, *plan, 0, from);
+    st.planTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (stats != nullptr)
+        *stats = st;
+    return 0;
+}
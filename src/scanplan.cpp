@@ -0,0 +1,313 @@
+#include "scanplan.h"
+#include "kinematics.h"
+
+#include <cmath>
+
+ScanPlan::ScanPlan(long numAxes) : naxes(numAxes)
+{
+}
+
+void ScanPlan::Clear(long numAxes)
+{
+    naxes = numAxes;
+    pts.clear();
+}
+
+void ScanPlan::Add(const float *pt)
+{
+    pts.insert(pts.end(), pt, pt + naxes);
+}
+
+long ScanPlan::NumAxes() const
+{
+    return naxes;
+}
+
+long ScanPlan::NumPoints() const
+{
+    return naxes > 0 ? (long)(pts.size() / naxes) : 0;
+}
+
+const float *ScanPlan::Point(long i) const
+{
+    return &pts[i * naxes];
+}
+
+float *ScanPlan::Point(long i)
+{
+    return &pts[i * naxes];
+}
+
+static long AxisPoints(const scanAxis *ax)
+{
+    // as ScanEngine::Sanitize() for a single axis: positions are not negative
+    if (!(ax->start >= 0 && std::isfinite(ax->start)) || !(ax->stop >= 0 && std::isfinite(ax->stop)) || !std::isfinite(ax->step))
+        return 0;
+    if (ax->start == ax->stop)
+        return 1;
+    if (ax->step == 0)
+        return 0;
+    return (long)floor(fabs(ax->stop - ax->start) / fabs(ax->step) + 1e-4) + 1;
+}
+
+static float AxisPoint(const scanAxis *ax, long i)
+{
+    float step = fabs(ax->step);
+    return ax->start < ax->stop ? ax->start + i * step : ax->start - i * step;
+}
+
+long ScanPlanGrid(const scanAxis *axes, long numAxes, scanOrder order, ScanPlan *plan)
+{
+    plan->Clear(numAxes);
+    if (numAxes < 1)
+        return SCAN_ERR_PARAM;
+    std::vector<long> n(numAxes);
+    long total = 1;
+    for (long j = 0; j < numAxes; j++)
+    {
+        n[j] = AxisPoints(&axes[j]);
+        if (n[j] < 1)
+            return SCAN_ERR_PARAM;
+        total *= n[j];
+    }
+    std::vector<float> pt(numAxes);
+    for (long k = 0; k < total; k++)
+    {
+        long rem = k, line = k;
+        for (long j = 0; j < numAxes; j++)
+        {
+            long d = rem % n[j];
+            rem /= n[j];
+            line /= n[j]; // index of the line along axis j that contains point k
+            // a serpentine path reverses an axis on every other pass, so consecutive points differ by one step
+            if (order == SCAN_SERPENTINE && (line & 1))
+                d = n[j] - 1 - d;
+            pt[j] = AxisPoint(&axes[j], d);
+        }
+        plan->Add(pt.data());
+    }
+    return 0;
+}
+
+double ScanPointMoveTime(const scanAxis *axes, long numAxes, const float *from, const float *to)
+{
+    double t = 0;
+    for (long j = 0; j < numAxes; j++)
+    {
+        double tj = MoveTime(to[j] - from[j], axes[j].minVel, axes[j].maxVel, axes[j].Accel);
+        if (tj > t)
+            t = tj;
+    }
+    return t;
+}
+
+double ScanPlanCost(const scanAxis *axes, const ScanPlan &plan, double overhead, const float *from)
+{
+    long npts = plan.NumPoints();
+    if (npts == 0)
+        return 0;
+    long naxes = plan.NumAxes();
+    double t = npts * overhead;
+    if (from != nullptr)
+        t += ScanPointMoveTime(axes, naxes, from, plan.Point(0));
+    for (long i = 1; i < npts; i++)
+        t += ScanPointMoveTime(axes, naxes, plan.Point(i - 1), plan.Point(i));
+    return t;
+}
+
+double ScanPlanPredict(const MotionModel *model, const scanAxis *axes, const ScanPlan &plan, double dwell, long first, const float *from)
+{
+    long npts = plan.NumPoints(), naxes = plan.NumAxes();
+    if (first >= npts)
+        return 0;
+    if (first < 0)
+        first = 0;
+    double perPoint = dwell + (model != nullptr ? model->PointTime(axes[0].idx) : 0);
+    double t = (npts - first) * perPoint;
+    for (long i = first; i < npts; i++)
+    {
+        const float *a = i > first ? plan.Point(i - 1) : from;
+        const float *b = plan.Point(i);
+        if (a == nullptr)
+            continue;
+        double ti = 0;
+        for (long j = 0; j < naxes; j++)
+        {
+            if (a[j] == b[j])
+                continue; // not commanded
+            double tj = model != nullptr ? model->PredictMove(axes[j].idx, b[j] - a[j], axes[j].minVel, axes[j].maxVel, axes[j].Accel)
+                                         : MoveTime(b[j] - a[j], axes[j].minVel, axes[j].maxVel, axes[j].Accel);
+            if (tj > ti)
+                ti = tj;
+        }
+        t += ti;
+    }
+    return t;
+}
+
+PlanRunner::PlanRunner(MotorDriver *drv, MotorTelemetry *tel) : drv(drv), tel(tel), model(nullptr), token(nullptr), meas(nullptr), env(nullptr), precise(false), prec(), table(nullptr)
+{
+}
+
+void PlanRunner::SetMeasurement(Measurement *meas)
+{
+    this->meas = meas;
+}
+
+void PlanRunner::SetStatusHook(std::function<void(const std::string &msg)> hook)
+{
+    statusHook = hook;
+}
+
+void PlanRunner::SetRunHook(std::function<bool()> hook)
+{
+    runHook = hook;
+}
+
+void PlanRunner::SetCancelToken(CancelToken *token)
+{
+    this->token = token;
+}
+
+void PlanRunner::SetMotionModel(MotionModel *model)
+{
+    this->model = model;
+}
+
+void PlanRunner::SetProgressHook(std::function<void(long done, long total, double remaining)> hook)
+{
+    progressHook = hook;
+}
+
+void PlanRunner::SetPointHook(std::function<void(long i, const float *actual, double value)> hook)
+{
+    pointHook = hook;
+}
+
+void PlanRunner::SetEnvelope(const SafetyEnvelope *env)
+{
+    this->env = env;
+}
+
+void PlanRunner::SetPrecision(const precisionParams *prec, BacklashTable *table)
+{
+    precise = prec != nullptr;
+    if (precise)
+        this->prec = *prec;
+    this->table = table;
+}
+
+long PlanRunner::Run(const scanAxis *axes, long numAxes, const ScanPlan &plan, const scanParams &p, long first)
+{
+    if (plan.NumAxes() != numAxes)
+        return SCAN_ERR_PARAM;
+    // the whole plan at once, from where the axes are now; the points are not checked again as they are reached
+    if (env != nullptr && first < plan.NumPoints())
+    {
+        std::vector<long> serNums(numAxes);
+        for (long j = 0; j < numAxes; j++)
+            serNums[j] = axes[j].serNum;
+        std::vector<float> lo(env->NumAxes()), hi(env->NumAxes());
+        env->Where(tel, lo.data(), hi.data());
+        long bad;
+        long ret = env->CheckPlan(serNums.data(), numAxes, plan.Point(0), plan.NumPoints(), first, lo.data(), hi.data(), &bad);
+        if (ret == ENV_ERR_TRAVEL && statusHook)
+            statusHook("Point " + std::to_string(bad + 1) + " is beyond the travel limits.");
+        else if (ret == ENV_ERR_ZONE && statusHook)
+            statusHook("The way to point " + std::to_string(bad + 1) + " passes through a forbidden zone.");
+        if (ret)
+            return ret;
+    }
+    std::vector<ScanEngine> engines;
+    for (long j = 0; j < numAxes; j++)
+    {
+        engines.push_back(ScanEngine(drv, tel, axes[j].idx, axes[j].serNum));
+        engines[j].SetRunHook(runHook);
+        engines[j].SetCancelToken(token);
+        engines[j].SetMotionModel(model);
+        engines[j].SetEnvelope(env);
+        engines[j].SetPrecision(precise ? &prec : nullptr, table);
+        engines[j].SetStatusHook(statusHook);
+    }
+    std::vector<float> actual(numAxes);
+    std::vector<bool> moved(numAxes);
+    long npts = plan.NumPoints();
+    long ret = 0;
+    // the prediction costs a pass over the remaining points, so it is redone about 256 times per scan
+    // and counted down in between
+    long stride = 1 + npts / 256;
+    double left = 0;
+    Clock *clock = tel->GetClock();
+    double predicted = clock->Now();
+    if (progressHook)
+    {
+        for (long j = 0; j < numAxes; j++)
+        {
+            motorState state;
+            tel->GetState(axes[j].idx, &state);
+            actual[j] = state.curPos;
+        }
+        left = ScanPlanPredict(model, axes, plan, p.dwell, first, actual.data());
+        progressHook(first, npts, left);
+    }
+    for (long i = first; i < npts && !ret; i++)
+    {
+        const float *pt = plan.Point(i);
+        if (statusHook)
+            statusHook("Point " + std::to_string(i + 1) + " of " + std::to_string(npts) + "...");
+        // start every axis that has to move, then wait: the point costs as much as the slowest axis
+        for (long j = 0; j < numAxes && !ret; j++)
+        {
+            moved[j] = i == first || pt[j] != plan.Point(i - 1)[j];
+            if (moved[j])
+                ret = engines[j].Command(pt[j]);
+        }
+        for (long j = 0; j < numAxes && !ret; j++)
+        {
+            if (moved[j])
+                ret = engines[j].WaitSettled(pt[j], p, &actual[j]);
+            else
+            {
+                motorState state;
+                tel->GetState(axes[j].idx, &state);
+                actual[j] = state.curPos;
+            }
+        }
+        if (ret)
+            break;
+        double settled = clock->Now();
+        ret = engines[0].Dwell(p.dwell);
+        double value = 0;
+        if (!ret && meas != nullptr)
+            ret = meas->Measure(actual.data(), numAxes, &value);
+        if (ret)
+            break;
+        double now = clock->Now();
+        if (model != nullptr)
+            model->ObservePoint(axes[0].idx, now - settled - p.dwell);
+        if (pointHook)
+            pointHook(i, actual.data(), value);
+        if (progressHook)
+        {
+            if ((i - first) % stride == stride - 1)
+            {
+                left = ScanPlanPredict(model, axes, plan, p.dwell, i + 1, plan.Point(i));
+                predicted = now;
+            }
+            double remaining = left - (now - predicted);
+            progressHook(i + 1, npts, remaining > 0 ? remaining : 0);
+        }
+    }
+    if (statusHook)
+    {
+        if (ret == SCAN_ERR_STOPPED)
+            statusHook("Scan stopped.");
+        else if (ret == SCAN_ERR_TIMEOUT)
+            statusHook("Stage did not settle.");
+        else if (ret)
+            statusHook("Scan failed: " + std::to_string(ret));
+        else
+            statusHook("Finished scan.");
+    }
+    return ret;
+}
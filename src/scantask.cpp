@@ -0,0 +1,245 @@
+#include "scantask.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+
+CancelToken::CancelToken(Clock *clock) : cancelled(false), clock(clock != nullptr ? clock : DefaultClock()), nextId(1)
+{
+}
+
+void CancelToken::Cancel()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    if (cancelled)
+        return;
+    cancelled = true;
+    clock->Notify(cond);
+    // under the lock, so Unsubscribe() can wait out a callback in progress
+    for (auto &s : subs)
+        s.second();
+}
+
+bool CancelToken::Cancelled() const
+{
+    return cancelled.load();
+}
+
+const std::atomic<bool> *CancelToken::Flag() const
+{
+    return &cancelled;
+}
+
+bool CancelToken::Sleep(double seconds)
+{
+    std::unique_lock<std::mutex> lk(lock);
+    return !clock->Wait(lk, cond, seconds, [this]
+                        { return cancelled.load(); });
+}
+
+long CancelToken::Subscribe(std::function<void()> fn)
+{
+    std::unique_lock<std::mutex> lk(lock);
+    if (cancelled)
+    {
+        lk.unlock();
+        fn();
+        return 0;
+    }
+    subs.push_back(std::make_pair(nextId, fn));
+    return nextId++;
+}
+
+void CancelToken::Unsubscribe(long id)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    for (size_t i = 0; i < subs.size(); i++)
+    {
+        if (subs[i].first == id)
+        {
+            subs.erase(subs.begin() + i);
+            return;
+        }
+    }
+}
+
+ScanTask::ScanTask(std::function<long(ScanTask *task)> fn) : fn(fn), state(TASK_QUEUED), result(0), value(0), dropped(0)
+{
+}
+
+taskState ScanTask::State() const
+{
+    return (taskState)state.load();
+}
+
+long ScanTask::Result() const
+{
+    return result.load();
+}
+
+void ScanTask::Cancel()
+{
+    token.Cancel();
+}
+
+CancelToken *ScanTask::Token()
+{
+    return &token;
+}
+
+void ScanTask::Post(const char *fmt, ...)
+{
+    taskMessage msg;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg.text, sizeof(msg.text), fmt, args);
+    va_end(args);
+    if (!msgs.Push(msg))
+        dropped++;
+}
+
+bool ScanTask::Pop(taskMessage *msg)
+{
+    return msgs.Pop(msg);
+}
+
+uint64_t ScanTask::Dropped() const
+{
+    return dropped.load();
+}
+
+void ScanTask::SetValue(double value)
+{
+    this->value = value;
+}
+
+double ScanTask::Value() const
+{
+    return value.load();
+}
+
+static double SteadyNow()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ScanTask::SetProgress(long done, long total, double remaining)
+{
+    taskProgress p = {done, total, remaining, SteadyNow()};
+    progress.Store(p);
+}
+
+bool ScanTask::Progress(long *done, long *total, double *remaining) const
+{
+    if (progress.Version() == 0)
+        return false;
+    taskProgress p = progress.Load();
+    *done = p.done;
+    *total = p.total;
+    *remaining = p.remaining - (SteadyNow() - p.stamp);
+    if (*remaining < 0) // overdue, NaN stays NaN
+        *remaining = 0;
+    return true;
+}
+
+void ScanTask::Wait()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    done.wait(lk, [this]
+              { return state == TASK_DONE; });
+}
+
+void ScanTask::Run()
+{
+    state = TASK_RUNNING;
+    result = fn(this);
+    fn = nullptr; // whatever the scan captured goes with it, not with the last handle
+}
+
+void ScanTask::Finish()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    state = TASK_DONE;
+    done.notify_all();
+}
+
+ScanTaskManager::ScanTaskManager(int threads) : maxThreads(threads < 1 ? 1 : threads), idle(0), stopping(false)
+{
+}
+
+ScanTaskManager::~ScanTaskManager()
+{
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        stopping = true;
+    }
+    // queued tasks still run, and return at once, so whatever they hold is released the usual way
+    CancelAll();
+    cond.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+std::shared_ptr<ScanTask> ScanTaskManager::Submit(std::function<long(ScanTask *task)> fn)
+{
+    std::shared_ptr<ScanTask> task = std::make_shared<ScanTask>(fn);
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        if (stopping)
+            return nullptr;
+        queue.push_back(task);
+        // the idle workers are already taking the tasks queued before this one
+        if (queue.size() > idle && workers.size() < maxThreads)
+            workers.push_back(std::thread(&ScanTaskManager::WorkerFcn, this));
+    }
+    cond.notify_one();
+    return task;
+}
+
+void ScanTaskManager::CancelAll()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    for (auto &t : queue)
+        t->Cancel();
+    for (auto &t : running)
+        t->Cancel();
+}
+
+long ScanTaskManager::Pending()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    return (long)(queue.size() + running.size());
+}
+
+void ScanTaskManager::WorkerFcn()
+{
+    std::unique_lock<std::mutex> lk(lock);
+    while (true)
+    {
+        idle++;
+        cond.wait(lk, [this]
+                  { return stopping || !queue.empty(); });
+        idle--;
+        if (queue.empty())
+            return; // stopping, and nothing left to run
+        std::shared_ptr<ScanTask> task = queue.front();
+        queue.pop_front();
+        running.push_back(task);
+        lk.unlock();
+        task->Run();
+        lk.lock();
+        for (size_t i = 0; i < running.size(); i++)
+        {
+            if (running[i] == task)
+            {
+                running.erase(running.begin() + i);
+                break;
+            }
+        }
+        // done only once off the books, so Pending() is 0 when every task has been waited for
+        lk.unlock();
+        task->Finish();
+        lk.lock();
+    }
+}
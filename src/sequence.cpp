@@ -0,0 +1,529 @@
+#include "sequence.h"
+#include "scanlog.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define SEQ_MAX_WORDS 4
+
+SeqProgram::SeqProgram() : numUnits(0)
+{
+}
+
+// splits a line at blanks, dropping the comment; false if it has more than max words
+static bool Words(char *line, char **words, int max, int *n)
+{
+    char *hash = strchr(line, '#');
+    if (hash != nullptr)
+        *hash = '\0';
+    *n = 0;
+    char *p = line;
+    while (true)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p == '\0')
+            return true;
+        if (*n == max)
+            return false;
+        words[(*n)++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            p++;
+        if (*p)
+            *p++ = '\0';
+    }
+}
+
+static bool Number(const char *word, float *value)
+{
+    char *end;
+    double v = strtod(word, &end);
+    if (end == word || *end || !std::isfinite(v))
+        return false;
+    *value = (float)v;
+    return true;
+}
+
+static bool Count(const char *word, long *value)
+{
+    char *end;
+    *value = strtol(word, &end, 10);
+    return end != word && !*end;
+}
+
+long SeqProgram::Compile(const char *text, long numUnits, std::string *msg)
+{
+    ops.clear();
+    motors.clear();
+    this->numUnits = numUnits;
+    std::vector<bool> used(numUnits, false);
+    std::vector<long> loops;    // index of the SEQ_LOOP of every open loop
+    std::vector<long> parallel; // motors moved in the open parallel block
+    bool inParallel = false;
+    long parallelLine = 0;
+    float tol = 0.005f, timeout = 60;
+    long count = 3;
+    char line[SEQ_MAX_LINE + 1];
+    char err[SEQ_MAX_LINE + 64] = "";
+    long lineNum = 0;
+    const char *p = text;
+    while (*p && !err[0])
+    {
+        lineNum++;
+        const char *eol = strchr(p, '\n');
+        size_t len = eol ? (size_t)(eol - p) : strlen(p);
+        if (len > SEQ_MAX_LINE)
+        {
+            snprintf(err, sizeof(err), "line %ld: longer than %d characters", lineNum, SEQ_MAX_LINE);
+            break;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p += eol ? len + 1 : len;
+        char *w[SEQ_MAX_WORDS];
+        int n;
+        if (!Words(line, w, SEQ_MAX_WORDS, &n))
+        {
+            snprintf(err, sizeof(err), "line %ld: too many words", lineNum);
+            break;
+        }
+        if (n == 0)
+            continue;
+        seqOp op = {};
+        op.line = (int32_t)lineNum;
+        long m = 0;
+        bool motion = !strcmp(w[0], "move") || !strcmp(w[0], "rmove") || !strcmp(w[0], "home") || !strcmp(w[0], "settle");
+        if (motion)
+        {
+            int args = !strcmp(w[0], "home") || !strcmp(w[0], "settle") ? 2 : 3;
+            if (n != args || !Count(w[1], &m) || (args == 3 && !Number(w[2], &op.x)))
+            {
+                snprintf(err, sizeof(err), "line %ld: expected '%s MOTOR%s'", lineNum, w[0], args == 3 ? (strcmp(w[0], "move") ? " DIST" : " POS") : "");
+                break;
+            }
+            if (m < 1 || m > numUnits)
+            {
+                snprintf(err, sizeof(err), "line %ld: no motor %ld, there are %ld", lineNum, m, numUnits);
+                break;
+            }
+            op.motor = (uint16_t)(m - 1);
+            used[m - 1] = true;
+            if (inParallel && !strcmp(w[0], "settle"))
+            {
+                snprintf(err, sizeof(err), "line %ld: settle inside a parallel block, its end waits for every motor", lineNum);
+                break;
+            }
+            if (!strcmp(w[0], "settle"))
+                op.op = SEQ_SETTLE;
+            else
+                op.op = !strcmp(w[0], "move") ? SEQ_MOVE : !strcmp(w[0], "rmove") ? SEQ_RMOVE : SEQ_HOME;
+            if (op.op != SEQ_SETTLE)
+                ops.push_back(op);
+            if (inParallel)
+            {
+                bool seen = false;
+                for (long q : parallel)
+                    seen |= q == m - 1;
+                if (!seen)
+                    parallel.push_back(m - 1);
+                continue;
+            }
+            // sequential: every command waits for its motor
+            op.op = SEQ_SETTLE;
+            op.x = tol;
+            op.n = (int32_t)count;
+            op.y = timeout;
+            ops.push_back(op);
+            continue;
+        }
+        if (inParallel && strcmp(w[0], "end"))
+        {
+            snprintf(err, sizeof(err), "line %ld: only move, rmove and home inside a parallel block", lineNum);
+            break;
+        }
+        if (!strcmp(w[0], "wait"))
+        {
+            if (n != 2 || !Number(w[1], &op.x) || op.x < 0)
+            {
+                snprintf(err, sizeof(err), "line %ld: expected 'wait SECONDS'", lineNum);
+                break;
+            }
+            op.op = SEQ_WAIT;
+            ops.push_back(op);
+        }
+        else if (!strcmp(w[0], "measure"))
+        {
+            if (n != 1)
+            {
+                snprintf(err, sizeof(err), "line %ld: measure takes no arguments", lineNum);
+                break;
+            }
+            op.op = SEQ_MEASURE;
+            ops.push_back(op);
+        }
+        else if (!strcmp(w[0], "loop"))
+        {
+            long passes;
+            if (n != 2 || !Count(w[1], &passes) || passes < 1 || passes > INT32_MAX)
+            {
+                snprintf(err, sizeof(err), "line %ld: expected 'loop N' with N >= 1", lineNum);
+                break;
+            }
+            if (loops.size() == SEQ_MAX_DEPTH)
+            {
+                snprintf(err, sizeof(err), "line %ld: loops nested deeper than %d", lineNum, SEQ_MAX_DEPTH);
+                break;
+            }
+            op.op = SEQ_LOOP;
+            op.n = (int32_t)passes;
+            loops.push_back((long)ops.size());
+            ops.push_back(op);
+        }
+        else if (!strcmp(w[0], "parallel"))
+        {
+            if (n != 1)
+            {
+                snprintf(err, sizeof(err), "line %ld: parallel takes no arguments", lineNum);
+                break;
+            }
+            inParallel = true;
+            parallelLine = lineNum;
+            parallel.clear();
+        }
+        else if (!strcmp(w[0], "end"))
+        {
+            if (n != 1)
+            {
+                snprintf(err, sizeof(err), "line %ld: end takes no arguments", lineNum);
+                break;
+            }
+            if (inParallel)
+            {
+                // the block ends once every motor it moved has settled
+                inParallel = false;
+                for (long q : parallel)
+                {
+                    op.op = SEQ_SETTLE;
+                    op.motor = (uint16_t)q;
+                    op.x = tol;
+                    op.n = (int32_t)count;
+                    op.y = timeout;
+                    ops.push_back(op);
+                }
+            }
+            else if (loops.empty())
+            {
+                snprintf(err, sizeof(err), "line %ld: end without loop or parallel", lineNum);
+                break;
+            }
+            else
+            {
+                op.op = SEQ_NEXT;
+                op.n = (int32_t)loops.back();
+                loops.pop_back();
+                ops.push_back(op);
+            }
+        }
+        else if (!strcmp(w[0], "tolerance"))
+        {
+            float t;
+            long c = count;
+            if (n < 2 || n > 3 || !Number(w[1], &t) || t <= 0 || (n == 3 && (!Count(w[2], &c) || c < 1)))
+            {
+                snprintf(err, sizeof(err), "line %ld: expected 'tolerance MM [COUNT]'", lineNum);
+                break;
+            }
+            tol = t;
+            count = c;
+        }
+        else if (!strcmp(w[0], "timeout"))
+        {
+            float t;
+            if (n != 2 || !Number(w[1], &t) || t <= 0)
+            {
+                snprintf(err, sizeof(err), "line %ld: expected 'timeout SECONDS'", lineNum);
+                break;
+            }
+            timeout = t;
+        }
+        else
+            snprintf(err, sizeof(err), "line %ld: unknown command '%s'", lineNum, w[0]);
+    }
+    if (!err[0] && inParallel)
+        snprintf(err, sizeof(err), "line %ld: parallel block without end", parallelLine);
+    if (!err[0] && !loops.empty())
+        snprintf(err, sizeof(err), "line %ld: loop without end", (long)ops[loops.back()].line);
+    if (err[0])
+    {
+        ops.clear();
+        if (msg != nullptr)
+            *msg = err;
+        return SEQ_ERR_SYNTAX;
+    }
+    for (long i = 0; i < numUnits; i++)
+    {
+        if (used[i])
+            motors.push_back(i);
+    }
+    return 0;
+}
+
+long SeqProgram::Load(const char *path, long numUnits, std::string *msg)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == nullptr)
+    {
+        if (msg != nullptr)
+            *msg = std::string("could not open ") + path;
+        return SEQ_ERR_FILE;
+    }
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        text.append(buf, n);
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if (failed)
+    {
+        if (msg != nullptr)
+            *msg = std::string("could not read ") + path;
+        return SEQ_ERR_FILE;
+    }
+    return Compile(text.c_str(), numUnits, msg);
+}
+
+long SeqProgram::NumOps() const
+{
+    return (long)ops.size();
+}
+
+const seqOp *SeqProgram::Ops() const
+{
+    return ops.data();
+}
+
+long SeqProgram::NumUnits() const
+{
+    return numUnits;
+}
+
+const std::vector<long> &SeqProgram::Motors() const
+{
+    return motors;
+}
+
+uint64_t SeqProgram::Hash() const
+{
+    return ScanLogHash(ops.data(), ops.size() * sizeof(seqOp));
+}
+
+SeqRunner::SeqRunner(MotorDriver *drv, MotorTelemetry *tel, const long *serNums, long numUnits) : tel(tel), numUnits(numUnits), serNums(serNums, serNums + numUnits), target(numUnits),
+                                                                                                   actual(numUnits), token(nullptr), meas(nullptr), env(nullptr), steps(0)
+{
+    for (long i = 0; i < numUnits; i++)
+        engines.push_back(std::unique_ptr<ScanEngine>(new ScanEngine(drv, tel, i, serNums[i])));
+}
+
+SeqRunner::~SeqRunner()
+{
+}
+
+void SeqRunner::SetStatusHook(std::function<void(const std::string &msg)> hook)
+{
+    statusHook = hook;
+}
+
+void SeqRunner::SetCancelToken(CancelToken *token)
+{
+    this->token = token;
+    for (auto &e : engines)
+        e->SetCancelToken(token);
+}
+
+void SeqRunner::SetMotionModel(MotionModel *model)
+{
+    for (auto &e : engines)
+        e->SetMotionModel(model);
+}
+
+void SeqRunner::SetMeasurement(Measurement *meas)
+{
+    this->meas = meas;
+}
+
+void SeqRunner::SetMeasureHook(std::function<void(long i, const float *target, const float *actual, double value)> hook)
+{
+    measureHook = hook;
+}
+
+void SeqRunner::SetStepHook(std::function<void(uint64_t steps, long line)> hook)
+{
+    stepHook = hook;
+}
+
+void SeqRunner::SetPrecision(const precisionParams *prec, BacklashTable *table)
+{
+    for (auto &e : engines)
+        e->SetPrecision(prec, table);
+}
+
+void SeqRunner::SetEnvelope(const SafetyEnvelope *env)
+{
+    this->env = env;
+    for (auto &e : engines)
+        e->SetEnvelope(env);
+    if (env != nullptr)
+    {
+        lo.resize(env->NumAxes());
+        hi.resize(env->NumAxes());
+    }
+}
+
+uint64_t SeqRunner::Steps() const
+{
+    return steps;
+}
+
+float SeqRunner::Position(long m) const
+{
+    motorState state;
+    tel->GetState(m, &state);
+    return state.curPos;
+}
+
+void SeqRunner::Status(const seqOp &op, const std::string &msg)
+{
+    if (statusHook)
+        statusHook("Line " + std::to_string(op.line) + ": " + msg);
+}
+
+// a move or home of op.motor to pos, the motors of the program where they were last sent and the
+// others where the telemetry has them; loops and relative moves make it one op at a time
+long SeqRunner::Check(const seqOp &op, float pos)
+{
+    if (env == nullptr)
+        return 0;
+    long serNum = serNums[op.motor];
+    long ret = op.op == SEQ_HOME ? 0 : env->CheckTarget(serNum, pos);
+    if (!ret && env->Axis(serNum) >= 0)
+    {
+        env->Where(tel, lo.data(), hi.data());
+        for (long m = 0; m < numUnits; m++)
+        {
+            long a = env->Axis(serNums[m]);
+            if (a < 0 || std::isnan(target[m]) || std::isnan(lo[a]))
+                continue;
+            lo[a] = std::min(lo[a], target[m]);
+            hi[a] = std::max(hi[a], target[m]);
+        }
+        ret = env->CheckPath(serNum, pos, lo.data(), hi.data());
+    }
+    if (ret == ENV_ERR_TRAVEL)
+        Status(op, "motor " + std::to_string(op.motor + 1) + " to " + std::to_string(pos) + " is beyond its travel limits.");
+    else if (ret == ENV_ERR_ZONE)
+        Status(op, "motor " + std::to_string(op.motor + 1) + " to " + std::to_string(pos) + " passes through a forbidden zone.");
+    return ret;
+}
+
+long SeqRunner::Measure(long i)
+{
+    for (long m = 0; m < numUnits; m++)
+        actual[m] = Position(m);
+    double value = NAN;
+    long ret = meas != nullptr ? meas->Measure(actual.data(), numUnits, &value) : 0;
+    if (!ret && measureHook)
+        measureHook(i, target.data(), actual.data(), value);
+    return ret;
+}
+
+long SeqRunner::Run(const SeqProgram &prog)
+{
+    steps = 0;
+    if (prog.NumUnits() != numUnits)
+    {
+        if (statusHook)
+            statusHook("Program compiled for " + std::to_string(prog.NumUnits()) + " motors, there are " + std::to_string(numUnits) + ".");
+        return SCAN_ERR_PARAM;
+    }
+    for (long m = 0; m < numUnits; m++)
+        target[m] = NAN;
+    const seqOp *ops = prog.Ops();
+    long n = prog.NumOps();
+    long passes[SEQ_MAX_DEPTH]; // left in every open loop
+    int depth = 0;
+    long measured = 0;
+    long ret = 0;
+    for (long pc = 0; pc < n && !ret; pc++)
+    {
+        const seqOp &op = ops[pc];
+        if (token != nullptr && token->Cancelled())
+        {
+            ret = SCAN_ERR_STOPPED;
+            break;
+        }
+        steps++;
+        if (stepHook && op.op != SEQ_LOOP && op.op != SEQ_NEXT)
+            stepHook(steps, op.line);
+        switch (op.op)
+        {
+        case SEQ_MOVE:
+            if ((ret = Check(op, op.x)))
+                break;
+            target[op.motor] = op.x;
+            ret = engines[op.motor]->Command(op.x);
+            break;
+        case SEQ_RMOVE:
+        {
+            float pos = (std::isnan(target[op.motor]) ? Position(op.motor) : target[op.motor]) + op.x;
+            if ((ret = Check(op, pos)))
+                break;
+            target[op.motor] = pos;
+            ret = engines[op.motor]->Command(pos);
+            break;
+        }
+        case SEQ_HOME:
+            if ((ret = Check(op, 0)))
+                break;
+            target[op.motor] = 0;
+            ret = engines[op.motor]->CommandHome();
+            break;
+        case SEQ_SETTLE:
+        {
+            scanParams p = {};
+            p.settleTol = op.x;
+            p.settleCount = op.n;
+            p.timeout = op.y;
+            if (std::isnan(target[op.motor])) // never commanded: settled where it is
+                target[op.motor] = Position(op.motor);
+            ret = engines[op.motor]->WaitSettled(target[op.motor], p);
+            if (ret == SCAN_ERR_TIMEOUT)
+                Status(op, "motor " + std::to_string(op.motor + 1) + " did not settle at " + std::to_string(target[op.motor]) + ".");
+            break;
+        }
+        case SEQ_WAIT:
+            ret = op.x > 0 ? engines[0]->Dwell(op.x) : 0;
+            break;
+        case SEQ_MEASURE:
+            ret = Measure(measured++);
+            if (ret)
+                Status(op, "measurement failed: " + std::to_string(ret));
+            break;
+        case SEQ_LOOP:
+            passes[depth++] = op.n;
+            break;
+        case SEQ_NEXT:
+            if (--passes[depth - 1] > 0)
+                pc = op.n; // the body starts after the SEQ_LOOP
+            else
+                depth--;
+            break;
+        }
+        if (ret && ret != SCAN_ERR_STOPPED && ret != SCAN_ERR_TIMEOUT && ret != ENV_ERR_TRAVEL && ret != ENV_ERR_ZONE && (op.op == SEQ_MOVE || op.op == SEQ_RMOVE || op.op == SEQ_HOME || op.op == SEQ_SETTLE))
+            Status(op, "motor " + std::to_string(op.motor + 1) + " returned " + std::to_string(ret) + ".");
+    }
+    return ret;
+}
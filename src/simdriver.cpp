@@ -0,0 +1,467 @@
+#include "simdriver.h"
+
+#include <algorithm>
+#include <cmath>
+
+// KST101 + ZST225B defaults, mm and mm/s
+#define SIM_MAX_VEL 2.6f
+#define SIM_MAX_ACCEL 4.0f
+#define SIM_TRAVEL 25.0f
+
+// a stage as it comes out of the box, at 0
+static simStage NewStage(long serNum)
+{
+    simStage s = {};
+    s.serNum = serNum;
+    s.present = true;
+    s.minVel = 0;
+    s.Accel = 1.0f;
+    s.maxVel = 1.0f;
+    s.homeVel = 1.0f;
+    s.ofst = 0.1f;
+    s.tEnd = -1e9;
+    s.stall = -1;
+    s.stuckAt = -1;
+    s.rng = (uint64_t)serNum * 0x9E3779B97F4A7C15ULL | 1;
+    return s;
+}
+
+// standard normal, from the xorshift state of a stage
+static float Gauss(uint64_t *state)
+{
+    double u[2];
+    for (double &x : u)
+    {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        x = ((*state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+    }
+    return (float)(sqrt(-2 * log(1 - u[0])) * cos(2 * 3.14159265358979 * u[1]));
+}
+
+// the play left once the motor has moved by dist
+static float TakeUp(const simStage *s, float dist)
+{
+    return std::min(std::max(s->play - dist, -s->backlash / 2), s->backlash / 2);
+}
+
+SimDriver::SimDriver(long numUnits, unsigned latencyUs) : latencyUs(latencyUs), initMs(0), jitterMs(0), ringAmp(0.002f), ringTau(0.05f), faultsHit(0), clock(DefaultClock())
+{
+    epoch = clock->Now();
+    for (long i = 0; i < numUnits; i++)
+        stages.push_back(NewStage(26000001 + i));
+}
+
+void SimDriver::SetLatency(unsigned latencyUs)
+{
+    this->latencyUs = latencyUs;
+}
+
+unsigned SimDriver::GetLatency() const
+{
+    return latencyUs;
+}
+
+void SimDriver::SetRinging(float amplitude, float tau)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    ringAmp = amplitude;
+    ringTau = tau > 0 ? tau : 1e-3f;
+}
+
+void SimDriver::SetInitTime(unsigned initMs, unsigned jitterMs)
+{
+    this->initMs = initMs;
+    this->jitterMs = jitterMs;
+}
+
+void SimDriver::Plug(long serNum)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    for (simStage &s : stages)
+    {
+        if (s.serNum == serNum)
+        {
+            s.present = true;
+            return;
+        }
+    }
+    stages.push_back(NewStage(serNum));
+}
+
+void SimDriver::Unplug(long serNum)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    for (simStage &s : stages)
+    {
+        if (s.serNum == serNum)
+        {
+            s.present = false;
+            s.init = false;
+        }
+    }
+}
+
+void SimDriver::SetClock(Clock *clock)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    this->clock = clock != nullptr ? clock : DefaultClock();
+    epoch = this->clock->Now();
+}
+
+void SimDriver::AddFault(const simFault &fault)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    faults.push_back(std::make_pair(fault, 0L));
+}
+
+void SimDriver::ClearFaults()
+{
+    std::lock_guard<std::mutex> lk(lock);
+    faults.clear();
+}
+
+long SimDriver::FaultsHit() const
+{
+    std::lock_guard<std::mutex> lk(lock);
+    return faultsHit;
+}
+
+void SimDriver::Stall(long serNum, float fraction)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s != nullptr)
+        s->stall = fraction < 0 ? 0 : fraction;
+}
+
+void SimDriver::SetBacklash(long serNum, float backlash, float noise)
+{
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return;
+    s->backlash = backlash > 0 ? backlash : 0;
+    s->noise = noise > 0 ? noise : 0;
+    s->play = TakeUp(s, 0);
+}
+
+double SimDriver::Now() const
+{
+    return clock->Now() - epoch;
+}
+
+void SimDriver::Delay() const
+{
+    unsigned us = latencyUs;
+    if (us)
+        clock->Sleep(us / 1e6);
+}
+
+long SimDriver::Inject(long serNum, simCall call)
+{
+    for (auto &f : faults)
+    {
+        const simFault &ft = f.first;
+        if ((ft.serNum && ft.serNum != serNum) || (ft.call != SIM_ANY && ft.call != call))
+            continue;
+        long n = f.second++;
+        if (n < ft.after || (ft.count > 0 && n >= ft.after + ft.count))
+            continue;
+        faultsHit++;
+        return ft.ret;
+    }
+    return 0;
+}
+
+simStage *SimDriver::Find(long serNum)
+{
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        if (stages[i].serNum == serNum)
+            return stages[i].present ? &stages[i] : nullptr;
+    }
+    return nullptr;
+}
+
+float SimDriver::Motor(const simStage *s, double now) const
+{
+    if (s->moving && s->stuckAt >= 0)
+        return (float)(s->startPos + ProfileDistance(&s->profile, std::min(now - s->t0, s->stuckAt)));
+    if (s->moving && now - s->t0 < s->profile.total)
+        return (float)(s->startPos + ProfileDistance(&s->profile, now - s->t0));
+    double tEnd = s->moving ? s->t0 + s->profile.total : s->tEnd;
+    double t = now - tEnd;
+    if (t < 10 * ringTau) // overshoot decaying about the target
+        return (float)(s->target + ringAmp * exp(-t / ringTau) * cos(3.14159265358979 * t / ringTau));
+    return s->target;
+}
+
+// the motor, less the play not taken up so far, plus the error drawn for the move as it progresses
+float SimDriver::Position(const simStage *s, double now) const
+{
+    float pos = Motor(s, now);
+    if (s->backlash == 0 && s->noise == 0)
+        return pos;
+    double t = s->moving ? std::min(now - s->t0, s->stuckAt >= 0 ? s->stuckAt : s->profile.total) : 0;
+    double frac = s->moving && s->profile.total > 0 ? t / s->profile.total : 1;
+    float dist = s->moving ? (float)ProfileDistance(&s->profile, t) : s->target - s->startPos;
+    return pos + TakeUp(s, dist) + s->errFrom + (float)frac * (s->errTo - s->errFrom);
+}
+
+void SimDriver::Update(simStage *s, double now)
+{
+    if (s->moving && s->stuckAt < 0 && now - s->t0 >= s->profile.total)
+    {
+        s->play = TakeUp(s, s->target - s->startPos);
+        s->errFrom = s->errTo;
+        s->tEnd = s->t0 + s->profile.total;
+        s->startPos = s->target;
+        s->moving = false;
+    }
+}
+
+long SimDriver::Init()
+{
+    Delay();
+    return 0;
+}
+
+long SimDriver::Cleanup()
+{
+    Delay();
+    return 0;
+}
+
+long SimDriver::GetNumUnits(long *numUnits)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    *numUnits = 0;
+    for (const simStage &s : stages)
+        *numUnits += s.present;
+    return 0;
+}
+
+long SimDriver::GetSerialNum(long idx, long *serNum)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    for (const simStage &s : stages)
+    {
+        if (s.present && idx-- == 0)
+        {
+            *serNum = s.serNum;
+            return 0;
+        }
+    }
+    return DRV_ERR_PARAM;
+}
+
+long SimDriver::InitDevice(long serNum)
+{
+    Delay();
+    unsigned ms = initMs, jitter = jitterMs;
+    if (jitter)
+        ms += (unsigned)(((unsigned long)serNum * 2654435761UL) % 1000) * jitter / 1000;
+    if (ms)
+        clock->Sleep(ms / 1e3);
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    long ret = Inject(serNum, SIM_INITDEVICE);
+    if (ret)
+        return ret;
+    s->init = true;
+    return 0;
+}
+
+long SimDriver::GetPosition(long serNum, float *pos)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    if (!s->init)
+        return DRV_ERR_NOTINIT;
+    long ret = Inject(serNum, SIM_GETPOSITION);
+    if (ret)
+        return ret;
+    double now = Now();
+    *pos = Position(s, now);
+    Update(s, now);
+    return 0;
+}
+
+long SimDriver::GetInMotion(long serNum, bool *moving)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    if (!s->init)
+        return DRV_ERR_NOTINIT;
+    long ret = Inject(serNum, SIM_GETINMOTION);
+    if (ret)
+        return ret;
+    Update(s, Now());
+    *moving = s->moving;
+    return 0;
+}
+
+long SimDriver::StartMove(long serNum, float pos, bool home, bool wait)
+{
+    double duration;
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        simStage *s = Find(serNum);
+        if (s == nullptr)
+            return DRV_ERR_NODEVICE;
+        if (!s->init)
+            return DRV_ERR_NOTINIT;
+        if (pos < 0 || pos > SIM_TRAVEL)
+            return DRV_ERR_PARAM;
+        long ret = Inject(serNum, SIM_MOVE);
+        if (ret)
+            return ret;
+        double now = Now();
+        Update(s, now);
+        // the ringing of a previous move is not carried into the new one
+        if (s->moving)
+        {
+            float carriage = Position(s, now);
+            s->startPos = Motor(s, now);
+            s->play = TakeUp(s, (float)ProfileDistance(&s->profile, std::min(now - s->t0, s->stuckAt >= 0 ? s->stuckAt : s->profile.total)));
+            s->errFrom = carriage - s->startPos - s->play;
+        }
+        else
+        {
+            s->startPos = s->target;
+            s->errFrom = s->errTo;
+        }
+        // a home finds the reference the carriage is measured from
+        if (home)
+            s->play = s->errFrom = 0;
+        s->errTo = home || s->noise == 0 ? 0 : s->noise * Gauss(&s->rng);
+        s->target = pos;
+        s->t0 = now;
+        if (home)
+            s->profile = ProfileMake(pos - s->startPos, 0, s->homeVel, s->Accel);
+        else
+            s->profile = ProfileMake(pos - s->startPos, s->minVel, s->maxVel, s->Accel);
+        s->moving = s->profile.total > 0;
+        s->stuckAt = -1;
+        if (s->moving && s->stall >= 0)
+        {
+            s->stuckAt = s->stall * s->profile.total;
+            s->stall = -1;
+        }
+        duration = s->stuckAt >= 0 ? s->stuckAt : s->profile.total;
+    }
+    if (wait)
+        clock->Sleep(duration);
+    return 0;
+}
+
+long SimDriver::MoveAbsolute(long serNum, float pos, bool wait)
+{
+    Delay();
+    return StartMove(serNum, pos, false, wait);
+}
+
+long SimDriver::MoveHome(long serNum, bool wait)
+{
+    Delay();
+    return StartMove(serNum, 0, true, wait);
+}
+
+long SimDriver::Stop(long serNum)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    if (!s->init)
+        return DRV_ERR_NOTINIT;
+    long ret = Inject(serNum, SIM_STOP);
+    if (ret)
+        return ret;
+    double now = Now();
+    Update(s, now);
+    if (s->moving)
+    {
+        float carriage = Position(s, now);
+        s->startPos = Motor(s, now);
+        s->play = TakeUp(s, (float)ProfileDistance(&s->profile, std::min(now - s->t0, s->stuckAt >= 0 ? s->stuckAt : s->profile.total)));
+        s->errFrom = s->errTo = carriage - s->startPos - s->play;
+        s->target = s->startPos;
+        s->tEnd = -1e9; // a profiled stop is assumed not to ring
+        s->moving = false;
+        s->stuckAt = -1;
+    }
+    return 0;
+}
+
+long SimDriver::GetVelParams(long serNum, float *minVel, float *accel, float *maxVel)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    long ret = Inject(serNum, SIM_GETVELPARAMS);
+    if (ret)
+        return ret;
+    *minVel = s->minVel;
+    *accel = s->Accel;
+    *maxVel = s->maxVel;
+    return 0;
+}
+
+long SimDriver::SetVelParams(long serNum, float minVel, float accel, float maxVel)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    if (minVel < 0 || maxVel <= 0 || minVel > maxVel || maxVel > SIM_MAX_VEL || accel <= 0 || accel > SIM_MAX_ACCEL)
+        return DRV_ERR_PARAM;
+    long ret = Inject(serNum, SIM_SETVELPARAMS);
+    if (ret)
+        return ret;
+    s->minVel = minVel;
+    s->Accel = accel;
+    s->maxVel = maxVel;
+    return 0;
+}
+
+long SimDriver::GetVelParamLimits(long serNum, float *maxAccel, float *maxVel)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    if (Find(serNum) == nullptr)
+        return DRV_ERR_NODEVICE;
+    *maxAccel = SIM_MAX_ACCEL;
+    *maxVel = SIM_MAX_VEL;
+    return 0;
+}
+
+long SimDriver::GetHomeParams(long serNum, long *homeDir, long *limSwitch, float *homeVel, float *ofst)
+{
+    Delay();
+    std::lock_guard<std::mutex> lk(lock);
+    simStage *s = Find(serNum);
+    if (s == nullptr)
+        return DRV_ERR_NODEVICE;
+    *homeDir = 2; // HOME_REV
+    *limSwitch = 1; // HOMELIMSW_REV
+    *homeVel = s->homeVel;
+    *ofst = s->ofst;
+    return 0;
+}
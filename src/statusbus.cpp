@@ -0,0 +1,453 @@
+#include "statusbus.h"
+
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// the layout is shared with other processes, which may be other builds
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "the status bus needs lock-free atomics to share them between processes");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Wait() sleeps on the sequence as a plain word");
+static_assert(sizeof(busMotor) == 48, "busMotor is part of the shared layout");
+static_assert(offsetof(busHeader, publishes) == 48, "pid takes the padding before publishes, the layout is unchanged");
+
+static const size_t headerSize = (sizeof(busHeader) + REG_LINE - 1) / REG_LINE * REG_LINE;
+
+static uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef _WIN32
+static std::string MappingName(const std::string &name)
+{
+    return "Local\\" + name;
+}
+
+static std::string WakeName(const std::string &name)
+{
+    return "Local\\" + name + "_wake";
+}
+#else
+static std::string ShmName(const std::string &name)
+{
+    return "/" + name;
+}
+
+// a segment of that name left by a publisher that is gone: closed, never set up, or its process
+// exited without closing it; false for one a live publisher holds, or one we may not look at
+static bool ShmStale(const std::string &path)
+{
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return errno == ENOENT;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(busHeader))
+        base = mmap(NULL, sizeof(busHeader), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return true;
+    const busHeader *h = (const busHeader *)base;
+    bool live = h->magic.load(std::memory_order_acquire) == BUS_MAGIC && h->open.load(std::memory_order_acquire) && h->pid != 0 &&
+                (kill((pid_t)h->pid, 0) == 0 || errno == EPERM);
+    munmap(base, sizeof(busHeader));
+    return !live;
+}
+#endif
+
+StatusBus::StatusBus() : reg(nullptr), ready(false), capacity(0), hdr(nullptr), slots(nullptr), mapSize(0)
+{
+#ifdef _WIN32
+    mapping = NULL;
+    wake = NULL;
+#endif
+}
+
+StatusBus::~StatusBus()
+{
+    Close();
+}
+
+long StatusBus::Open(const char *name, const MotorRegistry *reg)
+{
+    Close();
+    this->name = name;
+    this->reg = reg;
+    capacity = reg->Capacity();
+    mapSize = headerSize + capacity * sizeof(busSlot);
+    void *base = nullptr;
+#ifdef _WIN32
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)mapSize >> 32),
+                                 (DWORD)(mapSize & 0xffffffff), MappingName(this->name).c_str());
+    // an existing mapping is one a previous run left to its readers: too small, or theirs to keep
+    if (mapping != NULL && GetLastError() != ERROR_ALREADY_EXISTS)
+        base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, mapSize);
+    if (base != nullptr)
+        wake = CreateSemaphoreA(NULL, 0, LONG_MAX, WakeName(this->name).c_str());
+    if (base != nullptr && wake == NULL)
+    {
+        UnmapViewOfFile(base);
+        base = nullptr;
+    }
+#else
+    // a segment of the same name is another publisher's, as on Windows, unless that one is gone:
+    // then it is stale, from a run that did not close it, and readers still mapping it keep theirs,
+    // and see it never change
+    std::string path = ShmName(this->name);
+    if (!ShmStale(path))
+    {
+        Close();
+        return BUS_ERR_OPEN;
+    }
+    shm_unlink(path.c_str());
+    // readers map it read-write too, they update the count of waiters and wake the others; opening
+    // it O_RDWR takes write permission, given to the group and not to every user
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd >= 0)
+    {
+        if (ftruncate(fd, mapSize) == 0)
+            base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            base = nullptr;
+        close(fd);
+        if (base == nullptr)
+            shm_unlink(path.c_str());
+    }
+#endif
+    if (base == nullptr)
+    {
+        Close();
+        return BUS_ERR_OPEN;
+    }
+    // the segment is zero-filled; the magic goes in last, once the layout is there to check
+    hdr = new (base) busHeader();
+    hdr->version = BUS_VERSION;
+    hdr->capacity = (uint32_t)capacity;
+    hdr->slotSize = sizeof(busSlot);
+    hdr->headerSize = headerSize;
+    hdr->open.store(1, std::memory_order_relaxed);
+#ifndef _WIN32
+    hdr->pid = (uint32_t)getpid();
+#endif
+    slots = (busSlot *)((char *)base + headerSize);
+    for (long i = 0; i < capacity; i++)
+        new (&slots[i]) busSlot();
+    hdr->magic.store(BUS_MAGIC, std::memory_order_release);
+
+    locks.reset(new std::mutex[capacity]);
+    scan.reset(new std::atomic<int64_t>[capacity]);
+    for (long i = 0; i < capacity; i++)
+        scan[i].store(-1, std::memory_order_relaxed);
+    ready.store(true, std::memory_order_release);
+    long n = reg->NumSlots();
+    for (long i = 0; i < n; i++)
+        Write(i);
+    Wake();
+    return 0;
+}
+
+void StatusBus::Close()
+{
+    ready.store(false, std::memory_order_release);
+    if (hdr != nullptr)
+    {
+        // wakes the readers, which find the bus closed
+        hdr->open.store(0, std::memory_order_release);
+        Wake();
+    }
+#ifdef _WIN32
+    if (hdr != nullptr)
+        UnmapViewOfFile(hdr);
+    if (wake != NULL)
+        CloseHandle(wake);
+    if (mapping != NULL)
+        CloseHandle(mapping);
+    wake = NULL;
+    mapping = NULL;
+#else
+    if (hdr != nullptr)
+    {
+        munmap(hdr, mapSize);
+        shm_unlink(ShmName(name).c_str());
+    }
+#endif
+    hdr = nullptr;
+    slots = nullptr;
+}
+
+bool StatusBus::IsOpen() const
+{
+    return ready.load(std::memory_order_acquire);
+}
+
+void StatusBus::Publish(long idx)
+{
+    if (!ready.load(std::memory_order_acquire) || idx < 0 || idx >= capacity)
+        return;
+    Write(idx);
+    Wake();
+}
+
+void StatusBus::SetScanIndex(long idx, long index)
+{
+    if (!ready.load(std::memory_order_acquire) || idx < 0 || idx >= capacity)
+        return;
+    scan[idx].store(index, std::memory_order_relaxed);
+    Write(idx);
+    Wake();
+}
+
+uint64_t StatusBus::Publishes() const
+{
+    return hdr != nullptr ? hdr->publishes.load(std::memory_order_relaxed) : 0;
+}
+
+void StatusBus::Write(long idx)
+{
+    motorState st = {};
+    busMotor m = {};
+    std::lock_guard<std::mutex> lk(locks[idx]);
+    reg->Load(idx, &st);
+    m.serNum = reg->SerialNum(idx);
+    m.scanIndex = scan[idx].load(std::memory_order_relaxed);
+    m.polls = st.polls;
+    m.stampNs = NowNs();
+    m.ret = (int32_t)st.ret;
+    m.pos = st.curPos;
+    m.moving = st.moving;
+    m.present = reg->Present(idx);
+    slots[idx].state.Store(m);
+    uint32_t n = hdr->numSlots.load(std::memory_order_relaxed);
+    while (n < (uint32_t)idx + 1 && !hdr->numSlots.compare_exchange_weak(n, (uint32_t)idx + 1, std::memory_order_release))
+        ;
+    hdr->publishes.fetch_add(1, std::memory_order_relaxed);
+}
+
+#ifdef _WIN32
+static void WakeWaiters(void *wake, uint32_t n)
+{
+    ReleaseSemaphore(wake, (LONG)n, NULL);
+}
+#else
+static void WakeWaiters(std::atomic<uint32_t> *seq, uint32_t n)
+{
+#ifdef __linux__
+    // not FUTEX_PRIVATE_FLAG: the readers are other processes
+    syscall(SYS_futex, seq, FUTEX_WAKE, n > INT_MAX ? INT_MAX : (int)n, nullptr, nullptr, 0);
+#else
+    (void)seq;
+    (void)n;
+#endif
+}
+#endif
+
+// the sequence goes up before the count of waiters is read, and a reader counts itself before it
+// reads the sequence, so one of the two always sees the other
+void StatusBus::Wake()
+{
+    hdr->seq.fetch_add(1, std::memory_order_seq_cst);
+    // a reader killed while it waited stays counted, which costs a needless wake syscall, no more
+    if (!hdr->waiters.load(std::memory_order_seq_cst))
+        return;
+#ifdef _WIN32
+    WakeWaiters(wake, 1);
+#else
+    WakeWaiters(&hdr->seq, 1);
+#endif
+}
+
+StatusReader::StatusReader() : hdr(nullptr), slots(nullptr), mapSize(0)
+{
+#ifdef _WIN32
+    mapping = NULL;
+    wake = NULL;
+#endif
+}
+
+StatusReader::~StatusReader()
+{
+    Close();
+}
+
+long StatusReader::Open(const char *name)
+{
+    Close();
+    void *base = nullptr;
+#ifdef _WIN32
+    mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, MappingName(name).c_str());
+    if (mapping != NULL)
+        base = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION info;
+    if (base != nullptr && VirtualQuery(base, &info, sizeof(info)) == sizeof(info))
+        mapSize = info.RegionSize;
+    if (base != nullptr)
+        // waits on it, and releases it for the other waiters once woken
+        wake = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE, WakeName(name).c_str());
+    if (base != nullptr && wake == NULL)
+    {
+        UnmapViewOfFile(base);
+        base = nullptr;
+    }
+#else
+    int fd = shm_open(ShmName(name).c_str(), O_RDWR, 0);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= headerSize)
+    {
+        mapSize = st.st_size;
+        base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            base = nullptr;
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+    if (base == nullptr)
+    {
+        Close();
+        return BUS_ERR_OPEN;
+    }
+    hdr = (busHeader *)base;
+    slots = (const busSlot *)((char *)base + headerSize);
+    if (hdr->magic.load(std::memory_order_acquire) != BUS_MAGIC || hdr->version != BUS_VERSION || hdr->slotSize != sizeof(busSlot) ||
+        hdr->headerSize != headerSize || mapSize < headerSize + (size_t)hdr->capacity * sizeof(busSlot))
+    {
+        Close();
+        return BUS_ERR_LAYOUT;
+    }
+    return 0;
+}
+
+void StatusReader::Close()
+{
+#ifdef _WIN32
+    if (hdr != nullptr)
+        UnmapViewOfFile(hdr);
+    if (wake != NULL)
+        CloseHandle(wake);
+    if (mapping != NULL)
+        CloseHandle(mapping);
+    wake = NULL;
+    mapping = NULL;
+#else
+    if (hdr != nullptr)
+        munmap(hdr, mapSize);
+#endif
+    hdr = nullptr;
+    slots = nullptr;
+}
+
+long StatusReader::Capacity() const
+{
+    return hdr != nullptr ? hdr->capacity : 0;
+}
+
+long StatusReader::NumSlots() const
+{
+    return hdr != nullptr ? hdr->numSlots.load(std::memory_order_acquire) : 0;
+}
+
+bool StatusReader::Alive() const
+{
+    return hdr != nullptr && hdr->open.load(std::memory_order_acquire);
+}
+
+bool StatusReader::Read(long slot, busMotor *motor) const
+{
+    if (hdr == nullptr || slot < 0 || slot >= (long)hdr->capacity)
+        return false;
+    *motor = slots[slot].state.Load();
+    return true;
+}
+
+uint64_t StatusReader::Version(long slot) const
+{
+    if (hdr == nullptr || slot < 0 || slot >= (long)hdr->capacity)
+        return 0;
+    return slots[slot].state.Version();
+}
+
+long StatusReader::Snapshot(busMotor *motors, long n) const
+{
+    long num = NumSlots();
+    if (n > num)
+        n = num;
+    for (long i = 0; i < n; i++)
+        motors[i] = slots[i].state.Load();
+    return n;
+}
+
+uint32_t StatusReader::Sequence() const
+{
+    return hdr != nullptr ? hdr->seq.load(std::memory_order_acquire) : 0;
+}
+
+bool StatusReader::Wait(uint32_t *seq, int timeoutMs) const
+{
+    if (hdr == nullptr)
+        return false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (;;)
+    {
+        uint32_t cur = hdr->seq.load(std::memory_order_seq_cst);
+        if (cur != *seq)
+        {
+            *seq = cur;
+            return true;
+        }
+        long long left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0 || !Alive())
+            return false;
+        hdr->waiters.fetch_add(1, std::memory_order_seq_cst);
+        bool woken = false;
+        if (hdr->seq.load(std::memory_order_seq_cst) == *seq)
+        {
+#if defined(_WIN32)
+            woken = WaitForSingleObject(wake, (DWORD)((left + 999) / 1000)) == WAIT_OBJECT_0;
+#else
+            struct timespec ts;
+            ts.tv_sec = left / 1000000;
+            ts.tv_nsec = (left % 1000000) * 1000;
+#if defined(__linux__)
+            // returns at once if the sequence moved on since it was read
+            woken = syscall(SYS_futex, &hdr->seq, FUTEX_WAIT, *seq, &ts, nullptr, 0) == 0;
+#else
+            // no futex to share between processes: look again every millisecond
+            if (left > 1000)
+                ts = {0, 1000000};
+            nanosleep(&ts, nullptr);
+#endif
+#endif
+        }
+        uint32_t others = hdr->waiters.fetch_sub(1, std::memory_order_seq_cst) - 1;
+        // the publisher woke one reader, the first to wake for a new sequence wakes everyone else;
+        // whoever it was, a reader that slept on an older one is among them
+        cur = hdr->seq.load(std::memory_order_seq_cst);
+        if (woken && others && hdr->relayed.exchange(cur, std::memory_order_acq_rel) != cur)
+        {
+#ifdef _WIN32
+            WakeWaiters(wake, others);
+#else
+            WakeWaiters(&hdr->seq, others);
+#endif
+        }
+    }
+}
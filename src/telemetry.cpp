@@ -0,0 +1,297 @@
+#include "telemetry.h"
+
+#include <cmath>
+
+MotorTelemetry::MotorTelemetry(MotorDriver *drv, int pollMs) : drv(drv), rec(nullptr), clock(DefaultClock()), histCapacity(0), pollMs(pollMs), running(false)
+{
+    epoch = clock->Now();
+}
+
+void MotorTelemetry::SetRecorder(Recorder *rec)
+{
+    this->rec = rec;
+}
+
+void MotorTelemetry::EnableHistory(long capacity)
+{
+    histCapacity = capacity;
+}
+
+void MotorTelemetry::SetChangeHook(std::function<void(long idx)> hook)
+{
+    changeHook = hook;
+}
+
+void MotorTelemetry::SetClock(Clock *clock)
+{
+    this->clock = clock != nullptr ? clock : DefaultClock();
+    epoch = this->clock->Now();
+}
+
+Clock *MotorTelemetry::GetClock() const
+{
+    return clock;
+}
+
+MotorTelemetry::~MotorTelemetry()
+{
+    Stop();
+}
+
+void MotorTelemetry::Start(const long *serNums, long numUnits, bool active, long capacity)
+{
+    if (running)
+        return;
+    running = true;
+    // every slot's poller exists from here on, so the vector never changes under a reader
+    reg.reset(new MotorRegistry(capacity > numUnits ? capacity : numUnits));
+    pollers.clear();
+    for (long i = 0; i < reg->Capacity(); i++)
+    {
+        std::unique_ptr<poller> p(new poller());
+        p->idx = i;
+        p->serNum = 0;
+        p->kick = false;
+        p->active = false;
+        p->stop = false;
+        p->target = NAN;
+        p->hist = nullptr;
+        pollers.push_back(std::move(p));
+    }
+    for (long i = 0; i < numUnits; i++)
+    {
+        long idx;
+        Add(serNums[i], active, &idx);
+    }
+}
+
+void MotorTelemetry::Launch(poller *p, long serNum, bool active)
+{
+    if (histCapacity > 0 && p->hist.load(std::memory_order_relaxed) == nullptr)
+    {
+        p->histOwner.reset(new MotionHistory(histCapacity));
+        p->hist.store(p->histOwner.get(), std::memory_order_release);
+    }
+    p->serNum = serNum;
+    p->kick = false;
+    p->active = active;
+    p->stop = false;
+    p->target = NAN;
+    p->thr = clock->Spawn([this, p]()
+                          { PollFcn(p); });
+}
+
+long MotorTelemetry::Add(long serNum, bool active, long *idx)
+{
+    if (!running)
+        return DRV_ERR_NOTINIT;
+    std::lock_guard<std::mutex> lk(addLock);
+    long ret = reg->Add(serNum, idx);
+    if (ret)
+        return ret;
+    Launch(pollers[*idx].get(), serNum, active);
+    return 0;
+}
+
+long MotorTelemetry::Remove(long idx)
+{
+    std::lock_guard<std::mutex> lk(addLock);
+    if (!running)
+        return DRV_ERR_NOTINIT;
+    long ret = reg->Remove(idx);
+    if (ret)
+        return ret;
+    poller *p = pollers[idx].get();
+    {
+        std::lock_guard<std::mutex> plk(p->lock);
+        p->stop = true;
+    }
+    clock->Notify(p->cond);
+    clock->Join(p->thr);
+    // a last sample, so whatever waits on the motor learns it is gone
+    motorState st;
+    reg->Load(idx, &st);
+    st.moving = false;
+    st.ret = DRV_ERR_NODEVICE;
+    st.stamp = clock->Now() - epoch;
+    st.polls++;
+    reg->Store(idx, st);
+    {
+        std::lock_guard<std::mutex> plk(p->lock);
+    }
+    clock->Notify(p->updated);
+    if (changeHook)
+        changeHook(idx);
+    return 0;
+}
+
+void MotorTelemetry::Stop()
+{
+    if (!running)
+        return;
+    std::lock_guard<std::mutex> alk(addLock);
+    running = false;
+    for (size_t i = 0; i < pollers.size(); i++)
+    {
+        poller *p = pollers[i].get();
+        {
+            std::lock_guard<std::mutex> lk(p->lock);
+            p->kick = true;
+        }
+        clock->Notify(p->cond);
+        clock->Notify(p->updated);
+    }
+    for (size_t i = 0; i < pollers.size(); i++)
+        clock->Join(pollers[i]->thr);
+}
+
+void MotorTelemetry::SetPollInterval(int ms)
+{
+    if (ms < 1)
+        ms = 1;
+    pollMs = ms;
+}
+
+int MotorTelemetry::GetPollInterval() const
+{
+    return pollMs;
+}
+
+long MotorTelemetry::NumUnits() const
+{
+    return reg ? reg->NumSlots() : 0;
+}
+
+const MotorRegistry *MotorTelemetry::Registry() const
+{
+    return reg.get();
+}
+
+bool MotorTelemetry::GetState(long idx, motorState *state) const
+{
+    if (idx < 0 || idx >= NumUnits())
+        return false;
+    return reg->Load(idx, state);
+}
+
+void MotorTelemetry::Kick(long idx)
+{
+    if (idx < 0 || idx >= NumUnits())
+        return;
+    poller *p = pollers[idx].get();
+    {
+        std::lock_guard<std::mutex> lk(p->lock);
+        p->kick = true;
+    }
+    clock->Notify(p->cond);
+}
+
+void MotorTelemetry::SetTarget(long idx, float target)
+{
+    if (idx < 0 || idx >= NumUnits())
+        return;
+    pollers[idx]->target = target;
+}
+
+float MotorTelemetry::Target(long idx) const
+{
+    if (idx < 0 || idx >= NumUnits())
+        return NAN;
+    return pollers[idx]->target;
+}
+
+const MotionHistory *MotorTelemetry::History(long idx) const
+{
+    if (idx < 0 || idx >= NumUnits())
+        return nullptr;
+    return pollers[idx]->hist.load(std::memory_order_acquire);
+}
+
+void MotorTelemetry::Activate(long idx)
+{
+    if (idx < 0 || idx >= NumUnits())
+        return;
+    poller *p = pollers[idx].get();
+    {
+        std::lock_guard<std::mutex> lk(p->lock);
+        p->active = true;
+    }
+    clock->Notify(p->cond);
+}
+
+bool MotorTelemetry::WaitForUpdate(long idx, motorState *state, int timeoutMs, const std::atomic<bool> *abort)
+{
+    if (idx < 0 || idx >= NumUnits())
+        return false;
+    poller *p = pollers[idx].get();
+    uint64_t last = state->polls;
+    {
+        std::unique_lock<std::mutex> lk(p->lock);
+        clock->Wait(lk, p->updated, timeoutMs / 1e3, [this, p, last, abort]
+                    { return !running || (abort != nullptr && *abort) || reg->Polls(p->idx) != last; });
+    }
+    reg->Load(idx, state);
+    return state->polls != last;
+}
+
+void MotorTelemetry::Interrupt(long idx)
+{
+    if (idx < 0 || idx >= NumUnits())
+        return;
+    poller *p = pollers[idx].get();
+    {
+        // a waiter between testing its abort flag and blocking holds the lock, so it cannot miss this
+        std::lock_guard<std::mutex> lk(p->lock);
+    }
+    clock->Notify(p->updated);
+}
+
+void MotorTelemetry::PollFcn(poller *p)
+{
+    motorState st;
+    reg->Load(p->idx, &st); // a device plugged back in carries on counting polls where it left off
+    bool havePos = false;
+    bool settling = false; // position still changing after the motor reported stopped
+    bool first = true;
+    {
+        std::unique_lock<std::mutex> lk(p->lock);
+        clock->Wait(lk, p->cond, INFINITY, [this, p]
+                    { return p->active || p->stop || !running; });
+    }
+    while (running && !p->stop)
+    {
+        motorState prev = st;
+        bool moving = false;
+        long ret = drv->GetInMotion(p->serNum, &moving);
+        // position only changes while moving, or while settling right after a move
+        if (!ret && (moving || st.moving || settling || !havePos))
+        {
+            float lastPos = st.curPos;
+            ret = drv->GetPosition(p->serNum, &st.curPos);
+            settling = !ret && !moving && havePos && st.curPos != lastPos;
+            havePos = !ret;
+        }
+        st.moving = moving;
+        st.ret = ret;
+        st.stamp = clock->Now() - epoch;
+        st.polls++;
+        reg->Store(p->idx, st);
+        if (changeHook && (first || st.curPos != prev.curPos || st.moving != prev.moving || st.ret != prev.ret))
+            changeHook(p->idx);
+        first = false;
+        if (rec != nullptr)
+            rec->LogState(p->serNum, st.curPos, st.moving, st.ret);
+        MotionHistory *hist = p->hist.load(std::memory_order_relaxed);
+        if (hist != nullptr && havePos)
+        {
+            float target = p->target;
+            hist->Add(st.stamp, st.curPos, std::isnan(target) ? st.curPos : target);
+        }
+
+        std::unique_lock<std::mutex> lk(p->lock);
+        clock->Notify(p->updated);
+        clock->Wait(lk, p->cond, pollMs.load() / 1e3, [p]
+                    { return p->kick || p->stop; });
+        p->kick = false;
+    }
+}
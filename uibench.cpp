@@ -0,0 +1,181 @@
+// Allocation and time per frame of the motor panel, for 1 to 256 simulated motors. Runs headless:
+// the frame is built and rendered to draw lists by ImGui, nothing is drawn on screen. Once every row
+// was laid out, a frame must allocate nothing, through new or ImGui. Exits 1 if a check fails.
+//
+// usage: mcpher_uibench [--frames N] [--max-motors N]
+
+#include "imgui/imgui.h"
+#include "controller.h"
+#include "motorpanel.h"
+#include "paramcache.h"
+#include "simdriver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+static long failed = 0;
+
+static void Check(bool ok, const char *what)
+{
+    printf("%-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failed++;
+}
+
+// allocations made by the bench thread while counting, the pollers and queue workers are not counted
+static thread_local bool counting = false;
+static std::atomic<uint64_t> heapAllocs(0);
+static std::atomic<uint64_t> imguiAllocs(0);
+
+void *operator new(size_t size)
+{
+    if (counting)
+        heapAllocs++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    if (counting)
+        heapAllocs++;
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static void *ImAlloc(size_t size, void *)
+{
+    if (counting)
+        imguiAllocs++;
+    return malloc(size);
+}
+
+static void ImFree(void *p, void *)
+{
+    free(p);
+}
+
+#define BENCH_WIDTH 800
+#define BENCH_HEIGHT 600
+
+// one frame of the control panel, scrolled to scroll (0 top, 1 bottom)
+static void Frame(MotorPanel *panel, float scroll)
+{
+    ImGuiIO &io = ImGui::GetIO();
+    io.DisplaySize = ImVec2(BENCH_WIDTH, BENCH_HEIGHT);
+    io.DeltaTime = 1.0f / 60;
+    ImGui::NewFrame();
+    ImGui::SetNextWindowPos(ImVec2(0, 0), ImGuiCond_Always);
+    ImGui::SetNextWindowSize(ImVec2(BENCH_WIDTH, BENCH_HEIGHT), ImGuiCond_Always);
+    ImGui::Begin("Control Panel", nullptr, ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_NoResize);
+    ImGui::SetScrollY(scroll * ImGui::GetScrollMaxY());
+    panel->Update();
+    panel->Draw(false);
+    ImGui::End();
+    ImGui::Render();
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 600;
+    long maxMotors = 256;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !strcmp(argv[i], "--frames"))
+            frames = atoi(argv[++i]);
+        else if (i + 1 < argc && !strcmp(argv[i], "--max-motors"))
+            maxMotors = atol(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: mcpher_uibench [--frames N] [--max-motors N]\n");
+            return 1;
+        }
+    }
+    if (frames < 1)
+        frames = 1;
+    ImGui::SetAllocatorFunctions(ImAlloc, ImFree, nullptr);
+    ImGui::CreateContext();
+    ImGuiIO &io = ImGui::GetIO();
+    io.IniFilename = nullptr;
+    unsigned char *pixels;
+    int width, height;
+    io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height); // no renderer, the atlas only has to exist
+    printf("%8s %14s %14s %12s\n", "motors", "new/frame", "imgui/frame", "us/frame");
+    uint64_t heapMax = 0, imguiMax = 0;
+    for (long n = 1; n <= maxMotors; n *= 2)
+    {
+        SimDriver sim(n);
+        ParamCache cache(&sim);
+        MotorController controller(&cache);
+        std::string msg;
+        if (controller.Init(&msg, 8) || !controller.WaitAll(60000))
+        {
+            fprintf(stderr, "%ld motors: %s\n", n, msg.c_str());
+            return 1;
+        }
+        {
+            ScanTaskManager tasks(1); // no scans are started
+            MotorPanel panel(&controller, &cache, nullptr, &tasks);
+            // first pass lays out every row once; ImGui keeps what it allocated for them
+            for (int f = 0; f < frames; f++)
+                Frame(&panel, (float)f / frames);
+            heapAllocs = 0;
+            imguiAllocs = 0;
+            auto t0 = std::chrono::steady_clock::now();
+            counting = true;
+            for (int f = 0; f < frames; f++)
+                Frame(&panel, (float)f / frames);
+            counting = false;
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            printf("%8ld %14.2f %14.2f %12.1f\n", n, (double)heapAllocs / frames, (double)imguiAllocs / frames, elapsed / frames * 1e6);
+            heapMax = std::max(heapMax, heapAllocs.load());
+            imguiMax = std::max(imguiMax, imguiAllocs.load());
+        }
+        controller.Shutdown();
+        sim.Cleanup();
+    }
+    ImGui::DestroyContext();
+
+    Check(heapMax == 0, "a frame makes no heap allocation, at any number of motors");
+    Check(imguiMax == 0, "nor does ImGui once every row was laid out");
+
+    printf("%ld checks failed\n", failed);
+    return failed ? 1 : 0;
+}